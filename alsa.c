@@ -17,19 +17,24 @@
  *
  */
 
+#include <errno.h>
 #include <poll.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <alsa/asoundlib.h>
 
 #include "alsa.h"
+#include "rtlog.h"
 
 
 /* This structure doesn't have corresponding functions to be an
  * abstraction of the ALSA calls; it is merely a container for these
  * variables. */
 
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof(*x))
+
 struct alsa_pcm {
     snd_pcm_t *pcm;
 
@@ -37,12 +42,19 @@ struct alsa_pcm {
     size_t pe_count; /* number of pollfd entries */
 
     int rate;
+    enum device_format format;
 };
 
 
 struct alsa {
     struct alsa_pcm capture, playback;
-    bool playing;
+    bool playing,
+        linked; /* capture and playback share one clock and wakeup */
+
+    /* Parameters kept for re-opening, eg. by the buffer probe */
+
+    const char *name;
+    unsigned int requested_rate, buffer;
 };
 
 
@@ -52,6 +64,14 @@ static void alsa_error(const char *msg, int r)
 }
 
 
+/* As alsa_error(), but safe to call from the realtime thread */
+
+static void alsa_rt_error(const char *msg, int r)
+{
+    rtlog_ss("ALSA %s: %s\n", msg, snd_strerror(r));
+}
+
+
 static bool chk(const char *s, int r)
 {
     if (r < 0) {
@@ -80,18 +100,44 @@ static int pcm_open(struct alsa_pcm *alsa, const char *device_name,
 
     r = snd_pcm_hw_params_any(alsa->pcm, hw_params);
     if (!chk("hw_params_any", r))
-        return -1;
+        goto fail;
 
     r = snd_pcm_hw_params_set_access(alsa->pcm, hw_params,
                                      SND_PCM_ACCESS_MMAP_INTERLEAVED);
     if (!chk("hw_params_set_access", r))
-        return -1;
+        goto fail;
 
-    r = snd_pcm_hw_params_set_format(alsa->pcm, hw_params, SND_PCM_FORMAT_S16);
-    if (!chk("hw_params_set_format", r)) {
-        fprintf(stderr, "16-bit signed format is not available. "
-                "You may need to use a 'plughw' device.\n");
-        return -1;
+    /* Take whichever format the hardware implements natively, in
+     * order of our preference, rather than have libasound plug in a
+     * conversion layer with its own buffer and copy per period */
+
+    {
+        static const struct {
+            snd_pcm_format_t pcm;
+            enum device_format device;
+        } formats[] = {
+            { SND_PCM_FORMAT_S16, DEVICE_S16 },
+            { SND_PCM_FORMAT_S32, DEVICE_S32 },
+            { SND_PCM_FORMAT_S24, DEVICE_S24 },
+            { SND_PCM_FORMAT_FLOAT, DEVICE_FLOAT },
+        };
+        size_t n;
+
+        for (n = 0; n < ARRAY_SIZE(formats); n++) {
+            r = snd_pcm_hw_params_set_format(alsa->pcm, hw_params,
+                                             formats[n].pcm);
+            if (r == 0)
+                break;
+        }
+
+        if (n == ARRAY_SIZE(formats)) {
+            alsa_error("hw_params_set_format", r);
+            fprintf(stderr, "No known sample format is available. "
+                    "You may need to use a 'plughw' device.\n");
+            goto fail;
+        }
+
+        alsa->format = formats[n].device;
     }
 
     /* Prevent accidentally introducing excess resamplers. There is
@@ -101,14 +147,14 @@ static int pcm_open(struct alsa_pcm *alsa, const char *device_name,
 
     r = snd_pcm_hw_params_set_rate_resample(alsa->pcm, hw_params, 0);
     if (!chk("hw_params_set_rate_resample", r))
-        return -1;
+        goto fail;
 
     if (rate) {
         r = snd_pcm_hw_params_set_rate(alsa->pcm, hw_params, rate, 0);
         if (!chk("hw_params_set_rate", r)) {
             fprintf(stderr, "Sample rate of %dHz is not implemented by the hardware.\n",
                     rate);
-            return -1;
+            goto fail;
         }
 
     } else {
@@ -122,7 +168,7 @@ static int pcm_open(struct alsa_pcm *alsa, const char *device_name,
 
         r = snd_pcm_hw_params_set_rate_near(alsa->pcm, hw_params, &rate, &dir);
         if (!chk("hw_params_set_rate_near", r))
-            return -1;
+            goto fail;
 
         /* "rate" is set on return */
     }
@@ -133,7 +179,7 @@ static int pcm_open(struct alsa_pcm *alsa, const char *device_name,
     if (!chk("hw_params_set_channels", r)) {
         fprintf(stderr, "%d channel audio not available on this device.\n",
                 DEVICE_CHANNELS);
-        return -1;
+        goto fail;
     }
 
     /* This is fundamentally a latency-sensitive application that is
@@ -142,14 +188,14 @@ static int pcm_open(struct alsa_pcm *alsa, const char *device_name,
 
     r = snd_pcm_hw_params_set_period_size_first(alsa->pcm, hw_params, &frames, &dir);
     if (!chk("hw_params_set_buffer_time_near", r))
-        return -1;
+        goto fail;
 
     switch (stream) {
     case SND_PCM_STREAM_CAPTURE:
         /* Maximum buffer to minimise drops */
         r = snd_pcm_hw_params_set_buffer_size_last(alsa->pcm, hw_params, &frames);
         if (!chk("hw_params_set_buffer_size_last", r))
-            return -1;
+            goto fail;
         break;
 
     case SND_PCM_STREAM_PLAYBACK:
@@ -158,7 +204,7 @@ static int pcm_open(struct alsa_pcm *alsa, const char *device_name,
         if (!chk("hw_params_set_buffer_size", r)) {
             fprintf(stderr, "Buffer of %u samples is probably too small; try increasing it with -m\n",
                     buffer);
-            return -1;
+            goto fail;
         }
         break;
 
@@ -168,9 +214,14 @@ static int pcm_open(struct alsa_pcm *alsa, const char *device_name,
 
     r = snd_pcm_hw_params(alsa->pcm, hw_params);
     if (!chk("hw_params", r))
-        return -1;
+        goto fail;
 
     return 0;
+
+ fail:
+    if (snd_pcm_close(alsa->pcm) < 0)
+        abort();
+    return -1;
 }
 
 
@@ -212,7 +263,7 @@ static int pcm_revents(struct alsa_pcm *alsa, unsigned short *revents) {
     r = snd_pcm_poll_descriptors_revents(alsa->pcm, alsa->pe, alsa->pe_count,
                                          revents);
     if (r < 0) {
-        alsa_error("poll_descriptors_revents", r);
+        alsa_rt_error("poll_descriptors_revents", r);
         return -1;
     }
 
@@ -221,19 +272,9 @@ static int pcm_revents(struct alsa_pcm *alsa, unsigned short *revents) {
 
 
 
-/* Start the audio device capture and playback */
-
-static void start(struct device *dv)
-{
-    struct alsa *alsa = (struct alsa*)dv->local;
-
-    if (snd_pcm_start(alsa->capture.pcm) < 0)
-        abort();
-}
-
-
 /* Register this device's interest in a set of pollfd file
- * descriptors */
+ * descriptors.  A linked pair is woken by the capture direction
+ * alone; one wakeup services a full duplex period */
 
 static ssize_t pollfds(struct device *dv, struct pollfd *pe, size_t z)
 {
@@ -250,6 +291,12 @@ static ssize_t pollfds(struct device *dv, struct pollfd *pe, size_t z)
     z -= r;
     total += r;
 
+    if (alsa->linked) {
+        alsa->playback.pe = NULL;
+        alsa->playback.pe_count = 0;
+        return total;
+    }
+
     r = pcm_pollfds(&alsa->playback, pe, z);
     if (r < 0)
         return -1;
@@ -260,20 +307,73 @@ static ssize_t pollfds(struct device *dv, struct pollfd *pe, size_t z)
 }
 
 
-/* Access the interleaved area presented by the ALSA library.  The
- * device is opened SND_PCM_FORMAT_S16 which is in the local endianess
- * and therefore is "signed short" */
+/* Access the interleaved area presented by the ALSA library, in the
+ * local endianness and whichever sample format was negotiated */
 
-static signed short *buffer(const snd_pcm_channel_area_t *area,
-                          snd_pcm_uframes_t offset)
+static void *buffer(const snd_pcm_channel_area_t *area,
+                    snd_pcm_uframes_t offset, enum device_format fmt)
 {
     assert(area->first % 8 == 0);
-    assert(area->step == 32);  /* 2 channel 16-bit interleaved */
+    assert(area->step == DEVICE_CHANNELS * device_sample_bytes(fmt) * 8);
 
     return area->addr + area->first / 8 + offset * area->step / 8;
 }
 
 
+/* Fill the playback buffer with silence; the linked pair starts
+ * together, so there must be data queued before the trigger */
+
+static int silence(struct alsa_pcm *alsa)
+{
+    for (;;) {
+        int r;
+        snd_pcm_sframes_t avail;
+        snd_pcm_uframes_t frames, offset;
+        const snd_pcm_channel_area_t *area;
+
+        avail = snd_pcm_avail_update(alsa->pcm);
+        if (avail < 0)
+            return (int)avail;
+        if (avail == 0)
+            break;
+
+        frames = avail;
+
+        r = snd_pcm_mmap_begin(alsa->pcm, &area, &offset, &frames);
+        if (r < 0)
+            return r;
+
+        memset(buffer(&area[0], offset, alsa->format), 0,
+               frames * area->step / 8);
+
+        r = snd_pcm_mmap_commit(alsa->pcm, offset, frames);
+        if (r < 0)
+            return r;
+    }
+
+    return 0;
+}
+
+
+/* Start the audio device capture and playback */
+
+static void start(struct device *dv)
+{
+    struct alsa *alsa = (struct alsa*)dv->local;
+
+    if (alsa->linked) {
+        if (silence(&alsa->playback) < 0)
+            abort();
+        alsa->playing = true;
+    }
+
+    /* Starting capture triggers the whole group when linked */
+
+    if (snd_pcm_start(alsa->capture.pcm) < 0)
+        abort();
+}
+
+
 /* Collect audio from the player and push it into the device's buffer,
  * for playback */
 
@@ -293,13 +393,18 @@ static int playback(struct device *dv)
     if (frames < 0)
         return (int)frames;
 
+    /* When linked, the wakeup comes from the capture direction and
+     * the playback period may momentarily lag by a few frames */
+
+    if (frames == 0)
+        return 0;
+
     r = snd_pcm_mmap_begin(alsa->playback.pcm, &area, &offset, &frames);
     if (r < 0)
         return r;
 
-    assert(frames > 0);  /* otherwise we were woken unnecessarily */
-
-    device_collect(dv, buffer(&area[0], offset), frames);
+    device_collect_format(dv, buffer(&area[0], offset, alsa->playback.format),
+                          frames, alsa->playback.format);
 
     r = snd_pcm_mmap_commit(alsa->playback.pcm, offset, frames);
     if (r < 0)
@@ -345,7 +450,8 @@ static int capture(struct device *dv)
 
     assert(frames > 0);  /* otherwise we were woken unnecessarily */
 
-    device_submit(dv, buffer(&area[0], offset), frames);
+    device_submit_format(dv, buffer(&area[0], offset, alsa->capture.format),
+                         frames, alsa->capture.format);
 
     r = snd_pcm_mmap_commit(alsa->capture.pcm, offset, frames);
     if (r < 0)
@@ -355,6 +461,45 @@ static int capture(struct device *dv)
 }
 
 
+/* Recover a linked pair from an xrun.  A stall on either stream
+ * stops the whole group, so re-queue both and re-trigger */
+
+static int recover(struct device *dv)
+{
+    int r;
+    struct alsa *alsa = (struct alsa*)dv->local;
+
+    device_xrun(dv);
+    rtlog("ALSA: duplex xrun.\n", 0, 0);
+
+    r = snd_pcm_prepare(alsa->capture.pcm);
+    if (r < 0) {
+        alsa_rt_error("prepare", r);
+        return -1;
+    }
+
+    r = snd_pcm_prepare(alsa->playback.pcm);
+    if (r < 0) {
+        alsa_rt_error("prepare", r);
+        return -1;
+    }
+
+    r = silence(&alsa->playback);
+    if (r < 0) {
+        alsa_rt_error("silence", r);
+        return -1;
+    }
+
+    r = snd_pcm_start(alsa->capture.pcm);
+    if (r < 0) {
+        alsa_rt_error("start", r);
+        return -1;
+    }
+
+    return 0;
+}
+
+
 /* After poll() has returned, instruct a device to do all it can at
  * the present time. Return zero if success, otherwise -1 */
 
@@ -364,6 +509,32 @@ static int handle(struct device *dv)
     unsigned short revents;
     struct alsa *alsa = (struct alsa*)dv->local;
 
+    /* A linked pair shares one clock; a single POLLIN from the
+     * capture side services a full duplex period in both directions */
+
+    if (alsa->linked) {
+        r = pcm_revents(&alsa->capture, &revents);
+        if (r < 0)
+            return -1;
+
+        if (!(revents & POLLIN))
+            return 0;
+
+        r = capture(dv);
+        if (r == 0)
+            r = playback(dv);
+
+        if (r < 0) {
+            if (r == -EPIPE)
+                return recover(dv);
+
+            alsa_rt_error("duplex", r);
+            return -1;
+        }
+
+        return 0;
+    }
+
     /* Check input buffer for timecode capture */
 
     r = pcm_revents(&alsa->capture, &revents);
@@ -375,22 +546,23 @@ static int handle(struct device *dv)
 
         if (r < 0) {
             if (r == -EPIPE) {
-                fputs("ALSA: capture xrun.\n", stderr);
+                device_xrun(dv);
+                rtlog("ALSA: capture xrun.\n", 0, 0);
 
                 r = snd_pcm_prepare(alsa->capture.pcm);
                 if (r < 0) {
-                    alsa_error("prepare", r);
+                    alsa_rt_error("prepare", r);
                     return -1;
                 }
 
                 r = snd_pcm_start(alsa->capture.pcm);
                 if (r < 0) {
-                    alsa_error("start", r);
+                    alsa_rt_error("start", r);
                     return -1;
                 }
 
             } else {
-                alsa_error("capture", r);
+                alsa_rt_error("capture", r);
                 return -1;
             }
         }
@@ -407,11 +579,12 @@ static int handle(struct device *dv)
 
         if (r < 0) {
             if (r == -EPIPE) {
-                fputs("ALSA: playback xrun.\n", stderr);
+                device_xrun(dv);
+                rtlog("ALSA: playback xrun.\n", 0, 0);
 
                 r = snd_pcm_prepare(alsa->playback.pcm);
                 if (r < 0) {
-                    alsa_error("prepare", r);
+                    alsa_rt_error("prepare", r);
                     return -1;
                 }
 
@@ -421,7 +594,7 @@ static int handle(struct device *dv)
                  * explicitly start the device when writing */
 
             } else {
-                alsa_error("playback", r);
+                alsa_rt_error("playback", r);
                 return -1;
             }
         }
@@ -460,47 +633,205 @@ static struct device_ops alsa_ops = {
 };
 
 
-/* Open ALSA device. Do not operate on audio until device_start() */
+/* Open the capture and playback streams as a pair */
 
-int alsa_init(struct device *dv, const char *device_name,
-              unsigned int rate, unsigned int buffer)
+static int open_pair(struct alsa *alsa, const char *device_name,
+                     unsigned int rate, unsigned int buffer)
 {
-    struct alsa *alsa;
-
-    alsa = malloc(sizeof *alsa);
-    if (alsa == NULL) {
-        perror("malloc");
-        return -1;
-    }
-
     alsa->playing = false;
 
     if (pcm_open(&alsa->capture, device_name, SND_PCM_STREAM_CAPTURE,
                 rate, buffer) < 0)
     {
         fputs("Failed to open device for capture.\n", stderr);
-        goto fail;
+        return -1;
     }
 
     if (pcm_open(&alsa->playback, device_name, SND_PCM_STREAM_PLAYBACK,
                 rate, buffer) < 0)
     {
         fputs("Failed to open device for playback.\n", stderr);
-        goto fail_capture;
+        pcm_close(&alsa->capture);
+        return -1;
+    }
+
+    /* Couple the two streams onto one clock, halving the wakeups per
+     * period.  Some devices (eg. "plug" routing to separate cards)
+     * can't do this; fall back to polling each direction */
+
+    alsa->linked = (snd_pcm_link(alsa->capture.pcm, alsa->playback.pcm) == 0);
+
+    return 0;
+}
+
+
+static void close_pair(struct alsa *alsa)
+{
+    pcm_close(&alsa->capture);
+    pcm_close(&alsa->playback);
+}
+
+
+/* Open ALSA device. Do not operate on audio until device_start() */
+
+int alsa_init(struct device *dv, const char *device_name,
+              unsigned int rate, unsigned int buffer)
+{
+    struct alsa *alsa;
+
+    alsa = malloc(sizeof *alsa);
+    if (alsa == NULL) {
+        perror("malloc");
+        return -1;
+    }
+
+    alsa->name = device_name;
+    alsa->requested_rate = rate;
+    alsa->buffer = buffer;
+
+    if (open_pair(alsa, device_name, rate, buffer) == -1) {
+        free(alsa);
+        return -1;
     }
 
     device_init(dv, &alsa_ops);
     dv->local = alsa;
 
     return 0;
+}
+
+/* Run the device for a short interval at the given buffer size,
+ * exercising the full timecode and player path via the usual poll
+ * loop, and report the xruns seen.
+ *
+ * Return: -1 if this size can't be run at all, otherwise 0
+ */
+
+#define PROBE_TRIAL_MS 500
+#define PROBE_STEP 32 /* frames */
+
+static int trial(struct device *dv, unsigned int buffer,
+                 unsigned int *xruns)
+{
+    struct alsa *alsa = (struct alsa*)dv->local;
+    struct pollfd pe[8];
+    ssize_t npe;
+    struct timespec end;
+
+    if (open_pair(alsa, alsa->name, alsa->requested_rate, buffer) == -1)
+        return -1;
+
+    device_init(dv, &alsa_ops); /* reset the fault flag and counters */
+
+    npe = device_pollfds(dv, pe, ARRAY_SIZE(pe));
+    if (npe < 0)
+        goto fail;
+
+    device_start(dv);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    end.tv_nsec += (PROBE_TRIAL_MS % 1000) * 1000000;
+    end.tv_sec += PROBE_TRIAL_MS / 1000 + end.tv_nsec / 1000000000;
+    end.tv_nsec %= 1000000000;
+
+    for (;;) {
+        struct timespec now;
+        int ms, r;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        ms = (end.tv_sec - now.tv_sec) * 1000
+            + ((long)end.tv_nsec - now.tv_nsec) / 1000000;
+        if (ms <= 0)
+            break;
+
+        r = poll(pe, npe, ms);
+        if (r == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            goto fail;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        device_handle(dv, &now);
+
+        if (dv->fault)
+            goto fail;
+    }
+
+    *xruns = dv->stats.xruns;
+
+    close_pair(alsa);
+    return 0;
 
- fail_capture:
-    pcm_close(&alsa->capture);
  fail:
-    free(alsa);
+    close_pair(alsa);
     return -1;
 }
 
+/*
+ * Search for the smallest stable buffer size on this device
+ *
+ * Binary search over the buffer size, judged on the xrun counters
+ * from a short trial at each candidate.  The probe runs before
+ * realtime scheduling is acquired, so the result errs on the side
+ * of caution.
+ *
+ * Pre: dv was initialised by alsa_init() and is connected to its
+ *   timecoder and player
+ * Post: dv is open with the chosen buffer size
+ */
+
+int alsa_probe(struct device *dv)
+{
+    struct alsa *alsa = (struct alsa*)dv->local;
+    unsigned int lo, hi, xruns;
+
+    fprintf(stderr, "%s: probing for the smallest stable buffer...\n",
+            alsa->name);
+
+    close_pair(alsa); /* each trial re-opens the device */
+
+    lo = PROBE_STEP;
+    hi = alsa->buffer;
+
+    /* The configured size must itself be stable, otherwise there
+     * is no useful upper bound to search below */
+
+    if (trial(dv, hi, &xruns) == -1 || xruns > 0) {
+        fprintf(stderr, "%s: not stable at %u samples; "
+                "try a larger --buffer\n", alsa->name, hi);
+        goto done;
+    }
+
+    while (lo < hi) {
+        unsigned int mid;
+
+        mid = ((lo + hi) / 2) & ~(PROBE_STEP - 1);
+
+        fprintf(stderr, "%s: trying %u samples...\n", alsa->name, mid);
+
+        if (trial(dv, mid, &xruns) == -1 || xruns > 0)
+            lo = mid + PROBE_STEP;
+        else
+            hi = mid;
+    }
+
+    fprintf(stderr, "%s: minimum stable buffer is %u samples; "
+            "pass --buffer %u on future startups\n",
+            alsa->name, hi, hi);
+
+ done:
+    /* Leave the device open at the chosen size for this session */
+
+    if (open_pair(alsa, alsa->name, alsa->requested_rate, hi) == -1)
+        return -1;
+
+    device_init(dv, &alsa_ops);
+
+    return 0;
+}
+
 
 /* ALSA caches information when devices are open. Provide a call
  * to clear these caches so that valgrind output is clean. */
@@ -25,6 +25,8 @@
 int alsa_init(struct device *dv, const char *name,
               unsigned int rate, unsigned int buffer_time);
 
+int alsa_probe(struct device *dv);
+
 void alsa_clear_config_cache(void);
 
 #endif
@@ -0,0 +1,390 @@
+/*
+ * Copyright (C) 2021 Mark Hills <mark@xwax.org>
+ *
+ * This file is part of "xwax".
+ *
+ * "xwax" is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 3 as
+ * published by the Free Software Foundation.
+ *
+ * "xwax" is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Background analysis of records
+ *
+ * Records which arrive in the library without a BPM are queued, and
+ * an external script works through them, computing the BPM (and
+ * musical key) from the decoded audio. The pool of processes is a
+ * slot per CPU -- idle cores do the work -- and the script drops
+ * its own priority, so a library analyses itself overnight without
+ * intruding on the audio or the interface.
+ *
+ * The protocol is one line on standard output:
+ *
+ *   <bpm>[\t<key>]\n
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <math.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "analyse.h"
+#include "debug.h"
+#include "rig.h"
+#include "status.h"
+
+/* Results are applied to the library in batches; each pass re-sorts
+ * the listings and rebuilds the postings, so it is not per-record */
+
+#define BATCH 64
+
+static struct list jobs = LIST_INIT(jobs), /* all live jobs */
+    queue = LIST_INIT(queue); /* jobs awaiting a slot in the pool */
+static unsigned int running = 0, pool_size = 0;
+static const char *script = NULL;
+static struct library *library = NULL;
+static struct observer on_addition;
+
+static struct analysis result[BATCH];
+static char result_key[BATCH][16];
+static size_t results = 0;
+
+/*
+ * Apply the pending results to the library in one pass
+ */
+
+static void flush(void)
+{
+    if (results == 0)
+        return;
+
+    debug("flushing %zu results", results);
+
+    if (library_update_batch(library, result, results) == -1)
+        status_printf(STATUS_ALERT, "Out of memory applying analysis");
+
+    results = 0;
+}
+
+static void add_result(struct record *r, double bpm, const char *key)
+{
+    struct analysis *x;
+
+    x = &result[results];
+    x->record = r;
+    x->bpm = bpm;
+
+    if (key != NULL) {
+        snprintf(result_key[results], sizeof result_key[results], "%s", key);
+        x->key = result_key[results];
+    } else {
+        x->key = NULL;
+    }
+
+    results++;
+
+    if (results == BATCH)
+        flush();
+}
+
+/*
+ * Start the analysis process of the given job
+ *
+ * Return: 0 on success, -1 on error
+ */
+
+static int launch(struct analyse *a)
+{
+    pid_t pid;
+
+    assert(a->pending);
+
+    debug("analysing '%s'", a->pathname);
+
+    pid = fork_pipe_nb(&a->fd, script, "analyse", (char*)a->pathname, NULL);
+    if (pid == -1)
+        return -1;
+
+    a->pid = pid;
+    a->pending = false;
+    running++;
+
+    rig_post_analyse(a);
+
+    return 0;
+}
+
+/*
+ * Launch queued jobs, up to the size of the pool
+ */
+
+static void launch_next(void)
+{
+    while (running < pool_size && !list_empty(&queue)) {
+        struct analyse *a;
+
+        a = list_entry(queue.next, struct analyse, launch);
+        list_del(&a->launch);
+
+        if (launch(a) == 0)
+            continue;
+
+        /* A failed launch just forgets the job; the record keeps
+         * its unknown BPM */
+
+        list_del(&a->jobs);
+        free(a);
+    }
+}
+
+/*
+ * Queue the given record for analysis
+ *
+ * Failures are silent; the record simply keeps its unknown BPM.
+ */
+
+static void enqueue(struct record *r)
+{
+    struct analyse *a;
+    const char *pathname;
+
+    pathname = record_pathname(r);
+    if (pathname == NULL)
+        return;
+
+    a = malloc(sizeof *a);
+    if (a == NULL) {
+        perror("malloc");
+        return;
+    }
+
+    a->record = r;
+    a->pathname = pathname;
+    a->pending = true;
+    a->pid = 0;
+    a->fd = -1;
+    rb_reset(&a->rb);
+    a->has_result = false;
+
+    list_add(&a->jobs, &jobs);
+    list_add_tail(&a->launch, &queue);
+
+    launch_next();
+}
+
+/*
+ * Catch batches of records newly added to the library
+ *
+ * Records which already carry a BPM (eg. from filename tags) are
+ * left alone; re-added records which gained one from an earlier
+ * analysis are skipped the same way.
+ */
+
+static void filter_addition(struct observer *o, void *x)
+{
+    struct index *news = x;
+    size_t n;
+
+    for (n = 0; n < news->entries; n++) {
+        struct record *r = news->record[n];
+
+        if (r->bpm == 0.0)
+            enqueue(r);
+    }
+}
+
+/*
+ * Parse a line of output from the analysis process
+ */
+
+static void read_line(struct analyse *a, char *line)
+{
+    char *tab;
+    double bpm;
+
+    tab = strchr(line, '\t');
+    if (tab != NULL)
+        *tab = '\0';
+
+    errno = 0;
+    bpm = strtod(line, NULL);
+    if (errno == ERANGE || !isfinite(bpm) || bpm <= 0.0)
+        return;
+
+    a->bpm = bpm;
+
+    if (tab != NULL && tab[1] != '\0')
+        snprintf(a->key, sizeof a->key, "%s", tab + 1);
+    else
+        a->key[0] = '\0';
+
+    a->has_result = true;
+}
+
+/*
+ * Return: -1 on completion, otherwise zero
+ */
+
+static int read_from_pipe(struct analyse *a)
+{
+    for (;;) {
+        char *line;
+        ssize_t z;
+
+        z = get_line(a->fd, &a->rb, &line);
+        if (z == -1) {
+            if (errno == EAGAIN)
+                return 0;
+            perror("get_line");
+            return -1;
+        }
+
+        if (z == 0)
+            return -1;
+
+        debug("got line '%s'", line);
+
+        if (!a->has_result)
+            read_line(a, line);
+
+        free(line);
+    }
+}
+
+/*
+ * Reap the finished analysis process
+ */
+
+static void do_wait(struct analyse *a)
+{
+    int status;
+
+    assert(a->pid != 0);
+
+    rig_unmonitor(a->fd);
+
+    if (close(a->fd) == -1)
+        abort();
+
+    if (waitpid(a->pid, &status, 0) == -1)
+        abort();
+
+    a->pid = 0;
+    running--;
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+        a->has_result = false; /* don't trust a partial line */
+}
+
+void analyse_handle(struct analyse *a)
+{
+    assert(a->pid != 0);
+
+    if (read_from_pipe(a) != -1)
+        return;
+
+    do_wait(a);
+
+    if (a->has_result)
+        add_result(a->record, a->bpm, a->key[0] != '\0' ? a->key : NULL);
+
+    launch_next(); /* our slot in the pool is free */
+
+    list_del(&a->rig);
+    list_del(&a->jobs);
+    free(a);
+
+    /* The tail of the queue; put out whatever remains */
+
+    if (running == 0 && list_empty(&queue))
+        flush();
+}
+
+/*
+ * The descriptor which feeds this job, registered with the rig
+ *
+ * Pre: analysis is running
+ */
+
+int analyse_fd(const struct analyse *a)
+{
+    assert(a->pid != 0);
+
+    return a->fd;
+}
+
+/*
+ * Begin analysing records of the given library as they arrive
+ *
+ * Pre: called before the rig runs; the addition events fire on the
+ *   rig thread, where all of this module runs thereafter
+ */
+
+int analyse_init(const char *analyser, struct library *li)
+{
+    long ncpu;
+
+    assert(script == NULL);
+
+    script = analyser;
+    library = li;
+
+    ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    pool_size = ncpu > 0 ? ncpu : 1;
+
+    watch(&on_addition, &li->storage.addition, filter_addition);
+
+    return 0;
+}
+
+/*
+ * Terminate outstanding analysis and free the queue
+ *
+ * Pre: the rig has exited; nothing else touches the jobs
+ */
+
+void analyse_clear(void)
+{
+    if (script == NULL)
+        return;
+
+    ignore(&on_addition);
+
+    while (!list_empty(&jobs)) {
+        struct analyse *a;
+
+        a = list_entry(jobs.next, struct analyse, jobs);
+
+        if (a->pid != 0) {
+            if (kill(a->pid, SIGTERM) == -1)
+                abort();
+            do_wait(a);
+            list_del(&a->rig);
+        } else {
+            list_del(&a->launch);
+        }
+
+        list_del(&a->jobs);
+        free(a);
+    }
+
+    /* Results already in hand are not worth losing */
+
+    flush();
+
+    script = NULL;
+}
@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2021 Mark Hills <mark@xwax.org>
+ *
+ * This file is part of "xwax".
+ *
+ * "xwax" is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 3 as
+ * published by the Free Software Foundation.
+ *
+ * "xwax" is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef ANALYSE_H
+#define ANALYSE_H
+
+#include <sys/types.h>
+
+#include "external.h"
+#include "library.h"
+#include "list.h"
+
+/* A single record being analysed by an external process, or queued
+ * to be. Managed like the excrate scans: a pool of child processes,
+ * serviced by the rig */
+
+struct analyse {
+    struct record *record;
+    const char *pathname; /* interned; stable */
+
+    struct list jobs, rig, launch;
+    bool pending;
+    pid_t pid;
+    int fd;
+
+    /* State of reader */
+
+    struct rb rb;
+    bool has_result;
+    double bpm;
+    char key[16];
+};
+
+int analyse_init(const char *script, struct library *li);
+void analyse_clear(void);
+
+/* Used by the rig */
+
+int analyse_fd(const struct analyse *a);
+void analyse_handle(struct analyse *a);
+
+#endif
@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2021 Mark Hills <mark@xwax.org>
+ *
+ * This file is part of "xwax".
+ *
+ * "xwax" is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 3 as
+ * published by the Free Software Foundation.
+ *
+ * "xwax" is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "cache.h"
+
+/*
+ * The directory used for on-disk caches (timecode lookup tables,
+ * decoded audio), optionally creating it on the way
+ *
+ * Return: -1 if no suitable directory is configured, otherwise 0
+ * Post: if 0 is returned, buf contains the path of the directory
+ */
+
+int cache_dir(bool create, char *buf, size_t len)
+{
+    char dir[256];
+    const char *env;
+    int r;
+
+    env = getenv("XDG_CACHE_HOME");
+    if (env != NULL) {
+        r = snprintf(dir, sizeof dir, "%s", env);
+    } else {
+        env = getenv("HOME");
+        if (env == NULL)
+            return -1;
+        r = snprintf(dir, sizeof dir, "%s/.cache", env);
+    }
+
+    if (r < 0 || (size_t)r >= sizeof dir)
+        return -1;
+
+    if (create && mkdir(dir, 0755) == -1 && errno != EEXIST)
+        return -1;
+
+    r = snprintf(buf, len, "%s/xwax", dir);
+    if (r < 0 || (size_t)r >= len)
+        return -1;
+
+    if (create && mkdir(buf, 0755) == -1 && errno != EEXIST)
+        return -1;
+
+    return 0;
+}
@@ -18,10 +18,14 @@
  */
 
 #include <assert.h>
+#include <stdio.h>
+#include <time.h>
 
 #include "controller.h"
 #include "cues.h"
 #include "deck.h"
+#include "export.h"
+#include "library.h"
 #include "status.h"
 #include "rig.h"
 
@@ -32,7 +36,8 @@
 
 static const struct record no_record = {
     .artist = "",
-    .title = ""
+    .title = "",
+    .match = ""
 };
 
 /*
@@ -48,7 +53,7 @@ int deck_init(struct deck *d, struct rt *rt,
               struct timecode_def *timecode, const char *importer,
               double speed, bool phono, bool protect)
 {
-    unsigned int rate;
+    unsigned int rate, dec;
 
     if (rt_add_device(rt, &d->device) == -1)
         return -1;
@@ -56,13 +61,26 @@ int deck_init(struct deck *d, struct rt *rt,
     d->ncontrol = 0;
     d->record = &no_record;
     d->punch = NO_PUNCH;
+    d->loop_in = NO_LOOP;
     d->protect = protect;
     assert(importer != NULL);
     d->importer = importer;
     rate = device_sample_rate(&d->device);
     assert(timecode != NULL);
     timecoder_init(&d->timecoder, timecode, speed, rate, phono);
+
+    /* High capture rates oversample the timecode tone; decimate
+     * the decode down towards 48kHz to save CPU. The scope monitor
+     * is unaffected */
+
+    dec = 1;
+    while (dec < 4 && rate / (dec * 2) >= 44100)
+        dec *= 2;
+    if (dec > 1)
+        timecoder_set_decimation(&d->timecoder, dec);
+
     player_init(&d->player, rate, track_acquire_empty(), &d->timecoder);
+    recorder_init(&d->recorder);
     cues_reset(&d->cues);
 
     /* The timecoder and player are driven by requests from
@@ -77,6 +95,7 @@ int deck_init(struct deck *d, struct rt *rt,
 void deck_clear(struct deck *d)
 {
     /* FIXME: remove from rig and rt */
+    recorder_stop(&d->recorder);
     player_clear(&d->player);
     timecoder_clear(&d->timecoder);
     device_clear(&d->device);
@@ -87,6 +106,39 @@ bool deck_is_locked(const struct deck *d)
     return (d->protect && player_is_active(&d->player));
 }
 
+/*
+ * Begin recording the deck's output to a file in the given directory
+ *
+ * Pre: the realtime thread is not yet started
+ * Return: -1 on error, otherwise 0
+ */
+
+int deck_record_start(struct deck *d, const char *dir, unsigned int n)
+{
+    char stamp[32], path[512];
+    time_t now;
+    struct tm tm;
+
+    now = time(NULL);
+    localtime_r(&now, &tm);
+    strftime(stamp, sizeof stamp, "%Y%m%d-%H%M%S", &tm);
+
+    if (snprintf(path, sizeof path, "%s/deck%u-%s.wav",
+                 dir, n, stamp) >= (int)sizeof path)
+    {
+        fputs("Recording pathname is too long\n", stderr);
+        return -1;
+    }
+
+    if (recorder_start(&d->recorder, path,
+                       device_sample_rate(&d->device)) == -1)
+        return -1;
+
+    d->player.recorder = &d->recorder;
+
+    return 0;
+}
+
 /*
  * Load a record from the library to a deck
  */
@@ -94,18 +146,24 @@ bool deck_is_locked(const struct deck *d)
 void deck_load(struct deck *d, struct record *record)
 {
     struct track *t;
+    const char *pathname;
 
     if (deck_is_locked(d)) {
         status_printf(STATUS_WARN, "Stop deck to load a different track");
         return;
     }
 
-    t = track_acquire_by_import(d->importer, record->pathname);
+    pathname = record_pathname(record);
+    if (pathname == NULL)
+        return;
+
+    t = track_acquire_by_import(d->importer, pathname);
     if (t == NULL)
         return;
 
     d->record = record;
     player_set_track(&d->player, t); /* passes reference */
+    export_load(d->player.export, pathname);
 }
 
 void deck_recue(struct deck *d)
@@ -122,6 +180,9 @@ void deck_clone(struct deck *d, const struct deck *from)
 {
     d->record = from->record;
     player_clone(&d->player, &from->player);
+
+    if (d->record != &no_record)
+        export_load(d->player.export, record_pathname(d->record));
 }
 
 /*
@@ -131,6 +192,50 @@ void deck_clone(struct deck *d, const struct deck *from)
 void deck_unset_cue(struct deck *d, unsigned int label)
 {
     cues_unset(&d->cues, label);
+    export_cues(d->player.export, &d->cues);
+}
+
+/* PCM pinned into RAM around each cue point, so that playback from
+ * a cue starts without page faults or a cold cache */
+
+#define CUE_PIN_BEFORE 1.0 /* seconds */
+#define CUE_PIN_AFTER 4.0
+
+/*
+ * Pin and warm the region of the current track around a cue point
+ */
+
+static void pin_cue(struct deck *d, double position)
+{
+    struct track *t;
+    double base;
+    unsigned int start, samples;
+
+    t = d->player.track;
+
+    base = (position - CUE_PIN_BEFORE) * t->rate;
+    if (base < 0.0)
+        base = 0.0;
+
+    start = base;
+    samples = (CUE_PIN_BEFORE + CUE_PIN_AFTER) * t->rate;
+
+    track_pin(t, start, samples);
+    track_warm(t, start, samples);
+}
+
+/*
+ * Seek, timed from when the operator acted where a timestamp is
+ * given (eg. by a hardware controller), otherwise immediately
+ */
+
+static void seek(struct deck *d, double p, const struct timespec *when)
+{
+    if (when != NULL) {
+        player_seek_at(&d->player, p, when);
+    } else {
+        player_seek_to(&d->player, p);
+    }
 }
 
 /*
@@ -138,15 +243,26 @@ void deck_unset_cue(struct deck *d, unsigned int label)
  * or set the cue point if unset
  */
 
-void deck_cue(struct deck *d, unsigned int label)
+void deck_cue_at(struct deck *d, unsigned int label,
+                 const struct timespec *when)
 {
     double p;
 
     p = cues_get(&d->cues, label);
-    if (p == CUE_UNSET)
-        cues_set(&d->cues, label, player_get_elapsed(&d->player));
-    else
-        player_seek_to(&d->player, p);
+    if (p == CUE_UNSET) {
+        p = player_get_elapsed(&d->player);
+        cues_set(&d->cues, label, p);
+        export_cues(d->player.export, &d->cues);
+        pin_cue(d, p);
+    } else {
+        pin_cue(d, p); /* re-pin; the track may have changed */
+        seek(d, p, when);
+    }
+}
+
+void deck_cue(struct deck *d, unsigned int label)
+{
+    deck_cue_at(d, label, NULL);
 }
 
 /*
@@ -154,7 +270,8 @@ void deck_cue(struct deck *d, unsigned int label)
  * existing punch operation.
  */
 
-void deck_punch_in(struct deck *d, unsigned int label)
+void deck_punch_in_at(struct deck *d, unsigned int label,
+                      const struct timespec *when)
 {
     double p, e;
 
@@ -162,21 +279,29 @@ void deck_punch_in(struct deck *d, unsigned int label)
     p = cues_get(&d->cues, label);
     if (p == CUE_UNSET) {
         cues_set(&d->cues, label, e);
+        export_cues(d->player.export, &d->cues);
+        pin_cue(d, e);
         return;
     }
 
     if (d->punch != NO_PUNCH)
         e -= d->punch;
 
-    player_seek_to(&d->player, p);
+    pin_cue(d, p);
+    seek(d, p, when);
     d->punch = p - e;
 }
 
+void deck_punch_in(struct deck *d, unsigned int label)
+{
+    deck_punch_in_at(d, label, NULL);
+}
+
 /*
  * Return from a cue point
  */
 
-void deck_punch_out(struct deck *d)
+void deck_punch_out_at(struct deck *d, const struct timespec *when)
 {
     double e;
 
@@ -184,6 +309,87 @@ void deck_punch_out(struct deck *d)
         return;
 
     e = player_get_elapsed(&d->player);
-    player_seek_to(&d->player, e - d->punch);
+    seek(d, e - d->punch, when);
     d->punch = NO_PUNCH;
 }
+
+void deck_punch_out(struct deck *d)
+{
+    deck_punch_out_at(d, NULL);
+}
+
+/*
+ * Mark the entry point of a loop at the current position
+ */
+
+void deck_loop_in(struct deck *d)
+{
+    d->loop_in = player_get_elapsed(&d->player);
+}
+
+/*
+ * Close and engage the loop marked by deck_loop_in()
+ */
+
+void deck_loop_out(struct deck *d)
+{
+    double e;
+
+    if (d->loop_in == NO_LOOP)
+        return;
+
+    e = player_get_elapsed(&d->player);
+    if (e <= d->loop_in)
+        return;
+
+    pin_cue(d, d->loop_in); /* loops juggle like cues do */
+    player_set_loop(&d->player, d->loop_in, e);
+}
+
+/*
+ * Disengage the loop and continue playback from the current position
+ */
+
+void deck_loop_off(struct deck *d)
+{
+    player_clear_loop(&d->player);
+    d->loop_in = NO_LOOP;
+}
+
+/*
+ * Single control for the beat loop, for operators with one button or
+ * key: the first use marks the entry point, the next closes and
+ * engages the loop, and a further use releases it
+ */
+
+void deck_loop(struct deck *d)
+{
+    if (__atomic_load_n(&d->player.looping, __ATOMIC_ACQUIRE)) {
+        deck_loop_off(d);
+        status_printf(STATUS_VERBOSE, "Loop released");
+    } else if (d->loop_in == NO_LOOP) {
+        deck_loop_in(d);
+        status_printf(STATUS_VERBOSE, "Loop in");
+    } else {
+        deck_loop_out(d);
+        status_printf(STATUS_VERBOSE, "Loop out");
+    }
+}
+
+/*
+ * Engage a loop roll of the given length from the current position
+ *
+ * Unlike a plain loop, ending a roll returns playback to where it
+ * would have been had the roll never happened.
+ */
+
+void deck_loop_roll(struct deck *d, double length)
+{
+    pin_cue(d, player_get_elapsed(&d->player));
+    player_begin_roll(&d->player, length);
+}
+
+void deck_loop_roll_off(struct deck *d)
+{
+    player_end_roll(&d->player);
+}
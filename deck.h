@@ -27,9 +27,11 @@
 #include "index.h"
 #include "player.h"
 #include "realtime.h"
+#include "recorder.h"
 #include "timecoder.h"
 
 #define NO_PUNCH (HUGE_VAL)
+#define NO_LOOP (HUGE_VAL)
 
 struct deck {
     struct device device;
@@ -38,6 +40,7 @@ struct deck {
     bool protect;
 
     struct player player;
+    struct recorder recorder;
     const struct record *record;
     struct cues cues;
 
@@ -45,6 +48,10 @@ struct deck {
 
     double punch;
 
+    /* Loop entry point awaiting deck_loop_out(), or NO_LOOP */
+
+    double loop_in;
+
     /* A controller adds itself here */
 
     size_t ncontrol;
@@ -58,6 +65,8 @@ void deck_clear(struct deck *deck);
 
 bool deck_is_locked(const struct deck *deck);
 
+int deck_record_start(struct deck *deck, const char *dir, unsigned int n);
+
 void deck_load(struct deck *deck, struct record *record);
 
 void deck_recue(struct deck *deck);
@@ -67,4 +76,22 @@ void deck_cue(struct deck *deck, unsigned int label);
 void deck_punch_in(struct deck *d, unsigned int label);
 void deck_punch_out(struct deck *d);
 
+/* As above, timed from when the operator acted; see player_seek_at() */
+
+void deck_cue_at(struct deck *d, unsigned int label,
+                 const struct timespec *when);
+void deck_punch_in_at(struct deck *d, unsigned int label,
+                      const struct timespec *when);
+void deck_punch_out_at(struct deck *d, const struct timespec *when);
+
+void deck_loop_in(struct deck *d);
+void deck_loop_out(struct deck *d);
+void deck_loop_off(struct deck *d);
+
+/* As above, cycled from a single button or key */
+
+void deck_loop(struct deck *d);
+void deck_loop_roll(struct deck *d, double length);
+void deck_loop_roll_off(struct deck *d);
+
 #endif
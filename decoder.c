@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2021 Mark Hills <mark@xwax.org>
+ *
+ * This file is part of "xwax".
+ *
+ * "xwax" is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 3 as
+ * published by the Free Software Foundation.
+ *
+ * "xwax" is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <dlfcn.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "decoder.h"
+
+static const struct decoder *decoder = NULL;
+
+/*
+ * Load a decoder plugin from the given shared object
+ *
+ * Return: -1 if the plugin could not be loaded, otherwise 0
+ */
+
+int decoder_load(const char *lib)
+{
+    void *h;
+    const struct decoder *d;
+
+    h = dlopen(lib, RTLD_NOW);
+    if (h == NULL) {
+        fprintf(stderr, "%s\n", dlerror());
+        return -1;
+    }
+
+    d = dlsym(h, "xwax_decoder");
+    if (d == NULL) {
+        fprintf(stderr, "%s\n", dlerror());
+        if (dlclose(h) != 0)
+            abort();
+        return -1;
+    }
+
+    if (d->api != DECODER_API_VERSION) {
+        fprintf(stderr, "%s: decoder API version %u, expected %u\n",
+                lib, d->api, DECODER_API_VERSION);
+        if (dlclose(h) != 0)
+            abort();
+        return -1;
+    }
+
+    fprintf(stderr, "Loaded decoder '%s'\n", d->name);
+
+    decoder = d; /* held for the life of the process */
+
+    return 0;
+}
+
+/*
+ * Get the loaded decoder plugin
+ *
+ * Return: decoder, or NULL if none is loaded
+ */
+
+const struct decoder* decoder_get(void)
+{
+    return decoder;
+}
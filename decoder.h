@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2021 Mark Hills <mark@xwax.org>
+ *
+ * This file is part of "xwax".
+ *
+ * "xwax" is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 3 as
+ * published by the Free Software Foundation.
+ *
+ * "xwax" is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef DECODER_H
+#define DECODER_H
+
+#include <sys/types.h>
+
+/*
+ * Interface implemented by an in-process decoder plugin
+ *
+ * A plugin is a shared object which exports the symbol
+ * "xwax_decoder" of this type, eg. backed by libsndfile or
+ * libavcodec. It decodes directly into the track's own buffers,
+ * avoiding the process spawn and pipe copy of the importer, which
+ * remains the fallback for files the plugin declines.
+ *
+ * The read function is called from a worker thread, one thread per
+ * open context; a plugin must allow multiple contexts open at once.
+ */
+
+#define DECODER_API_VERSION 1
+
+struct decoder {
+    unsigned int api; /* DECODER_API_VERSION */
+    const char *name;
+
+    /* Return a decode context, or NULL if this plugin cannot
+     * handle the given file. Output is interleaved stereo signed
+     * 16-bit at the given sample rate */
+
+    void* (*open)(const char *path, unsigned int rate);
+
+    /* Decode up to the given number of stereo samples into pcm.
+     * Return the number decoded, zero at the end of the audio,
+     * or -1 on error */
+
+    ssize_t (*read)(void *ctx, signed short *pcm, size_t samples);
+
+    void (*close)(void *ctx);
+};
+
+int decoder_load(const char *lib);
+const struct decoder* decoder_get(void);
+
+#endif
@@ -18,18 +18,135 @@
  */
 
 #include <assert.h>
+#include <limits.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include "debug.h"
 #include "device.h"
 #include "player.h"
+#include "status.h"
 #include "timecoder.h"
 
+/* When on, the service time is broken down per call site and
+ * histogrammed. Off by default: the extra clock reads are cheap but
+ * not free, and the branch which skips them is well-predicted */
+
+static bool profile;
+
 void device_init(struct device *dv, struct device_ops *ops)
 {
     debug("%p", dv);
     dv->fault = false;
     dv->ops = ops;
+    memset(&dv->stats, 0, sizeof dv->stats);
+}
+
+/*
+ * Enable or disable the per-callsite breakdown, for all devices
+ *
+ * Pre: the realtime threads are not yet started
+ */
+
+void device_set_profile(bool on)
+{
+    profile = on;
+}
+
+/*
+ * Nanoseconds elapsed between two timestamps
+ */
+
+static unsigned long long elapsed_ns(const struct timespec *from,
+                                     const struct timespec *to)
+{
+    return (to->tv_sec - from->tv_sec) * 1000000000ULL
+        + to->tv_nsec - from->tv_nsec;
+}
+
+/*
+ * Time a section of the service, when profiling is on
+ *
+ * A single well-predicted branch when off; the clock is the vDSO,
+ * so no system call is made either way
+ */
+
+static void lap_begin(struct timespec *t)
+{
+    if (profile)
+        clock_gettime(CLOCK_MONOTONIC, t);
+}
+
+static void lap_end(unsigned long long *total, const struct timespec *begin)
+{
+    struct timespec end;
+
+    if (!profile)
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    *total += elapsed_ns(begin, &end);
+}
+
+/*
+ * Count a service in the histogram; bucket n holds services of less
+ * than 2^n microseconds
+ */
+
+static void histogram(struct device_stats *s, unsigned int us)
+{
+    unsigned int b;
+
+    b = 0;
+    while (b < DEVICE_HIST_BUCKETS - 1 && (1U << b) <= us)
+        b++;
+
+    s->hist[b]++;
+}
+
+/*
+ * Write a summary of the performance counters to the given stream
+ */
+
+static void dump_stats(const struct device_stats *s, FILE *f)
+{
+    fprintf(f, "Device: %u xruns, %u handles, "
+            "service %u/%llu/%u us (min/mean/max), "
+            "mean wakeup delay %llu us\n",
+            s->xruns, s->handles,
+            s->service_min_us,
+            s->service_ns / s->handles / 1000,
+            s->service_max_us,
+            s->delay_ns / s->handles / 1000);
+
+    if (profile) {
+        unsigned int b;
+
+        fprintf(f, "  mean per handle: collect %llu us, submit %llu us\n",
+                s->collect_ns / s->handles / 1000,
+                s->submit_ns / s->handles / 1000);
+
+        fprintf(f, "  service histogram (<us: n):");
+        for (b = 0; b < DEVICE_HIST_BUCKETS; b++) {
+            if (s->hist[b] != 0)
+                fprintf(f, " <%u: %u", 1U << b, s->hist[b]);
+        }
+        fputc('\n', f);
+    }
+}
+
+/*
+ * As above, but public and safe to call at any time
+ */
+
+void device_stats_dump(struct device *dv, FILE *f)
+{
+    if (dv->stats.handles > 0)
+        dump_stats(&dv->stats, f);
 }
 
 /*
@@ -39,6 +156,9 @@ void device_init(struct device *dv, struct device_ops *ops)
 
 void device_clear(struct device *dv)
 {
+    if (dv->stats.handles > 0)
+        dump_stats(&dv->stats, stderr);
+
     if (dv->ops->clear != NULL)
         dv->ops->clear(dv);
 }
@@ -105,22 +225,100 @@ ssize_t device_pollfds(struct device *dv, struct pollfd *pe, size_t z)
  *
  * This function can be called when there is activity on any file
  * descriptor, not specifically one returned by this device.
+ *
+ * Pre: wake is the time poll() returned, or NULL if not known
  */
 
-void device_handle(struct device *dv)
+void device_handle(struct device *dv, const struct timespec *wake)
 {
+    struct device_stats *s = &dv->stats;
+    struct timespec begin, end;
+    unsigned long long ns;
+    unsigned int us;
+    int r;
+
     if (dv->fault)
         return;
 
     if (dv->ops->handle == NULL)
         return;
 
-    if (dv->ops->handle(dv) != 0) {
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+
+    r = dv->ops->handle(dv);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    ns = elapsed_ns(&begin, &end);
+    us = ns / 1000;
+
+    s->service_ns += ns;
+    if (s->handles == 0 || us < s->service_min_us)
+        s->service_min_us = us;
+    if (us > s->service_max_us)
+        s->service_max_us = us;
+    if (wake != NULL)
+        s->delay_ns += elapsed_ns(wake, &begin);
+    s->handles++;
+
+    if (profile)
+        histogram(s, us);
+
+    if (r != 0) {
         dv->fault = true;
         fputs("Error handling audio device; disabling it\n", stderr);
     }
 }
 
+/*
+ * Count an overrun or underrun of the device's audio buffers
+ *
+ * Called from the realtime thread at the point the xrun is seen
+ */
+
+void device_xrun(struct device *dv)
+{
+    dv->stats.xruns++;
+}
+
+/*
+ * Put a summary of the performance counters on the status line
+ */
+
+void device_stats_status(struct device *dv, unsigned int deck)
+{
+    const struct device_stats *s = &dv->stats;
+
+    if (s->handles == 0) {
+        status_printf(STATUS_VERBOSE, "Deck %u: no device activity", deck);
+        return;
+    }
+
+    if (profile) {
+
+        /* The breakdown answers where the service time goes, which
+         * is the question being asked whilst tuning */
+
+        status_printf(STATUS_VERBOSE,
+                      "Deck %u: %u xruns, service %llu us "
+                      "(collect %llu, submit %llu), max %u us",
+                      deck, s->xruns,
+                      s->service_ns / s->handles / 1000,
+                      s->collect_ns / s->handles / 1000,
+                      s->submit_ns / s->handles / 1000,
+                      s->service_max_us);
+        return;
+    }
+
+    status_printf(STATUS_VERBOSE,
+                  "Deck %u: %u xruns, service %u/%llu/%u us, delay %llu us",
+                  deck, s->xruns,
+                  s->service_min_us,
+                  s->service_ns / s->handles / 1000,
+                  s->service_max_us,
+                  s->delay_ns / s->handles / 1000);
+}
+
 /*
  * Send audio from a device for processing
  *
@@ -129,8 +327,13 @@ void device_handle(struct device *dv)
 
 void device_submit(struct device *dv, signed short *pcm, size_t n)
 {
+    struct timespec lap;
+
     assert(dv->timecoder != NULL);
+
+    lap_begin(&lap);
     timecoder_submit(dv->timecoder, pcm, n);
+    lap_end(&dv->stats.submit_ns, &lap);
 }
 
 /*
@@ -141,6 +344,176 @@ void device_submit(struct device *dv, signed short *pcm, size_t n)
 
 void device_collect(struct device *dv, signed short *pcm, size_t n)
 {
+    struct timespec lap;
+
     assert(dv->player != NULL);
+
+    lap_begin(&lap);
     player_collect(dv->player, pcm, n);
+    lap_end(&dv->stats.collect_ns, &lap);
+}
+
+/*
+ * Bytes per sample of the given format
+ */
+
+size_t device_sample_bytes(enum device_format fmt)
+{
+    switch (fmt) {
+    case DEVICE_S16:
+        return sizeof(signed short);
+    case DEVICE_S24:
+    case DEVICE_S32:
+        return sizeof(int32_t);
+    case DEVICE_FLOAT:
+        return sizeof(float);
+    default:
+        abort();
+    }
+}
+
+/* Hardware which doesn't take S16 natively is fed via the
+ * conversions below, done in cache-hot blocks at the device
+ * boundary.  This is cheaper than the conversion, copy and added
+ * buffer of a libasound 'plug' device, and it keeps direct mmap
+ * access to the hardware */
+
+#define CONVERT_BLOCK 512 /* frames converted per pass */
+
+static void widen(void *out, const signed short *in, size_t n,
+                  enum device_format fmt)
+{
+    size_t i;
+
+    switch (fmt) {
+    case DEVICE_S24:
+        for (i = 0; i < n; i++)
+            ((int32_t*)out)[i] = (int32_t)in[i] << 8;
+        break;
+
+    case DEVICE_S32:
+        for (i = 0; i < n; i++)
+            ((int32_t*)out)[i] = (int32_t)in[i] << 16;
+        break;
+
+    case DEVICE_FLOAT:
+        for (i = 0; i < n; i++)
+            ((float*)out)[i] = (float)in[i] / 32768;
+        break;
+
+    default:
+        abort();
+    }
+}
+
+static void narrow(signed short *out, const void *in, size_t n,
+                   enum device_format fmt)
+{
+    size_t i;
+
+    switch (fmt) {
+    case DEVICE_S24:
+        for (i = 0; i < n; i++)
+            out[i] = ((const int32_t*)in)[i] >> 8;
+        break;
+
+    case DEVICE_S32:
+        for (i = 0; i < n; i++)
+            out[i] = ((const int32_t*)in)[i] >> 16;
+        break;
+
+    case DEVICE_FLOAT:
+        for (i = 0; i < n; i++) {
+            float v;
+
+            v = ((const float*)in)[i] * 32768;
+
+            if (v > SHRT_MAX) {
+                out[i] = SHRT_MAX;
+            } else if (v < SHRT_MIN) {
+                out[i] = SHRT_MIN;
+            } else {
+                out[i] = (signed short)v;
+            }
+        }
+        break;
+
+    default:
+        abort();
+    }
+}
+
+/*
+ * As device_submit(), but taking samples in the device's native
+ * format
+ */
+
+void device_submit_format(struct device *dv, const void *pcm, size_t n,
+                          enum device_format fmt)
+{
+    struct timespec lap;
+
+    assert(dv->timecoder != NULL);
+
+    if (fmt == DEVICE_S16) {
+        device_submit(dv, (signed short*)pcm, n);
+        return;
+    }
+
+    lap_begin(&lap);
+
+    while (n > 0) {
+        signed short block[CONVERT_BLOCK * DEVICE_CHANNELS];
+        size_t b;
+
+        b = n;
+        if (b > CONVERT_BLOCK)
+            b = CONVERT_BLOCK;
+
+        narrow(block, pcm, b * DEVICE_CHANNELS, fmt);
+        timecoder_submit(dv->timecoder, block, b);
+
+        pcm = (const char*)pcm
+            + b * DEVICE_CHANNELS * device_sample_bytes(fmt);
+        n -= b;
+    }
+
+    lap_end(&dv->stats.submit_ns, &lap);
+}
+
+/*
+ * As device_collect(), but filling the buffer in the device's native
+ * format
+ */
+
+void device_collect_format(struct device *dv, void *pcm, size_t n,
+                           enum device_format fmt)
+{
+    struct timespec lap;
+
+    assert(dv->player != NULL);
+
+    if (fmt == DEVICE_S16) {
+        device_collect(dv, pcm, n);
+        return;
+    }
+
+    lap_begin(&lap);
+
+    while (n > 0) {
+        signed short block[CONVERT_BLOCK * DEVICE_CHANNELS];
+        size_t b;
+
+        b = n;
+        if (b > CONVERT_BLOCK)
+            b = CONVERT_BLOCK;
+
+        player_collect(dv->player, block, b);
+        widen(pcm, block, b * DEVICE_CHANNELS, fmt);
+
+        pcm = (char*)pcm + b * DEVICE_CHANNELS * device_sample_bytes(fmt);
+        n -= b;
+    }
+
+    lap_end(&dv->stats.collect_ns, &lap);
 }
@@ -22,15 +22,55 @@
 
 #include <poll.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <sys/types.h>
+#include <time.h>
 
 #define DEVICE_CHANNELS 2
 
+/* Sample formats which can be negotiated with the hardware.  The
+ * players and timecoder work natively in S16, the depth of the track
+ * data itself; the other formats are converted at the device
+ * boundary */
+
+enum device_format {
+    DEVICE_S16,
+    DEVICE_S24, /* in a 32-bit word, justified low */
+    DEVICE_S32,
+    DEVICE_FLOAT
+};
+
+/* Performance counters, written only by the realtime thread which
+ * serves the device; reads from other threads are unsynchronised
+ * and used for display only */
+
+/* Histogram of service time; bucket n counts services which took
+ * less than 2^n microseconds */
+
+#define DEVICE_HIST_BUCKETS 16
+
+struct device_stats {
+    unsigned int xruns;
+    unsigned int handles;
+    unsigned long long service_ns; /* total time inside handle() */
+    unsigned long long delay_ns; /* total poll wakeup to service */
+    unsigned int service_min_us, service_max_us;
+
+    /* Breakdown of where the service time goes, taken only when
+     * device_profile is on; see device_set_profile() */
+
+    unsigned long long collect_ns, /* inside player_collect() */
+        submit_ns; /* inside timecoder_submit() */
+    unsigned int hist[DEVICE_HIST_BUCKETS];
+};
+
 struct device {
     bool fault;
     void *local;
     struct device_ops *ops;
 
+    struct device_stats stats;
+
     struct timecoder *timecoder;
     struct player *player;
 };
@@ -58,9 +98,21 @@ void device_start(struct device *dv);
 void device_stop(struct device *dv);
 
 ssize_t device_pollfds(struct device *dv, struct pollfd *pe, size_t z);
-void device_handle(struct device *dv);
+void device_handle(struct device *dv, const struct timespec *wake);
+
+void device_xrun(struct device *dv);
+void device_set_profile(bool on);
+void device_stats_dump(struct device *dv, FILE *f);
+void device_stats_status(struct device *dv, unsigned int deck);
+
+size_t device_sample_bytes(enum device_format fmt);
 
 void device_submit(struct device *dv, signed short *pcm, size_t npcm);
 void device_collect(struct device *dv, signed short *pcm, size_t npcm);
 
+void device_submit_format(struct device *dv, const void *pcm, size_t npcm,
+                          enum device_format fmt);
+void device_collect_format(struct device *dv, void *pcm, size_t npcm,
+                           enum device_format fmt);
+
 #endif
@@ -44,6 +44,10 @@
 #define LOOP 1
 #define ROLL 2
 
+/* Length of the shortest loop roll, in seconds */
+
+#define ROLL_BASE 0.0625
+
 #ifdef DEBUG
 static const char *actions[] = {
     "CUE",
@@ -65,6 +69,11 @@ struct dicer {
     struct deck *left, *right;
     led_t left_led[NBUTTONS], right_led[NBUTTONS];
 
+    /* A message part-way through framing from the input batch */
+
+    unsigned char msg[3];
+    size_t mfill;
+
     char obuf[180];
     size_t ofill;
 };
@@ -288,7 +297,8 @@ static void set_led(led_t *led, unsigned char set, unsigned char clear)
 
 static void event_decoded(struct deck *d, led_t led[NBUTTONS],
                           unsigned char action, bool shift,
-                          unsigned char button, bool on)
+                          unsigned char button, bool on,
+                          const struct timespec *when)
 {
     /* Always toggle the LED status */
 
@@ -310,16 +320,29 @@ static void event_decoded(struct deck *d, led_t led[NBUTTONS],
         return;
 
     if (action == CUE && on) {
-        deck_cue(d, button);
+        deck_cue_at(d, button, when);
         set_led(&led[button], ON, 0);
     }
 
     if (action == LOOP) {
         if (on) {
-            deck_punch_in(d, button);
+            deck_punch_in_at(d, button, when);
+            set_led(&led[button], ON, 0);
+        } else {
+            deck_punch_out_at(d, when);
+        }
+    }
+
+    /* The roll page: hold for a loop roll whose length doubles with
+     * each button, release to fall back into normal playback */
+
+    if (action == ROLL) {
+        if (on) {
+            deck_loop_roll(d, ROLL_BASE * (1 << button));
             set_led(&led[button], ON, 0);
         } else {
-            deck_punch_out(d);
+            deck_loop_roll_off(d);
+            set_led(&led[button], 0, ON);
         }
     }
 }
@@ -328,7 +351,8 @@ static void event_decoded(struct deck *d, led_t led[NBUTTONS],
  * Process an event from the device, given the MIDI control codes
  */
 
-static void event(struct dicer *d, unsigned char buf[3])
+static void event(struct dicer *d, unsigned char buf[3],
+                  const struct timespec *when)
 {
     struct deck *deck;
     led_t *led;
@@ -406,7 +430,7 @@ static void event(struct dicer *d, unsigned char buf[3])
           button, on ? "ON" : "OFF",
           deck);
 
-    event_decoded(deck, led, action, shift, button, on);
+    event_decoded(deck, led, action, shift, button, on, when);
 }
 
 static ssize_t pollfds(struct controller *c, struct pollfd *pe, size_t z)
@@ -426,18 +450,27 @@ static int realtime(struct controller *c)
     struct dicer *d = c->local;
 
     for (;;) {
-        unsigned char buf[3];
-        ssize_t z;
+        unsigned char buf[48]; /* a batch of events */
+        struct timespec when;
+        ssize_t z, n;
 
-        z = midi_read(&d->midi, buf, sizeof buf);
+        z = midi_read_stamped(&d->midi, buf, sizeof buf, &when);
         if (z == -1)
             return -1;
         if (z == 0)
             break;
 
-        debug("got event");
+        debug("got %zd bytes", z);
+
+        /* Frame into 3-byte messages; a batch may end mid-message */
 
-        event(d, buf);
+        for (n = 0; n < z; n++) {
+            d->msg[d->mfill++] = buf[n];
+            if (d->mfill == sizeof d->msg) {
+                event(d, d->msg, &when);
+                d->mfill = 0;
+            }
+        }
     }
 
     sync_all_leds(d);
@@ -490,6 +523,7 @@ int dicer_init(struct controller *c, struct rt *rt, const char *hw)
 
     d->left = NULL;
     d->right = NULL;
+    d->mfill = 0;
     d->ofill = 0;
 
     for (n = 0; n < NBUTTONS; n++) {
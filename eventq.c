@@ -0,0 +1,128 @@
+/*
+ * Copyright (C) 2021 Mark Hills <mark@xwax.org>
+ *
+ * This file is part of "xwax".
+ *
+ * "xwax" is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 3 as
+ * published by the Free Software Foundation.
+ *
+ * "xwax" is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "eventq.h"
+
+/*
+ * Each cell carries a sequence number which encodes whether it is
+ * free (seq == posting position) or full (seq == position + 1); a
+ * producer claims a free cell by advancing the shared head, and
+ * publishes with a release store of the sequence which the consumer
+ * acquires. Wrap-around adds EVENTQ_SIZE each lap.
+ */
+
+void eventq_init(struct eventq *q, void (*wake)(void))
+{
+    unsigned int n;
+
+    for (n = 0; n < EVENTQ_SIZE; n++)
+        q->cell[n].seq = n;
+
+    q->head = 0;
+    q->tail = 0;
+    q->wake = wake;
+}
+
+void eventq_clear(struct eventq *q)
+{
+    assert(q->head == q->tail); /* all events drained */
+}
+
+/*
+ * Post an event to be run on the owning thread
+ *
+ * Return: 0 on success, -1 if the queue is full
+ *
+ * The caller keeps ownership of data until func runs. On failure the
+ * caller falls back, typically to doing the work in place.
+ */
+
+int eventq_post(struct eventq *q, void (*func)(void *data), void *data)
+{
+    struct eventq_cell *cell;
+    unsigned int pos;
+
+    pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+
+    for (;;) {
+        int dif;
+
+        cell = &q->cell[pos % EVENTQ_SIZE];
+        dif = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - pos;
+
+        if (dif < 0)
+            return -1; /* full; a lap behind */
+
+        if (dif > 0) { /* another producer took this cell */
+            pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        if (__atomic_compare_exchange_n(&q->head, &pos, pos + 1,
+                                        true, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED))
+            break;
+    }
+
+    cell->func = func;
+    cell->data = data;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+
+    if (q->wake != NULL)
+        q->wake();
+
+    return 0;
+}
+
+/*
+ * Run all pending events, in the order they were posted
+ *
+ * Pre: called only by the owning thread
+ */
+
+void eventq_drain(struct eventq *q)
+{
+    for (;;) {
+        struct eventq_cell *cell;
+        unsigned int pos;
+        void (*func)(void *data);
+        void *data;
+
+        pos = q->tail;
+        cell = &q->cell[pos % EVENTQ_SIZE];
+
+        if (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) != pos + 1)
+            break; /* empty, or a producer mid-post */
+
+        func = cell->func;
+        data = cell->data;
+
+        /* Release the cell before running the event; the handler
+         * may itself post */
+
+        __atomic_store_n(&cell->seq, pos + EVENTQ_SIZE, __ATOMIC_RELEASE);
+        q->tail = pos + 1;
+
+        func(data);
+    }
+}
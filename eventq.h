@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2021 Mark Hills <mark@xwax.org>
+ *
+ * This file is part of "xwax".
+ *
+ * "xwax" is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 3 as
+ * published by the Free Software Foundation.
+ *
+ * "xwax" is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef EVENTQ_H
+#define EVENTQ_H
+
+/*
+ * Bounded queue of events crossing between threads
+ *
+ * The observer pattern (observer.h) runs its callbacks on whichever
+ * thread fires the event. Where the work belongs to a different
+ * thread, a queue carries a compact event to it instead: any thread
+ * posts, and the single owning thread drains at the top of its event
+ * loop. Posting is lock-free, so it never waits on work in flight on
+ * the owning thread.
+ */
+
+#define EVENTQ_SIZE 64 /* events; power of two */
+
+struct eventq_cell {
+    unsigned int seq;
+    void (*func)(void *data);
+    void *data;
+};
+
+struct eventq {
+    struct eventq_cell cell[EVENTQ_SIZE];
+    unsigned int head, /* next posting, shared by producers */
+        tail; /* next drain, owning thread only */
+    void (*wake)(void); /* stir the owning thread's event loop */
+};
+
+void eventq_init(struct eventq *q, void (*wake)(void));
+void eventq_clear(struct eventq *q);
+
+int eventq_post(struct eventq *q, void (*func)(void *data), void *data);
+void eventq_drain(struct eventq *q);
+
+#endif
@@ -32,34 +32,113 @@
 
 #include "debug.h"
 #include "excrate.h"
+#include "libcache.h"
 #include "rig.h"
 #include "status.h"
 
-static struct list excrates = LIST_INIT(excrates);
+#define POOL_SIZE 4 /* concurrent scan processes */
 
-static int excrate_init(struct excrate *e, const char *script,
-                        const char *search, struct listing *storage)
+static struct list excrates = LIST_INIT(excrates),
+    queue = LIST_INIT(queue); /* scans awaiting a slot in the pool */
+static unsigned int running = 0;
+
+/*
+ * Start the scan process of the given excrate
+ *
+ * Return: 0 on success, -1 on error
+ */
+
+static int launch(struct excrate *e)
 {
     pid_t pid;
 
-    fprintf(stderr, "External scan '%s'...\n", search);
+    assert(e->pending);
 
-    pid = fork_pipe_nb(&e->fd, script, "scan", search, NULL);
+    fprintf(stderr, "External scan '%s'...\n", e->search);
+
+    pid = fork_pipe_nb(&e->fd, e->script, "scan", e->search, NULL);
     if (pid == -1)
         return -1;
 
     e->pid = pid;
-    e->pe = NULL;
+    e->pending = false;
+    running++;
+
+    /* Only now does the rig see this scan; a pending scan has no
+     * file descriptor and would waste a poll entry */
+
+    rig_post_excrate(e);
+
+    return 0;
+}
+
+/*
+ * Launch queued scans, up to the size of the pool
+ *
+ * Several crates over a slow disk would otherwise contend with each
+ * other, and the library is not complete until the slowest of them;
+ * the pool bounds the contention whilst keeping the disk busy.
+ */
+
+static void launch_next(void)
+{
+    while (running < POOL_SIZE && !list_empty(&queue)) {
+        struct excrate *e;
+
+        e = list_entry(queue.next, struct excrate, launch);
+        list_del(&e->launch);
+
+        if (launch(e) == 0)
+            continue;
+
+        /* Treat a failed launch like a failed scan */
+
+        e->pending = false;
+        status_printf(STATUS_ALERT, "Error scanning %s", e->search);
+        fire(&e->completion, NULL);
+    }
+}
+
+static int excrate_init(struct excrate *e, const char *script,
+                        const char *search, struct listing *storage,
+                        bool use_cache, bool save)
+{
+    e->fd = -1;
+    e->pid = 0;
+    e->pending = true;
+    e->save = save;
     e->terminated = false;
     e->refcount = 0;
     rb_reset(&e->rb);
     listing_init(&e->listing);
+    listing_init(&e->fresh);
+    index_init(&e->batch);
     e->storage = storage;
     event_init(&e->completion);
+    e->script = script;
     e->search = search;
 
+    /* If a previous scan left a cache, its records are available
+     * immediately; the scan continues in the background as a
+     * freshness check */
+
+    if (use_cache && libcache_load(script, search, storage, &e->listing) == 0) {
+        fprintf(stderr, "Loaded %zu cached records for '%s'\n",
+                e->listing.by_order.entries, search);
+    }
+
     list_add(&e->excrates, &excrates);
-    rig_post_excrate(e);
+
+    /* The caller's reference; the rig takes its own when the scan
+     * is launched */
+
+    excrate_acquire(e);
+
+    /* Scans run a few at a time; this one may have to wait for
+     * a slot */
+
+    list_add_tail(&e->launch, &queue);
+    launch_next();
 
     return 0;
 }
@@ -67,13 +146,18 @@ static int excrate_init(struct excrate *e, const char *script,
 static void excrate_clear(struct excrate *e)
 {
     assert(e->pid == 0);
+    if (e->pending)
+        list_del(&e->launch); /* never launched */
     list_del(&e->excrates);
     listing_clear(&e->listing);
+    listing_clear(&e->fresh);
+    index_clear(&e->batch);
     event_clear(&e->completion);
 }
 
 struct excrate* excrate_acquire_by_scan(const char *script, const char *search,
-                                        struct listing *storage)
+                                        struct listing *storage,
+                                        bool use_cache)
 {
     struct excrate *e;
 
@@ -85,17 +169,44 @@ struct excrate* excrate_acquire_by_scan(const char *script, const char *search,
         return NULL;
     }
 
-    if (excrate_init(e, script, search, storage) == -1) {
+    if (excrate_init(e, script, search, storage, use_cache, true) == -1) {
         free(e);
         return NULL;
     }
 
-    excrate_acquire(e);
-
     debug("returning %p", e)
     return e;
 }
 
+/*
+ * As excrate_acquire_by_scan(), for a scan of part of a library
+ *
+ * The result feeds the listings but is not worth a cache of its
+ * own; the cache stays keyed on whole crates.
+ */
+
+struct excrate* excrate_acquire_by_refresh(const char *script,
+                                           const char *search,
+                                           struct listing *storage)
+{
+    struct excrate *e;
+
+    debug("get_by_refresh %s, %s", script, search);
+
+    e = malloc(sizeof *e);
+    if (e == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+
+    if (excrate_init(e, script, search, storage, false, false) == -1) {
+        free(e);
+        return NULL;
+    }
+
+    return e;
+}
+
 void excrate_acquire(struct excrate *e)
 {
     debug("get %p", e);
@@ -137,29 +248,31 @@ void excrate_release(struct excrate *e)
 }
 
 /*
- * Get entry for use by poll()
+ * The descriptor which feeds this scan, registered with the rig
  *
  * Pre: scan is running
- * Post: *pe contains poll entry
  */
 
-void excrate_pollfd(struct excrate *e, struct pollfd *pe)
+int excrate_fd(const struct excrate *e)
 {
     assert(e->pid != 0);
 
-    pe->fd = e->fd;
-    pe->events = POLLIN;
-
-    e->pe = pe;
+    return e->fd;
 }
 
-static void do_wait(struct excrate *e)
+/*
+ * Return: 0 if the scan exited cleanly, otherwise -1
+ */
+
+static int do_wait(struct excrate *e)
 {
     int status;
 
     assert(e->pid != 0);
     debug("waiting on pid %d", e->pid);
 
+    rig_unmonitor(e->fd);
+
     if (close(e->fd) == -1)
         abort();
 
@@ -168,15 +281,52 @@ static void do_wait(struct excrate *e)
 
     debug("wait for pid %d returned %d", e->pid, status);
 
+    e->pid = 0;
+    running--;
+
     if (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS) {
         fprintf(stderr, "Scan completed\n");
+        return 0;
     } else {
         fprintf(stderr, "Scan completed with status %d\n", status);
         if (!e->terminated)
             status_printf(STATUS_ALERT, "Error scanning %s", e->search);
+        return -1;
     }
+}
 
-    e->pid = 0;
+/*
+ * Merge the pending batch of records into the listings in one pass
+ *
+ * Inserting records one at a time is quadratic in the size of the
+ * library, and the UI stutters whilst a large scan streams in.
+ *
+ * Return: -1 if out of memory, otherwise zero
+ */
+
+static int flush_batch(struct excrate *e)
+{
+    if (e->batch.entries == 0)
+        return 0;
+
+    /* Resolve against the global storage first; the batch then
+     * holds the canonical pointer for the other listings */
+
+    if (listing_add_batch(e->storage, &e->batch) == -1)
+        return -1;
+
+    if (listing_add_batch(&e->listing, &e->batch) == -1)
+        return -1;
+
+    /* Track what the scan actually delivered, which becomes
+     * the next cache; entries only in the old cache expire */
+
+    if (listing_add_batch(&e->fresh, &e->batch) == -1)
+        return -1;
+
+    index_blank(&e->batch);
+
+    return 0;
 }
 
 /*
@@ -188,36 +338,32 @@ static int read_from_pipe(struct excrate *e)
     for (;;) {
         char *line;
         ssize_t z;
-        struct record *d, *x;
+        struct record *d;
 
         z = get_line(e->fd, &e->rb, &line);
         if (z == -1) {
             if (errno == EAGAIN)
-                return 0;
+                return flush_batch(e);
             perror("get_line");
             return -1;
         }
 
-        if (z == 0)
+        if (z == 0) {
+            (void)flush_batch(e);
             return -1;
+        }
 
         debug("got line '%s'", line);
 
-        d = get_record(line);
+        d = get_record(e->storage, line);
         if (d == NULL) {
             free(line);
             continue; /* ignore malformed entries */
         }
 
-        x = listing_add(e->storage, d);
-        if (x == NULL)
-            return -1;
-        if (x != d) /* our new record is a duplicate */
-            free(d);
-
-        x = listing_add(&e->listing, x);
-        if (x == NULL)
+        if (index_reserve(&e->batch, 1) == -1)
             return -1;
+        index_add(&e->batch, d);
     }
 }
 
@@ -225,16 +371,14 @@ void excrate_handle(struct excrate *e)
 {
     assert(e->pid != 0);
 
-    if (e->pe == NULL)
+    if (read_from_pipe(e) != -1)
         return;
 
-    if (e->pe->revents == 0)
-        return;
+    if (do_wait(e) == 0 && !e->terminated && e->save)
+        libcache_save(e->script, e->search, &e->fresh);
 
-    if (read_from_pipe(e) != -1)
-        return;
+    launch_next(); /* our slot in the pool is free */
 
-    do_wait(e);
     fire(&e->completion, NULL);
     list_del(&e->rig);
     excrate_release(e); /* may invalidate e */
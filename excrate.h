@@ -20,7 +20,6 @@
 #ifndef EXCRATE_H
 #define EXCRATE_H
 
-#include <poll.h>
 #include <sys/types.h>
 
 #include "external.h"
@@ -31,16 +30,27 @@
 struct excrate {
     struct list excrates;
     unsigned int refcount;
-    const char *search;
+    const char *script, *search;
     struct listing listing, *storage;
     struct event completion;
 
-    /* State of the external scan process */
+    /* Records delivered by the scan itself, excluding any
+     * pre-loaded from the cache; what the cache becomes next */
 
-    struct list rig;
+    struct listing fresh;
+
+    /* Records read but not yet merged into the listings */
+
+    struct index batch;
+
+    /* State of the external scan process. Scans run a few at a
+     * time; a pending scan is queued for launch */
+
+    struct list rig, launch;
+    bool pending;
+    bool save; /* cache the result on completion */
     pid_t pid;
     int fd;
-    struct pollfd *pe;
     bool terminated;
 
     /* State of reader */
@@ -49,14 +59,18 @@ struct excrate {
 };
 
 struct excrate* excrate_acquire_by_scan(const char *script, const char *search,
-                                        struct listing *storage);
+                                        struct listing *storage,
+                                        bool use_cache);
+struct excrate* excrate_acquire_by_refresh(const char *script,
+                                           const char *search,
+                                           struct listing *storage);
 
 void excrate_acquire(struct excrate *e);
 void excrate_release(struct excrate *e);
 
 /* Used by the rig and main thread */
 
-void excrate_pollfd(struct excrate *tr, struct pollfd *pe);
+int excrate_fd(const struct excrate *e);
 void excrate_handle(struct excrate *tr);
 
 #endif
@@ -0,0 +1,185 @@
+/*
+ * Copyright (C) 2021 Mark Hills <mark@xwax.org>
+ *
+ * This file is part of "xwax".
+ *
+ * "xwax" is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 3 as
+ * published by the Free Software Foundation.
+ *
+ * "xwax" is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "export.h"
+
+static struct export_header *header = NULL;
+static size_t size = 0;
+static char segment[32];
+
+/*
+ * Map the shared memory segment and prepare a slot for each deck
+ *
+ * Return: -1 if the segment could not be made, otherwise 0
+ */
+
+int export_init(size_t ndeck)
+{
+    int fd;
+    size_t n, q;
+
+    snprintf(segment, sizeof segment, "/xwax-%d", (int)getpid());
+
+    size = sizeof(struct export_header)
+        + ndeck * sizeof(struct export_deck);
+
+    fd = shm_open(segment, O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd == -1) {
+        perror("shm_open");
+        return -1;
+    }
+
+    if (ftruncate(fd, size) == -1) {
+        perror("ftruncate");
+        goto fail;
+    }
+
+    header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (header == MAP_FAILED) {
+        perror("mmap");
+        header = NULL;
+        goto fail;
+    }
+
+    if (close(fd) == -1)
+        abort();
+
+    /* The segment arrives zeroed; fill in the fields for which zero
+     * is a misleading value, then declare it valid */
+
+    for (n = 0; n < ndeck; n++) {
+        for (q = 0; q < MAX_CUES; q++)
+            header->deck[n].cue[q] = CUE_UNSET;
+    }
+
+    header->version = EXPORT_VERSION;
+    header->ndeck = ndeck;
+
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    header->magic = EXPORT_MAGIC;
+
+    fprintf(stderr, "Exporting deck state to shared memory '%s'\n",
+            segment);
+
+    return 0;
+
+fail:
+    if (close(fd) == -1)
+        abort();
+    (void)shm_unlink(segment);
+    return -1;
+}
+
+void export_clear(void)
+{
+    if (header == NULL)
+        return;
+
+    if (munmap(header, size) == -1)
+        abort();
+    (void)shm_unlink(segment);
+
+    header = NULL;
+}
+
+/*
+ * Get the export slot for the given deck
+ *
+ * Return: the slot, or NULL if there is no export segment
+ */
+
+struct export_deck* export_slot(size_t n)
+{
+    if (header == NULL || n >= header->ndeck)
+        return NULL;
+
+    return &header->deck[n];
+}
+
+/*
+ * Hash a pathname, FNV-1a
+ *
+ * The hash stands in for the pathname itself, which is too long
+ * for the fixed layout; an external reader hashes the pathnames it
+ * knows about and matches against this.
+ */
+
+uint32_t export_hash(const char *s)
+{
+    uint32_t h = 2166136261u;
+
+    while (*s != '\0') {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+
+    return h;
+}
+
+static void begin_track(struct export_deck *x)
+{
+    __atomic_store_n(&x->track_seq, x->track_seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void end_track(struct export_deck *x)
+{
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&x->track_seq, x->track_seq + 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Note the pathname of the loaded track
+ */
+
+void export_load(struct export_deck *x, const char *pathname)
+{
+    if (x == NULL)
+        return;
+
+    begin_track(x);
+    x->path_hash = export_hash(pathname);
+    end_track(x);
+}
+
+/*
+ * Publish the current set of cue points
+ */
+
+void export_cues(struct export_deck *x, const struct cues *q)
+{
+    size_t n;
+
+    if (x == NULL)
+        return;
+
+    begin_track(x);
+
+    for (n = 0; n < MAX_CUES; n++)
+        x->cue[n] = q->position[n];
+
+    end_track(x);
+}
@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2021 Mark Hills <mark@xwax.org>
+ *
+ * This file is part of "xwax".
+ *
+ * "xwax" is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 3 as
+ * published by the Free Software Foundation.
+ *
+ * "xwax" is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Shared-memory export of deck state, for external visualisers
+ *
+ * The segment is published as "/xwax-<pid>" in POSIX shared memory.
+ * Each deck has a slot protected by seqlocks: a sequence count is
+ * odd whilst a write is in progress, and a reader retries until it
+ * sees the same even count before and after reading. The realtime
+ * and control fields have separate counts, as they have separate
+ * writers.
+ */
+
+#ifndef EXPORT_H
+#define EXPORT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cues.h"
+
+#define EXPORT_MAGIC 0x78776178 /* "xawx", little-endian "xwax" */
+#define EXPORT_VERSION 1
+
+struct export_deck {
+    /* Written by the realtime thread, once per audio cycle */
+
+    uint32_t seq;
+    double position, /* elapsed playback (seconds) */
+        pitch; /* effective playback pitch */
+
+    /* Written when a track is loaded or a cue point changes */
+
+    uint32_t track_seq;
+    uint32_t path_hash; /* of the track pathname; see export_hash() */
+    double cue[MAX_CUES]; /* seconds, or CUE_UNSET */
+};
+
+struct export_header {
+    uint32_t magic, /* written last; zero until the rest is valid */
+        version,
+        ndeck;
+    struct export_deck deck[];
+};
+
+int export_init(size_t ndeck);
+void export_clear(void);
+
+struct export_deck* export_slot(size_t n);
+
+uint32_t export_hash(const char *s);
+void export_load(struct export_deck *x, const char *pathname);
+void export_cues(struct export_deck *x, const struct cues *q);
+
+/*
+ * Per-cycle update from the audio thread
+ *
+ * A handful of stores and no syscall; safe in the realtime path.
+ */
+
+static inline void export_tick(struct export_deck *x,
+                               double position, double pitch)
+{
+    if (x == NULL)
+        return;
+
+    __atomic_store_n(&x->seq, x->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    x->position = position;
+    x->pitch = pitch;
+
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&x->seq, x->seq + 1, __ATOMIC_RELAXED);
+}
+
+#endif
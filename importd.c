@@ -0,0 +1,197 @@
+/*
+ * Copyright (C) 2021 Mark Hills <mark@xwax.org>
+ *
+ * This file is part of "xwax".
+ *
+ * "xwax" is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 3 as
+ * published by the Free Software Foundation.
+ *
+ * "xwax" is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Importer daemon; the resident end of --import-daemon
+ *
+ * Run by the 'import' script in its --daemon mode as:
+ *
+ *   importd <socket> <rate> <importer>
+ *
+ * Listens on the given UNIX socket, implementing the protocol
+ * expected by track_daemon(): each connection carries one
+ * newline-terminated pathname, answered with the raw PCM from the
+ * importer and end-of-stream on completion. A client which shuts
+ * down its end early stops the decode via SIGPIPE.
+ *
+ * The decoder itself still runs per track, but its fork leaves this
+ * small process instead of the main xwax one, whose large and
+ * partly-locked address space makes each fork and the following
+ * shell startup expensive; see track_daemon().
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static const char *socket_path;
+
+/*
+ * A terminating signal; tidy the socket away. track_daemon_stop()
+ * also unlinks it, in case we are killed outright
+ */
+
+static void handle_terminate(int sig)
+{
+    unlink(socket_path);
+    _exit(EXIT_SUCCESS);
+}
+
+/*
+ * Serve one connection: read the pathname and hand the decode to the
+ * importer, with its output connected to the client
+ */
+
+static void serve(int conn, const char *importer, const char *rate)
+{
+    char path[4096], *nl;
+    size_t used;
+    pid_t pid;
+
+    used = 0;
+
+    for (;;) {
+        ssize_t z;
+
+        if (used == sizeof path - 1) {
+            fprintf(stderr, "Pathname is too long\n");
+            return;
+        }
+
+        z = read(conn, path + used, sizeof path - 1 - used);
+        if (z == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("read");
+            return;
+        }
+        if (z == 0)
+            return; /* client went away */
+
+        nl = memchr(path + used, '\n', z);
+        used += z;
+
+        if (nl != NULL) {
+            *nl = '\0';
+            break;
+        }
+    }
+
+    pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        return;
+    }
+
+    if (pid == 0) { /* child */
+        if (dup2(conn, STDOUT_FILENO) == -1) {
+            perror("dup2");
+            _exit(EXIT_FAILURE);
+        }
+
+        if (close(conn) == -1)
+            abort();
+
+        if (execl(importer, "import", path, rate, NULL) == -1)
+            perror(importer);
+        _exit(EXIT_FAILURE);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    struct sockaddr_un addr;
+    const char *rate, *importer;
+    int sock;
+
+    if (argc != 4) {
+        fprintf(stderr, "usage: %s <socket> <rate> <importer>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    socket_path = argv[1];
+    rate = argv[2];
+    importer = argv[3];
+
+    if (strlen(socket_path) >= sizeof addr.sun_path) {
+        fprintf(stderr, "%s: socket pathname is too long\n", socket_path);
+        return EXIT_FAILURE;
+    }
+
+    /* Decoders are not waited on individually */
+
+    if (signal(SIGCHLD, SIG_IGN) == SIG_ERR)
+        abort();
+    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
+        abort();
+    if (signal(SIGTERM, handle_terminate) == SIG_ERR)
+        abort();
+    if (signal(SIGINT, handle_terminate) == SIG_ERR)
+        abort();
+
+    /* The listening socket must not leak into the decoders, which
+     * outlive any one connection */
+
+    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1) {
+        perror("socket");
+        return EXIT_FAILURE;
+    }
+
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+
+    unlink(socket_path); /* stale socket from a previous run */
+
+    if (bind(sock, (struct sockaddr*)&addr, sizeof addr) == -1) {
+        perror(socket_path);
+        return EXIT_FAILURE;
+    }
+
+    if (listen(sock, 8) == -1) {
+        perror("listen");
+        return EXIT_FAILURE;
+    }
+
+    for (;;) {
+        int conn;
+
+        conn = accept(sock, NULL, NULL);
+        if (conn == -1) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            perror("accept");
+            return EXIT_FAILURE;
+        }
+
+        serve(conn, importer, rate);
+
+        /* The decoder holds its own duplicate; the client sees
+         * end-of-stream when the decode finishes */
+
+        if (close(conn) == -1)
+            abort();
+    }
+}
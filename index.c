@@ -17,13 +17,13 @@
  *
  */
 
-#define _GNU_SOURCE /* strcasestr(), strdupa() */
 #include <assert.h>
 #include <ctype.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h> /* strcasecmp() */
 
 #include "index.h"
 
@@ -130,19 +130,32 @@ static int record_cmp_artist(const struct record *a, const struct record *b)
 {
     int r;
 
-    r = strcasecmp(a->artist, b->artist);
-    if (r < 0)
-        return -1;
-    else if (r > 0)
-        return 1;
+    /* Artist and title strings are interned; the common case of
+     * equality is a pointer compare */
 
-    r = strcasecmp(a->title, b->title);
-    if (r < 0)
-        return -1;
-    else if (r > 0)
-        return 1;
+    if (a->artist != b->artist) {
+        r = strcasecmp(a->artist, b->artist);
+        if (r < 0)
+            return -1;
+        else if (r > 0)
+            return 1;
+    }
+
+    if (a->title != b->title) {
+        r = strcasecmp(a->title, b->title);
+        if (r < 0)
+            return -1;
+        else if (r > 0)
+            return 1;
+    }
 
-    return strcmp(a->pathname, b->pathname);
+    if (a->dir != b->dir) {
+        r = strcmp(a->dir, b->dir);
+        if (r != 0)
+            return r;
+    }
+
+    return strcmp(a->base, b->base);
 }
 
 /*
@@ -161,6 +174,60 @@ static int record_cmp_bpm(const struct record *a, const struct record *b)
     return record_cmp_artist(a, b);
 }
 
+/*
+ * Compare two records in the given sort order
+ */
+
+int record_cmp(const struct record *a, const struct record *b, int sort)
+{
+    switch (sort) {
+    case SORT_ARTIST:
+        return record_cmp_artist(a, b);
+    case SORT_BPM:
+        return record_cmp_bpm(a, b);
+    case SORT_PLAYLIST:
+    default:
+        abort();
+    }
+}
+
+/*
+ * Comparison functions, see qsort(3)
+ */
+
+static int qcompar_artist(const void *a, const void *b)
+{
+    return record_cmp_artist(*(struct record *const *)a,
+                             *(struct record *const *)b);
+}
+
+static int qcompar_bpm(const void *a, const void *b)
+{
+    return record_cmp_bpm(*(struct record *const *)a,
+                          *(struct record *const *)b);
+}
+
+/*
+ * Sort the index into the given order
+ */
+
+void index_sort(struct index *ls, int sort)
+{
+    switch (sort) {
+    case SORT_ARTIST:
+        qsort(ls->record, ls->entries, sizeof(struct record*),
+              qcompar_artist);
+        break;
+    case SORT_BPM:
+        qsort(ls->record, ls->entries, sizeof(struct record*),
+              qcompar_bpm);
+        break;
+    case SORT_PLAYLIST:
+    default:
+        abort();
+    }
+}
+
 /*
  * Check if a record matches the given string. This function is the
  * definitive code which defines what constitutes a 'match'.
@@ -170,20 +237,12 @@ static int record_cmp_bpm(const struct record *a, const struct record *b)
 
 static bool record_match_word(struct record *re, const char *match)
 {
-    /* Some records provide a dedicated string for matching against,
-     * in the same locale as "match" */
-
-    if (re->match) {
-        if (strcasestr(re->match, match) != NULL)
-            return true;
-    } else {
-        if (strcasestr(re->artist, match) != NULL)
-            return true;
-        if (strcasestr(re->title, match) != NULL)
-            return true;
-    }
+    /* Every record carries its searchable text pre-folded for case
+     * and locale (see matchable()) and match_compile() folds the
+     * search, so this is a plain byte search -- the C library's
+     * vectorised strstr() -- with no per-character conversion */
 
-    return false;
+    return strstr(re->match, match) != NULL;
 }
 
 /*
@@ -231,6 +290,9 @@ int index_copy(const struct index *src, struct index *dest)
 /*
  * Compile a search object from a given string
  *
+ * The case is folded here, once, to match the pre-folded text of
+ * the records.
+ *
  * Pre: search string is within length
  */
 
@@ -242,6 +304,9 @@ void match_compile(struct match *h, const char *d)
     assert(strlen(d) < sizeof h->buf);
     strcpy(h->buf, d);
 
+    for (buf = h->buf; *buf != '\0'; buf++)
+        *buf = tolower((unsigned char)*buf);
+
     buf = h->buf;
     n = 0;
     for (;;) {
@@ -295,6 +360,354 @@ int index_match(struct index *src, struct index *dest,
     return 0;
 }
 
+/*
+ * Inverted index of trigrams
+ *
+ * record_match() over every record is repeated for each keystroke of
+ * a search; the cost of each keystroke grows with the library. The
+ * postings map each three-byte window of the searchable text to the
+ * records containing it, so a search intersects a few posting lists
+ * and verifies only a small candidate set.
+ */
+
+void postings_init(struct postings *p, const struct index *over)
+{
+    p->over = over;
+    p->slot = NULL;
+    p->size = 0;
+    p->fill = 0;
+    p->indexed = 0;
+    p->failed = false;
+}
+
+void postings_clear(struct postings *p)
+{
+    size_t n;
+
+    for (n = 0; n < p->size; n++) {
+        if (p->slot[n].key != 0)
+            free(p->slot[n].position);
+    }
+
+    free(p->slot); /* may be NULL */
+}
+
+/*
+ * Pack the three-byte window at the given string into a trigram
+ *
+ * The indexed text and the search are both pre-folded for case
+ * (see matchable() and match_compile()), so the bytes pack
+ * directly. No window contains '\0', hence zero is free as the
+ * empty-slot sentinel.
+ */
+
+static unsigned int trigram(const char *s)
+{
+    return ((unsigned int)(unsigned char)s[0] << 16)
+        | ((unsigned int)(unsigned char)s[1] << 8)
+        | (unsigned int)(unsigned char)s[2];
+}
+
+/*
+ * Return: slot for the given trigram; empty if it is not present
+ * Pre: table has at least one empty slot
+ */
+
+static struct posting* postings_slot(struct postings *p, unsigned int key)
+{
+    size_t n;
+
+    n = (key * 2654435761u) & (p->size - 1); /* Knuth multiplicative */
+
+    for (;;) {
+        if (p->slot[n].key == 0 || p->slot[n].key == key)
+            return &p->slot[n];
+        n = (n + 1) & (p->size - 1); /* linear probe */
+    }
+}
+
+/*
+ * Return: 0 on success, -1 on memory allocation failure
+ */
+
+static int postings_grow(struct postings *p)
+{
+    size_t n, size;
+    struct posting *slot;
+    struct postings bigger;
+
+    size = p->size ? p->size * 2 : 1024;
+
+    slot = calloc(size, sizeof *slot);
+    if (slot == NULL) {
+        perror("calloc");
+        return -1;
+    }
+
+    bigger = *p;
+    bigger.slot = slot;
+    bigger.size = size;
+
+    for (n = 0; n < p->size; n++) {
+        if (p->slot[n].key != 0)
+            *postings_slot(&bigger, p->slot[n].key) = p->slot[n];
+    }
+
+    free(p->slot);
+    *p = bigger;
+
+    return 0;
+}
+
+/*
+ * Append a position to the posting list of the given trigram
+ *
+ * Return: 0 on success, -1 on memory allocation failure
+ */
+
+static int post(struct postings *p, unsigned int key, unsigned int pos)
+{
+    struct posting *s;
+
+    if (p->fill * 3 >= p->size * 2) { /* limit occupancy to 2/3 */
+        if (postings_grow(p) == -1)
+            return -1;
+    }
+
+    s = postings_slot(p, key);
+
+    if (s->key == 0) {
+        s->key = key;
+        s->position = NULL;
+        s->size = 0;
+        s->entries = 0;
+        p->fill++;
+    }
+
+    /* The same trigram typically repeats within one record */
+
+    if (s->entries > 0 && s->position[s->entries - 1] == pos)
+        return 0;
+
+    if (s->entries == s->size) {
+        unsigned int *ln;
+        size_t size;
+
+        size = s->size ? s->size * 2 : 4;
+
+        ln = realloc(s->position, sizeof(unsigned int) * size);
+        if (ln == NULL) {
+            perror("realloc");
+            return -1;
+        }
+
+        s->position = ln;
+        s->size = size;
+    }
+
+    s->position[s->entries++] = pos;
+
+    return 0;
+}
+
+static int postings_add_text(struct postings *p, const char *s,
+                             unsigned int pos)
+{
+    for (; s[0] != '\0' && s[1] != '\0' && s[2] != '\0'; s++) {
+        if (post(p, trigram(s), pos) == -1)
+            return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Add the next record of the backing index to the postings
+ *
+ * The same text is indexed as record_match() searches: the record's
+ * pre-folded match string.
+ *
+ * Pre: r is the record at position 'indexed' of the backing index
+ * Return: 0 on success, -1 on memory allocation failure
+ * Post: on failure the postings are marked incomplete, and are no
+ * longer offered for matching
+ */
+
+int postings_add(struct postings *p, const struct record *r)
+{
+    unsigned int pos;
+
+    if (p->failed)
+        return -1;
+
+    pos = p->indexed++;
+
+    if (postings_add_text(p, r->match, pos) == -1) {
+        p->failed = true;
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Check whether the postings are able to answer the given search
+ *
+ * A word shorter than three bytes has no trigram; the caller falls
+ * back to a linear scan unless at least one word can narrow the
+ * candidates.
+ */
+
+bool postings_can_match(const struct postings *p, const struct match *m)
+{
+    char *const *w;
+
+    if (p->failed)
+        return false;
+
+    for (w = m->words; *w != NULL; w++) {
+        if (strlen(*w) >= 3)
+            return true;
+    }
+
+    return false;
+}
+
+/*
+ * Find entries which match, using the postings
+ *
+ * The posting lists of the search trigrams are intersected, and only
+ * the resulting candidates are verified with record_match(). The
+ * destination is filled in the order of the backing index.
+ *
+ * Pre: postings_can_match() returned true
+ * Return: 0 on success, or -1 on memory allocation failure
+ * Post: on failure, dest is valid but incomplete
+ */
+
+int postings_match(struct postings *p, struct index *dest,
+                   const struct match *m)
+{
+    unsigned int key[64], *cand;
+    struct posting *list[ARRAY_SIZE(key)], *least;
+    char *const *w;
+    size_t keys, n, i;
+
+    index_blank(dest);
+
+    if (p->size == 0) /* nothing indexed */
+        return 0;
+
+    /*
+     * Gather the distinct trigrams of the search words
+     */
+
+    keys = 0;
+
+    for (w = m->words; *w != NULL; w++) {
+        const char *s;
+
+        for (s = *w; s[0] != '\0' && s[1] != '\0' && s[2] != '\0'; s++) {
+            unsigned int k;
+
+            k = trigram(s);
+
+            for (i = 0; i < keys; i++) {
+                if (key[i] == k)
+                    break;
+            }
+            if (i < keys)
+                continue;
+
+            if (keys == ARRAY_SIZE(key))
+                continue; /* verification covers the excess */
+
+            key[keys++] = k;
+        }
+    }
+
+    assert(keys > 0); /* see postings_can_match() */
+
+    /*
+     * Every candidate must appear in every posting list; begin
+     * with the shortest
+     */
+
+    least = NULL;
+
+    for (i = 0; i < keys; i++) {
+        struct posting *s;
+
+        s = postings_slot(p, key[i]);
+        if (s->key == 0)
+            return 0; /* no record contains this trigram */
+
+        if (least == NULL || s->entries < least->entries)
+            least = s;
+
+        list[i] = s;
+    }
+
+    cand = malloc(sizeof(unsigned int) * least->entries);
+    if (cand == NULL) {
+        perror("malloc");
+        return -1;
+    }
+
+    memcpy(cand, least->position, sizeof(unsigned int) * least->entries);
+    n = least->entries;
+
+    for (i = 0; i < keys && n > 0; i++) {
+        struct posting *s;
+        size_t a, b, z;
+
+        s = list[i];
+        if (s == least)
+            continue;
+
+        a = b = z = 0;
+
+        while (a < n && b < s->entries) {
+            if (cand[a] < s->position[b]) {
+                a++;
+            } else if (cand[a] > s->position[b]) {
+                b++;
+            } else {
+                cand[z++] = cand[a];
+                a++;
+                b++;
+            }
+        }
+
+        n = z;
+    }
+
+    /*
+     * The trigrams are necessary but not sufficient; verify the
+     * candidates
+     */
+
+    for (i = 0; i < n; i++) {
+        struct record *re;
+
+        re = p->over->record[cand[i]];
+
+        if (!record_match(re, m))
+            continue;
+
+        if (index_reserve(dest, 1) == -1) {
+            free(cand);
+            return -1;
+        }
+
+        index_add(dest, re);
+    }
+
+    free(cand);
+
+    return 0;
+}
+
 /*
  * Binary search of sorted index
  *
@@ -325,17 +738,7 @@ static size_t bin_search(struct record **base, size_t n,
     mid = n / 2;
     x = base[mid];
 
-    switch (sort) {
-    case SORT_ARTIST:
-        r = record_cmp_artist(item, x);
-        break;
-    case SORT_BPM:
-        r = record_cmp_bpm(item, x);
-        break;
-    case SORT_PLAYLIST:
-    default:
-        abort();
-    }
+    r = record_cmp(item, x, sort);
 
     if (r < 0)
         return bin_search(base, mid, item, sort, found);
@@ -377,6 +780,70 @@ struct record* index_insert(struct index *ls, struct record *item,
     return item;
 }
 
+/*
+ * Look for a matching entry in a sorted index
+ *
+ * Pre: index is sorted
+ * Return: the matching entry, or NULL if there is none
+ */
+
+struct record* index_search(struct index *ls, struct record *item,
+                            int sort)
+{
+    bool found;
+    size_t z;
+
+    z = bin_search(ls->record, ls->entries, item, sort, &found);
+    if (!found)
+        return NULL;
+
+    return ls->record[z];
+}
+
+/*
+ * Merge a sorted batch of records into a sorted index, in a single
+ * linear pass
+ *
+ * In contrast to repeated index_insert(), no comparison is made
+ * against existing entries; the caller resolves duplicates first.
+ *
+ * Pre: dest and src are sorted
+ * Return: 0 on success, or -1 on memory allocation failure
+ * Post: dest is sorted and contains the entries of src
+ */
+
+int index_merge(struct index *dest, const struct index *src, int sort)
+{
+    size_t d, s, w;
+
+    if (src->entries == 0)
+        return 0;
+
+    if (index_reserve(dest, src->entries) == -1)
+        return -1;
+
+    /* Work backwards, so that entries of dest are moved at most
+     * once, directly to their final position */
+
+    d = dest->entries;
+    s = src->entries;
+    w = d + s;
+
+    while (s > 0) {
+        if (d > 0 && record_cmp(dest->record[d - 1],
+                                src->record[s - 1], sort) > 0)
+        {
+            dest->record[--w] = dest->record[--d];
+        } else {
+            dest->record[--w] = src->record[--s];
+        }
+    }
+
+    dest->entries += src->entries;
+
+    return 0;
+}
+
 /*
  * Reserve space in the index for the addition of n new items
  *
@@ -413,6 +880,8 @@ void index_debug(struct index *ls)
 {
     int n;
 
-    for (n = 0; n < ls->entries; n++)
-        fprintf(stderr, "%d: %s\n", n, ls->record[n]->pathname);
+    for (n = 0; n < ls->entries; n++) {
+        fprintf(stderr, "%d: %s%s\n", n,
+                ls->record[n]->dir, ls->record[n]->base);
+    }
 }
@@ -20,6 +20,7 @@
 #ifndef INDEX_H
 #define INDEX_H
 
+#include <stdbool.h>
 #include <stddef.h>
 
 #define SORT_ARTIST   0
@@ -30,14 +31,22 @@
 /* A single music track in our listings */
 
 struct record {
-    char *pathname, *artist, *title; /* a single malloc */
+    /* The pathname is stored split at the final '/', with the
+     * directory (including that '/') interned and shared between
+     * the many records beneath it; see record_pathname() */
 
-    /* An optional extra string may be used to match against search
-     * input; allows us to handle locale but still type in ASCII */
+    char *dir, *base;
 
-    char *match; /* or NULL */
+    char *artist, *title;
+
+    /* The text matched against search input: artist and title in
+     * the search locale with the case pre-folded, so a search is a
+     * plain byte comparison */
+
+    char *match;
 
     double bpm; /* or 0.0 if not known */
+    char *key; /* musical key from analysis, or NULL if not known */
 };
 
 /* Index points to records, but does not manage those pointers */
@@ -55,10 +64,30 @@ struct match {
     char *words[32]; /* NULL-terminated array */
 };
 
+/* Inverted index of trigrams to positions in a backing index,
+ * so that a search resolves a small candidate set rather than
+ * scanning every record */
+
+struct posting {
+    unsigned int key; /* packed trigram; zero when the slot is empty */
+    unsigned int *position; /* ascending positions in the backing index */
+    size_t size, entries;
+};
+
+struct postings {
+    const struct index *over; /* the index which positions refer to */
+    struct posting *slot;
+    size_t size, fill;
+    unsigned int indexed; /* prefix of 'over' indexed so far */
+    bool failed; /* out of memory; the postings are incomplete */
+};
+
 void index_init(struct index *ls);
 void index_clear(struct index *ls);
 void index_blank(struct index *ls);
 void index_add(struct index *li, struct record *lr);
+void index_sort(struct index *ls, int sort);
+int record_cmp(const struct record *a, const struct record *b, int sort);
 bool record_match(struct record *re, const struct match *h);
 int index_copy(const struct index *src, struct index *dest);
 void match_compile(struct match *h, const char *d);
@@ -66,8 +95,18 @@ int index_match(struct index *src, struct index *dest,
                 const struct match *match);
 struct record* index_insert(struct index *ls, struct record *item,
                             int sort);
+struct record* index_search(struct index *ls, struct record *item,
+                            int sort);
+int index_merge(struct index *dest, const struct index *src, int sort);
 int index_reserve(struct index *i, unsigned int n);
 size_t index_find(struct index *ls, struct record *item, int sort);
 void index_debug(struct index *ls);
 
+void postings_init(struct postings *p, const struct index *over);
+void postings_clear(struct postings *p);
+int postings_add(struct postings *p, const struct record *r);
+bool postings_can_match(const struct postings *p, const struct match *m);
+int postings_match(struct postings *p, struct index *dest,
+                   const struct match *m);
+
 #endif
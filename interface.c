@@ -20,6 +20,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <iconv.h>
+#include <limits.h>
 #include <math.h>
 #include <pthread.h>
 #include <stdbool.h>
@@ -34,8 +35,11 @@
 #include <SDL_ttf.h>
 
 #include "debug.h"
+#include "eventq.h"
 #include "interface.h"
 #include "layout.h"
+#include "list.h"
+#include "memory.h"
 #include "player.h"
 #include "rig.h"
 #include "selector.h"
@@ -47,6 +51,16 @@
 
 #define REFRESH 10
 
+/* Refresh time when nothing on screen is in motion; the display is
+ * kept alive but idle CPU drops to near zero */
+
+#define REFRESH_IDLE 100
+
+/* Time (in milliseconds) the selection must dwell on a record
+ * before it is speculatively imported */
+
+#define PRELOAD 500
+
 /* Font definitions */
 
 #define FONT "DejaVuSans.ttf"
@@ -119,6 +133,7 @@
 #define FUNC_LOAD 0
 #define FUNC_RECUE 1
 #define FUNC_TIMECODE 2
+#define FUNC_SYNC 3
 
 /* Types of SDL_USEREVENT */
 
@@ -134,8 +149,21 @@
 
 #define LOCK(sf) if (SDL_MUSTLOCK(sf)) SDL_LockSurface(sf)
 #define UNLOCK(sf) if (SDL_MUSTLOCK(sf)) SDL_UnlockSurface(sf)
-#define UPDATE(sf, rect) SDL_UpdateRect(sf, (rect)->x, (rect)->y, \
-                                        (rect)->w, (rect)->h)
+
+/* Upper limit of damaged regions collected in one redraw; enough for
+ * every region to be damaged at once */
+
+#define MAX_DAMAGE 32
+
+/* Number of rows of search results we take a snapshot of, to notice
+ * when their content changes under a stationary listbox */
+
+#define VISIBLE_MAX 128
+
+/* Upper limit of rendered strings kept for re-use; enough for every
+ * string on screen, plus some scrolling */
+
+#define TEXT_CACHE_SIZE 512
 
 /* List of directories to use as search path for fonts. */
 
@@ -169,13 +197,107 @@ static unsigned short *spinner_angle, spinner_size;
 
 static int width = DEFAULT_WIDTH, height = DEFAULT_HEIGHT,
     meter_scale = DEFAULT_METER_SCALE;
+#ifdef WITH_SDL2
+static Uint32 video_flags = SDL_WINDOW_RESIZABLE;
+
+/* With SDL2 we composite into our own software surface, and present
+ * the damaged regions via a streaming texture on the GPU renderer */
+
+static SDL_Window *window = NULL;
+static SDL_Renderer *renderer = NULL;
+static SDL_Texture *texture = NULL;
+static SDL_Surface *screen = NULL;
+#else
 static Uint32 video_flags = SDL_RESIZABLE;
+#endif
 static float scale = DEFAULT_SCALE;
 static iconv_t utf;
 static pthread_t ph;
 static struct selector selector;
+static struct eventq events; /* work posted to this thread */
 static struct observer on_status, on_selector;
 
+/* Damage accumulated during a redraw, and flushed to the display
+ * in a single operation */
+
+static SDL_Rect damage[MAX_DAMAGE];
+static size_t damaged = 0;
+
+/* What was most recently painted for each deck, so that the regular
+ * refresh repaints only the regions whose inputs have changed */
+
+struct painted {
+    bool valid;
+    const struct record *record;
+    const struct track *track;
+    unsigned int length;
+    int position, elapsed, remain, timecode, scale;
+    bool importing, control, recalibrate, locked;
+    double pitch, sync_pitch, difference;
+};
+
+static struct painted painted[MAX_DECKS]; /* one per entry in deck[] */
+
+/* Likewise for the library. The records themselves are immutable,
+ * so a snapshot of the visible row pointers is enough to notice a
+ * change of content beneath a stationary listbox */
+
+static struct {
+    bool valid;
+    char search[SEARCH_MAX];
+    size_t matches;
+    int sort;
+    bool busy; /* of the selected crate */
+    struct listbox crates, records;
+    const struct record *row[VISIBLE_MAX];
+} library_painted;
+
+static char status_painted[256];
+static int status_level_painted = -1;
+
+/* An entry in the cache of rendered text, most-recently-used at the
+ * head of the list */
+
+struct rendered {
+    struct list lru;
+    TTF_Font *font;
+    SDL_Color fg, bg;
+    bool utf8;
+    SDL_Surface *surface;
+    char text[];
+};
+
+static struct list text_cache = LIST_INIT(text_cache);
+static size_t text_cache_entries = 0;
+
+/* Off-screen strip of rendered close-up waveform columns. The
+ * close-up is drawn on a grid of fixed sample blocks, so a column
+ * depends only on its block number and can be kept in a ring buffer
+ * as the view scrolls; per-frame work is then a blit plus whichever
+ * columns are new */
+
+struct strip {
+    SDL_Surface *surface;
+    const struct track *track;
+    int w, h, scale;
+    int *block;            /* block held by each column; INT_MIN if none */
+    unsigned int *covered; /* track length when the column was rendered */
+};
+
+static struct strip strip[MAX_DECKS]; /* one per entry in deck[] */
+
+/* The track being speculatively imported, and the record the
+ * selection has dwelt on; at most one track at a time */
+
+static struct track *preload = NULL;
+static struct record *preload_dwell = NULL;
+static Uint32 preload_since;
+
+/* Written by the interface thread, read by the timer callback; a
+ * stale read costs at most one mis-paced tick */
+
+static volatile bool animate = true;
+
 /*
  * Scale a dimension according to the current zoom level
  *
@@ -370,6 +492,55 @@ static int load_fonts(void)
     return 0;
 }
 
+/*
+ * Bring up the font library and load all fonts
+ *
+ * Independent of SDL, so this can run ahead of it; searching the
+ * font directories is a noticeable part of a cold start
+ */
+
+static int fonts_init(void)
+{
+    if (TTF_Init() == -1) {
+        fprintf(stderr, "%s\n", TTF_GetError());
+        return -1;
+    }
+
+    if (load_fonts() == -1) {
+        TTF_Quit();
+        return -1;
+    }
+
+    return 0;
+}
+
+static pthread_t font_ph;
+static bool font_loading = false;
+static int font_rc;
+
+/* Entry point of the thread which loads fonts in the background */
+
+static void* font_worker(void *p)
+{
+    font_rc = fonts_init();
+    return NULL;
+}
+
+/*
+ * Begin loading fonts in the background, to overlap other startup
+ * work; interface_start() joins and collects the result
+ */
+
+void interface_load_fonts(void)
+{
+    if (pthread_create(&font_ph, NULL, font_worker, NULL) != 0) {
+        perror("pthread_create");
+        return; /* fall back to loading in interface_start() */
+    }
+
+    font_loading = true;
+}
+
 /*
  * Free resources associated with fonts
  */
@@ -389,6 +560,190 @@ static Uint32 palette(SDL_Surface *sf, SDL_Color *col)
     return SDL_MapRGB(sf->format, col->r, col->g, col->b);
 }
 
+/*
+ * Note a region of the surface which has been re-painted and is
+ * awaiting an update to the display
+ *
+ * Updates are batched; a single SDL_UpdateRects() on the damage list
+ * is considerably cheaper than a full-surface update when only small
+ * regions (eg. the clocks or meters) have moved on.
+ */
+
+static void push_damage(const struct rect *rect)
+{
+    SDL_Rect *d;
+
+    if (rect->w <= 0 || rect->h <= 0)
+        return;
+
+    if (damaged == MAX_DAMAGE) {
+
+        /* Unlikely, but widen the last entry rather than lose
+         * the damage */
+
+        int xe, ye;
+
+        d = &damage[damaged - 1];
+
+        xe = d->x + d->w;
+        ye = d->y + d->h;
+
+        if (rect->x < d->x)
+            d->x = rect->x;
+        if (rect->y < d->y)
+            d->y = rect->y;
+        if (rect->x + rect->w > xe)
+            xe = rect->x + rect->w;
+        if (rect->y + rect->h > ye)
+            ye = rect->y + rect->h;
+
+        d->w = xe - d->x;
+        d->h = ye - d->y;
+
+        return;
+    }
+
+    d = &damage[damaged++];
+
+    d->x = rect->x;
+    d->y = rect->y;
+    d->w = rect->w;
+    d->h = rect->h;
+}
+
+/*
+ * Bring the display up-to-date with all of the damaged regions
+ */
+
+static void flush_damage(SDL_Surface *surface)
+{
+    if (damaged == 0)
+        return;
+
+#ifdef WITH_SDL2
+    size_t n;
+
+    for (n = 0; n < damaged; n++) {
+        const SDL_Rect *d = &damage[n];
+
+        SDL_UpdateTexture(texture, d,
+                          (Uint8*)surface->pixels
+                          + d->y * surface->pitch
+                          + d->x * surface->format->BytesPerPixel,
+                          surface->pitch);
+    }
+
+    SDL_RenderCopy(renderer, texture, NULL, NULL);
+    SDL_RenderPresent(renderer);
+#else
+    SDL_UpdateRects(surface, damaged, damage);
+#endif
+
+    damaged = 0;
+}
+
+/*
+ * Force the next redraw to paint everything from scratch, eg. because
+ * the surface has been replaced on a resize
+ */
+
+static void invalidate_painted(void)
+{
+    size_t n;
+
+    for (n = 0; n < sizeof painted / sizeof painted[0]; n++)
+        painted[n].valid = false;
+
+    library_painted.valid = false;
+    status_level_painted = -1;
+}
+
+static bool colour_eq(SDL_Color a, SDL_Color b)
+{
+    return a.r == b.r && a.g == b.g && a.b == b.b;
+}
+
+/*
+ * Get a rendering of the given string, via the cache
+ *
+ * Rasterising text is the most expensive part of a redraw, and the
+ * same strings appear frame after frame.  The returned surface is
+ * owned by the cache and remains valid until the next call.
+ *
+ * Return: rendered text, or NULL if it could not be rendered
+ */
+
+static SDL_Surface* render_text(const char *text, TTF_Font *font,
+                                SDL_Color fg, SDL_Color bg, bool utf8)
+{
+    struct rendered *r;
+    SDL_Surface *surface;
+
+    list_for_each(r, &text_cache, lru) {
+        if (r->font == font && r->utf8 == utf8
+            && colour_eq(r->fg, fg) && colour_eq(r->bg, bg)
+            && !strcmp(r->text, text))
+        {
+            /* Hit; keep the list in most-recently-used order */
+
+            list_del(&r->lru);
+            list_add(&r->lru, &text_cache);
+
+            return r->surface;
+        }
+    }
+
+    if (utf8)
+        surface = TTF_RenderUTF8_Shaded(font, text, fg, bg);
+    else
+        surface = TTF_RenderText_Shaded(font, text, fg, bg);
+
+    if (surface == NULL)
+        return NULL;
+
+    r = malloc(sizeof *r + strlen(text) + 1);
+    if (r == NULL) {
+        perror("malloc");
+        SDL_FreeSurface(surface);
+        return NULL;
+    }
+
+    r->font = font;
+    r->fg = fg;
+    r->bg = bg;
+    r->utf8 = utf8;
+    r->surface = surface;
+    strcpy(r->text, text);
+
+    if (text_cache_entries == TEXT_CACHE_SIZE) {
+        struct rendered *evict;
+
+        evict = list_entry(text_cache.prev, struct rendered, lru);
+        list_del(&evict->lru);
+        SDL_FreeSurface(evict->surface);
+        free(evict);
+        text_cache_entries--;
+    }
+
+    list_add(&r->lru, &text_cache);
+    text_cache_entries++;
+
+    return surface;
+}
+
+static void text_cache_clear(void)
+{
+    struct rendered *r, *tmp;
+
+    list_for_each_safe(r, tmp, &text_cache, lru) {
+        list_del(&r->lru);
+        SDL_FreeSurface(r->surface);
+        free(r);
+    }
+
+    text_cache_entries = 0;
+}
+
 /*
  * Draw text
  *
@@ -415,7 +770,7 @@ static int do_draw_text(SDL_Surface *sf, const struct rect *rect,
 
     } else {
         if (!locale) {
-            rendered = TTF_RenderText_Shaded(font, buf, fg, bg);
+            rendered = render_text(buf, font, fg, bg, false);
         } else {
             char ubuf[256], /* fixed buffer is reasonable for rendering */
                 *in, *out;
@@ -433,19 +788,23 @@ static int do_draw_text(SDL_Surface *sf, const struct rect *rect,
             (void)iconv(utf, &in, &len, &out, &fill);
             *out = '\0';
 
-            rendered = TTF_RenderUTF8_Shaded(font, ubuf, fg, bg);
+            rendered = render_text(ubuf, font, fg, bg, true);
         }
 
-        src.x = 0;
-        src.y = 0;
-        src.w = MIN(rect->w, rendered->w);
-        src.h = MIN(rect->h, rendered->h);
+        if (rendered == NULL) {
+            src.w = 0;
+            src.h = 0;
+        } else {
+            src.x = 0;
+            src.y = 0;
+            src.w = MIN(rect->w, rendered->w);
+            src.h = MIN(rect->h, rendered->h);
 
-        dst.x = rect->x;
-        dst.y = rect->y;
+            dst.x = rect->x;
+            dst.y = rect->y;
 
-        SDL_BlitSurface(rendered, &src, sf, &dst);
-        SDL_FreeSurface(rendered);
+            SDL_BlitSurface(rendered, &src, sf, &dst);
+        }
     }
 
     /* Complete the remaining space with a blank rectangle */
@@ -671,6 +1030,79 @@ static void draw_record(SDL_Surface *surface, const struct rect *rect,
                         font, text_col, background_col);
 }
 
+/*
+ * Draw a string one glyph at a time
+ *
+ * The clocks produce a different string every frame, which would
+ * thrash the rendered-text cache; the individual digits are stable
+ * and are rasterised only once.
+ *
+ * Return: width of text drawn
+ */
+
+static int draw_glyph_string(SDL_Surface *sf, const struct rect *rect,
+                             const char *buf, TTF_Font *font,
+                             SDL_Color fg, SDL_Color bg)
+{
+    int x, h;
+    const char *s;
+    SDL_Rect fill;
+
+    x = 0;
+    h = 0;
+
+    for (s = buf; *s != '\0' && x < rect->w; s++) {
+        char c[2];
+        SDL_Surface *glyph;
+        SDL_Rect src, dst;
+
+        c[0] = *s;
+        c[1] = '\0';
+
+        glyph = render_text(c, font, fg, bg, false);
+        if (glyph == NULL)
+            break;
+
+        src.x = 0;
+        src.y = 0;
+        src.w = MIN(rect->w - x, glyph->w);
+        src.h = MIN(rect->h, glyph->h);
+
+        dst.x = rect->x + x;
+        dst.y = rect->y;
+
+        SDL_BlitSurface(glyph, &src, sf, &dst);
+
+        if (src.h > h)
+            h = src.h;
+
+        x += glyph->w;
+    }
+
+    if (x > rect->w)
+        x = rect->w;
+
+    /* Complete the remaining space with a blank rectangle */
+
+    if (x < rect->w) {
+        fill.x = rect->x + x;
+        fill.y = rect->y;
+        fill.w = rect->w - x;
+        fill.h = rect->h;
+        SDL_FillRect(sf, &fill, palette(sf, &bg));
+    }
+
+    if (h < rect->h) {
+        fill.x = rect->x;
+        fill.y = rect->y + h;
+        fill.w = x; /* the x-fill rectangle does the corner */
+        fill.h = rect->h - h;
+        SDL_FillRect(sf, &fill, palette(sf, &bg));
+    }
+
+    return x;
+}
+
 /*
  * Draw a single time in milliseconds in hours:minutes.seconds format
  */
@@ -684,12 +1116,13 @@ static void draw_clock(SDL_Surface *surface, const struct rect *rect, int t,
 
     time_to_clock(hms, deci, t);
 
-    v = draw_text(surface, rect, hms, clock_font, col, background_col);
+    v = draw_glyph_string(surface, rect, hms, clock_font,
+                          col, background_col);
 
     split(*rect, pixels(from_left(v, 0)), NULL, &sr);
     track_baseline(&sr, clock_font, &sr, deci_font);
 
-    draw_text(surface, &sr, deci, deci_font, col, background_col);
+    draw_glyph_string(surface, &sr, deci, deci_font, col, background_col);
 }
 
 /*
@@ -702,6 +1135,8 @@ static void draw_scope(SDL_Surface *surface, const struct rect *rect,
     int r, c, v, mid;
     Uint8 *p;
 
+    timecoder_monitor_update(tc); /* bring the raster up to date */
+
     mid = tc->mon_size / 2;
 
     for (r = 0; r < tc->mon_size; r++) {
@@ -826,7 +1261,7 @@ static void draw_overview(SDL_Surface *surface, const struct rect *rect,
                           struct track *tr, int position)
 {
     int x, y, w, h, r, c, sp, fade, bytes_per_pixel, pitch, height,
-        current_position;
+        current_position, level;
     Uint8 *pixels, *p;
     SDL_Color col;
 
@@ -844,6 +1279,18 @@ static void draw_overview(SDL_Surface *surface, const struct rect *rect,
     else
         current_position = 0;
 
+    /* Pyramid level covering a column's span of audio, so that
+     * peaks between columns are not lost to aliasing */
+
+    level = 0;
+    if (tr->length) {
+        while (level < TRACK_OVERVIEW_LEVELS &&
+              (TRACK_OVERVIEW_RES << (level + 1)) <= tr->length / w)
+        {
+            level++;
+        }
+    }
+
     for (c = 0; c < w; c++) {
 
         /* Collect the correct meter value for this column */
@@ -851,7 +1298,7 @@ static void draw_overview(SDL_Surface *surface, const struct rect *rect,
         sp = (long long)tr->length * c / w;
 
         if (sp < tr->length) /* account for rounding */
-            height = track_get_overview(tr, sp) * h / 256;
+            height = track_get_overview_peak(tr, sp, level) * h / 256;
         else
             height = 0;
 
@@ -899,76 +1346,217 @@ static void draw_overview(SDL_Surface *surface, const struct rect *rect,
     }
 }
 
+/*
+ * Draw a single column of the close-up meter
+ */
+
+static void draw_closeup_column(SDL_Surface *surface, int x, int y, int h,
+                                struct track *tr, int sp, int level,
+                                SDL_Color col, int fade)
+{
+    int r, height;
+    Uint8 *p;
+
+    if (sp < tr->length && sp > 0)
+        height = track_get_ppm_peak(tr, sp, level) * h / 256;
+    else
+        height = 0;
+
+    /* Get a pointer to the top of the column, and increment
+     * it for each row */
+
+    p = (Uint8*)surface->pixels + y * surface->pitch
+        + x * surface->format->BytesPerPixel;
+
+    r = h;
+    while (r > height) {
+        p[0] = col.b >> fade;
+        p[1] = col.g >> fade;
+        p[2] = col.r >> fade;
+        p += surface->pitch;
+        r--;
+    }
+    while (r) {
+        p[0] = col.b;
+        p[1] = col.g;
+        p[2] = col.r;
+        p += surface->pitch;
+        r--;
+    }
+}
+
+static void strip_clear(struct strip *strip)
+{
+    if (strip->surface != NULL)
+        SDL_FreeSurface(strip->surface);
+    free(strip->block);
+    free(strip->covered);
+
+    strip->surface = NULL;
+    strip->block = NULL;
+    strip->covered = NULL;
+}
+
+/*
+ * Make the strip ready to hold columns of the given rendering
+ *
+ * Any change of size, track or zoom starts afresh; the common case
+ * of a change in position keeps the columns already rendered.
+ *
+ * Return: -1 if the strip could not be allocated, otherwise 0
+ */
+
+static int strip_prepare(struct strip *strip, const SDL_PixelFormat *f,
+                         int w, int h, const struct track *tr, int scale)
+{
+    int n;
+
+    if (strip->surface != NULL && strip->w == w && strip->h == h
+        && strip->track == tr && strip->scale == scale)
+    {
+        return 0;
+    }
+
+    strip_clear(strip);
+
+    strip->surface = SDL_CreateRGBSurface(SDL_SWSURFACE, w, h,
+                                          f->BitsPerPixel,
+                                          f->Rmask, f->Gmask, f->Bmask, 0);
+    if (strip->surface == NULL)
+        return -1;
+
+    strip->block = malloc(w * sizeof *strip->block);
+    strip->covered = malloc(w * sizeof *strip->covered);
+    if (strip->block == NULL || strip->covered == NULL) {
+        perror("malloc");
+        strip_clear(strip);
+        return -1;
+    }
+
+    for (n = 0; n < w; n++)
+        strip->block[n] = INT_MIN; /* not a valid block */
+
+    strip->w = w;
+    strip->h = h;
+    strip->track = tr;
+    strip->scale = scale;
+
+    return 0;
+}
+
 /*
  * Draw the close-up meter, which can be zoomed to a level set by
  * 'scale'
+ *
+ * The underlying PCM never changes, so columns are rendered into the
+ * strip once and re-used; only the needle is drawn per-frame.
  */
 
 static void draw_closeup(SDL_Surface *surface, const struct rect *rect,
-                         struct track *tr, int position, int scale)
+                         struct track *tr, int position, int scale,
+                         struct strip *strip)
 {
-    int x, y, w, h, c;
-    size_t bytes_per_pixel, pitch;
-    Uint8 *pixels;
+    int x, y, w, h, c, level, b0, s0;
+    SDL_Rect src, dst;
 
     x = rect->x;
     y = rect->y;
     w = rect->w;
     h = rect->h;
 
-    pixels = surface->pixels;
-    bytes_per_pixel = surface->format->BytesPerPixel;
-    pitch = surface->pitch;
+    if (w <= 0 || h <= 0)
+        return;
 
-    /* Draw in columns. This may seem like a performance hit,
-     * but oprofile shows it makes no difference */
+    /* Pyramid level matching the span of one column; at close
+     * zoom a column sits within a single meter group */
 
-    for (c = 0; c < w; c++) {
-        int r, sp, height, fade;
-        Uint8 *p;
-        SDL_Color col;
+    level = scale - 6; /* log2(TRACK_PPM_RES) */
+    if (level < 0)
+        level = 0;
+    if (level > TRACK_PPM_LEVELS)
+        level = TRACK_PPM_LEVELS;
 
-        /* Work out the meter height in pixels for this column */
+    /* Block of audio at the left-hand edge of the view */
 
-        sp = position - (position % (1 << scale))
-            + ((c - w / 2) << scale);
+    b0 = position / (1 << scale) - w / 2;
 
-        if (sp < tr->length && sp > 0)
-            height = track_get_ppm(tr, sp) * h / 256;
-        else
-            height = 0;
+    if (strip_prepare(strip, surface->format, w, h, tr, scale) == -1) {
 
-        /* Select the appropriate colour */
+        /* No memory for the strip; render every column directly */
 
-        if (c == w / 2) {
-            col = needle_col;
-            fade = 1;
-        } else {
-            col = elapsed_col;
-            fade = 3;
+        for (c = 0; c < w; c++) {
+            SDL_Color col;
+            int fade;
+
+            if (c == w / 2) {
+                col = needle_col;
+                fade = 1;
+            } else {
+                col = elapsed_col;
+                fade = 3;
+            }
+
+            draw_closeup_column(surface, x + c, y, h, tr,
+                                (b0 + c) * (1 << scale), level, col, fade);
         }
 
-        /* Get a pointer to the top of the column, and increment
-         * it for each row */
+        return;
+    }
 
-        p = pixels + y * pitch + (x + c) * bytes_per_pixel;
+    /* Bring the columns of the ring up-to-date. A column is rendered
+     * if it holds a different block, or if it was rendered before the
+     * import had committed all of its samples */
 
-        r = h;
-        while (r > height) {
-            p[0] = col.b >> fade;
-            p[1] = col.g >> fade;
-            p[2] = col.r >> fade;
-            p += pitch;
-            r--;
-        }
-        while (r) {
-            p[0] = col.b;
-            p[1] = col.g;
-            p[2] = col.r;
-            p += pitch;
-            r--;
+    for (c = 0; c < w; c++) {
+        int b, s, sp, end;
+
+        b = b0 + c;
+        s = ((b % w) + w) % w;
+        sp = b * (1 << scale);
+        end = sp + (1 << scale);
+
+        if (strip->block[s] == b
+            && !(strip->covered[s] < tr->length
+                 && end > 0 && (unsigned int)end > strip->covered[s]))
+        {
+            continue;
         }
+
+        draw_closeup_column(strip->surface, s, 0, h, tr, sp, level,
+                            elapsed_col, 3);
+
+        strip->block[s] = b;
+        strip->covered[s] = tr->length;
     }
+
+    /* The ring wraps; the display is made of up to two spans */
+
+    s0 = ((b0 % w) + w) % w;
+
+    src.x = s0;
+    src.y = 0;
+    src.w = w - s0;
+    src.h = h;
+
+    dst.x = x;
+    dst.y = y;
+
+    SDL_BlitSurface(strip->surface, &src, surface, &dst);
+
+    if (s0 > 0) {
+        src.x = 0;
+        src.w = s0;
+
+        dst.x = x + (w - s0);
+
+        SDL_BlitSurface(strip->surface, &src, surface, &dst);
+    }
+
+    /* The needle is the only position-dependent column */
+
+    draw_closeup_column(surface, x + w / 2, y, h, tr,
+                        (b0 + w / 2) * (1 << scale), level,
+                        needle_col, 1);
 }
 
 /*
@@ -976,7 +1564,8 @@ static void draw_closeup(SDL_Surface *surface, const struct rect *rect,
  */
 
 static void draw_meters(SDL_Surface *surface, const struct rect *rect,
-                        struct track *tr, int position, int scale)
+                        struct track *tr, int position, int scale,
+                        struct strip *strip)
 {
     struct rect overview, closeup;
 
@@ -987,7 +1576,7 @@ static void draw_meters(SDL_Surface *surface, const struct rect *rect,
     else
         closeup = *rect;
 
-    draw_closeup(surface, &closeup, tr, position, scale);
+    draw_closeup(surface, &closeup, tr, position, scale, strip);
 }
 
 /*
@@ -1061,57 +1650,131 @@ static void draw_deck_status(SDL_Surface *surface,
 
 /*
  * Draw a single deck
+ *
+ * Each region is compared against what was last painted, and skipped
+ * if its inputs have not changed; an idle deck costs nothing even
+ * though the refresh timer fires constantly.
  */
 
 static void draw_deck(SDL_Surface *surface, const struct rect *rect,
-                      struct deck *deck, int meter_scale)
+                      struct deck *deck, int meter_scale,
+                      struct painted *last, struct strip *strip)
 {
-    int position;
+    bool fresh, clocks_changed, top_changed, status_changed,
+        meters_changed;
     struct rect track, top, meters, status, rest, lower;
     struct player *pl;
     struct track *t;
+    struct painted now;
 
     pl = &deck->player;
     t = pl->track;
 
-    position = player_get_elapsed(pl) * t->rate;
+    /* Snapshot everything this deck's rendering depends on */
+
+    now.valid = true;
+    now.record = deck->record;
+    now.track = t;
+    now.length = t->length;
+    now.position = player_get_elapsed(pl) * t->rate;
+    now.elapsed = player_get_elapsed(pl) * 1000;
+    now.remain = player_get_remain(pl) * 1000;
+    now.timecode = timecoder_get_position(pl->timecoder, NULL);
+    now.scale = meter_scale;
+    now.importing = track_is_importing(t);
+    now.control = pl->timecode_control;
+    now.recalibrate = pl->recalibrate;
+    now.locked = deck_is_locked(deck);
+    now.pitch = pl->pitch;
+    now.sync_pitch = pl->sync_pitch;
+    now.difference = pl->last_difference;
+
+    fresh = !last->valid;
+
+    clocks_changed = fresh || last->track != now.track
+        || last->elapsed != now.elapsed || last->remain != now.remain
+        || last->importing != now.importing
+        || last->control != now.control;
+
+    /* Whilst under timecode control the scope and spinner follow the
+     * live input signal, so there is no state to compare against */
+
+    top_changed = clocks_changed || now.control;
+
+    status_changed = fresh || last->control != now.control
+        || last->timecode != now.timecode
+        || last->pitch != now.pitch
+        || last->sync_pitch != now.sync_pitch
+        || last->difference != now.difference
+        || last->recalibrate != now.recalibrate
+        || last->locked != now.locked;
+
+    meters_changed = fresh || last->track != now.track
+        || last->position != now.position || last->length != now.length
+        || last->importing != now.importing || last->scale != now.scale;
 
     split(*rect, from_top(FONT_SPACE + BIG_FONT_SPACE, 0), &track, &rest);
-    if (rest.h < 160)
+    if (rest.h < 160) {
         rest = *rect;
-    else
+    } else if (fresh || last->record != now.record) {
         draw_record(surface, &track, deck->record);
+        push_damage(&track);
+    }
 
     split(rest, from_top(CLOCK_FONT_SIZE * 2, SPACER), &top, &lower);
-    if (lower.h < 64)
+    if (lower.h < 64) {
         lower = rest;
-    else
+    } else if (top_changed) {
         draw_deck_top(surface, &top, pl, t);
+        push_damage(&top);
+    }
 
     split(lower, from_bottom(FONT_SPACE, SPACER), &meters, &status);
-    if (meters.h < 64)
+    if (meters.h < 64) {
         meters = lower;
-    else
+    } else if (status_changed) {
         draw_deck_status(surface, &status, deck);
+        push_damage(&status);
+    }
+
+    if (meters_changed) {
+        draw_meters(surface, &meters, t, now.position, meter_scale, strip);
+        push_damage(&meters);
+    }
 
-    draw_meters(surface, &meters, t, position, meter_scale);
+    *last = now;
 }
 
 /*
  * Draw all the decks in the system left to right
+ *
+ * Up to three decks sit side-by-side; more than that and they are
+ * laid out in two rows, to keep each wide enough to read
  */
 
 static void draw_decks(SDL_Surface *surface, const struct rect *rect,
                        struct deck deck[], size_t ndecks, int meter_scale)
 {
-    int d;
-    struct rect left, right;
+    size_t d, r, nrow;
+    struct rect remain;
+
+    nrow = ndecks > 3 ? 2 : 1;
+    remain = *rect;
+    d = 0;
+
+    for (r = 0; r < nrow; r++) {
+        size_t c, in_row;
+        struct rect row, left;
 
-    right = *rect;
+        in_row = (ndecks - d + nrow - r - 1) / (nrow - r);
 
-    for (d = 0; d < ndecks; d++) {
-        split(right, columns(d, ndecks, BORDER), &left, &right);
-        draw_deck(surface, &left, &deck[d], meter_scale);
+        split(remain, rows(r, nrow, BORDER), &row, &remain);
+
+        for (c = 0; c < in_row; c++, d++) {
+            split(row, columns(c, in_row, BORDER), &left, &row);
+            draw_deck(surface, &left, &deck[d], meter_scale, &painted[d],
+                      &strip[d]);
+        }
     }
 }
 
@@ -1122,8 +1785,17 @@ static void draw_decks(SDL_Surface *surface, const struct rect *rect,
 static void draw_status(SDL_Surface *sf, const struct rect *rect)
 {
     SDL_Color fg, bg;
+    int level;
 
-    switch (status_level()) {
+    level = status_level();
+
+    if (level == status_level_painted
+        && !strcmp(status(), status_painted))
+    {
+        return; /* eg. repeated keypresses setting the same text */
+    }
+
+    switch (level) {
     case STATUS_ALERT:
     case STATUS_WARN:
         fg = text_col;
@@ -1135,6 +1807,10 @@ static void draw_status(SDL_Surface *sf, const struct rect *rect)
     }
 
     draw_text_in_locale(sf, rect, status(), detail_font, fg, bg);
+    push_damage(rect);
+
+    status_level_painted = level;
+    snprintf(status_painted, sizeof status_painted, "%s", status());
 }
 
 /*
@@ -1368,7 +2044,9 @@ static void draw_library(SDL_Surface *surface, const struct rect *rect,
                          struct selector *sel)
 {
     struct rect rsearch, rlists, rcrates, rrecords;
-    unsigned int rows;
+    unsigned int rows, row;
+    int current;
+    bool busy, search_changed, crates_changed, records_changed;
 
     split(*rect, from_top(SEARCH_HEIGHT, SPACER), &rsearch, &rlists);
 
@@ -1381,29 +2059,127 @@ static void draw_library(SDL_Surface *surface, const struct rect *rect,
 
         draw_search(surface, rect, sel);
         selector_set_lines(sel, 1);
+        push_damage(rect);
+        library_painted.valid = false;
 
         return;
     }
 
-    draw_search(surface, &rsearch, sel);
     selector_set_lines(sel, rows);
 
+    /* Compare each pane against what was last painted. The selector
+     * notifies us of any change, but not of what changed */
+
+    search_changed = !library_painted.valid
+        || strcmp(library_painted.search, sel->search) != 0
+        || library_painted.matches != sel->view_index->entries;
+
+    current = listbox_current(&sel->crates);
+    busy = (current != -1) && sel->library->crate[current]->is_busy;
+
+    crates_changed = !library_painted.valid
+        || library_painted.sort != sel->sort
+        || library_painted.busy != busy
+        || library_painted.crates.entries != sel->crates.entries
+        || library_painted.crates.offset != sel->crates.offset
+        || library_painted.crates.selected != sel->crates.selected;
+
+    records_changed = !library_painted.valid
+        || library_painted.records.entries != sel->records.entries
+        || library_painted.records.offset != sel->records.offset
+        || library_painted.records.selected != sel->records.selected;
+
+    if (!records_changed) {
+        for (row = 0;; row++) {
+            int entry;
+
+            entry = listbox_map(&sel->records, row);
+            if (entry == -1)
+                break;
+
+            if (row == VISIBLE_MAX
+                || library_painted.row[row] != sel->view_index->record[entry])
+            {
+                records_changed = true;
+                break;
+            }
+        }
+    }
+
+    if (search_changed) {
+        draw_search(surface, &rsearch, sel);
+        push_damage(&rsearch);
+    }
+
     split(rlists, columns(0, 4, SPACER), &rcrates, &rrecords);
     if (rcrates.w > LIBRARY_MIN_WIDTH) {
-        draw_index(surface, rrecords, sel);
-        draw_crates(surface, rcrates, sel);
+        if (records_changed) {
+            draw_index(surface, rrecords, sel);
+            push_damage(&rrecords);
+        }
+        if (crates_changed) {
+            draw_crates(surface, rcrates, sel);
+            push_damage(&rcrates);
+        }
     } else {
-        draw_index(surface, *rect, sel);
+        if (records_changed || crates_changed) {
+            draw_index(surface, *rect, sel);
+            push_damage(rect);
+        }
+    }
+
+    library_painted.valid = true;
+    strcpy(library_painted.search, sel->search);
+    library_painted.matches = sel->view_index->entries;
+    library_painted.sort = sel->sort;
+    library_painted.busy = busy;
+    library_painted.crates = sel->crates;
+    library_painted.records = sel->records;
+
+    for (row = 0; row < VISIBLE_MAX; row++) {
+        int entry;
+
+        entry = listbox_map(&sel->records, row);
+        if (entry == -1)
+            break;
+
+        library_painted.row[row] = sel->view_index->record[entry];
     }
 }
 
+/*
+ * Choose a deck for the given deck to sync to: the first other deck
+ * which is actually playing
+ *
+ * Return: the player to use as sync master, or NULL if there is none
+ */
+
+static struct player* choose_sync_master(const struct deck *de)
+{
+    size_t n;
+
+    for (n = 0; n < ndeck; n++) {
+        if (&deck[n] == de)
+            continue;
+
+        if (player_is_active(&deck[n].player))
+            return &deck[n].player;
+    }
+
+    return NULL;
+}
+
 /*
  * Handle a single key event
  *
  * Return: true if the selector needs to be redrawn, otherwise false
  */
 
+#ifdef WITH_SDL2
+static bool handle_key(SDL_Keycode key, Uint16 mod)
+#else
 static bool handle_key(SDLKey key, SDLMod mod)
+#endif
 {
     struct selector *sel = &selector;
 
@@ -1486,6 +2262,21 @@ static bool handle_key(SDLKey key, SDLMod mod)
 
         fprintf(stderr, "Meter scale increased to %d\n", meter_scale);
 
+    } else if (key == SDLK_BACKQUOTE) {
+        static size_t d = 0;
+
+        /* Cycle through the decks, showing the audio device
+         * counters for each in turn on the status line, and
+         * finally the memory totals */
+
+        if (ndeck > 0) {
+            if (d < ndeck)
+                device_stats_status(&deck[d].device, d);
+            else
+                memory_status();
+            d = (d + 1) % (ndeck + 1);
+        }
+
     } else if (key >= SDLK_F1 && key <= SDLK_F12) {
         size_t d;
 
@@ -1516,6 +2307,11 @@ static bool handle_key(SDLKey key, SDLMod mod)
 
             } else switch(func) {
             case FUNC_LOAD:
+                if (mod & KMOD_CTRL) {
+                    deck_loop(de);
+                    break;
+                }
+
                 re = selector_current(sel);
                 if (re != NULL)
                     deck_load(de, re);
@@ -1535,6 +2331,29 @@ static bool handle_key(SDLKey key, SDLMod mod)
                     (void)player_toggle_timecode_control(pl);
                 }
                 break;
+
+            case FUNC_SYNC:
+                if (mod & KMOD_CTRL) {
+                    if (player_toggle_interp(pl) == PLAYER_SINC) {
+                        status_printf(STATUS_VERBOSE,
+                                      "Deck %u high quality resampler",
+                                      (unsigned)d);
+                    } else {
+                        status_printf(STATUS_VERBOSE,
+                                      "Deck %u standard resampler",
+                                      (unsigned)d);
+                    }
+                } else if (pl->sync_master != NULL) {
+                    player_set_sync(pl, NULL);
+                    status_printf(STATUS_VERBOSE, "Deck %u sync released",
+                                  (unsigned)d);
+                } else if (player_toggle_sync(pl, choose_sync_master(de))) {
+                    status_printf(STATUS_VERBOSE, "Deck %u synced",
+                                  (unsigned)d);
+                } else {
+                    status_printf(STATUS_WARN, "No playing deck to sync to");
+                }
+                break;
             }
         }
     }
@@ -1550,11 +2369,54 @@ static SDL_Surface* set_size(int w, int h, struct rect *r)
 {
     SDL_Surface *surface;
 
+#ifdef WITH_SDL2
+    if (window == NULL) {
+        window = SDL_CreateWindow(banner,
+                                  SDL_WINDOWPOS_UNDEFINED,
+                                  SDL_WINDOWPOS_UNDEFINED,
+                                  w, h, video_flags);
+        if (window == NULL) {
+            fprintf(stderr, "%s\n", SDL_GetError());
+            return NULL;
+        }
+
+        renderer = SDL_CreateRenderer(window, -1, 0);
+        if (renderer == NULL) {
+            fprintf(stderr, "%s\n", SDL_GetError());
+            return NULL;
+        }
+    }
+
+    if (texture != NULL)
+        SDL_DestroyTexture(texture);
+
+    texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888,
+                                SDL_TEXTUREACCESS_STREAMING, w, h);
+    if (texture == NULL) {
+        fprintf(stderr, "%s\n", SDL_GetError());
+        return NULL;
+    }
+
+    if (screen != NULL)
+        SDL_FreeSurface(screen);
+
+    /* Masks match the byte order the drawing code assumes */
+
+    screen = SDL_CreateRGBSurface(0, w, h, 32, 0x00ff0000,
+                                  0x0000ff00, 0x000000ff, 0);
+    if (screen == NULL) {
+        fprintf(stderr, "%s\n", SDL_GetError());
+        return NULL;
+    }
+
+    surface = screen;
+#else
     surface = SDL_SetVideoMode(w, h, 32, video_flags);
     if (surface == NULL) {
         fprintf(stderr, "%s\n", SDL_GetError());
         return NULL;
     }
+#endif
 
     *r = shrink(rect(0, 0, w, h, scale), BORDER);
 
@@ -1567,21 +2429,74 @@ static void push_event(int t)
 {
     SDL_Event e;
 
+#ifdef WITH_SDL2
+    if (!SDL_PeepEvents(&e, 1, SDL_PEEKEVENT, t, t)) {
+        e.type = t;
+        if (SDL_PushEvent(&e) < 0)
+            abort();
+    }
+#else
     if (!SDL_PeepEvents(&e, 1, SDL_PEEKEVENT, SDL_EVENTMASK(t))) {
         e.type = t;
         if (SDL_PushEvent(&e) == -1)
             abort();
     }
+#endif
 }
 
 /*
  * Timer which posts a screen redraw event
+ *
+ * The pace adapts to activity: full frame rate whilst anything on
+ * screen is in motion, and a slow keep-alive tick otherwise. The
+ * slow tick is what notices motion which begins outside the
+ * interface thread, eg. the needle being dropped on a record.
  */
 
 static Uint32 ticker(Uint32 interval, void *p)
 {
     push_event(EVENT_TICKER);
-    return interval;
+
+    return animate ? REFRESH : REFRESH_IDLE;
+}
+
+/*
+ * True if any deck needs the full frame rate
+ *
+ * Called with the rig lock held.
+ */
+
+static bool animate_required(void)
+{
+    size_t n;
+    struct record *r;
+
+    for (n = 0; n < ndeck; n++) {
+        struct player *pl = &deck[n].player;
+
+        if (player_is_active(pl))
+            return true;
+
+        /* The scope follows the live input signal */
+
+        if (pl->timecode_control)
+            return true;
+
+        if (track_is_importing(pl->track))
+            return true;
+    }
+
+    /* A speculative import may be waiting out its dwell time */
+
+    r = selector_current(&selector);
+    if (r != NULL && ndeck > 0
+        && (preload == NULL
+            || strcmp(preload->path, record_pathname(r)) != 0))
+    {
+        return true;
+    }
+
+    return false;
 }
 
 /*
@@ -1598,6 +2513,66 @@ static void defer_selector_redraw(struct observer *o, void *x)
     push_event(EVENT_SELECTOR);
 }
 
+/*
+ * Wake the event loop when work is posted to this thread; the
+ * selector events it carries all imply a library redraw
+ */
+
+static void wake_event_queue(void)
+{
+    push_event(EVENT_SELECTOR);
+}
+
+/*
+ * Speculatively import the selected record
+ *
+ * Called regularly with the rig lock held. Once the selection has
+ * rested on a record for a short while, begin importing it in the
+ * background so that a load to a deck finds the PCM already
+ * resident. Only one speculative import is held at a time, and it
+ * is abandoned as soon as the selection moves on.
+ */
+
+static void preload_update(void)
+{
+    struct record *r;
+    const char *pathname;
+
+    if (ndeck == 0)
+        return;
+
+    r = selector_current(&selector);
+
+    if (r != preload_dwell) {
+        preload_dwell = r;
+        preload_since = SDL_GetTicks();
+    }
+
+    pathname = r != NULL ? record_pathname(r) : NULL;
+
+    if (preload != NULL) {
+        if (pathname != NULL && !strcmp(preload->path, pathname))
+            return;
+
+        /* The selection moved on; drop our reference, which stops
+         * the import unless a deck has picked the track up */
+
+        track_release(preload);
+        preload = NULL;
+    }
+
+    if (pathname == NULL || SDL_GetTicks() - preload_since < PRELOAD)
+        return;
+
+    /* A preload is the definition of speculative; don't start one
+     * when the memory budget is short */
+
+    if (memory_short())
+        return;
+
+    preload = track_acquire_by_import(deck[0].importer, pathname);
+}
+
 /*
  * The SDL interface thread
  */
@@ -1635,25 +2610,53 @@ static int interface_main(void)
 
         rig_lock();
 
+        eventq_drain(&events);
+
         switch(event.type) {
         case SDL_QUIT: /* user request to quit application; eg. window close */
             if (rig_quit() == -1)
                 return -1;
             break;
 
+#ifdef WITH_SDL2
+        case SDL_WINDOWEVENT:
+            switch (event.window.event) {
+            case SDL_WINDOWEVENT_SIZE_CHANGED:
+                surface = set_size(event.window.data1, event.window.data2,
+                                   &rworkspace);
+                if (!surface)
+                    return -1;
+
+                /* fall-through */
+
+            case SDL_WINDOWEVENT_EXPOSED:
+                invalidate_painted();
+
+                library_update = true;
+                decks_update = true;
+                status_update = true;
+            }
+
+            break;
+#else
         case SDL_VIDEORESIZE:
             surface = set_size(event.resize.w, event.resize.h, &rworkspace);
             if (!surface)
                 return -1;
 
+            invalidate_painted();
+
             library_update = true;
             decks_update = true;
             status_update = true;
 
             break;
+#endif
 
         case EVENT_TICKER:
+            preload_update();
             decks_update = true;
+            animate = animate_required();
             break;
 
         case EVENT_QUIT: /* internal request to finish this thread */
@@ -1668,13 +2671,15 @@ static int interface_main(void)
             break;
 
         case SDL_KEYDOWN:
+            animate = true; /* a key can start a deck; re-check promptly */
+
             if (handle_key(event.key.keysym.sym, event.key.keysym.mod))
             {
                 struct record *r;
 
                 r = selector_current(&selector);
                 if (r != NULL) {
-                    status_set(STATUS_VERBOSE, r->pathname);
+                    status_printf(STATUS_VERBOSE, "%s%s", r->dir, r->base);
                 } else {
                     status_set(STATUS_VERBOSE, "No search results found");
                 }
@@ -1705,35 +2710,33 @@ static int interface_main(void)
 
         LOCK(surface);
 
-        if (library_update)
-            draw_library(surface, &rlibrary, &selector);
-
-        if (status_update)
-            draw_status(surface, &rstatus);
-
-        if (decks_update)
-            draw_decks(surface, &rplayers, deck, ndeck, meter_scale);
-
-        UNLOCK(surface);
-
         if (library_update) {
-            UPDATE(surface, &rlibrary);
+            draw_library(surface, &rlibrary, &selector);
             library_update = false;
         }
 
         if (status_update) {
-            UPDATE(surface, &rstatus);
+            draw_status(surface, &rstatus);
             status_update = false;
         }
 
         if (decks_update) {
-            UPDATE(surface, &rplayers);
+            draw_decks(surface, &rplayers, deck, ndeck, meter_scale);
             decks_update = false;
         }
 
+        UNLOCK(surface);
+
+        flush_damage(surface);
+
     } /* main loop */
 
  finish:
+    if (preload != NULL) {
+        track_release(preload);
+        preload = NULL;
+    }
+
     rig_unlock();
 
     SDL_RemoveTimer(timer);
@@ -1836,10 +2839,27 @@ static void cleanup()
     for (n = 0; n < ndeck; n++)
         timecoder_monitor_clear(&deck[n].timecoder);
 
+    for (n = 0; n < sizeof strip / sizeof strip[0]; n++)
+        strip_clear(&strip[n]);
+
+#ifdef WITH_SDL2
+    if (screen != NULL)
+        SDL_FreeSurface(screen);
+    if (texture != NULL)
+        SDL_DestroyTexture(texture);
+    if (renderer != NULL)
+        SDL_DestroyRenderer(renderer);
+    if (window != NULL)
+        SDL_DestroyWindow(window);
+#endif
+
     clear_spinner();
     ignore(&on_status);
     ignore(&on_selector);
+    eventq_drain(&events); /* stragglers, before the selector goes */
     selector_clear(&selector);
+    eventq_clear(&events);
+    text_cache_clear();
     clear_fonts();
 
     if (iconv_close(utf) == -1)
@@ -1862,8 +2882,13 @@ int interface_start(struct library *lib, const char *geo, bool decor)
         return -1;
     }
 
-    if (!decor)
+    if (!decor) {
+#ifdef WITH_SDL2
+        video_flags |= SDL_WINDOW_BORDERLESS;
+#else
         video_flags |= SDL_NOFRAME;
+#endif
+    }
 
     /*
      * Start allocating resources
@@ -1878,14 +2903,16 @@ int interface_start(struct library *lib, const char *geo, bool decor)
 
     fprintf(stderr, "Initialising fonts...\n");
 
-    if (TTF_Init() == -1) {
-        fprintf(stderr, "%s\n", TTF_GetError());
-        return -1;
+    if (font_loading) {
+        if (pthread_join(font_ph, NULL) != 0)
+            abort();
+        font_loading = false;
+    } else {
+        font_worker(NULL);
     }
 
-    if (load_fonts() == -1) {
-        goto fail_fonts;
-    }
+    if (font_rc == -1)
+        return -1;
 
     /*
      * SDL
@@ -1898,8 +2925,10 @@ int interface_start(struct library *lib, const char *geo, bool decor)
         goto fail_fonts;
     }
 
+#ifndef WITH_SDL2
     SDL_WM_SetCaption(banner, NULL);
     SDL_EnableKeyRepeat(SDL_DEFAULT_REPEAT_DELAY, SDL_DEFAULT_REPEAT_INTERVAL);
+#endif
 
     /*
      * Character translations; internally UTF8 is used
@@ -1924,6 +2953,8 @@ int interface_start(struct library *lib, const char *geo, bool decor)
     }
 
     selector_init(&selector, lib);
+    eventq_init(&events, wake_event_queue);
+    selector_use_eventq(&selector, &events);
     watch(&on_status, &status_changed, defer_status_redraw);
     watch(&on_selector, &selector.changed, defer_selector_redraw);
     status_set(STATUS_VERBOSE, banner);
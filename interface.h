@@ -23,6 +23,7 @@
 #include "deck.h"
 #include "library.h"
 
+void interface_load_fonts(void);
 int interface_start(struct library *lib, const char *geo, bool decor);
 void interface_stop();
 
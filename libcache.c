@@ -0,0 +1,612 @@
+/*
+ * Copyright (C) 2021 Mark Hills <mark@xwax.org>
+ *
+ * This file is part of "xwax".
+ *
+ * "xwax" is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 3 as
+ * published by the Free Software Foundation.
+ *
+ * "xwax" is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Binary cache of a library scan
+ *
+ * Launching the scan script and parsing its output line-by-line
+ * is too slow to block startup on for a large archive. The records
+ * of a completed scan are written to a cache file: a header, a
+ * fixed-size record table in playlist order, permutations for the
+ * sorted indexes, and a string pool. The next startup maps the
+ * file and fills the indexes directly, and the scan itself is
+ * demoted to a freshness check in the background.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "cache.h"
+#include "debug.h"
+#include "libcache.h"
+
+#define LIBCACHE_MAGIC "xwaxlib"
+#define LIBCACHE_VERSION 3
+
+struct header {
+    char magic[8];
+    uint32_t version, records;
+    uint64_t pool_len;
+    uint32_t scan, path, /* key strings, as pool offsets */
+        pad[2];
+};
+
+struct entry {
+    uint32_t dir, base, artist, title,
+        match, /* pool offsets */
+        pad;
+    double bpm;
+};
+
+/* Records from a cache point their strings into the mapped pool,
+ * and so both stay for the life of the process */
+
+struct arena {
+    struct arena *next;
+    void *map;
+    size_t maplen;
+    struct record *records;
+};
+
+static struct arena *arenas = NULL;
+
+/*
+ * Pathname of the cache file for the given scan and path
+ *
+ * Return: -1 if no suitable directory is configured, otherwise 0
+ */
+
+static int cache_file(const char *scan, const char *path, bool create,
+                      char *buf, size_t len)
+{
+    char dir[256];
+    uint32_t h = 2166136261u; /* FNV-1a, over both key strings */
+    int r;
+    const char *s;
+
+    for (s = scan; ; s++) {
+        h ^= (unsigned char)*s;
+        h *= 16777619u;
+        if (*s == '\0') /* include the separator */
+            break;
+    }
+
+    for (s = path; *s != '\0'; s++) {
+        h ^= (unsigned char)*s;
+        h *= 16777619u;
+    }
+
+    if (cache_dir(create, dir, sizeof dir) == -1)
+        return -1;
+
+    r = snprintf(buf, len, "%s/%08x.lib", dir, h);
+    if (r < 0 || (size_t)r >= len)
+        return -1;
+
+    return 0;
+}
+
+/*
+ * Load the cached records of a previous scan of the given path
+ *
+ * The records are added to the storage and the given listing, as
+ * the scan itself would. When the storage is empty (the common
+ * case at startup) the indexes are filled directly from the table
+ * and its permutations, with no sorting or searching.
+ *
+ * Return: -1 if no valid cache is available, otherwise 0
+ */
+
+int libcache_load(const char *scan, const char *path,
+                  struct listing *storage, struct listing *into)
+{
+    char file[512];
+    const struct header *h;
+    const struct entry *table;
+    const uint32_t *by_artist, *by_bpm;
+    const char *pool;
+    struct arena *a;
+    struct record *r;
+    struct stat st;
+    size_t bytes, n;
+    void *map;
+    int fd;
+
+    if (cache_file(scan, path, false, file, sizeof file) == -1)
+        return -1;
+
+    fd = open(file, O_RDONLY);
+    if (fd == -1)
+        return -1;
+
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof *h) {
+        if (close(fd) == -1)
+            abort();
+        return -1;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    if (close(fd) == -1)
+        abort(); /* under our control; see close(2) */
+
+    if (map == MAP_FAILED)
+        return -1;
+
+    h = map;
+
+    if (memcmp(h->magic, LIBCACHE_MAGIC, sizeof h->magic) != 0 ||
+       h->version != LIBCACHE_VERSION ||
+       h->pool_len == 0)
+    {
+        goto fail;
+    }
+
+    bytes = sizeof *h + (size_t)h->records * (sizeof(struct entry) + 8)
+        + h->pool_len;
+
+    if ((size_t)st.st_size != bytes) /* eg. truncated write */
+        goto fail;
+
+    table = (const void*)(h + 1);
+    by_artist = (const void*)(table + h->records);
+    by_bpm = by_artist + h->records;
+    pool = (const void*)(by_bpm + h->records);
+
+    /* The file is not trusted to contain sane offsets */
+
+    if (pool[h->pool_len - 1] != '\0')
+        goto fail;
+
+    if (h->scan >= h->pool_len || h->path >= h->pool_len ||
+       strcmp(pool + h->scan, scan) != 0 ||
+       strcmp(pool + h->path, path) != 0)
+    {
+        goto fail;
+    }
+
+    for (n = 0; n < h->records; n++) {
+        const struct entry *e = &table[n];
+
+        if (e->dir >= h->pool_len || e->base >= h->pool_len ||
+           e->artist >= h->pool_len || e->title >= h->pool_len ||
+           e->match == 0 || e->match >= h->pool_len ||
+           by_artist[n] >= h->records || by_bpm[n] >= h->records)
+        {
+            goto fail;
+        }
+    }
+
+    a = malloc(sizeof *a);
+    if (a == NULL) {
+        perror("malloc");
+        goto fail;
+    }
+
+    r = malloc(sizeof(struct record) * h->records);
+    if (r == NULL) {
+        perror("malloc");
+        free(a);
+        goto fail;
+    }
+
+    for (n = 0; n < h->records; n++) {
+        const struct entry *e = &table[n];
+
+        r[n].dir = (char*)(pool + e->dir);
+        r[n].base = (char*)(pool + e->base);
+        r[n].artist = (char*)(pool + e->artist);
+        r[n].title = (char*)(pool + e->title);
+        r[n].match = (char*)(pool + e->match);
+        r[n].bpm = e->bpm;
+        r[n].key = NULL; /* analysis results are not cached */
+    }
+
+    a->map = map;
+    a->maplen = st.st_size;
+    a->records = r;
+    a->next = arenas;
+    arenas = a;
+
+    if (storage->by_order.entries == 0) {
+
+        /* Fill the indexes directly; the table is in playlist
+         * order and carries the sorted permutations */
+
+        if (index_reserve(&storage->by_order, h->records) == -1 ||
+           index_reserve(&storage->by_artist, h->records) == -1 ||
+           index_reserve(&storage->by_bpm, h->records) == -1 ||
+           index_reserve(&into->by_order, h->records) == -1 ||
+           index_reserve(&into->by_artist, h->records) == -1 ||
+           index_reserve(&into->by_bpm, h->records) == -1)
+        {
+            return -1;
+        }
+
+        for (n = 0; n < h->records; n++) {
+            index_add(&storage->by_order, &r[n]);
+            index_add(&into->by_order, &r[n]);
+
+            (void)postings_add(&storage->postings, &r[n]);
+            (void)postings_add(&into->postings, &r[n]);
+
+            index_add(&storage->by_artist, &r[by_artist[n]]);
+            index_add(&into->by_artist, &r[by_artist[n]]);
+
+            index_add(&storage->by_bpm, &r[by_bpm[n]]);
+            index_add(&into->by_bpm, &r[by_bpm[n]]);
+        }
+    } else {
+
+        /* Records from another crate are already present; merge
+         * as a batch, re-using any duplicates */
+
+        struct index batch;
+
+        index_init(&batch);
+
+        if (index_reserve(&batch, h->records) == -1) {
+            index_clear(&batch);
+            return -1;
+        }
+
+        for (n = 0; n < h->records; n++)
+            index_add(&batch, &r[n]);
+
+        if (listing_add_batch(storage, &batch) == -1 ||
+           listing_add_batch(into, &batch) == -1)
+        {
+            index_clear(&batch);
+            return -1;
+        }
+
+        index_clear(&batch);
+    }
+
+    return 0;
+
+fail:
+    if (munmap(map, st.st_size) == -1)
+        abort();
+    return -1;
+}
+
+/*
+ * Append a string to the pool
+ *
+ * Return: offset of the string, or 0 on failure; 0 is never a
+ * valid offset as the pool begins with a reserved terminator
+ */
+
+static uint32_t pool_add(char **pool, size_t *fill, size_t *size,
+                         const char *s)
+{
+    size_t len, offset;
+
+    len = strlen(s) + 1;
+
+    if (*fill + len > *size) {
+        char *p;
+        size_t target;
+
+        target = *size * 2;
+        if (target < *fill + len)
+            target = *fill + len;
+
+        p = realloc(*pool, target);
+        if (p == NULL) {
+            perror("realloc");
+            return 0;
+        }
+
+        *pool = p;
+        *size = target;
+    }
+
+    offset = *fill;
+    memcpy(*pool + offset, s, len);
+    *fill += len;
+
+    return offset;
+}
+
+/* Table of pool offsets, to store repeated strings only once */
+
+struct dedup {
+    uint32_t *slot; /* 0 is an empty slot */
+    size_t size, fill;
+};
+
+static uint32_t hash_string(const char *s)
+{
+    uint32_t h = 2166136261u; /* FNV-1a */
+
+    while (*s != '\0') {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+
+    return h;
+}
+
+static uint32_t* dedup_slot(struct dedup *t, const char *pool,
+                            const char *s)
+{
+    size_t n;
+
+    n = hash_string(s) & (t->size - 1);
+
+    for (;;) {
+        if (t->slot[n] == 0 || strcmp(pool + t->slot[n], s) == 0)
+            return &t->slot[n];
+        n = (n + 1) & (t->size - 1); /* linear probe */
+    }
+}
+
+static int dedup_grow(struct dedup *t, const char *pool)
+{
+    size_t n, size;
+    uint32_t *slot;
+    struct dedup bigger;
+
+    size = t->size ? t->size * 2 : 4096;
+
+    slot = calloc(size, sizeof(uint32_t));
+    if (slot == NULL) {
+        perror("calloc");
+        return -1;
+    }
+
+    bigger.slot = slot;
+    bigger.size = size;
+    bigger.fill = t->fill;
+
+    for (n = 0; n < t->size; n++) {
+        if (t->slot[n] != 0)
+            *dedup_slot(&bigger, pool, pool + t->slot[n]) = t->slot[n];
+    }
+
+    free(t->slot);
+    *t = bigger;
+
+    return 0;
+}
+
+/*
+ * Append a string to the pool, re-using an identical one
+ *
+ * The loaded records then share a pointer for equal strings, as
+ * interned records do; see intern() in library.c.
+ *
+ * Return: offset of the string, or 0 on failure
+ */
+
+static uint32_t pool_intern(char **pool, size_t *fill, size_t *size,
+                            struct dedup *t, const char *s)
+{
+    uint32_t *slot, offset;
+
+    if (t->fill * 3 >= t->size * 2) { /* limit occupancy to 2/3 */
+        if (dedup_grow(t, *pool) == -1)
+            return 0;
+    }
+
+    slot = dedup_slot(t, *pool, s);
+    if (*slot != 0)
+        return *slot;
+
+    offset = pool_add(pool, fill, size, s);
+    if (offset == 0)
+        return 0;
+
+    *slot = offset;
+    t->fill++;
+
+    return offset;
+}
+
+/* Map a record pointer back to its position in playlist order */
+
+struct ref {
+    const struct record *record;
+    uint32_t n;
+};
+
+static int ref_cmp(const void *a, const void *b)
+{
+    const struct ref *x = a, *y = b;
+
+    if (x->record < y->record)
+        return -1;
+    if (x->record > y->record)
+        return 1;
+    return 0;
+}
+
+static uint32_t lookup(const struct ref *map, size_t n,
+                       const struct record *r)
+{
+    struct ref key, *m;
+
+    key.record = r;
+    m = bsearch(&key, map, n, sizeof key, ref_cmp);
+    assert(m != NULL);
+
+    return m->n;
+}
+
+/*
+ * Write the given listing to the cache, for the next startup
+ *
+ * Failure is not fatal; the next startup simply waits for the
+ * scan as before.
+ */
+
+void libcache_save(const char *scan, const char *path,
+                   const struct listing *l)
+{
+    char file[512], tmp[520];
+    struct header h;
+    struct entry *table = NULL;
+    struct ref *map = NULL;
+    uint32_t *perm = NULL;
+    char *pool = NULL;
+    size_t entries, fill, size, n;
+    struct dedup dedup = { NULL, 0, 0 };
+    FILE *f = NULL;
+
+    entries = l->by_order.entries;
+
+    assert(l->by_artist.entries == entries);
+    assert(l->by_bpm.entries == entries);
+
+    if (entries > UINT32_MAX)
+        return;
+
+    if (cache_file(scan, path, true, file, sizeof file) == -1)
+        return;
+
+    if (snprintf(tmp, sizeof tmp, "%s.new", file) >= (int)sizeof tmp)
+        return;
+
+    size = 4096;
+    pool = malloc(size);
+    if (pool == NULL) {
+        perror("malloc");
+        return;
+    }
+    pool[0] = '\0'; /* offset 0 is reserved */
+    fill = 1;
+
+    table = malloc(sizeof(struct entry) * entries);
+    map = malloc(sizeof(struct ref) * entries);
+    perm = malloc(sizeof(uint32_t) * entries * 2);
+
+    if ((entries > 0 && (table == NULL || map == NULL || perm == NULL)))
+    {
+        perror("malloc");
+        goto out;
+    }
+
+    memset(&h, 0, sizeof h);
+    memcpy(h.magic, LIBCACHE_MAGIC, sizeof h.magic);
+    h.version = LIBCACHE_VERSION;
+    h.records = entries;
+
+    h.scan = pool_add(&pool, &fill, &size, scan);
+    h.path = pool_add(&pool, &fill, &size, path);
+    if (h.scan == 0 || h.path == 0)
+        goto out;
+
+    for (n = 0; n < entries; n++) {
+        const struct record *r = l->by_order.record[n];
+        struct entry *e = &table[n];
+
+        e->dir = pool_intern(&pool, &fill, &size, &dedup, r->dir);
+        e->base = pool_add(&pool, &fill, &size, r->base);
+        e->artist = pool_intern(&pool, &fill, &size, &dedup, r->artist);
+        e->title = pool_intern(&pool, &fill, &size, &dedup, r->title);
+        e->match = pool_intern(&pool, &fill, &size, &dedup, r->match);
+        if (e->dir == 0 || e->base == 0 ||
+           e->artist == 0 || e->title == 0 || e->match == 0)
+        {
+            goto out;
+        }
+        e->pad = 0;
+
+        e->bpm = r->bpm;
+
+        map[n].record = r;
+        map[n].n = n;
+    }
+
+    qsort(map, entries, sizeof(struct ref), ref_cmp);
+
+    for (n = 0; n < entries; n++) {
+        perm[n] = lookup(map, entries, l->by_artist.record[n]);
+        perm[entries + n] = lookup(map, entries, l->by_bpm.record[n]);
+    }
+
+    h.pool_len = fill;
+
+    f = fopen(tmp, "w");
+    if (f == NULL)
+        goto out;
+
+    if (fwrite(&h, sizeof h, 1, f) != 1 ||
+       (entries > 0 &&
+        (fwrite(table, sizeof(struct entry) * entries, 1, f) != 1 ||
+         fwrite(perm, sizeof(uint32_t) * entries * 2, 1, f) != 1)) ||
+       fwrite(pool, fill, 1, f) != 1)
+    {
+        fclose(f);
+        unlink(tmp);
+        f = NULL;
+        goto out;
+    }
+
+    if (fclose(f) == EOF) {
+        unlink(tmp);
+        f = NULL;
+        goto out;
+    }
+    f = NULL;
+
+    if (rename(tmp, file) == -1) /* atomic replace */
+        unlink(tmp);
+
+    debug("cached %zu library records for '%s'", entries, path);
+
+out:
+    free(pool);
+    free(table);
+    free(map);
+    free(perm);
+    free(dedup.slot);
+}
+
+/*
+ * Release the mappings and records held by loaded caches
+ *
+ * The records may be referenced throughout the library; called
+ * only when that is done with, at exit.
+ */
+
+void libcache_clear(void)
+{
+    while (arenas != NULL) {
+        struct arena *a = arenas;
+
+        arenas = a->next;
+
+        if (munmap(a->map, a->maplen) == -1)
+            abort();
+
+        free(a->records);
+        free(a);
+    }
+}
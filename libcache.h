@@ -0,0 +1,34 @@
+/*
+ * Copyright (C) 2021 Mark Hills <mark@xwax.org>
+ *
+ * This file is part of "xwax".
+ *
+ * "xwax" is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 3 as
+ * published by the Free Software Foundation.
+ *
+ * "xwax" is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef LIBCACHE_H
+#define LIBCACHE_H
+
+#include "library.h"
+
+/* On-disk cache of a library scan, so that the records are
+ * available at startup without waiting for the scan */
+
+int libcache_load(const char *scan, const char *path,
+                  struct listing *storage, struct listing *into);
+void libcache_save(const char *scan, const char *path,
+                   const struct listing *l);
+void libcache_clear(void);
+
+#endif
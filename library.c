@@ -19,6 +19,8 @@
 
 #define _GNU_SOURCE /* strdupa() */
 #include <assert.h>
+#include <ctype.h>
+#include <pthread.h>
 #include <errno.h>
 #include <iconv.h>
 #include <libgen.h> /*  basename() */
@@ -30,15 +32,229 @@
 
 #include "excrate.h"
 #include "external.h"
+#include "libcache.h"
+#include "memory.h"
+#include "watch.h"
 
 #define CRATE_ALL "All records"
 
+#define CHUNK_SIZE (64 * 1024) /* bytes, per arena chunk */
+
+#define PARALLEL_SORT 4096 /* newcomers, before a worker thread pays off */
+
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof(*x))
 
+/*
+ * Arena for the records of a listing
+ *
+ * A large library means hundreds of thousands of records, and a
+ * malloc for each is heap overhead and poor locality when a search
+ * scans them. Allocations are bumped out of large chunks instead,
+ * and freed wholesale with the listing; nothing is freed
+ * individually.
+ */
+
+struct chunk {
+    struct chunk *next;
+    size_t fill, size;
+    char mem[];
+};
+
+static void pool_init(struct pool *p)
+{
+    p->chunk = NULL;
+}
+
+static void pool_clear(struct pool *p)
+{
+    while (p->chunk != NULL) {
+        struct chunk *c = p->chunk;
+
+        p->chunk = c->next;
+        memory_sub(MEMORY_LIBRARY, sizeof *c + c->size);
+        free(c);
+    }
+}
+
+/*
+ * Return: pointer to len bytes, aligned for any use, or NULL if
+ * out of memory
+ */
+
+static void* pool_alloc(struct pool *p, size_t len)
+{
+    void *x;
+    struct chunk *c;
+
+    len = (len + 7) & ~(size_t)7; /* keep the next caller aligned */
+
+    c = p->chunk;
+
+    if (c == NULL || c->fill + len > c->size) {
+        size_t size;
+
+        size = CHUNK_SIZE;
+        if (size < len) /* oversized allocation */
+            size = len;
+
+        c = malloc(sizeof *c + size);
+        if (c == NULL) {
+            perror("malloc");
+            return NULL;
+        }
+
+        memory_add(MEMORY_LIBRARY, sizeof *c + size);
+
+        c->fill = 0;
+        c->size = size;
+        c->next = p->chunk;
+        p->chunk = c;
+    }
+
+    x = c->mem + c->fill;
+    c->fill += len;
+
+    return x;
+}
+
+static char* pool_strdup(struct pool *p, const char *s)
+{
+    size_t len;
+    char *x;
+
+    len = strlen(s) + 1;
+
+    x = pool_alloc(p, len);
+    if (x == NULL)
+        return NULL;
+
+    memcpy(x, s, len);
+
+    return x;
+}
+
+/*
+ * Interning of repeated strings (artists, titles, directories)
+ *
+ * A large library repeats the same artist across many records;
+ * identical strings are stored once in the pool and shared. This
+ * also means equal strings compare as equal pointers, which the
+ * sort comparisons exploit.
+ */
+
+static void intern_init(struct intern *t)
+{
+    t->slot = NULL;
+    t->size = 0;
+    t->fill = 0;
+}
+
+static void intern_clear(struct intern *t)
+{
+    free(t->slot); /* the strings belong to the pool */
+}
+
+static unsigned int hash_string(const char *s)
+{
+    unsigned int h = 2166136261u; /* FNV-1a */
+
+    while (*s != '\0') {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+
+    return h;
+}
+
+/*
+ * Return: slot for the given string; empty if it is not present
+ * Pre: table has at least one empty slot
+ */
+
+static char** intern_slot(struct intern *t, const char *s)
+{
+    size_t n;
+
+    n = hash_string(s) & (t->size - 1);
+
+    for (;;) {
+        if (t->slot[n] == NULL || strcmp(t->slot[n], s) == 0)
+            return &t->slot[n];
+        n = (n + 1) & (t->size - 1); /* linear probe */
+    }
+}
+
+/*
+ * Return: 0 on success, -1 on memory allocation failure
+ */
+
+static int intern_grow(struct intern *t)
+{
+    size_t n, size;
+    char **slot;
+    struct intern bigger;
+
+    size = t->size ? t->size * 2 : 256;
+
+    slot = calloc(size, sizeof(char*));
+    if (slot == NULL) {
+        perror("calloc");
+        return -1;
+    }
+
+    bigger.slot = slot;
+    bigger.size = size;
+    bigger.fill = t->fill;
+
+    for (n = 0; n < t->size; n++) {
+        if (t->slot[n] != NULL)
+            *intern_slot(&bigger, t->slot[n]) = t->slot[n];
+    }
+
+    free(t->slot);
+    *t = bigger;
+
+    return 0;
+}
+
+/*
+ * Return: the shared copy of the given string, or NULL if out of
+ * memory
+ */
+
+static char* intern(struct intern *t, struct pool *p, const char *s)
+{
+    char **slot, *x;
+
+    if (t->fill * 3 >= t->size * 2) { /* limit occupancy to 2/3 */
+        if (intern_grow(t) == -1)
+            return NULL;
+    }
+
+    slot = intern_slot(t, s);
+    if (*slot != NULL)
+        return *slot;
+
+    x = pool_strdup(p, s);
+    if (x == NULL)
+        return NULL;
+
+    *slot = x;
+    t->fill++;
+
+    return x;
+}
+
 /* The locale used for searches */
 
 static iconv_t ascii = (iconv_t)-1;
 
+/* Reconstructed pathnames, shared for the life of the process;
+ * see record_pathname() */
+
+static struct pool path_pool = { NULL };
+static struct intern path_intern = { NULL, 0, 0 };
+
 int library_global_init(void)
 {
     assert(ascii == (iconv_t)-1);
@@ -68,6 +284,10 @@ void library_global_clear(void)
 
     if (iconv_close(ascii) == -1)
         abort();
+
+    pool_clear(&path_pool);
+    intern_clear(&path_intern);
+    libcache_clear();
 }
 
 void listing_init(struct listing *l)
@@ -75,7 +295,11 @@ void listing_init(struct listing *l)
     index_init(&l->by_artist);
     index_init(&l->by_bpm);
     index_init(&l->by_order);
+    postings_init(&l->postings, &l->by_order);
     event_init(&l->addition);
+    event_init(&l->removal);
+    pool_init(&l->pool);
+    intern_init(&l->intern);
 }
 
 void listing_clear(struct listing *l)
@@ -83,7 +307,11 @@ void listing_clear(struct listing *l)
     index_clear(&l->by_artist);
     index_clear(&l->by_bpm);
     index_clear(&l->by_order);
+    postings_clear(&l->postings);
     event_clear(&l->addition);
+    event_clear(&l->removal);
+    pool_clear(&l->pool);
+    intern_clear(&l->intern);
 }
 
 /*
@@ -103,6 +331,7 @@ static int crate_init(struct crate *c, const char *name)
     }
 
     c->is_busy = false;
+    c->watch = NULL;
 
     event_init(&c->activity);
     event_init(&c->refresh);
@@ -122,6 +351,17 @@ static void propagate_addition(struct observer *o, void *x)
     fire(&c->addition, x);
 }
 
+/*
+ * A removal does not carry enough information to patch every view,
+ * so propagate it as a refresh of this crate
+ */
+
+static void propagate_removal(struct observer *o, void *x)
+{
+    struct crate *c = container_of(o, struct crate, on_removal);
+    fire(&c->refresh, NULL);
+}
+
 /*
  * Propagate notification that the scan has finished
  */
@@ -147,6 +387,7 @@ static int crate_init_all(struct library *l, struct crate *c, const char *name)
     c->is_fixed = true;
     c->listing = &l->storage;
     watch(&c->on_addition, &c->listing->addition, propagate_addition);
+    watch(&c->on_removal, &c->listing->removal, propagate_removal);
     c->excrate = NULL;
 
     return 0;
@@ -168,6 +409,7 @@ static void hook_up_excrate(struct crate *c, struct excrate *e)
     fire(&c->refresh, NULL);
 
     watch(&c->on_addition, &c->listing->addition, propagate_addition);
+    watch(&c->on_removal, &c->listing->removal, propagate_removal);
     watch(&c->on_completion, &e->completion, propagate_completion);
 }
 
@@ -193,12 +435,17 @@ static int crate_init_scan(struct library *l, struct crate *c, const char *name,
     c->scan = scan;
     c->path = path;
 
-    e = excrate_acquire_by_scan(scan, path, &l->storage);
+    e = excrate_acquire_by_scan(scan, path, &l->storage, true);
     if (e == NULL)
         return -1;
 
     hook_up_excrate(c, e);
 
+    /* Keep up with changes on disk; without this, only a manual
+     * rescan notices them */
+
+    c->watch = watch_add(c, &l->storage);
+
     return 0;
 }
 
@@ -217,12 +464,16 @@ static int crate_rescan(struct crate *c, struct library *l)
     /* Replace the excrate in-place. Care needed to re-wire
      * everything back up again as before */
 
-    e = excrate_acquire_by_scan(c->scan, c->path, &l->storage);
+    /* The records of the old scan are already in place; using
+     * the cache here would bring nothing new */
+
+    e = excrate_acquire_by_scan(c->scan, c->path, &l->storage, false);
     if (e == NULL)
         return -1;
 
     ignore(&c->on_completion);
     ignore(&c->on_addition);
+    ignore(&c->on_removal);
     excrate_release(c->excrate);
     hook_up_excrate(c, e);
 
@@ -239,6 +490,10 @@ static int crate_rescan(struct crate *c, struct library *l)
 static void crate_clear(struct crate *c)
 {
     ignore(&c->on_addition);
+    ignore(&c->on_removal);
+
+    if (c->watch != NULL)
+        watch_remove(c->watch);
 
     if (c->excrate != NULL) {
         ignore(&c->on_completion);
@@ -266,40 +521,352 @@ static int crate_cmp(const struct crate *a, const struct crate *b)
 }
 
 /*
- * Add a record into a crate and its various indexes
+ * A record new to the batch, and its position in the batch
  *
- * Return: Pointer to existing entry, NULL if out of memory
- * Post: Record added to the crate
+ * The position breaks ties in the sort below, so that of several
+ * identical records the earliest in the batch is the canonical one.
  */
 
-struct record* listing_add(struct listing *l, struct record *r)
+struct newcomer {
+    struct record *record;
+    size_t pos;
+};
+
+/*
+ * Comparison functions, see qsort(3)
+ */
+
+static int qcompar_newcomer(const void *a, const void *b)
 {
-    struct record *x;
+    const struct newcomer *x = a, *y = b;
+    int r;
+
+    r = record_cmp(x->record, y->record, SORT_ARTIST);
+    if (r != 0)
+        return r;
+
+    return (x->pos > y->pos) - (x->pos < y->pos);
+}
+
+static int qcompar_pos(const void *a, const void *b)
+{
+    const size_t *x = a, *y = b;
+
+    return (*x > *y) - (*x < *y);
+}
+
+/*
+ * The BPM index does not share entries with the other sorted index,
+ * so its sort and merge can proceed on a worker thread while the
+ * calling thread merges by artist
+ */
+
+struct merge_job {
+    struct index *dest, *src;
+    int sort, result;
+};
+
+static void* merge_worker(void *x)
+{
+    struct merge_job *j = x;
+
+    index_sort(j->src, j->sort);
+    j->result = index_merge(j->dest, j->src, j->sort);
+
+    return NULL;
+}
+
+/*
+ * Add a batch of records into a crate and its various indexes
+ *
+ * The sorted indexes are merged once per batch, not once per
+ * record, and the addition event carries an index of the newcomers
+ * -- inserting one record at a time is quadratic as the crate
+ * grows large.
+ *
+ * Duplicates are resolved against the existing entries, which are
+ * re-used; the redundant records remain in their pool until it is
+ * freed.
+ *
+ * Return: 0 on success, -1 if out of memory (batch is incomplete)
+ * Post: each entry of batch is the canonical record pointer
+ */
+
+int listing_add_batch(struct listing *l, struct index *batch)
+{
+    int ret = -1, artist;
+    size_t n, m, seeds, uniq, *first = NULL;
+    struct newcomer *seed = NULL;
+    struct index sorted, news, bpm;
+    struct merge_job job;
+    pthread_t pt;
+    bool threaded;
+
+    index_init(&sorted); /* newcomers, sorted by artist */
+    index_init(&news); /* newcomers, in batch order */
+    index_init(&bpm);
+
+    seed = malloc(sizeof(struct newcomer) * batch->entries);
+    first = malloc(sizeof(size_t) * batch->entries);
+    if (seed == NULL || first == NULL) {
+        perror("malloc");
+        goto out;
+    }
+
+    seeds = 0;
+
+    for (n = 0; n < batch->entries; n++) {
+        struct record *d, *x;
+
+        d = batch->record[n];
+        assert(d != NULL);
+
+        x = index_search(&l->by_artist, d, SORT_ARTIST);
+
+        if (x != NULL) {
+            batch->record[n] = x;
+        } else {
+            seed[seeds].record = d;
+            seed[seeds].pos = n;
+            seeds++;
+        }
+    }
+
+    if (seeds == 0) {
+        ret = 0;
+        goto out;
+    }
+
+    /* One sort brings duplicates within the batch itself adjacent,
+     * rather than an insertion sort per record */
+
+    qsort(seed, seeds, sizeof(struct newcomer), qcompar_newcomer);
+
+    if (index_reserve(&sorted, seeds) == -1)
+        goto out;
+
+    uniq = 0;
+
+    for (n = 0; n < seeds; n = m) {
+        struct record *canon = seed[n].record;
+
+        index_add(&sorted, canon);
+        first[uniq++] = seed[n].pos;
+
+        for (m = n; m < seeds &&
+            record_cmp(seed[m].record, canon, SORT_ARTIST) == 0; m++)
+        {
+            batch->record[seed[m].pos] = canon;
+        }
+    }
+
+    /* Restore the batch order of the newcomers */
 
-    assert(r != NULL);
+    qsort(first, uniq, sizeof(size_t), qcompar_pos);
+
+    if (index_reserve(&news, uniq) == -1)
+        goto out;
+
+    for (n = 0; n < uniq; n++)
+        index_add(&news, batch->record[first[n]]);
+
+    if (index_copy(&sorted, &bpm) == -1)
+        goto out;
 
     /* Do all the memory reservation up-front as we can't
      * un-wind if it errors later */
 
-    if (index_reserve(&l->by_artist, 1) == -1)
-        return NULL;
-    if (index_reserve(&l->by_bpm, 1) == -1)
-        return NULL;
-    if (index_reserve(&l->by_order, 1) == -1)
+    if (index_reserve(&l->by_order, news.entries) == -1)
+        goto out;
+
+    job.dest = &l->by_bpm;
+    job.src = &bpm;
+    job.sort = SORT_BPM;
+    job.result = -1;
+
+    threaded = news.entries >= PARALLEL_SORT &&
+        pthread_create(&pt, NULL, merge_worker, &job) == 0;
+
+    artist = index_merge(&l->by_artist, &sorted, SORT_ARTIST);
+
+    if (threaded) {
+        if (pthread_join(pt, NULL) != 0)
+            abort();
+    } else {
+        merge_worker(&job);
+    }
+
+    if (artist == -1 || job.result == -1)
+        goto out;
+
+    for (n = 0; n < news.entries; n++) {
+        index_add(&l->by_order, news.record[n]);
+
+        /* On failure, the postings withdraw themselves and the
+         * search falls back to a linear scan */
+
+        (void)postings_add(&l->postings, news.record[n]);
+    }
+
+    fire(&l->addition, &news);
+    ret = 0;
+out:
+    free(seed);
+    free(first);
+    index_clear(&sorted);
+    index_clear(&news);
+    index_clear(&bpm);
+    return ret;
+}
+
+/*
+ * Add a single record into a crate; see listing_add_batch()
+ *
+ * Return: Pointer to the canonical entry, NULL if out of memory
+ */
+
+struct record* listing_add(struct listing *l, struct record *r)
+{
+    struct record *slot = r;
+    struct index batch;
+
+    batch.record = &slot;
+    batch.size = 1;
+    batch.entries = 1;
+
+    if (listing_add_batch(l, &batch) == -1)
         return NULL;
 
-    x = index_insert(&l->by_artist, r, SORT_ARTIST);
-    assert(x != NULL);
-    if (x != r)
-        return x;
+    return slot;
+}
+
+/*
+ * Comparison of the record pointers themselves, for the victim set
+ * of a removal
+ */
+
+static int qcompar_ptr(const void *a, const void *b)
+{
+    struct record *const *x = a, *const *y = b;
+
+    return (*x > *y) - (*x < *y);
+}
+
+/*
+ * Drop the entries of the given set from an index, in one pass
+ */
+
+static void index_compact(struct index *i, struct record *const *set,
+                          size_t entries)
+{
+    size_t from, to;
+
+    to = 0;
+
+    for (from = 0; from < i->entries; from++) {
+        struct record *r = i->record[from];
+
+        if (bsearch(&r, set, entries, sizeof(struct record*),
+                    qcompar_ptr) != NULL)
+        {
+            continue;
+        }
+
+        i->record[to++] = r;
+    }
+
+    i->entries = to;
+}
+
+/*
+ * Remove a set of records from a crate and its indexes
+ *
+ * The records themselves stay in their pool -- outstanding pointers
+ * (eg. a track on a deck) remain valid -- they simply cease to be
+ * listed.
+ *
+ * Return: 0 on success, -1 if out of memory
+ */
+
+int listing_remove_batch(struct listing *l, struct index *gone)
+{
+    size_t n;
+    struct record **set;
+
+    if (gone->entries == 0)
+        return 0;
+
+    set = malloc(sizeof(struct record*) * gone->entries);
+    if (set == NULL) {
+        perror("malloc");
+        return -1;
+    }
+
+    memcpy(set, gone->record, sizeof(struct record*) * gone->entries);
+    qsort(set, gone->entries, sizeof(struct record*), qcompar_ptr);
+
+    index_compact(&l->by_artist, set, gone->entries);
+    index_compact(&l->by_bpm, set, gone->entries);
+    index_compact(&l->by_order, set, gone->entries);
+
+    free(set);
+
+    /* The postings hold positions into by_order, which have just
+     * shifted; rebuild them. This is linear in the listing, but
+     * removals are rare */
+
+    postings_clear(&l->postings);
+    postings_init(&l->postings, &l->by_order);
+
+    for (n = 0; n < l->by_order.entries; n++)
+        (void)postings_add(&l->postings, l->by_order.record[n]);
+
+    fire(&l->removal, gone);
+
+    return 0;
+}
+
+/*
+ * Collect the records at the given pathname, or below it if it
+ * names a directory
+ *
+ * Return: 0 on success, -1 if out of memory
+ * Post: the matching records are appended to gone
+ */
+
+int listing_find_below(struct listing *l, const char *path,
+                       struct index *gone)
+{
+    size_t n, len;
+
+    len = strlen(path);
+
+    for (n = 0; n < l->by_order.entries; n++) {
+        struct record *r = l->by_order.record[n];
+        size_t dir = strlen(r->dir);
+
+        if (dir > len) {
+            /* Below the directory at path */
+
+            if (strncmp(r->dir, path, len) != 0 || r->dir[len] != '/')
+                continue;
+        } else {
+            /* The exact file */
+
+            if (strncmp(path, r->dir, dir) != 0 ||
+                strcmp(path + dir, r->base) != 0)
+            {
+                continue;
+            }
+        }
 
-    x = index_insert(&l->by_bpm, r, SORT_BPM);
-    assert(x == r);
+        if (index_reserve(gone, 1) == -1)
+            return -1;
 
-    index_add(&l->by_order, r);
+        index_add(gone, r);
+    }
 
-    fire(&l->addition, r);
-    return r;
+    return 0;
 }
 
 /*
@@ -388,16 +955,6 @@ int library_init(struct library *li)
     return 0;
 }
 
-/*
- * Free resources associated with a record
- */
-
-static void record_clear(struct record *re)
-{
-    free(re->pathname);
-    free(re->match); /* may be NULL */
-}
-
 /*
  * Free resources associated with the music library
  */
@@ -406,15 +963,8 @@ void library_clear(struct library *li)
 {
     int n;
 
-    /* This object is responsible for all the record pointers */
-
-    for (n = 0; n < li->storage.by_artist.entries; n++) {
-        struct record *re;
-
-        re = li->storage.by_artist.record[n];
-        record_clear(re);
-        free(re);
-    }
+    /* The records themselves are freed with the storage pool
+     * below, or with their mapped cache; see libcache.c */
 
     /* Clear crates */
 
@@ -482,19 +1032,19 @@ static size_t split(char *s, char *x[], size_t len)
 }
 
 /*
- * Construct a string for matching against
+ * Construct the string for matching against
  *
- * Only construct the string if the given "artist" and "title" contain
- * characters which require converting to the ASCII locale which is
- * used for searches.
+ * The given "artist" and "title" are converted to the ASCII locale
+ * which is used for searches, and the case is folded -- once here,
+ * rather than per-character on every comparison; see record_match().
  *
- * Return: string with responsibility, or NULL if not required
+ * Return: string allocated from the pool, or NULL if out of memory
  */
 
-static char* matchable(const char *artist, const char *title)
+static char* matchable(struct pool *p, const char *artist, const char *title)
 {
-    char *buf, *in, *out;
-    size_t len, fill, nonrev;
+    char *buf, *in, *out, *s;
+    size_t len, fill;
 
     /*
      * Append all the strings of interest into a single buffer
@@ -523,70 +1073,121 @@ static char* matchable(const char *artist, const char *title)
 
     in = buf;
 
-    nonrev = iconv(ascii, &in, &len, &out, &fill);
+    (void)iconv(ascii, &in, &len, &out, &fill);
     *out = '\0';
 
-    if (nonrev == 0)
-        return NULL;
+    for (s = buf; *s != '\0'; s++)
+        *s = tolower((unsigned char)*s);
 
-    return strdup(buf);
+    return pool_strdup(p, buf);
 }
 
 /*
  * Convert a line from the scan script to a record structure in memory
  *
- * Return: pointer to alloc'd record, or NULL on error
+ * The record and its strings are allocated from the pool of the
+ * given listing, and are freed with it.
+ *
+ * Return: pointer to record, or NULL on error
  * Post: if successful, responsibility for pointer line is taken
  */
 
-struct record* get_record(char *line)
+struct record* get_record(struct listing *l, char *line)
 {
     int n;
+    double bpm;
     struct record *x;
-    char *field[4];
-
-    x = malloc(sizeof *x);
-    if (!x) {
-        perror("malloc");
-        return NULL;
-    }
+    char *field[4], *slash;
 
-    x->bpm = 0.0;
+    bpm = 0.0;
 
     n = split(line, field, ARRAY_SIZE(field));
 
     switch (n) {
     case 4:
-        x->bpm = parse_bpm(field[3]);
-        if (!isfinite(x->bpm)) {
+        bpm = parse_bpm(field[3]);
+        if (!isfinite(bpm)) {
             fprintf(stderr, "%s: Ignoring malformed BPM '%s'\n",
                     field[0], field[3]);
-            x->bpm = 0.0;
+            bpm = 0.0;
         }
         /* fall-through */
     case 3:
-        x->pathname = field[0];
-        x->artist = field[1];
-        x->title = field[2];
         break;
 
     case 2:
     case 1:
     default:
         fprintf(stderr, "Malformed record '%s'\n", line);
-        goto bad;
+        return NULL;
     }
 
-    /* Decide if this record needs a character-equivalent in the
-     * locale used for searching */
+    x = pool_alloc(&l->pool, sizeof *x);
+    if (x == NULL)
+        return NULL;
 
-    x->match = matchable(x->artist, x->title);
+    /* The directory, artist and title repeat across the library
+     * and are shared; only the basename is unique to this record */
+
+    slash = strrchr(field[0], '/');
+    if (slash != NULL) {
+        x->base = pool_strdup(&l->pool, slash + 1);
+        slash[1] = '\0'; /* directory keeps its trailing '/' */
+        x->dir = intern(&l->intern, &l->pool, field[0]);
+    } else {
+        x->base = pool_strdup(&l->pool, field[0]);
+        x->dir = intern(&l->intern, &l->pool, "");
+    }
+
+    x->artist = intern(&l->intern, &l->pool, field[1]);
+    x->title = intern(&l->intern, &l->pool, field[2]);
+
+    if (x->dir == NULL || x->base == NULL ||
+       x->artist == NULL || x->title == NULL)
+    {
+        return NULL;
+    }
+
+    x->bpm = bpm;
+    x->key = NULL;
+
+    /* The searchable text is precomputed, in the locale and case
+     * used for searching */
+
+    x->match = matchable(&l->pool, x->artist, x->title);
+    if (x->match == NULL)
+        return NULL;
+
+    free(line);
 
     return x;
+}
 
-bad:
-    free(x);
-    return NULL;
+/*
+ * Reconstruct the full pathname of a record
+ *
+ * The result is interned: stable for the life of the process, and
+ * the same pointer on repeated calls, which is how
+ * track_acquire_by_import() re-uses a track already loaded.
+ *
+ * Return: the pathname, or NULL if out of memory
+ */
+
+char* record_pathname(const struct record *r)
+{
+    size_t dir, base;
+    char *buf;
+
+    dir = strlen(r->dir);
+    base = strlen(r->base);
+
+    buf = alloca(dir + base + 1);
+    assert(buf);
+
+    memcpy(buf, r->dir, dir);
+    memcpy(buf + dir, r->base, base + 1);
+
+    return intern(&path_intern, &path_pool, buf);
 }
 
 /*
@@ -645,3 +1246,129 @@ int library_rescan(struct library *l, struct crate *c)
     else
         return crate_rescan(c, l);
 }
+
+/*
+ * Apply a batch of analysis results to the library
+ *
+ * A record's BPM decides its place in the SORT_BPM order, so the
+ * affected records are withdrawn from every listing and re-added
+ * with their new values; the removal and addition events carry the
+ * change out to the views, the same way a rescan does.
+ *
+ * Return: 0 on success, -1 if out of memory (some results or
+ *   records may have been dropped)
+ */
+
+int library_update_batch(struct library *li, const struct analysis *a,
+                         size_t entries)
+{
+    int ret = -1;
+    size_t n, c, nls;
+    struct listing **ls = NULL;
+    struct index *sub = NULL;
+    struct record **set = NULL;
+
+    if (entries == 0)
+        return 0;
+
+    /* The distinct listings; crates can share one (eg. 'all' is
+     * the storage itself), and a scanned crate keeps a 'fresh'
+     * listing which must stay coherent for the cache it becomes */
+
+    ls = malloc(sizeof(struct listing*) * (li->crates * 2 + 1));
+    set = malloc(sizeof(struct record*) * entries);
+    if (ls == NULL || set == NULL) {
+        perror("malloc");
+        goto out;
+    }
+
+    nls = 0;
+    ls[nls++] = &li->storage;
+
+    for (c = 0; c < li->crates; c++) {
+        struct crate *x = li->crate[c];
+        size_t m;
+
+        for (m = 0; m < nls && ls[m] != x->listing; m++)
+            ;
+        if (m == nls)
+            ls[nls++] = x->listing;
+
+        if (x->excrate != NULL) {
+            struct listing *f = &x->excrate->fresh;
+
+            for (m = 0; m < nls && ls[m] != f; m++)
+                ;
+            if (m == nls)
+                ls[nls++] = f;
+        }
+    }
+
+    sub = malloc(sizeof(struct index) * nls);
+    if (sub == NULL) {
+        perror("malloc");
+        goto out;
+    }
+
+    for (n = 0; n < nls; n++)
+        index_init(&sub[n]);
+
+    /* The records in hand, sorted by pointer for the membership
+     * tests below */
+
+    for (n = 0; n < entries; n++)
+        set[n] = a[n].record;
+    qsort(set, entries, sizeof(struct record*), qcompar_ptr);
+
+    for (n = 0; n < nls; n++) {
+        const struct index *order = &ls[n]->by_order;
+        size_t m;
+
+        for (m = 0; m < order->entries; m++) {
+            struct record *r = order->record[m];
+
+            if (bsearch(&r, set, entries, sizeof(struct record*),
+                        qcompar_ptr) == NULL)
+            {
+                continue;
+            }
+
+            if (index_reserve(&sub[n], 1) == -1)
+                goto out_sub;
+            index_add(&sub[n], r);
+        }
+
+        if (sub[n].entries > 0)
+            (void)listing_remove_batch(ls[n], &sub[n]);
+    }
+
+    /* With the records out of the sort orders, the keys are free
+     * to change */
+
+    for (n = 0; n < entries; n++) {
+        struct record *r = a[n].record;
+
+        if (a[n].bpm > 0.0)
+            r->bpm = a[n].bpm;
+
+        if (a[n].key != NULL)
+            r->key = intern(&li->storage.intern, &li->storage.pool,
+                            a[n].key);
+    }
+
+    ret = 0;
+
+    for (n = 0; n < nls; n++) {
+        if (sub[n].entries > 0 && listing_add_batch(ls[n], &sub[n]) == -1)
+            ret = -1;
+    }
+
+out_sub:
+    for (n = 0; n < nls; n++)
+        index_clear(&sub[n]);
+out:
+    free(sub);
+    free(set);
+    free(ls);
+    return ret;
+}
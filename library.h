@@ -26,11 +26,31 @@
 #include "index.h"
 #include "observer.h"
 
+/* Bump allocator for records and their strings, freed wholesale
+ * with the listing which owns them */
+
+struct pool {
+    struct chunk *chunk;
+};
+
+/* Interning table, so identical strings share pool storage */
+
+struct intern {
+    char **slot;
+    size_t size, fill;
+};
+
+struct watch;
+
 /* A set of records, with several optimised indexes */
 
 struct listing {
     struct index by_artist, by_bpm, by_order;
-    struct event addition;
+    struct postings postings; /* over by_order, for searches */
+    struct event addition, /* fired with an index of new records */
+        removal; /* fired with an index of removed records */
+    struct pool pool;
+    struct intern intern;
 };
 
 /* A single crate of records */
@@ -39,13 +59,14 @@ struct crate {
     bool is_fixed, is_busy;
     char *name;
     struct listing *listing;
-    struct observer on_addition, on_completion;
+    struct observer on_addition, on_removal, on_completion;
     struct event activity, /* at the crate level, not the listing */
         refresh, addition;
 
     /* Optionally, the corresponding source */
     const char *scan, *path;
     struct excrate *excrate;
+    struct watch *watch; /* or NULL if not watched */
 };
 
 /* The complete music library, which consists of multiple crates */
@@ -62,11 +83,27 @@ void library_global_clear(void);
 void listing_init(struct listing *l);
 void listing_clear(struct listing *l);
 struct record* listing_add(struct listing *l, struct record *r);
+int listing_add_batch(struct listing *l, struct index *batch);
+int listing_remove_batch(struct listing *l, struct index *gone);
+int listing_find_below(struct listing *l, const char *path,
+                       struct index *gone);
 
 int library_init(struct library *li);
 void library_clear(struct library *li);
 
-struct record* get_record(char *line);
+struct record* get_record(struct listing *l, char *line);
+char* record_pathname(const struct record *r);
+
+/* A result of background analysis, to be applied to a record */
+
+struct analysis {
+    struct record *record;
+    double bpm;
+    const char *key; /* or NULL */
+};
+
+int library_update_batch(struct library *li, const struct analysis *a,
+                         size_t entries);
 
 int library_import(struct library *lib, const char *scan, const char *path);
 int library_rescan(struct library *l, struct crate *c);
@@ -19,49 +19,72 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "lut.h"
+#include "memory.h"
 
-/* The number of bits to form the hash, which governs the overall size
- * of the hash lookup table, and hence the amount of chaining */
+#define EMPTY ((slot_no_t)-1)
 
-#define HASH_BITS 16
+/*
+ * A single flat table with linear probing, rather than hash chains;
+ * each lookup is one cache miss in the common case, instead of two
+ * dependent loads (hash table, then slot chain).
+ */
+
+/* Scatter the timecode across the table; the raw LFSR values are
+ * heavily correlated in their low bits */
+
+static inline unsigned int mix(unsigned int timecode)
+{
+    return timecode * 2654435761u; /* Knuth */
+}
+
+/*
+ * The table size used for the given number of entries: the next
+ * power of two which keeps the load factor at 2/3 or less
+ */
 
-#define HASH(timecode) ((timecode) & ((1 << HASH_BITS) - 1))
-#define NO_SLOT ((unsigned)-1)
+static size_t table_size(int nslots)
+{
+    size_t size;
 
+    size = 1;
+    while (size < (size_t)nslots + nslots / 2)
+        size <<= 1;
 
-/* Initialise an empty hash lookup table to store the given number
+    return size;
+}
+
+/* Initialise an empty lookup table to store the given number
  * of timecode -> position lookups */
 
 int lut_init(struct lut *lut, int nslots)
 {
-    int n, hashes;
-    size_t bytes;
+    size_t size, bytes;
 
-    hashes = 1 << HASH_BITS;
-    bytes = sizeof(struct slot) * nslots + sizeof(slot_no_t) * hashes;
+    size = table_size(nslots);
+    bytes = sizeof(struct lut_entry) * size;
 
-    fprintf(stderr, "Lookup table has %d hashes to %d slots"
-            " (%d slots per hash, %zuKb)\n",
-            hashes, nslots, nslots / hashes, bytes / 1024);
+    fprintf(stderr, "Lookup table has %zu entries for %d timecodes"
+            " (load %zu%%, %zuKb)\n",
+            size, nslots, (size_t)nslots * 100 / size, bytes / 1024);
 
-    lut->slot = malloc(sizeof(struct slot) * nslots);
-    if (lut->slot == NULL) {
+    lut->entry = malloc(bytes);
+    if (lut->entry == NULL) {
         perror("malloc");
         return -1;
     }
 
-    lut->table = malloc(sizeof(slot_no_t) * hashes);
-    if (lut->table == NULL) {
-        perror("malloc");
-        return -1;
-    }
+    memory_add(MEMORY_LUT, bytes);
 
-    for (n = 0; n < hashes; n++)
-        lut->table[n] = NO_SLOT;
+    memset(lut->entry, 0xff, bytes); /* all positions EMPTY */
 
+    lut->mask = size - 1;
     lut->avail = 0;
+    lut->map = NULL;
 
     return 0;
 }
@@ -69,42 +92,108 @@ int lut_init(struct lut *lut, int nslots)
 
 void lut_clear(struct lut *lut)
 {
-    free(lut->table);
-    free(lut->slot);
+    if (lut->map != NULL) {
+
+        /* File-backed and read-only; never counted */
+
+        if (munmap(lut->map, lut->maplen) == -1)
+            abort(); /* under our control; see munmap(2) */
+        return;
+    }
+
+    memory_sub(MEMORY_LUT, sizeof(struct lut_entry) * (lut->mask + 1));
+    free(lut->entry);
 }
 
 
 void lut_push(struct lut *lut, unsigned int timecode)
 {
-    unsigned int hash;
-    slot_no_t slot_no;
-    struct slot *slot;
+    unsigned int n;
 
-    slot_no = lut->avail++; /* take the next available slot */
+    n = mix(timecode) & lut->mask;
 
-    slot = &lut->slot[slot_no];
-    slot->timecode = timecode;
+    while (lut->entry[n].position != EMPTY)
+        n = (n + 1) & lut->mask;
 
-    hash = HASH(timecode);
-    slot->next = lut->table[hash];
-    lut->table[hash] = slot_no;
+    lut->entry[n].timecode = timecode;
+    lut->entry[n].position = lut->avail++;
+}
+
+/*
+ * Write the table to the given stream, in the format expected by
+ * lut_map()
+ *
+ * Pre: lut is fully populated; ie. avail == nslots
+ * Return: -1 on error, otherwise 0
+ */
+
+int lut_store(const struct lut *lut, int nslots, FILE *f)
+{
+    size_t size;
+
+    size = table_size(nslots);
+
+    if (fwrite(lut->entry, sizeof(struct lut_entry), size, f) != size)
+        return -1;
+
+    return 0;
+}
+
+/*
+ * Point the lookup table into a file previously written by
+ * lut_store(), mapped read-only into memory
+ *
+ * The table begins at the given byte offset into the file. No copy of
+ * the data is made; the mapping is demand-paged by the kernel.
+ *
+ * Return: -1 on error, otherwise 0
+ * Post: if 0 is returned, the lut is initialised and lut_clear()
+ *   releases the mapping
+ */
+
+int lut_map(struct lut *lut, int nslots, int fd, size_t offset)
+{
+    size_t size, bytes;
+    struct stat st;
+    void *base;
+
+    size = table_size(nslots);
+    bytes = offset + sizeof(struct lut_entry) * size;
+
+    if (fstat(fd, &st) == -1) {
+        perror("fstat");
+        return -1;
+    }
+
+    if ((size_t)st.st_size != bytes) /* wrong size; eg. truncated write */
+        return -1;
+
+    base = mmap(NULL, bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+
+    lut->map = base;
+    lut->maplen = bytes;
+    lut->entry = (struct lut_entry*)((char*)base + offset);
+    lut->mask = size - 1;
+    lut->avail = nslots;
+
+    return 0;
 }
 
 
 unsigned int lut_lookup(struct lut *lut, unsigned int timecode)
 {
-    unsigned int hash;
-    slot_no_t slot_no;
-    struct slot *slot;
-
-    hash = HASH(timecode);
-    slot_no = lut->table[hash];
-
-    while (slot_no != NO_SLOT) {
-        slot = &lut->slot[slot_no];
-        if (slot->timecode == timecode)
-            return slot_no;
-        slot_no = slot->next;
+    unsigned int n;
+
+    n = mix(timecode) & lut->mask;
+
+    while (lut->entry[n].position != EMPTY) {
+        if (lut->entry[n].timecode == timecode)
+            return lut->entry[n].position;
+        n = (n + 1) & lut->mask;
     }
 
     return (unsigned)-1;
@@ -20,17 +20,27 @@
 #ifndef LUT_H
 #define LUT_H
 
+#include <stddef.h>
+#include <stdio.h>
+
 typedef unsigned int slot_no_t;
 
-struct slot {
+/* A packed entry in the open-addressing table; eight entries share
+ * each 64-byte cache line, so the linear probe on collision usually
+ * stays within the line already fetched */
+
+struct lut_entry {
     unsigned int timecode;
-    slot_no_t next; /* next slot with the same hash */
+    slot_no_t position; /* order of lut_push(), or EMPTY */
 };
 
 struct lut {
-    struct slot *slot;
-    slot_no_t *table, /* hash -> slot lookup */
-        avail; /* next available slot */
+    struct lut_entry *entry;
+    unsigned int mask; /* table size minus one; power of two */
+    slot_no_t avail; /* next position to be pushed */
+
+    void *map; /* base of mmap(), or NULL if heap allocated */
+    size_t maplen;
 };
 
 int lut_init(struct lut *lut, int nslots);
@@ -39,4 +49,7 @@ void lut_clear(struct lut *lut);
 void lut_push(struct lut *lut, unsigned int timecode);
 unsigned int lut_lookup(struct lut *lut, unsigned int timecode);
 
+int lut_store(const struct lut *lut, int nslots, FILE *f);
+int lut_map(struct lut *lut, int nslots, int fd, size_t offset);
+
 #endif
@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2021 Mark Hills <mark@xwax.org>
+ *
+ * This file is part of "xwax".
+ *
+ * "xwax" is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 3 as
+ * published by the Free Software Foundation.
+ *
+ * "xwax" is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <assert.h>
+
+#include "memory.h"
+#include "status.h"
+
+static size_t budget = 0; /* bytes, or zero for no budget */
+
+/* Written concurrently by the rig, decode workers and the LUT
+ * builder; plain counters behind atomic add and subtract */
+
+static size_t used[MEMORY_END];
+
+void memory_set_budget(size_t bytes)
+{
+    budget = bytes;
+}
+
+void memory_add(int use, size_t bytes)
+{
+    assert(use >= 0 && use < MEMORY_END);
+    __atomic_add_fetch(&used[use], bytes, __ATOMIC_RELAXED);
+}
+
+void memory_sub(int use, size_t bytes)
+{
+    assert(use >= 0 && use < MEMORY_END);
+    __atomic_sub_fetch(&used[use], bytes, __ATOMIC_RELAXED);
+}
+
+size_t memory_used(int use)
+{
+    assert(use >= 0 && use < MEMORY_END);
+    return __atomic_load_n(&used[use], __ATOMIC_RELAXED);
+}
+
+size_t memory_total(void)
+{
+    size_t t;
+    int n;
+
+    t = 0;
+
+    for (n = 0; n < MEMORY_END; n++)
+        t += memory_used(n);
+
+    return t;
+}
+
+/*
+ * A sixteenth of the budget is kept as headroom: speculative work
+ * is refused, and the track cache evicted, before the budget is
+ * actually hit
+ */
+
+bool memory_short(void)
+{
+    if (budget == 0)
+        return false;
+
+    return memory_total() + budget / 16 > budget;
+}
+
+void memory_status(void)
+{
+    if (budget != 0) {
+        status_printf(STATUS_VERBOSE,
+                      "Memory: %zu of %zu MB "
+                      "(tracks %zu, timecode %zu, library %zu)",
+                      memory_total() >> 20, budget >> 20,
+                      memory_used(MEMORY_TRACK) >> 20,
+                      memory_used(MEMORY_LUT) >> 20,
+                      memory_used(MEMORY_LIBRARY) >> 20);
+    } else {
+        status_printf(STATUS_VERBOSE,
+                      "Memory: %zu MB, no budget "
+                      "(tracks %zu, timecode %zu, library %zu)",
+                      memory_total() >> 20,
+                      memory_used(MEMORY_TRACK) >> 20,
+                      memory_used(MEMORY_LUT) >> 20,
+                      memory_used(MEMORY_LIBRARY) >> 20);
+    }
+}
@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2021 Mark Hills <mark@xwax.org>
+ *
+ * This file is part of "xwax".
+ *
+ * "xwax" is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 3 as
+ * published by the Free Software Foundation.
+ *
+ * "xwax" is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef MEMORY_H
+#define MEMORY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Accounting of the memory in our hands
+ *
+ * The large consumers -- track audio, the timecode lookup table and
+ * the record library -- report their allocations here, so the total
+ * is visible and an overall budget can be enforced before the OOM
+ * killer does it for us. File-backed mappings are not counted; the
+ * kernel reclaims those itself.
+ */
+
+#define MEMORY_TRACK   0
+#define MEMORY_LUT     1
+#define MEMORY_LIBRARY 2
+#define MEMORY_END     3
+
+/* Zero, the default, imposes no budget */
+
+void memory_set_budget(size_t bytes);
+
+/* Safe from any thread */
+
+void memory_add(int use, size_t bytes);
+void memory_sub(int use, size_t bytes);
+
+size_t memory_used(int use);
+size_t memory_total(void);
+
+/* Return true if the budget leaves no room for speculative work,
+ * and consumers should be freeing memory rather than taking more */
+
+bool memory_short(void);
+
+/* Put the current totals on the status line */
+
+void memory_status(void);
+
+#endif
@@ -18,6 +18,7 @@
  */
 
 #include <stdio.h>
+#include <time.h>
 
 #include "midi.h"
 
@@ -95,6 +96,28 @@ ssize_t midi_read(struct midi *m, void *buf, size_t len)
     return r;
 }
 
+/*
+ * As midi_read(), but draining a batch and stamping its arrival
+ *
+ * The kernel does not timestamp rawmidi data for us; the stamp is
+ * taken as the batch leaves the buffer, which the caller keeps
+ * accurate by polling and draining promptly.
+ *
+ * Post: on success with n > 0, ts is the arrival time of the batch
+ */
+
+ssize_t midi_read_stamped(struct midi *m, void *buf, size_t len,
+                          struct timespec *ts)
+{
+    ssize_t z;
+
+    z = midi_read(m, buf, len);
+    if (z > 0)
+        clock_gettime(CLOCK_MONOTONIC, ts);
+
+    return z;
+}
+
 ssize_t midi_write(struct midi *m, const void *buf, size_t len)
 {
     int r;
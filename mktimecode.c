@@ -24,10 +24,17 @@
 
 #define _GNU_SOURCE /* sincos() */
 #include <assert.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <math.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #define BANNER "xwax timecode generator " \
     "(C) Copyright 2021 Mark Hills <mark@xwax.org>"
@@ -80,6 +87,247 @@ static inline double dither(void)
     return (double)(rand() % 32768) / 32768.0 - 0.5;
 }
 
+/*
+ * Synthesise one stereo frame of the modulated timecode signal
+ *
+ * The bitstream state is carried by the caller; see the serial loop
+ * in main() which this is lifted from.
+ */
+
+static void synth(unsigned long long s, bits_t b, const double noise[2],
+                  signed short c[2])
+{
+    double time, cycle, angle, modulate, x, y;
+
+    time = (double)s / RATE;
+    cycle = time * RESOLUTION;
+    angle = cycle * M_PI * 2;
+
+    sincos(angle, &x, &y);
+
+    /* Modulate the waveform according to the bitstream */
+
+    modulate = 1.0 - (-cos(angle) + 1.0) * 0.25 * ((b & 0x1) == 0);
+    x *= modulate;
+    y *= modulate;
+
+    /* 16-bit PCM data */
+
+    c[0] = -y * SHRT_MAX * 0.5 + noise[0];
+    c[1] = x * SHRT_MAX * 0.5 + noise[1];
+}
+
+/*
+ * Step the LFSR forward by the given number of cycles
+ */
+
+static bits_t seek(unsigned int cycles)
+{
+    bits_t b;
+
+    b = SEED;
+    while (cycles-- > 0)
+        b = fwd(b, TAPS, BITS);
+
+    return b;
+}
+
+/* A block of samples handed to one worker thread */
+
+struct job {
+    unsigned long long s0, s1; /* sample range */
+    signed short *pcm; /* output, s0 relative to the start */
+};
+
+/*
+ * Entry point of a worker which synthesises one range of samples
+ *
+ * Each worker seeks the LFSR to its block boundary and then runs the
+ * same per-sample loop as the serial generator. Dither comes from a
+ * thread-local generator seeded by the block, so output is
+ * deterministic for a given partitioning but not identical to the
+ * serial stream -- it is noise either way.
+ */
+
+static void* synth_worker(void *p)
+{
+    struct job *j = p;
+    unsigned long long s;
+    unsigned int r = j->s0;
+    int length;
+    bits_t b;
+
+    if (j->s0 == 0) {
+        length = 0;
+    } else {
+        length = (double)(j->s0 - 1) / RATE * RESOLUTION;
+    }
+
+    b = seek(length);
+
+    for (s = j->s0; s < j->s1; s++) {
+        double cycle, noise[2];
+        signed short c[2];
+
+        cycle = (double)s / RATE * RESOLUTION;
+
+        noise[0] = (double)(rand_r(&r) % 32768) / 32768.0 - 0.5;
+        noise[1] = (double)(rand_r(&r) % 32768) / 32768.0 - 0.5;
+        synth(s, b, noise, c);
+
+        j->pcm[(s - j->s0) * 2] = c[0];
+        j->pcm[(s - j->s0) * 2 + 1] = c[1];
+
+        /* Advance the bitstream, as the serial loop does after
+         * each sample is written */
+
+        if ((int)cycle > length) {
+            assert((int)cycle - length == 1);
+            b = fwd(b, TAPS, BITS);
+            length = cycle;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Write a canonical WAV header for 16-bit stereo PCM
+ */
+
+static void le16(unsigned char *p, uint16_t v)
+{
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+}
+
+static void le32(unsigned char *p, uint32_t v)
+{
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = (v >> 24) & 0xff;
+}
+
+static void wav_header(unsigned char *h, unsigned long long samples)
+{
+    uint32_t data = samples * 4;
+
+    memcpy(h, "RIFF", 4);
+    le32(h + 4, data + 36);
+    memcpy(h + 8, "WAVEfmt ", 8);
+    le32(h + 16, 16); /* chunk size */
+    le16(h + 20, 1); /* PCM */
+    le16(h + 22, 2); /* stereo */
+    le32(h + 24, RATE);
+    le32(h + 28, RATE * 4); /* byte rate */
+    le16(h + 32, 4); /* block align */
+    le16(h + 34, 16); /* bits per sample */
+    memcpy(h + 36, "data", 4);
+    le32(h + 40, data);
+}
+
+/*
+ * Generate the full-length signal to a WAV file, partitioned across
+ * worker threads
+ *
+ * Return: -1 on error, otherwise 0
+ */
+
+static int generate_wav(const char *path)
+{
+    unsigned long long total, n;
+    unsigned int period;
+    long nthreads;
+    size_t bytes;
+    bits_t b;
+    void *map;
+    int fd;
+
+    /* Period of the LFSR, in cycles */
+
+    period = 0;
+    b = SEED;
+    do {
+        b = fwd(b, TAPS, BITS);
+        period++;
+    } while (b != SEED);
+
+    /* The serial generator emits its last sample at the first which
+     * reaches the final cycle; reproduce that boundary exactly */
+
+    total = (double)period * RATE / RESOLUTION;
+    while ((int)((double)total / RATE * RESOLUTION) < (int)period)
+        total++;
+    while (total > 0 &&
+          (int)((double)(total - 1) / RATE * RESOLUTION) >= (int)period)
+    {
+        total--;
+    }
+    total++;
+
+    fprintf(stderr, "Generating %0.1f seconds of timecode to %s\n",
+            (double)total / RATE, path);
+
+    bytes = 44 + total * 4;
+
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        perror("open");
+        return -1;
+    }
+
+    if (ftruncate(fd, bytes) == -1) {
+        perror("ftruncate");
+        goto fail;
+    }
+
+    map = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        goto fail;
+    }
+
+    wav_header(map, total);
+
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads < 1)
+        nthreads = 1;
+
+    {
+        pthread_t th[nthreads];
+        struct job job[nthreads];
+
+        for (n = 0; n < (unsigned)nthreads; n++) {
+            job[n].s0 = total * n / nthreads;
+            job[n].s1 = total * (n + 1) / nthreads;
+            job[n].pcm = (signed short*)((char*)map + 44)
+                + job[n].s0 * 2;
+
+            if (pthread_create(&th[n], NULL, synth_worker, &job[n]) != 0)
+                abort();
+        }
+
+        for (n = 0; n < (unsigned)nthreads; n++) {
+            if (pthread_join(th[n], NULL) != 0)
+                abort();
+        }
+    }
+
+    if (munmap(map, bytes) == -1)
+        abort();
+
+    if (close(fd) == -1)
+        abort();
+
+    return 0;
+
+fail:
+    if (close(fd) == -1)
+        abort();
+    return -1;
+}
+
 int main(int argc, char *argv[])
 {
     unsigned int s;
@@ -92,30 +340,26 @@ int main(int argc, char *argv[])
     fprintf(stderr, "Generating %d-bit %dHz timecode sampled at %dKhz\n",
             BITS, RESOLUTION, RATE);
 
+    /* With a filename, synthesise the full modulated signal to a
+     * WAV in parallel; otherwise stream raw PCM to stdout */
+
+    if (argc > 1)
+        return generate_wav(argv[1]) == -1 ? 1 : 0;
+
     b = SEED;
     length = 0;
 
     for (s = 0; ; s++) {
-        double time, cycle, angle, modulate, x, y;
+        double cycle, noise[2];
         signed short c[2];
 
-        time = (double)s / RATE;
-        cycle = time * RESOLUTION;
-        angle = cycle * M_PI * 2;
-
-        sincos(angle, &x, &y);
-
-        /* Modulate the waveform according to the bitstream */
-
-        modulate = 1.0 - (-cos(angle) + 1.0) * 0.25 * ((b & 0x1) == 0);
-        x *= modulate;
-        y *= modulate;
+        cycle = (double)s / RATE * RESOLUTION;
 
         /* Write out 16-bit PCM data */
 
-        c[0] = -y * SHRT_MAX * 0.5 + dither();
-        c[1] = x * SHRT_MAX * 0.5 + dither();
-
+        noise[0] = dither();
+        noise[1] = dither();
+        synth(s, b, noise, c);
         fwrite(c, sizeof(signed short), 2, stdout);
 
         /* Advance the bitstream if required */
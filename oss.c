@@ -24,17 +24,27 @@
 #include <string.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/soundcard.h>
 
 #include "oss.h"
 
 #define FRAME 32 /* maximum read size */
 
+#define FRAME_BYTES (DEVICE_CHANNELS * sizeof(signed short))
+
 
 struct oss {
     int fd;
     struct pollfd *pe;
     unsigned int rate;
+
+    /* Memory-mapped DMA rings, or NULL to fall back on
+     * read() and write() */
+
+    signed short *imap, *omap;
+    int isize, osize, /* ring sizes (bytes) */
+        itail, ohead; /* our positions in each ring (bytes) */
 };
 
 
@@ -43,6 +53,13 @@ static void clear(struct device *dv)
     int r;
     struct oss *oss = (struct oss*)dv->local;
 
+    if (oss->imap != NULL) {
+        if (munmap(oss->imap, oss->isize) == -1)
+            abort();
+        if (munmap(oss->omap, oss->osize) == -1)
+            abort();
+    }
+
     r = close(oss->fd);
     if (r == -1) {
         perror("close");
@@ -97,12 +114,153 @@ static int pull(int fd, signed short *pcm, int samples)
 }
 
 
+/* Map both DMA rings into our address space, for zero-copy transfer.
+ * Return -1 if the hardware can't do it, and the caller falls back
+ * on read() and write() */
+
+static int map_rings(struct oss *oss)
+{
+    int p;
+    struct audio_buf_info bi;
+
+    if (ioctl(oss->fd, SNDCTL_DSP_GETCAPS, &p) == -1)
+        return -1;
+
+    if (!(p & DSP_CAP_MMAP) || !(p & DSP_CAP_TRIGGER)
+        || !(p & DSP_CAP_DUPLEX))
+    {
+        return -1;
+    }
+
+    /* Hold the transfer until both rings are in place; it is
+     * released by start() */
+
+    p = 0;
+    if (ioctl(oss->fd, SNDCTL_DSP_SETTRIGGER, &p) == -1)
+        return -1;
+
+    if (ioctl(oss->fd, SNDCTL_DSP_GETISPACE, &bi) == -1)
+        return -1;
+    oss->isize = bi.fragstotal * bi.fragsize;
+
+    if (ioctl(oss->fd, SNDCTL_DSP_GETOSPACE, &bi) == -1)
+        return -1;
+    oss->osize = bi.fragstotal * bi.fragsize;
+
+    /* The protection requested selects which of the two rings
+     * is mapped */
+
+    oss->imap = mmap(NULL, oss->isize, PROT_READ, MAP_SHARED,
+                     oss->fd, 0);
+    if (oss->imap == MAP_FAILED) {
+        oss->imap = NULL;
+        return -1;
+    }
+
+    oss->omap = mmap(NULL, oss->osize, PROT_WRITE, MAP_SHARED,
+                     oss->fd, 0);
+    if (oss->omap == MAP_FAILED) {
+        if (munmap(oss->imap, oss->isize) == -1)
+            abort();
+        oss->imap = NULL;
+        return -1;
+    }
+
+    memset(oss->omap, 0, oss->osize); /* the ring starts on silence */
+    oss->itail = 0;
+    oss->ohead = 0;
+
+    return 0;
+}
+
+
+/* Begin the transfer on the mapped rings.  The output ring is full
+ * of silence, so both directions share the trigger */
+
+static void start(struct device *dv)
+{
+    int p;
+    struct oss *oss = (struct oss*)dv->local;
+
+    if (oss->imap == NULL)
+        return;
+
+    p = PCM_ENABLE_INPUT | PCM_ENABLE_OUTPUT;
+    if (ioctl(oss->fd, SNDCTL_DSP_SETTRIGGER, &p) == -1) {
+        perror("SNDCTL_DSP_SETTRIGGER");
+        abort();
+    }
+}
+
+
+/* Exchange audio with the DMA rings in-place.  Capture is handed to
+ * the timecoder straight out of the ring, and the played part of the
+ * output ring is re-filled behind the DMA pointer; no copy in either
+ * direction */
+
+static int handle_mapped(struct device *dv)
+{
+    struct count_info c;
+    struct oss *oss = (struct oss*)dv->local;
+
+    if (!(oss->pe->revents & (POLLIN | POLLOUT)))
+        return 0;
+
+    if (ioctl(oss->fd, SNDCTL_DSP_GETIPTR, &c) == -1) {
+        perror("SNDCTL_DSP_GETIPTR");
+        return -1;
+    }
+
+    while (oss->itail != c.ptr) {
+        int bytes;
+
+        bytes = c.ptr - oss->itail;
+        if (bytes < 0)
+            bytes = oss->isize - oss->itail; /* span to end of ring */
+        bytes -= bytes % FRAME_BYTES;
+        if (bytes == 0)
+            break;
+
+        device_submit(dv, oss->imap + oss->itail / sizeof *oss->imap,
+                      bytes / FRAME_BYTES);
+
+        oss->itail = (oss->itail + bytes) % oss->isize;
+    }
+
+    if (ioctl(oss->fd, SNDCTL_DSP_GETOPTR, &c) == -1) {
+        perror("SNDCTL_DSP_GETOPTR");
+        return -1;
+    }
+
+    while (oss->ohead != c.ptr) {
+        int bytes;
+
+        bytes = c.ptr - oss->ohead;
+        if (bytes < 0)
+            bytes = oss->osize - oss->ohead;
+        bytes -= bytes % FRAME_BYTES;
+        if (bytes == 0)
+            break;
+
+        device_collect(dv, oss->omap + oss->ohead / sizeof *oss->omap,
+                       bytes / FRAME_BYTES);
+
+        oss->ohead = (oss->ohead + bytes) % oss->osize;
+    }
+
+    return 0;
+}
+
+
 static int handle(struct device *dv)
 {
     signed short pcm[FRAME * DEVICE_CHANNELS];
     int samples;
     struct oss *oss = (struct oss*)dv->local;
 
+    if (oss->imap != NULL)
+        return handle_mapped(dv);
+
     /* Check input buffer for recording */
 
     if (oss->pe->revents & POLLIN) {
@@ -152,6 +310,7 @@ static struct device_ops oss_ops = {
     .pollfds = pollfds,
     .handle = handle,
     .sample_rate = sample_rate,
+    .start = start,
     .clear = clear
 };
 
@@ -219,6 +378,10 @@ int oss_init(struct device *dv, const char *filename, unsigned int rate,
     oss->fd = fd;
     oss->pe = NULL;
     oss->rate = rate;
+    oss->imap = NULL;
+    oss->omap = NULL;
+
+    (void)map_rings(oss); /* optional; plain I/O otherwise */
 
     device_init(dv, &oss_ops);
     dv->local = oss;
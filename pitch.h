@@ -20,6 +20,8 @@
 #ifndef PITCH_H
 #define PITCH_H
 
+#include <math.h>
+
 /* Values for the filter concluded experimentally */
 
 #define ALPHA (1.0/512)
@@ -29,6 +31,12 @@
 
 struct pitch {
     double dt, x, v;
+
+    /* Constant terms for folding a batch of observations into one
+     * filter update, precomputed by pitch_init_batch() */
+
+    unsigned int batch;
+    double batch_dt, alpha_batch, beta_batch; /* beta over batch_dt */
 };
 
 /* Prepare the filter for observations every dt seconds */
@@ -38,6 +46,31 @@ static inline void pitch_init(struct pitch *p, double dt)
     p->dt = dt;
     p->x = 0.0;
     p->v = 0.0;
+
+    p->batch = 1;
+    p->batch_dt = dt;
+    p->alpha_batch = ALPHA;
+    p->beta_batch = BETA / dt;
+}
+
+/*
+ * As pitch_init(), for observations folded into batches of n
+ *
+ * The batched gains reproduce the decay the per-observation filter
+ * would apply over the same n steps; what is lost is the placement
+ * of the movement within the batch, which is far below the filter's
+ * time constants.
+ */
+
+static inline void pitch_init_batch(struct pitch *p, double dt,
+                                    unsigned int n)
+{
+    pitch_init(p, dt);
+
+    p->batch = n;
+    p->batch_dt = dt * n;
+    p->alpha_batch = 1.0 - pow(1.0 - ALPHA, n);
+    p->beta_batch = (1.0 - pow(1.0 - BETA, n)) / p->batch_dt;
 }
 
 /* Input an observation to the filter; in the last dt seconds the
@@ -61,6 +94,33 @@ static inline void pitch_dt_observation(struct pitch *p, double dx)
     p->x -= dx; /* relative to previous */
 }
 
+/* Input a batch of n observations in one update; in the last n
+ * periods of dt seconds the position has moved by dx in total.
+ *
+ * Pre: the filter was prepared with pitch_init_batch()
+ */
+
+static inline void pitch_batch_observation(struct pitch *p, double dx,
+                                           unsigned int n)
+{
+    double predicted_x, residual_x;
+
+    if (n != p->batch) { /* eg. the tail of a block */
+        if (n == 0)
+            return;
+        pitch_dt_observation(p, dx);
+        while (--n > 0)
+            pitch_dt_observation(p, 0.0);
+        return;
+    }
+
+    predicted_x = p->x + p->v * p->batch_dt;
+    residual_x = dx - predicted_x;
+
+    p->x = predicted_x + residual_x * p->alpha_batch - dx;
+    p->v = p->v + residual_x * p->beta_batch;
+}
+
 /* Get the pitch after filtering */
 
 static inline double pitch_current(struct pitch *p)
@@ -18,15 +18,33 @@
  */
 
 #include <assert.h>
+#include <errno.h>
 #include <limits.h>
 #include <math.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define RESAMPLE_DISPATCH_X86
+#endif
+
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
 #include "device.h"
+#include "export.h"
+#include "list.h"
+#include "mutex.h"
 #include "player.h"
+#include "recorder.h"
+#include "rig.h"
+#include "rtlog.h"
 #include "track.h"
 #include "timecoder.h"
 
@@ -51,6 +69,34 @@
 #define SQ(x) ((x)*(x))
 #define TARGET_UNKNOWN INFINITY
 
+static void flush_deferred(struct player *pl);
+
+/* Position within the track as a 32.32 fixed-point sample count.
+ * The resamplers accumulate this instead of a double, so the hot
+ * loop updates position with integer arithmetic only and carries no
+ * rounding drift across a period */
+
+typedef int64_t phase_t;
+
+#define PHASE_ONE ((phase_t)1 << 32)
+
+static inline phase_t phase_of(double sample)
+{
+    return (phase_t)(sample * PHASE_ONE);
+}
+
+/* The arithmetic shift floors correctly for negative positions */
+
+static inline int phase_index(phase_t p)
+{
+    return p >> 32;
+}
+
+static inline double phase_frac(phase_t p)
+{
+    return (uint32_t)p * (1.0 / 4294967296.0);
+}
+
 /*
  * Return: the cubic interpolation of the sample at position 2 + mu
  */
@@ -94,11 +140,365 @@ static double dither(void)
     return (double)v / 4096 - 0.5; /* not quite whole range */
 }
 
+/*
+ * Fill the given buffer with dither values, used to feed the vector
+ * resamplers from the same LFSR as the scalar code
+ */
+
+static void dither_block(float *v, unsigned n)
+{
+    unsigned i;
+
+    for (i = 0; i < n; i++)
+        v[i] = dither();
+}
+
+/* The vector resamplers handle a fixed-size group of output frames
+ * per call. The tap windows are laid out tap-major, so that one tap
+ * across all frames of one channel is contiguous in memory */
+
+#define VECTOR_FRAMES 4
+
+struct resample_block {
+    float w[4][PLAYER_CHANNELS * VECTOR_FRAMES],
+        mu[PLAYER_CHANNELS * VECTOR_FRAMES];
+};
+
+typedef void resample_fn(signed short *pcm, const struct resample_block *b,
+                         double vol, double gradient);
+
+/* Kernel in use, chosen at runtime; NULL means scalar code only */
+
+static resample_fn *resample_vector = NULL;
+
+/*
+ * Gather the interpolation windows for a group of output frames
+ *
+ * Pre: all taps are within the track
+ */
+
+static void gather_block(struct resample_block *b, struct track *tr,
+                         phase_t phase, phase_t step)
+{
+    int f;
+
+    for (f = 0; f < VECTOR_FRAMES; f++) {
+        int sa, q, c;
+        double m;
+
+        sa = phase_index(phase);
+        m = phase_frac(phase);
+        sa--;
+
+        for (c = 0; c < PLAYER_CHANNELS; c++)
+            b->mu[c * VECTOR_FRAMES + f] = m;
+
+        for (q = 0; q < 4; q++) {
+            signed short *ts;
+
+            ts = track_get_sample(tr, sa + q);
+            for (c = 0; c < PLAYER_CHANNELS; c++)
+                b->w[q][c * VECTOR_FRAMES + f] = ts[c];
+        }
+
+        phase += step;
+    }
+}
+
+#ifdef RESAMPLE_DISPATCH_X86
+
+/*
+ * Cubic interpolation of one group of frames, 4 lanes per channel
+ *
+ * Equivalent to the scalar code: evaluate the interpolation
+ * polynomial, apply the volume ramp and dither, and clamp into the
+ * 16-bit range (via the saturating pack) before interleaving the
+ * channels into the output buffer.
+ */
+
+__attribute__((target("sse2")))
+static void resample_block_sse2(signed short *pcm,
+                                const struct resample_block *b,
+                                double vol, double gradient)
+{
+    __m128 ramp;
+    __m128i i32[PLAYER_CHANNELS], lo, hi;
+    float d[PLAYER_CHANNELS * VECTOR_FRAMES];
+    int c;
+
+    dither_block(d, PLAYER_CHANNELS * VECTOR_FRAMES);
+
+    ramp = _mm_add_ps(_mm_set1_ps(vol),
+                      _mm_mul_ps(_mm_set1_ps(gradient),
+                                 _mm_setr_ps(0.0, 1.0, 2.0, 3.0)));
+
+    for (c = 0; c < PLAYER_CHANNELS; c++) {
+        __m128 y0, y1, y2, y3, a0, a1, a2, mu, v;
+
+        y0 = _mm_loadu_ps(&b->w[0][c * VECTOR_FRAMES]);
+        y1 = _mm_loadu_ps(&b->w[1][c * VECTOR_FRAMES]);
+        y2 = _mm_loadu_ps(&b->w[2][c * VECTOR_FRAMES]);
+        y3 = _mm_loadu_ps(&b->w[3][c * VECTOR_FRAMES]);
+        mu = _mm_loadu_ps(&b->mu[c * VECTOR_FRAMES]);
+
+        a0 = _mm_add_ps(_mm_sub_ps(_mm_sub_ps(y3, y2), y0), y1);
+        a1 = _mm_sub_ps(_mm_sub_ps(y0, y1), a0);
+        a2 = _mm_sub_ps(y2, y0);
+
+        v = _mm_add_ps(_mm_mul_ps(a0, mu), a1);
+        v = _mm_add_ps(_mm_mul_ps(v, mu), a2);
+        v = _mm_add_ps(_mm_mul_ps(v, mu), y1);
+
+        v = _mm_add_ps(_mm_mul_ps(v, ramp),
+                       _mm_loadu_ps(&d[c * VECTOR_FRAMES]));
+
+        i32[c] = _mm_cvtps_epi32(v);
+    }
+
+    lo = _mm_packs_epi32(i32[0], i32[0]);
+    hi = _mm_packs_epi32(i32[1], i32[1]);
+    _mm_storeu_si128((__m128i*)pcm, _mm_unpacklo_epi16(lo, hi));
+}
+
+/*
+ * As above, but using a single 8-lane pass over both channels
+ */
+
+__attribute__((target("avx2,fma")))
+static void resample_block_avx2(signed short *pcm,
+                                const struct resample_block *b,
+                                double vol, double gradient)
+{
+    __m256 y0, y1, y2, y3, a0, a1, a2, mu, v, ramp4, ramp;
+    __m256i i32;
+    __m128i lo, hi;
+    float d[PLAYER_CHANNELS * VECTOR_FRAMES];
+
+    dither_block(d, PLAYER_CHANNELS * VECTOR_FRAMES);
+
+    /* The same volume ramp applies to both channel halves */
+
+    ramp4 = _mm256_setr_ps(0.0, 1.0, 2.0, 3.0, 0.0, 1.0, 2.0, 3.0);
+    ramp = _mm256_fmadd_ps(_mm256_set1_ps(gradient), ramp4,
+                           _mm256_set1_ps(vol));
+
+    y0 = _mm256_loadu_ps(b->w[0]);
+    y1 = _mm256_loadu_ps(b->w[1]);
+    y2 = _mm256_loadu_ps(b->w[2]);
+    y3 = _mm256_loadu_ps(b->w[3]);
+    mu = _mm256_loadu_ps(b->mu);
+
+    a0 = _mm256_add_ps(_mm256_sub_ps(_mm256_sub_ps(y3, y2), y0), y1);
+    a1 = _mm256_sub_ps(_mm256_sub_ps(y0, y1), a0);
+    a2 = _mm256_sub_ps(y2, y0);
+
+    v = _mm256_fmadd_ps(a0, mu, a1);
+    v = _mm256_fmadd_ps(v, mu, a2);
+    v = _mm256_fmadd_ps(v, mu, y1);
+
+    v = _mm256_fmadd_ps(v, ramp, _mm256_loadu_ps(d));
+
+    i32 = _mm256_cvtps_epi32(v);
+
+    lo = _mm_packs_epi32(_mm256_castsi256_si128(i32),
+                         _mm256_castsi256_si128(i32));
+    hi = _mm_packs_epi32(_mm256_extracti128_si256(i32, 1),
+                         _mm256_extracti128_si256(i32, 1));
+    _mm_storeu_si128((__m128i*)pcm, _mm_unpacklo_epi16(lo, hi));
+}
+
+#endif
+
+#ifdef __ARM_NEON
+
+static void resample_block_neon(signed short *pcm,
+                                const struct resample_block *b,
+                                double vol, double gradient)
+{
+    float32x4_t ramp;
+    int16x4x2_t out;
+    float d[PLAYER_CHANNELS * VECTOR_FRAMES];
+    static const float lane[VECTOR_FRAMES] = { 0.0, 1.0, 2.0, 3.0 };
+    int c;
+
+    dither_block(d, PLAYER_CHANNELS * VECTOR_FRAMES);
+
+    ramp = vmlaq_n_f32(vdupq_n_f32(vol), vld1q_f32(lane), gradient);
+
+    for (c = 0; c < PLAYER_CHANNELS; c++) {
+        float32x4_t y0, y1, y2, y3, a0, a1, a2, mu, v;
+
+        y0 = vld1q_f32(&b->w[0][c * VECTOR_FRAMES]);
+        y1 = vld1q_f32(&b->w[1][c * VECTOR_FRAMES]);
+        y2 = vld1q_f32(&b->w[2][c * VECTOR_FRAMES]);
+        y3 = vld1q_f32(&b->w[3][c * VECTOR_FRAMES]);
+        mu = vld1q_f32(&b->mu[c * VECTOR_FRAMES]);
+
+        a0 = vaddq_f32(vsubq_f32(vsubq_f32(y3, y2), y0), y1);
+        a1 = vsubq_f32(vsubq_f32(y0, y1), a0);
+        a2 = vsubq_f32(y2, y0);
+
+        v = vmlaq_f32(a1, a0, mu);
+        v = vmlaq_f32(a2, v, mu);
+        v = vmlaq_f32(y1, v, mu);
+
+        v = vmlaq_f32(vld1q_f32(&d[c * VECTOR_FRAMES]), v, ramp);
+
+        out.val[c] = vqmovn_s32(vcvtq_s32_f32(v));
+    }
+
+    vst2_s16(pcm, out); /* interleave the channels */
+}
+
+#endif
+
+/* Polyphase windowed-sinc filter bank, for the higher-quality
+ * interpolation mode. The bank is indexed by the fractional sample
+ * position quantised to SINC_PHASES steps; each phase is a short FIR
+ * whose taps are a Blackman-windowed sinc. The whole table is a few
+ * kilobytes and stays cache-resident */
+
+#define SINC_PHASE_BITS 7
+#define SINC_PHASES (1 << SINC_PHASE_BITS)
+#define SINC_TAPS 16
+
+/* Cutoff below Nyquist, leaving a transition band for the window */
+
+#define SINC_CUTOFF 0.9
+
+static float sinc_table[SINC_PHASES][SINC_TAPS];
+
+/*
+ * Build the polyphase filter bank
+ *
+ * Done once, via player_init(), so that no libm calls are
+ * made during playback.
+ */
+
+static void sinc_init(void)
+{
+    static bool done = false;
+    int p, t;
+
+    if (done)
+        return;
+
+    for (p = 0; p < SINC_PHASES; p++) {
+        double frac, sum;
+
+        frac = (double)p / SINC_PHASES;
+        sum = 0.0;
+
+        for (t = 0; t < SINC_TAPS; t++) {
+            double x, sinc, window;
+
+            /* Tap offset from the ideal (fractional) position */
+
+            x = t - (SINC_TAPS / 2 - 1) - frac;
+
+            if (x == 0.0) {
+                sinc = SINC_CUTOFF;
+            } else {
+                sinc = sin(M_PI * SINC_CUTOFF * x) / (M_PI * x);
+            }
+
+            window = 0.42
+                - 0.5 * cos(2 * M_PI * (t + 1 - frac) / (SINC_TAPS + 1))
+                + 0.08 * cos(4 * M_PI * (t + 1 - frac) / (SINC_TAPS + 1));
+
+            sinc_table[p][t] = sinc * window;
+            sum += sinc_table[p][t];
+        }
+
+        /* Normalise to unity gain at DC, otherwise the quantised
+         * phases produce audible level ripple */
+
+        for (t = 0; t < SINC_TAPS; t++)
+            sinc_table[p][t] /= sum;
+    }
+
+    done = true;
+}
+
+/*
+ * Resample one output frame using the windowed-sinc filter bank
+ *
+ * Pre: all taps are within the track
+ */
+
+static void resample_frame_sinc(signed short *pcm, struct track *tr,
+                                phase_t phase, double vol)
+{
+    int sa, t, c, p;
+    float acc[PLAYER_CHANNELS];
+    const float *w;
+
+    sa = phase_index(phase);
+    sa -= SINC_TAPS / 2 - 1;
+
+    /* The top fractional bits select the filter phase directly */
+
+    p = (uint32_t)phase >> (32 - SINC_PHASE_BITS);
+    w = sinc_table[p];
+
+    for (c = 0; c < PLAYER_CHANNELS; c++)
+        acc[c] = 0.0;
+
+    for (t = 0; t < SINC_TAPS; t++) {
+        signed short *ts;
+
+        ts = track_get_sample(tr, sa + t);
+        for (c = 0; c < PLAYER_CHANNELS; c++)
+            acc[c] += w[t] * ts[c];
+    }
+
+    for (c = 0; c < PLAYER_CHANNELS; c++) {
+        double v;
+
+        v = vol * acc[c] + dither();
+
+        if (v > SHRT_MAX) {
+            *pcm++ = SHRT_MAX;
+        } else if (v < SHRT_MIN) {
+            *pcm++ = SHRT_MIN;
+        } else {
+            *pcm++ = (signed short)v;
+        }
+    }
+}
+
+/*
+ * Choose the resampling kernel for this machine
+ */
+
+static void resample_init(void)
+{
+    static bool done = false;
+
+    if (done)
+        return;
+
+#if defined(RESAMPLE_DISPATCH_X86)
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        resample_vector = resample_block_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        resample_vector = resample_block_sse2;
+    }
+#elif defined(__ARM_NEON)
+    resample_vector = resample_block_neon;
+#endif
+
+    done = true;
+}
+
 /*
  * Build a block of PCM audio, resampled from the track
  *
  * This is just a basic resampler which has a small amount of aliasing
- * where pitch > 1.0.
+ * where pitch > 1.0.  Where the interpolation windows fall safely
+ * inside the track, whole groups of output frames are handed to a
+ * vector kernel; the scalar code handles the remainder and the edges
+ * of the track.
  *
  * Return: number of seconds advanced in the source audio track
  * Post: buffer at pcm is filled with the given number of samples
@@ -106,28 +506,72 @@ static double dither(void)
 
 static double build_pcm(signed short *pcm, unsigned samples, double sample_dt,
                         struct track *tr, double position, double pitch,
-                        double start_vol, double end_vol)
+                        double start_vol, double end_vol,
+                        enum player_interp interp)
 {
-    int s;
-    double sample, step, vol, gradient;
+    unsigned s;
+    double vol, gradient;
+    phase_t phase, step;
 
-    sample = position * tr->rate;
-    step = sample_dt * pitch * tr->rate;
+    phase = phase_of(position * tr->rate);
+    step = phase_of(sample_dt * pitch * tr->rate);
 
     vol = start_vol;
     gradient = (end_vol - start_vol) / samples;
 
-    for (s = 0; s < samples; s++) {
+    s = 0;
+
+    while (s < samples) {
         int c, sa, q;
         double f;
         signed short i[PLAYER_CHANNELS][4];
 
+        if (interp == PLAYER_SINC &&
+            phase >= (phase_t)(SINC_TAPS / 2) * PHASE_ONE &&
+            phase < ((phase_t)tr->length - SINC_TAPS / 2) * PHASE_ONE)
+        {
+            resample_frame_sinc(pcm, tr, phase, vol);
+
+            pcm += PLAYER_CHANNELS;
+            phase += step;
+            vol += gradient;
+            s++;
+
+            continue;
+        }
+
+        if (interp == PLAYER_CUBIC && resample_vector != NULL &&
+            samples - s >= VECTOR_FRAMES)
+        {
+            phase_t lo, hi;
+
+            if (step >= 0) {
+                lo = phase;
+                hi = phase + step * (VECTOR_FRAMES - 1);
+            } else {
+                lo = phase + step * (VECTOR_FRAMES - 1);
+                hi = phase;
+            }
+
+            if (lo >= PHASE_ONE && hi < ((phase_t)tr->length - 2) * PHASE_ONE) {
+                struct resample_block b;
+
+                gather_block(&b, tr, phase, step);
+                resample_vector(pcm, &b, vol, gradient);
+
+                pcm += VECTOR_FRAMES * PLAYER_CHANNELS;
+                phase += step * VECTOR_FRAMES;
+                vol += gradient * VECTOR_FRAMES;
+                s += VECTOR_FRAMES;
+
+                continue;
+            }
+        }
+
         /* 4-sample window for interpolation */
 
-        sa = (int)sample;
-        if (sample < 0.0)
-            sa--;
-        f = sample - sa;
+        sa = phase_index(phase);
+        f = phase_frac(phase);
         sa--;
 
         for (q = 0; q < 4; q++, sa++) {
@@ -158,28 +602,14 @@ static double build_pcm(signed short *pcm, unsigned samples, double sample_dt,
             }
         }
 
-        sample += step;
+        phase += step;
         vol += gradient;
+        s++;
     }
 
     return sample_dt * pitch * samples;
 }
 
-/*
- * Equivalent to build_pcm, but for use when the track is
- * not available
- *
- * Return: number of seconds advanced in the audio track
- * Post: buffer at pcm is filled with silence
- */
-
-static double build_silence(signed short *pcm, unsigned samples,
-                            double sample_dt, double pitch)
-{
-    memset(pcm, '\0', sizeof(*pcm) * PLAYER_CHANNELS * samples);
-    return sample_dt * pitch * samples;
-}
-
 /*
  * Change the timecoder used by this playback
  */
@@ -202,10 +632,12 @@ void player_init(struct player *pl, unsigned int sample_rate,
     assert(track != NULL);
     assert(sample_rate != 0);
 
-    spin_init(&pl->lock);
+    resample_init();
+    sinc_init();
 
     pl->sample_dt = 1.0 / sample_rate;
     pl->track = track;
+    pl->collects = 0;
     player_set_timecoder(pl, tc);
 
     pl->position = 0.0;
@@ -216,6 +648,22 @@ void player_init(struct player *pl, unsigned int sample_rate,
     pl->pitch = 0.0;
     pl->sync_pitch = 1.0;
     pl->volume = 0.0;
+
+    pl->sync_master = NULL;
+    pl->sync_offset = 0.0;
+
+    pl->export = NULL;
+    pl->recorder = NULL;
+
+    pl->interp = PLAYER_CUBIC;
+
+    pl->looping = false;
+    pl->loop_start = 0.0;
+    pl->loop_end = 0.0;
+    pl->roll_offset = 0.0;
+
+    pl->deferred_seek = false;
+    pl->seek_seconds = 0.0;
 }
 
 /*
@@ -225,7 +673,7 @@ void player_init(struct player *pl, unsigned int sample_rate,
 
 void player_clear(struct player *pl)
 {
-    spin_clear(&pl->lock);
+    flush_deferred(pl);
     track_release(pl->track);
 }
 
@@ -260,6 +708,32 @@ void player_set_internal_playback(struct player *pl)
     pl->pitch = 1.0;
 }
 
+/*
+ * Set the interpolation used to resample this deck
+ */
+
+void player_set_interp(struct player *pl, enum player_interp interp)
+{
+    pl->interp = interp;
+}
+
+/*
+ * Toggle between the interpolation modes
+ *
+ * Return: the new interpolation mode
+ */
+
+enum player_interp player_toggle_interp(struct player *pl)
+{
+    if (pl->interp == PLAYER_CUBIC) {
+        pl->interp = PLAYER_SINC;
+    } else {
+        pl->interp = PLAYER_CUBIC;
+    }
+
+    return pl->interp;
+}
+
 double player_get_position(struct player *pl)
 {
     return pl->position;
@@ -290,6 +764,110 @@ void player_recue(struct player *pl)
     pl->offset = pl->position;
 }
 
+/* Tracks retired from a player by an atomic swap. The reference is
+ * dropped by the rig thread once the audio callback is known to have
+ * moved on to the new track */
+
+struct deferred {
+    struct list deferred;
+    struct player *pl;
+    struct track *track;
+    unsigned int collects; /* player collect count when retired */
+};
+
+static struct list deferred = LIST_INIT(deferred);
+static mutex deferred_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Swap the track in use by the playback thread
+ *
+ * The old track cannot be released here: the audio callback may
+ * still be part-way through a collect cycle using it. Instead it is
+ * queued, and released once a further collect cycle has completed.
+ *
+ * Pre: caller holds reference on track
+ */
+
+static void swap_track(struct player *pl, struct track *track)
+{
+    struct deferred *d;
+
+    d = malloc(sizeof *d);
+    if (d == NULL)
+        abort();
+
+    d->pl = pl;
+    d->track = __atomic_exchange_n(&pl->track, track, __ATOMIC_ACQ_REL);
+    d->collects = __atomic_load_n(&pl->collects, __ATOMIC_ACQUIRE);
+
+    mutex_lock(&deferred_lock);
+    list_add_tail(&d->deferred, &deferred);
+    mutex_unlock(&deferred_lock);
+
+    rig_awaken(); /* schedule player_release_deferred() */
+}
+
+/*
+ * Release tracks which the audio callback has finished with
+ *
+ * A track retired in the middle of a collect cycle is safe to
+ * release only when a further whole cycle has completed. Whilst
+ * audio is stopped the reference is simply held.
+ *
+ * Pre: current thread is not realtime
+ * Return: true if releases remain pending, otherwise false
+ */
+
+bool player_release_deferred(void)
+{
+    struct deferred *d, *x;
+    bool pending;
+
+    rt_not_allowed();
+
+    mutex_lock(&deferred_lock);
+
+    list_for_each_safe(d, x, &deferred, deferred) {
+        unsigned int now;
+
+        now = __atomic_load_n(&d->pl->collects, __ATOMIC_ACQUIRE);
+        if ((signed int)(now - d->collects) > 0) {
+            list_del(&d->deferred);
+            track_release(d->track);
+            free(d);
+        }
+    }
+
+    pending = !list_empty(&deferred);
+
+    mutex_unlock(&deferred_lock);
+
+    return pending;
+}
+
+/*
+ * Release deferred tracks belonging to this player, without waiting
+ *
+ * Used on shutdown, when the audio thread has already stopped.
+ */
+
+static void flush_deferred(struct player *pl)
+{
+    struct deferred *d, *x;
+
+    mutex_lock(&deferred_lock);
+
+    list_for_each_safe(d, x, &deferred, deferred) {
+        if (d->pl == pl) {
+            list_del(&d->deferred);
+            track_release(d->track);
+            free(d);
+        }
+    }
+
+    mutex_unlock(&deferred_lock);
+}
+
 /*
  * Set the track used for the playback
  *
@@ -299,17 +877,10 @@ void player_recue(struct player *pl)
 
 void player_set_track(struct player *pl, struct track *track)
 {
-    struct track *x;
-
     assert(track != NULL);
     assert(track->refcount > 0);
 
-    spin_lock(&pl->lock); /* Synchronise with the playback thread */
-    x = pl->track;
-    pl->track = track;
-    spin_unlock(&pl->lock);
-
-    track_release(x); /* discard the old track */
+    swap_track(pl, track);
 }
 
 /*
@@ -320,7 +891,7 @@ void player_set_track(struct player *pl, struct track *track)
 void player_clone(struct player *pl, const struct player *from)
 {
     double elapsed;
-    struct track *x, *t;
+    struct track *t;
 
     elapsed = from->position - from->offset;
     pl->offset = pl->position - elapsed;
@@ -328,12 +899,7 @@ void player_clone(struct player *pl, const struct player *from)
     t = from->track;
     track_acquire(t);
 
-    spin_lock(&pl->lock);
-    x = pl->track;
-    pl->track = t;
-    spin_unlock(&pl->lock);
-
-    track_release(x);
+    swap_track(pl, t);
 }
 
 /*
@@ -371,6 +937,84 @@ static int sync_to_timecode(struct player *pl)
     return 0;
 }
 
+/*
+ * Synchronise to the position and speed of another player
+ *
+ * The master's state is written by its own audio thread; we make
+ * plain reads of it, the same as the user interface does to draw a
+ * deck. A torn read is possible in principle, but the bias only ever
+ * chases the target, so it self-corrects on the next cycle.
+ */
+
+static void sync_to_master(struct player *pl, const struct player *master)
+{
+    double elapsed;
+
+    elapsed = master->position - master->offset;
+
+    /* Follow the master's effective speed, and place our target at
+     * the engaged distance from its position. The bias mechanism of
+     * retarget() then holds the phase, cycle by cycle, with no
+     * further work in the audio path */
+
+    pl->pitch = master->pitch * master->sync_pitch;
+    pl->target_position = pl->offset + elapsed + pl->sync_offset;
+}
+
+/*
+ * Slave this deck's playback to another, or pass NULL to release it
+ *
+ * Pre: master is not this player
+ */
+
+void player_set_sync(struct player *pl, struct player *master)
+{
+    assert(master != pl);
+
+    if (master != NULL) {
+
+        /* Capture the relative position, so that engaging sync holds
+         * the current phase rather than seeking; the operator lines
+         * the tracks up once and sync keeps them there */
+
+        pl->sync_offset = (pl->position - pl->offset)
+            - (master->position - master->offset);
+        pl->timecode_control = false;
+    }
+
+    __atomic_store_n(&pl->sync_master, master, __ATOMIC_RELEASE);
+}
+
+/*
+ * Toggle synchronisation to the given master
+ *
+ * Return: the new state of synchronisation
+ */
+
+bool player_toggle_sync(struct player *pl, struct player *master)
+{
+    const struct player *m;
+
+    if (pl->sync_master != NULL) {
+        player_set_sync(pl, NULL);
+        return false;
+    }
+
+    if (master == NULL)
+        return false; /* no deck to sync to */
+
+    /* Refuse a master which is slaved to us, directly or via a
+     * chain; a cycle would leave no deck defining the tempo */
+
+    for (m = master; m != NULL; m = m->sync_master) {
+        if (m == pl)
+            return false;
+    }
+
+    player_set_sync(pl, master);
+    return true;
+}
+
 /*
  * Synchronise to the position given by the timecoder without
  * affecting the audio playback position
@@ -403,7 +1047,7 @@ void retarget(struct player *pl)
         /* Jump the track to the time */
 
         pl->position = pl->target_position;
-        fprintf(stderr, "Seek to new position %.2lfs.\n", pl->position);
+        rtlog("Seek to new position %.2fs.\n", pl->position, 0);
 
     } else if (fabs(pl->pitch) > SYNC_PITCH) {
 
@@ -424,6 +1068,71 @@ void player_seek_to(struct player *pl, double seconds)
     pl->offset = pl->position - seconds;
 }
 
+/*
+ * As player_seek_to(), but timed: the seek lands at the sample
+ * offset inside the next collected block which makes the latency
+ * since the operator acted a constant one block. Applied at a block
+ * boundary instead, a cue press would land with up to a whole block
+ * of jitter.
+ *
+ * No locks; the audio callback acts on the flag only after the
+ * position and time are visible.
+ */
+
+void player_seek_at(struct player *pl, double seconds,
+                    const struct timespec *when)
+{
+    pl->seek_seconds = seconds;
+    pl->seek_time = *when;
+    __atomic_store_n(&pl->deferred_seek, true, __ATOMIC_RELEASE);
+}
+
+/*
+ * Engage a loop between the given points of the track
+ *
+ * No locks and no allocation; the loop is position arithmetic only.
+ * The audio callback acts on the flag only after the bounds are
+ * visible.
+ */
+
+void player_set_loop(struct player *pl, double start, double end)
+{
+    assert(end > start);
+
+    pl->loop_start = start;
+    pl->loop_end = end;
+
+    __atomic_store_n(&pl->looping, true, __ATOMIC_RELEASE);
+}
+
+void player_clear_loop(struct player *pl)
+{
+    __atomic_store_n(&pl->looping, false, __ATOMIC_RELEASE);
+}
+
+/*
+ * Begin a loop roll: a loop which, when ended, returns playback to
+ * where it would otherwise have been
+ */
+
+void player_begin_roll(struct player *pl, double length)
+{
+    double e;
+
+    if (pl->looping) /* re-trigger whilst rolling; keep the offset */
+        return;
+
+    e = player_get_elapsed(pl);
+    pl->roll_offset = pl->offset;
+    player_set_loop(pl, e, e + length);
+}
+
+void player_end_roll(struct player *pl)
+{
+    player_clear_loop(pl);
+    pl->offset = pl->roll_offset;
+}
+
 /*
  * Get a block of PCM audio data to send to the soundcard
  *
@@ -436,15 +1145,49 @@ void player_seek_to(struct player *pl, double seconds)
 
 void player_collect(struct player *pl, signed short *pcm, unsigned samples)
 {
-    double r, pitch, dt, target_volume;
+    double pitch, dt, target_volume, vol;
+    unsigned done, seek_at;
+    bool looping;
+    struct track *tr;
 
     dt = pl->sample_dt * samples;
+    looping = __atomic_load_n(&pl->looping, __ATOMIC_ACQUIRE);
+
+    /* Place any timed seek within this block, so that it lands a
+     * constant one block after the operator acted */
+
+    seek_at = samples; /* none */
+
+    if (__atomic_load_n(&pl->deferred_seek, __ATOMIC_ACQUIRE)) {
+        struct timespec now;
+        double age;
+        unsigned back;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        age = (now.tv_sec - pl->seek_time.tv_sec)
+            + (now.tv_nsec - pl->seek_time.tv_nsec) / 1e9;
+
+        back = age > 0.0 ? age / pl->sample_dt : 0;
+        seek_at = back < samples ? samples - back : 0;
+    }
 
     if (pl->timecode_control) {
         if (sync_to_timecode(pl) == -1)
             pl->timecode_control = false;
+    } else {
+        struct player *master;
+
+        master = __atomic_load_n(&pl->sync_master, __ATOMIC_ACQUIRE);
+        if (master != NULL)
+            sync_to_master(pl, master);
     }
 
+    /* Whilst looping, follow only the timecoder's pitch; an absolute
+     * position would fight the loop by seeking back out of it */
+
+    if (looping)
+        pl->target_position = TARGET_UNKNOWN;
+
     if (pl->target_position != TARGET_UNKNOWN) {
 
         /* Bias the pitch towards a known target, and acknowledge that
@@ -469,18 +1212,82 @@ void player_collect(struct player *pl, signed short *pcm, unsigned samples)
 
     pitch = pl->pitch * pl->sync_pitch;
 
-    /* We must return audio immediately to stay realtime. A spin
-     * lock protects us from changes to the audio source */
+    /* We must return audio immediately to stay realtime. The track
+     * is swapped atomically by other threads and its release is
+     * deferred, so the pointer stays valid for this whole cycle and
+     * no lock is taken; see swap_track() */
 
-    if (!spin_try_lock(&pl->lock)) {
-        r = build_silence(pcm, samples, pl->sample_dt, pitch);
-    } else {
-        r = build_pcm(pcm, samples, pl->sample_dt, pl->track,
+    tr = __atomic_load_n(&pl->track, __ATOMIC_ACQUIRE);
+
+    /* Build the audio, splitting the period where playback crosses
+     * the loop boundary. The wrap is a step of the offset, so there
+     * is no per-sample test in the resampler */
+
+    done = 0;
+    vol = pl->volume;
+
+    while (done < samples) {
+        unsigned n;
+        double r, end_vol;
+
+        if (done == seek_at) {
+            pl->offset = pl->position - pl->seek_seconds;
+            __atomic_store_n(&pl->deferred_seek, false, __ATOMIC_RELEASE);
+            seek_at = samples;
+        }
+
+        n = samples - done;
+        if (done < seek_at && seek_at < samples)
+            n = seek_at - done;
+
+        if (looping && pitch > 0.0) {
+            double p, until;
+
+            p = pl->position - pl->offset;
+            if (p >= pl->loop_end) {
+                pl->offset += pl->loop_end - pl->loop_start;
+                p = pl->position - pl->offset;
+            }
+
+            until = (pl->loop_end - p) / (pl->sample_dt * pitch);
+
+            if (until < 1.0)
+                until = 1.0; /* degenerate loop; make progress */
+            if (until < n)
+                n = until;
+        }
+
+        end_vol = pl->volume
+            + (target_volume - pl->volume) * (done + n) / samples;
+
+        r = build_pcm(pcm + done * PLAYER_CHANNELS, n, pl->sample_dt, tr,
                       pl->position - pl->offset, pitch,
-                      pl->volume, target_volume);
-        spin_unlock(&pl->lock);
+                      vol, end_vol, pl->interp);
+
+        pl->position += r;
+        vol = end_vol;
+        done += n;
     }
 
-    pl->position += r;
     pl->volume = target_volume;
+
+    /* Note the playback frontier on the track; a hint for the rig,
+     * which services the import closest to running dry first */
+
+    if (pl->position > pl->offset)
+        tr->demand = (pl->position - pl->offset) * tr->rate;
+
+    /* Publish position for external visualisers */
+
+    export_tick(pl->export, pl->position - pl->offset, pitch);
+
+    /* Tap the output for recording; appends to a ring, no I/O */
+
+    if (pl->recorder != NULL)
+        recorder_submit(pl->recorder, pcm, samples);
+
+    /* Mark the completed cycle, which allows retired tracks to be
+     * released by the rig thread */
+
+    __atomic_store_n(&pl->collects, pl->collects + 1, __ATOMIC_RELEASE);
 }
@@ -21,17 +21,31 @@
 #define PLAYER_H
 
 #include <stdbool.h>
+#include <time.h>
 
-#include "spin.h"
 #include "track.h"
 
+struct export_deck;
+struct recorder;
+
 #define PLAYER_CHANNELS 2
 
+/* Interpolation used to resample the track */
+
+enum player_interp {
+    PLAYER_CUBIC, /* lightweight, some aliasing when pitch > 1.0 */
+    PLAYER_SINC /* polyphase windowed-sinc filter bank */
+};
+
 struct player {
     double sample_dt;
 
-    spin lock;
+    /* Swapped atomically by other threads; the old track is retired
+     * to the rig thread for release, so the audio callback never
+     * takes a lock. See player_release_deferred() */
+
     struct track *track;
+    unsigned int collects; /* collect cycles completed, by audio thread */
 
     /* Current playback parameters */
 
@@ -43,11 +57,42 @@ struct player {
         sync_pitch, /* pitch required to sync to timecode signal */
         volume;
 
+    enum player_interp interp;
+
+    /* Loop, in track time. The bounds are written by other threads
+     * and read by the audio callback; see player_set_loop() */
+
+    bool looping;
+    double loop_start, loop_end,
+        roll_offset; /* offset to restore after a loop roll */
+
+    /* A seek scheduled to land at a sample offset inside the next
+     * collected block; see player_seek_at() */
+
+    bool deferred_seek;
+    double seek_seconds;
+    struct timespec seek_time; /* when the operator acted */
+
     /* Timecode control */
 
     struct timecoder *timecoder;
     bool timecode_control,
         recalibrate; /* re-sync offset at next opportunity */
+
+    /* Deck to slave our playback to, or NULL. Set atomically by
+     * other threads; see player_set_sync() */
+
+    struct player *sync_master;
+    double sync_offset; /* relative position held whilst synced */
+
+    /* Shared-memory slot for external visualisers, or NULL */
+
+    struct export_deck *export;
+
+    /* Sink for the audio sent to this deck's output, or NULL.
+     * Connected before the realtime thread starts */
+
+    struct recorder *recorder;
 };
 
 void player_init(struct player *pl, unsigned int sample_rate,
@@ -59,6 +104,12 @@ void player_set_timecode_control(struct player *pl, bool on);
 bool player_toggle_timecode_control(struct player *pl);
 void player_set_internal_playback(struct player *pl);
 
+void player_set_sync(struct player *pl, struct player *master);
+bool player_toggle_sync(struct player *pl, struct player *master);
+
+void player_set_interp(struct player *pl, enum player_interp interp);
+enum player_interp player_toggle_interp(struct player *pl);
+
 void player_set_track(struct player *pl, struct track *track);
 void player_clone(struct player *pl, const struct player *from);
 
@@ -68,8 +119,17 @@ double player_get_remain(struct player *pl);
 bool player_is_active(const struct player *pl);
 
 void player_seek_to(struct player *pl, double seconds);
+void player_seek_at(struct player *pl, double seconds,
+                    const struct timespec *when);
 void player_recue(struct player *pl);
 
+void player_set_loop(struct player *pl, double start, double end);
+void player_clear_loop(struct player *pl);
+void player_begin_roll(struct player *pl, double length);
+void player_end_roll(struct player *pl);
+
 void player_collect(struct player *pl, signed short *pcm, unsigned samples);
 
+bool player_release_deferred(void);
+
 #endif
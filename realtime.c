@@ -17,10 +17,15 @@
  *
  */
 
+#define _GNU_SOURCE /* pthread_setaffinity_np() */
+
 #include <assert.h>
 #include <errno.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "controller.h"
 #include "debug.h"
@@ -62,15 +67,41 @@ static int raise_priority(int priority)
 }
 
 /*
- * The realtime thread
+ * Pin the current thread to a single CPU
+ *
+ * Isolates this thread from cache and scheduling interference by
+ * the non-realtime threads (eg. the SDL interface.)
+ *
+ * Return: -1 if the affinity could not be set, otherwise 0
+ */
+
+static int pin_to_cpu(int cpu)
+{
+    cpu_set_t mask;
+
+    CPU_ZERO(&mask);
+    CPU_SET(cpu, &mask);
+
+    errno = pthread_setaffinity_np(pthread_self(), sizeof mask, &mask);
+    if (errno) {
+        perror("pthread_setaffinity_np");
+        fprintf(stderr, "Failed to pin thread to CPU %d\n", cpu);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * The worker thread which serves a single audio device
  */
 
-static void rt_main(struct rt *rt)
+static void source_main(struct rt_source *s)
 {
+    struct rt *rt = s->rt;
     int r;
-    size_t n;
 
-    debug("%p", rt);
+    debug("%p device %p", rt, s->dv);
 
     thread_to_realtime();
 
@@ -79,11 +110,18 @@ static void rt_main(struct rt *rt)
             rt->finished = true;
     }
 
+    if (s->cpu != -1) {
+        if (pin_to_cpu(s->cpu) == -1)
+            rt->finished = true;
+    }
+
     if (sem_post(&rt->sem) == -1)
         abort(); /* under our control; see sem_post(3) */
 
     while (!rt->finished) {
-        r = poll(rt->pt, rt->npt, -1);
+        struct timespec wake;
+
+        r = poll(s->pt, s->npt, -1);
         if (r == -1) {
             if (errno == EINTR) {
                 continue;
@@ -93,17 +131,71 @@ static void rt_main(struct rt *rt)
             }
         }
 
+        clock_gettime(CLOCK_MONOTONIC, &wake);
+
+        device_handle(s->dv, &wake);
+    }
+}
+
+/* Upper bound on shutdown latency of the controller thread, which
+ * has no other guaranteed wakeup (milliseconds) */
+
+#define CTL_TIMEOUT 100
+
+/*
+ * The worker thread which serves the controllers
+ */
+
+static void ctl_main(struct rt *rt)
+{
+    int r;
+    size_t n;
+
+    debug("%p controllers", rt);
+
+    thread_to_realtime();
+
+    if (rt->priority != 0) {
+        if (raise_priority(rt->priority) == -1)
+            rt->finished = true;
+    }
+
+    if (rt->ctl_cpu != -1) {
+        if (pin_to_cpu(rt->ctl_cpu) == -1)
+            rt->finished = true;
+    }
+
+    if (sem_post(&rt->sem) == -1)
+        abort();
+
+    while (!rt->finished) {
+        r = poll(rt->pt, rt->npt, CTL_TIMEOUT);
+        if (r == -1) {
+            if (errno == EINTR) {
+                continue;
+            } else {
+                perror("poll");
+                abort();
+            }
+        }
+
+        if (r == 0)
+            continue;
+
         for (n = 0; n < rt->nctl; n++)
             controller_handle(rt->ctl[n]);
-
-        for (n = 0; n < rt->ndv; n++)
-            device_handle(rt->dv[n]);
     }
 }
 
-static void* launch(void *p)
+static void* launch_source(void *p)
+{
+    source_main(p);
+    return NULL;
+}
+
+static void* launch_ctl(void *p)
 {
-    rt_main(p);
+    ctl_main(p);
     return NULL;
 }
 
@@ -119,6 +211,7 @@ void rt_init(struct rt *rt)
     rt->ndv = 0;
     rt->nctl = 0;
     rt->npt = 0;
+    rt->ctl_running = false;
 }
 
 /*
@@ -138,27 +231,32 @@ void rt_clear(struct rt *rt)
 
 int rt_add_device(struct rt *rt, struct device *dv)
 {
+    struct rt_source *s;
     ssize_t z;
 
     debug("%p adding device %p", rt, dv);
 
-    if (rt->ndv == ARRAY_SIZE(rt->dv)) {
+    if (rt->ndv == ARRAY_SIZE(rt->source)) {
         fprintf(stderr, "Too many audio devices\n");
         return -1;
     }
 
+    s = &rt->source[rt->ndv];
+
     /* The requested poll events never change, so populate the poll
-     * entry table before entering the realtime thread */
+     * entry table before entering the worker thread */
 
-    z = device_pollfds(dv, &rt->pt[rt->npt], sizeof(rt->pt) - rt->npt);
+    z = device_pollfds(dv, s->pt, ARRAY_SIZE(s->pt));
     if (z == -1) {
         fprintf(stderr, "Device failed to return file descriptors.\n");
         return -1;
     }
 
-    rt->npt += z;
+    s->npt = z;
+    s->dv = dv;
+    s->rt = rt;
+    s->running = false;
 
-    rt->dv[rt->ndv] = dv;
     rt->ndv++;
 
     return 0;
@@ -181,9 +279,10 @@ int rt_add_controller(struct rt *rt, struct controller *c)
         return -1;
     }
 
-    /* Similar to adding a PCM device */
+    /* Similar to adding a PCM device, but the controllers share one
+     * poll table and worker thread */
 
-    z = controller_pollfds(c, &rt->pt[rt->npt], sizeof(rt->pt) - rt->npt);
+    z = controller_pollfds(c, &rt->pt[rt->npt], ARRAY_SIZE(rt->pt) - rt->npt);
     if (z == -1) {
         fprintf(stderr, "Controller failed to return file descriptors.\n");
         return -1;
@@ -195,62 +294,130 @@ int rt_add_controller(struct rt *rt, struct controller *c)
     return 0;
 }
 
+/*
+ * Join all worker threads which have been started
+ */
+
+static void join_threads(struct rt *rt)
+{
+    size_t n;
+
+    for (n = 0; n < rt->ndv; n++) {
+        struct rt_source *s = &rt->source[n];
+
+        if (!s->running)
+            continue;
+
+        if (pthread_join(s->ph, NULL) != 0)
+            abort();
+        s->running = false;
+    }
+
+    if (rt->ctl_running) {
+        if (pthread_join(rt->ctl_ph, NULL) != 0)
+            abort();
+        rt->ctl_running = false;
+    }
+}
+
+/*
+ * Create one worker thread, and wait for it to declare it is
+ * initialised
+ *
+ * Return: -1 on error, otherwise 0
+ * Post: if 0 is returned, *running is true
+ */
+
+static int start_thread(struct rt *rt, pthread_t *ph, bool *running,
+                        void* (*main)(void*), void *arg)
+{
+    int r;
+
+    r = pthread_create(ph, NULL, main, arg);
+    if (r != 0) {
+        errno = r;
+        perror("pthread_create");
+        return -1;
+    }
+
+    *running = true;
+
+    if (sem_wait(&rt->sem) == -1)
+        abort();
+
+    return 0;
+}
+
 /*
  * Start realtime handling of the given devices
  *
- * This forks the realtime thread if it is required (eg. ALSA). Some
- * devices (eg. JACK) start their own thread.
+ * This forks a worker thread per device where one is required (eg.
+ * ALSA). Some devices (eg. JACK) start their own thread. The
+ * controllers, if any, get a worker thread of their own.
+ *
+ * If a CPU is given, the worker threads are pinned to consecutive
+ * CPUs beginning there, wrapping to stay within the CPUs online.
  *
  * Return: -1 on error, otherwise 0
  */
 
-int rt_start(struct rt *rt, int priority)
+int rt_start(struct rt *rt, int priority, int cpu)
 {
     size_t n;
+    long ncpu;
 
     assert(priority >= 0);
     rt->priority = priority;
 
-    /* If there are any devices which returned file descriptors for
-     * poll() then launch the realtime thread to handle them */
+    ncpu = sysconf(_SC_NPROCESSORS_ONLN);
 
-    if (rt->npt > 0) {
-        int r;
+    for (n = 0; n < rt->ndv; n++)
+        rt->source[n].cpu = (cpu != -1) ? (cpu + n) % ncpu : -1;
+    rt->ctl_cpu = (cpu != -1) ? (cpu + rt->ndv) % ncpu : -1;
 
-        fprintf(stderr, "Launching realtime thread to handle devices...\n");
+    fprintf(stderr, "Launching realtime threads to handle devices...\n");
 
-        if (sem_init(&rt->sem, 0, 0) == -1) {
-            perror("sem_init");
-            return -1;
-        }
+    if (sem_init(&rt->sem, 0, 0) == -1) {
+        perror("sem_init");
+        return -1;
+    }
 
-        r = pthread_create(&rt->ph, NULL, launch, (void*)rt);
-        if (r != 0) {
-            errno = r;
-            perror("pthread_create");
-            if (sem_destroy(&rt->sem) == -1)
-                abort();
-            return -1;
-        }
+    for (n = 0; n < rt->ndv; n++) {
+        struct rt_source *s = &rt->source[n];
 
-        /* Wait for the realtime thread to declare it is initialised */
+        if (s->npt == 0) /* device brings its own thread */
+            continue;
 
-        if (sem_wait(&rt->sem) == -1)
-            abort();
-        if (sem_destroy(&rt->sem) == -1)
-            abort();
+        if (start_thread(rt, &s->ph, &s->running,
+                         launch_source, s) == -1)
+            goto fail;
+    }
 
-        if (rt->finished) {
-            if (pthread_join(rt->ph, NULL) != 0)
-                abort();
-            return -1;
-        }
+    if (rt->nctl > 0 && rt->npt > 0) {
+        if (start_thread(rt, &rt->ctl_ph, &rt->ctl_running,
+                         launch_ctl, rt) == -1)
+            goto fail;
+    }
+
+    if (sem_destroy(&rt->sem) == -1)
+        abort();
+
+    if (rt->finished) { /* a thread failed to initialise */
+        join_threads(rt);
+        return -1;
     }
 
     for (n = 0; n < rt->ndv; n++)
-        device_start(rt->dv[n]);
+        device_start(rt->source[n].dv);
 
     return 0;
+
+ fail:
+    rt->finished = true;
+    join_threads(rt);
+    if (sem_destroy(&rt->sem) == -1)
+        abort();
+    return -1;
 }
 
 /*
@@ -266,10 +433,7 @@ void rt_stop(struct rt *rt)
     /* Stop audio rolling on devices */
 
     for (n = 0; n < rt->ndv; n++)
-        device_stop(rt->dv[n]);
+        device_stop(rt->source[n].dv);
 
-    if (rt->npt > 0) {
-        if (pthread_join(rt->ph, NULL) != 0)
-            abort();
-    }
+    join_threads(rt);
 }
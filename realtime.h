@@ -26,24 +26,53 @@
 #include <stdbool.h>
 
 /*
- * State data for the realtime thread, maintained during rt_start and
- * rt_stop
+ * State data for the realtime threads, maintained during rt_start
+ * and rt_stop
  */
 
-struct rt {
+struct rt;
+
+/* Upper bound on the decks in the rig; the actual count is however
+ * many are given on the command line. Each deck brings its own
+ * worker thread, so adding decks scales across CPUs rather than
+ * lengthening a single poll loop */
+
+#define MAX_DECKS 4
+
+/* An audio device and the worker thread which serves it. Each
+ * device is polled and handled on its own thread, so a stall in one
+ * device cannot delay audio on another */
+
+struct rt_source {
     pthread_t ph;
+    bool running;
+    int cpu; /* or -1 for no affinity */
+    struct rt *rt;
+    struct device *dv;
+
+    size_t npt;
+    struct pollfd pt[8];
+};
+
+struct rt {
     sem_t sem;
     bool finished;
     int priority;
 
     size_t ndv;
-    struct device *dv[3];
+    struct rt_source source[MAX_DECKS];
+
+    /* The controllers share one worker thread of their own */
+
+    pthread_t ctl_ph;
+    bool ctl_running;
+    int ctl_cpu;
 
     size_t nctl;
     struct controller *ctl[3];
 
     size_t npt;
-    struct pollfd pt[32];
+    struct pollfd pt[8];
 };
 
 int rt_global_init();
@@ -55,7 +84,7 @@ void rt_clear(struct rt *rt);
 int rt_add_device(struct rt *rt, struct device *dv);
 int rt_add_controller(struct rt *rt, struct controller *c);
 
-int rt_start(struct rt *rt, int priority);
+int rt_start(struct rt *rt, int priority, int cpu);
 void rt_stop(struct rt *rt);
 
 #endif
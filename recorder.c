@@ -0,0 +1,341 @@
+/*
+ * Copyright (C) 2021 Mark Hills <mark@xwax.org>
+ *
+ * This file is part of "xwax".
+ *
+ * "xwax" is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 3 as
+ * published by the Free Software Foundation.
+ *
+ * "xwax" is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mutex.h"
+#include "recorder.h"
+
+#define CHANNELS 2
+#define FRAME_BYTES (CHANNELS * sizeof(signed short))
+
+/* Depth of each ring; the slack the disk is given before frames are
+ * dropped. Rounded up to a power of two frames */
+
+#define RING_SECONDS 4
+
+/* The writer's cadence. Infrequent enough that each pass makes
+ * large writes, frequent enough to use little of the ring */
+
+#define WRITE_INTERVAL_MS 250
+
+#define WAV_HEADER_BYTES 44
+
+static struct list recorders = LIST_INIT(recorders);
+static mutex lock; /* on the list, and draining */
+static pthread_t thread;
+static bool started, finished;
+
+static void put16(unsigned char *p, unsigned int v)
+{
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+}
+
+static void put32(unsigned char *p, unsigned long v)
+{
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = (v >> 24) & 0xff;
+}
+
+/*
+ * Canonical 16-bit PCM WAV header; the sizes are patched when the
+ * recording is finalised
+ */
+
+static int write_header(int fd, unsigned int rate)
+{
+    unsigned char h[WAV_HEADER_BYTES];
+
+    memcpy(h, "RIFF", 4);
+    put32(h + 4, 0); /* patched on close */
+    memcpy(h + 8, "WAVEfmt ", 8);
+    put32(h + 16, 16); /* fmt chunk size */
+    put16(h + 20, 1); /* PCM */
+    put16(h + 22, CHANNELS);
+    put32(h + 24, rate);
+    put32(h + 28, rate * FRAME_BYTES); /* byte rate */
+    put16(h + 32, FRAME_BYTES); /* block align */
+    put16(h + 34, 16); /* bits per sample */
+    memcpy(h + 36, "data", 4);
+    put32(h + 40, 0); /* patched on close */
+
+    if (write(fd, h, sizeof h) != sizeof h)
+        return -1;
+
+    return 0;
+}
+
+static int patch_header(int fd, unsigned long long bytes)
+{
+    unsigned char b[4];
+
+    put32(b, bytes + WAV_HEADER_BYTES - 8);
+    if (pwrite(fd, b, 4, 4) != 4)
+        return -1;
+
+    put32(b, bytes);
+    if (pwrite(fd, b, 4, 40) != 4)
+        return -1;
+
+    return 0;
+}
+
+/*
+ * Write frames from the ring to disk, at most two writes (the wrap)
+ *
+ * Pre: lock is held
+ */
+
+static void drain(struct recorder *r)
+{
+    unsigned int t, n;
+
+    t = r->tail;
+    n = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) - t;
+
+    while (n > 0) {
+        unsigned int at, span;
+        ssize_t z;
+
+        at = t & (r->frames - 1);
+
+        span = n;
+        if (at + span > r->frames)
+            span = r->frames - at; /* up to the wrap */
+
+        if (!r->fault) {
+            z = write(r->fd, r->ring + at * CHANNELS,
+                      span * FRAME_BYTES);
+            if (z == -1) {
+                perror("write");
+                fputs("Error writing recording; stopping it\n", stderr);
+                r->fault = true;
+            } else {
+                r->bytes += z;
+                if (z % FRAME_BYTES != 0 || (size_t)z != span * FRAME_BYTES) {
+                    fputs("Short write of recording; stopping it\n", stderr);
+                    r->fault = true;
+                }
+            }
+        }
+
+        /* On fault, frames are still consumed, so the audio thread
+         * rolls on unaffected */
+
+        t += span;
+        n -= span;
+
+        __atomic_store_n(&r->tail, t, __ATOMIC_RELEASE);
+    }
+}
+
+static void* writer_main(void *p)
+{
+    while (!__atomic_load_n(&finished, __ATOMIC_ACQUIRE)) {
+        struct timespec ts;
+        struct recorder *r;
+
+        ts.tv_sec = 0;
+        ts.tv_nsec = WRITE_INTERVAL_MS * 1000000L;
+        nanosleep(&ts, NULL);
+
+        mutex_lock(&lock);
+
+        list_for_each(r, &recorders, recorders)
+            drain(r);
+
+        mutex_unlock(&lock);
+    }
+
+    return NULL;
+}
+
+int recorder_global_init(void)
+{
+    mutex_init(&lock);
+
+    finished = false;
+
+    if (pthread_create(&thread, NULL, writer_main, NULL) != 0) {
+        perror("pthread_create");
+        mutex_clear(&lock);
+        return -1;
+    }
+
+    started = true;
+
+    return 0;
+}
+
+void recorder_global_clear(void)
+{
+    assert(started);
+    assert(list_empty(&recorders)); /* all recordings stopped */
+
+    __atomic_store_n(&finished, true, __ATOMIC_RELEASE);
+
+    if (pthread_join(thread, NULL) != 0)
+        abort();
+
+    mutex_clear(&lock);
+}
+
+void recorder_init(struct recorder *r)
+{
+    r->fd = -1;
+}
+
+/*
+ * Begin recording to the given pathname
+ *
+ * Return: -1 on error, otherwise 0
+ */
+
+int recorder_start(struct recorder *r, const char *path, unsigned int rate)
+{
+    unsigned int frames;
+
+    assert(r->fd == -1);
+
+    frames = 1;
+    while (frames < rate * RING_SECONDS)
+        frames <<= 1;
+
+    r->ring = malloc((size_t)frames * FRAME_BYTES);
+    if (r->ring == NULL) {
+        perror("malloc");
+        return -1;
+    }
+
+    r->fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0666);
+    if (r->fd == -1) {
+        perror(path);
+        goto fail;
+    }
+
+    if (write_header(r->fd, rate) == -1) {
+        perror("write");
+        goto fail_file;
+    }
+
+    r->frames = frames;
+    r->head = 0;
+    r->tail = 0;
+    r->drops = 0;
+    r->fault = false;
+    r->rate = rate;
+    r->bytes = 0;
+
+    fprintf(stderr, "Recording to '%s'\n", path);
+
+    mutex_lock(&lock);
+    list_add(&r->recorders, &recorders);
+    mutex_unlock(&lock);
+
+    return 0;
+
+fail_file:
+    if (close(r->fd) == -1)
+        abort();
+fail:
+    free(r->ring);
+    r->fd = -1;
+    return -1;
+}
+
+/*
+ * Finalise the recording, flushing the ring and patching the sizes
+ * into the WAV header
+ *
+ * Pre: the audio thread is no longer submitting
+ */
+
+void recorder_stop(struct recorder *r)
+{
+    if (r->fd == -1)
+        return; /* never started */
+
+    mutex_lock(&lock);
+    drain(r);
+    list_del(&r->recorders);
+    mutex_unlock(&lock);
+
+    if (!r->fault && patch_header(r->fd, r->bytes) == -1)
+        perror("pwrite");
+
+    if (close(r->fd) == -1)
+        abort();
+
+    fprintf(stderr, "Recording: %llu seconds written, %u frames dropped\n",
+            r->bytes / FRAME_BYTES / r->rate, r->drops);
+
+    free(r->ring);
+    r->fd = -1;
+}
+
+/*
+ * Append a block of stereo audio to the recording
+ *
+ * Called from the realtime thread: no locks, no allocation and no
+ * I/O. A block which does not fit is counted and dropped whole,
+ * which keeps the file aligned to block boundaries.
+ */
+
+void recorder_submit(struct recorder *r, const signed short *pcm,
+                     size_t frames)
+{
+    unsigned int h, space;
+
+    h = r->head;
+    space = r->frames - (h - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE));
+
+    if (frames > space) {
+        r->drops += frames;
+        return;
+    }
+
+    while (frames > 0) {
+        unsigned int at, span;
+
+        at = h & (r->frames - 1);
+
+        span = frames;
+        if (at + span > r->frames)
+            span = r->frames - at;
+
+        memcpy(r->ring + at * CHANNELS, pcm, span * FRAME_BYTES);
+
+        pcm += span * CHANNELS;
+        h += span;
+        frames -= span;
+    }
+
+    __atomic_store_n(&r->head, h, __ATOMIC_RELEASE);
+}
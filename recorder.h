@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2021 Mark Hills <mark@xwax.org>
+ *
+ * This file is part of "xwax".
+ *
+ * "xwax" is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 3 as
+ * published by the Free Software Foundation.
+ *
+ * "xwax" is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef RECORDER_H
+#define RECORDER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "list.h"
+
+/*
+ * Record the audio sent to a deck's output to a WAV file
+ *
+ * The audio thread appends blocks to a ring; a writer thread drains
+ * all rings to disk in large writes. A stalled disk can never hold
+ * up the realtime path: when the ring is full, frames are counted
+ * and dropped.
+ */
+
+struct recorder {
+    struct list recorders;
+
+    /* The ring, in frames; written by the audio thread, read by the
+     * writer thread, without a lock */
+
+    signed short *ring;
+    unsigned int frames, /* capacity; power of two */
+        head, tail, /* absolute frame positions */
+        drops; /* frames lost to a full ring */
+
+    int fd; /* -1 when not recording */
+    bool fault; /* disk error; stop writing, keep consuming */
+    unsigned int rate;
+    unsigned long long bytes; /* audio written, for the header */
+};
+
+/* The writer thread, shared by all recorders */
+
+int recorder_global_init(void);
+void recorder_global_clear(void);
+
+void recorder_init(struct recorder *r);
+
+int recorder_start(struct recorder *r, const char *path, unsigned int rate);
+void recorder_stop(struct recorder *r);
+
+/* Called from the realtime audio thread */
+
+void recorder_submit(struct recorder *r, const signed short *pcm,
+                     size_t frames);
+
+#endif
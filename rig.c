@@ -24,21 +24,38 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/epoll.h>
 #include <unistd.h>
 
 #include "list.h"
 #include "mutex.h"
+#include "player.h"
 #include "realtime.h"
 #include "rig.h"
+#include "rtlog.h"
+#include "watch.h"
 
 #define EVENT_WAKE 0
 #define EVENT_QUIT 1
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof(*x))
 
-static int event[2]; /* pipe to wake up service thread */
+static int event[2], /* pipe to wake up service thread */
+    epfd; /* persistent set of descriptors which wake the rig */
 static struct list tracks = LIST_INIT(tracks),
-    excrates = LIST_INIT(excrates);
+    excrates = LIST_INIT(excrates),
+    analyses = LIST_INIT(analyses);
+
+/* Work posted by other threads but not yet adopted into the lists
+ * above, which belong to the service thread. A separate lock means
+ * posting never waits on the service loop mid-I/O; the event pipe
+ * publishes the change */
+
+static struct list posted_tracks = LIST_INIT(posted_tracks),
+    posted_excrates = LIST_INIT(posted_excrates),
+    posted_analyses = LIST_INIT(posted_analyses);
+static mutex post_lock;
+
 mutex lock;
 
 int rig_init()
@@ -52,28 +69,139 @@ int rig_init()
 
     if (fcntl(event[0], F_SETFL, O_NONBLOCK) == -1) {
         perror("fcntl");
-        if (close(event[1]) == -1)
-            abort();
-        if (close(event[0]) == -1)
-            abort();
-        return -1;
+        goto fail;
     }
 
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd == -1) {
+        perror("epoll_create1");
+        goto fail;
+    }
+
+    rig_monitor(event[0]);
+
     mutex_init(&lock);
+    mutex_init(&post_lock);
 
     return 0;
+
+ fail:
+    if (close(event[1]) == -1)
+        abort();
+    if (close(event[0]) == -1)
+        abort();
+    return -1;
 }
 
 void rig_clear()
 {
+    mutex_clear(&post_lock);
     mutex_clear(&lock);
 
+    if (close(epfd) == -1)
+        abort();
     if (close(event[0]) == -1)
         abort();
     if (close(event[1]) == -1)
         abort();
 }
 
+/*
+ * Add a file descriptor to those which wake the rig
+ *
+ * The registration is persistent; it lasts until the matching call to
+ * rig_unmonitor(). The rig does not track which descriptor woke it;
+ * every wakeup services all clients, who see EAGAIN if they have no
+ * data. A descriptor of -1 is ignored, for callers whose work has no
+ * file descriptor.
+ */
+
+void rig_monitor(int fd)
+{
+    struct epoll_event ev;
+
+    if (fd == -1)
+        return;
+
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+        abort();
+}
+
+/*
+ * Withdraw a file descriptor registered with rig_monitor()
+ *
+ * Pre: fd has not yet been closed; a close() does not remove the
+ * registration if a child process also holds the descriptor
+ */
+
+void rig_unmonitor(int fd)
+{
+    if (fd == -1)
+        return;
+
+    if (epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL) == -1)
+        abort();
+}
+
+/*
+ * Enable or disable wakeups from a registered descriptor, used to
+ * throttle a client without losing its registration
+ */
+
+static void arm(int fd, bool on)
+{
+    struct epoll_event ev;
+
+    if (fd == -1)
+        return;
+
+    ev.events = on ? EPOLLIN : 0;
+    ev.data.fd = fd;
+
+    if (epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) == -1)
+        abort();
+}
+
+/*
+ * Bring posted work into the service thread's own lists
+ *
+ * Pre: rig lock is held
+ */
+
+static void adopt(void)
+{
+    mutex_lock(&post_lock);
+
+    while (!list_empty(&posted_tracks)) {
+        struct track *t;
+
+        t = list_entry(posted_tracks.next, struct track, rig);
+        list_del(&t->rig);
+        list_add(&t->rig, &tracks);
+    }
+
+    while (!list_empty(&posted_excrates)) {
+        struct excrate *e;
+
+        e = list_entry(posted_excrates.next, struct excrate, rig);
+        list_del(&e->rig);
+        list_add(&e->rig, &excrates);
+    }
+
+    while (!list_empty(&posted_analyses)) {
+        struct analyse *a;
+
+        a = list_entry(posted_analyses.next, struct analyse, rig);
+        list_del(&a->rig);
+        list_add(&a->rig, &analyses);
+    }
+
+    mutex_unlock(&post_lock);
+}
+
 /*
  * Main thread which handles input and output
  *
@@ -89,91 +217,115 @@ void rig_clear()
 
 int rig_main()
 {
-    struct pollfd pt[4];
-    const struct pollfd *px = pt + ARRAY_SIZE(pt);
+    struct pollfd tmp;
+
+    /* Wake to drain the realtime log ring */
 
-    /* Monitor event pipe from external threads */
+    rtlog_pollfd(&tmp);
+    rig_monitor(tmp.fd);
 
-    pt[0].fd = event[0];
-    pt[0].revents = 0;
-    pt[0].events = POLLIN;
+    /* Watches on the library directories */
+
+    watch_pollfd(&tmp);
+    rig_monitor(tmp.fd);
 
     mutex_lock(&lock);
 
     for (;;) { /* exit via EVENT_QUIT */
-        int r;
-        struct pollfd *pe;
+        struct epoll_event ev[8];
+        int r, timeout;
+        bool starved;
         struct track *track, *xtrack;
         struct excrate *excrate, *xexcrate;
+        struct analyse *analyse, *xanalyse;
+
+        adopt();
 
-        pe = &pt[1];
+        /* Release tracks the audio threads have finished with. Poll
+         * with a timeout whilst any remain pending */
+
+        if (player_release_deferred()) {
+            timeout = 10; /* milliseconds */
+        } else {
+            timeout = -1;
+        }
 
-        /* Do our best if we run out of poll entries */
+        /* Where playback is about to overrun an import, drain that
+         * track alone and leave the others until it is ahead */
+
+        starved = false;
 
         list_for_each(track, &tracks, rig) {
-            if (pe == px)
-                break;
-            track_pollfd(track, pe);
-            pe++;
+            if (track_is_starved(track))
+                starved = true;
         }
 
-        list_for_each(excrate, &excrates, rig) {
-            if (pe == px)
-                break;
-            excrate_pollfd(excrate, pe);
-            pe++;
+        list_for_each(track, &tracks, rig) {
+            bool throttle;
+
+            throttle = starved && !track_is_starved(track);
+            if (track_throttle(track, throttle))
+                arm(track_fd(track), !throttle);
         }
 
         mutex_unlock(&lock);
 
-        r = poll(pt, pe - pt, -1);
+        /* Which descriptors woke us is not used; every wakeup
+         * sweeps all clients, and they are few */
+
+        r = epoll_wait(epfd, ev, ARRAY_SIZE(ev), timeout);
         if (r == -1) {
             if (errno == EINTR) {
                 mutex_lock(&lock);
                 continue;
             } else {
-                perror("poll");
+                perror("epoll_wait");
                 return -1;
             }
         }
 
+        rtlog_handle();
+
         /* Process all events on the event pipe */
 
-        if (pt[0].revents != 0) {
-            for (;;) {
-                char e;
-                size_t z;
-
-                z = read(event[0], &e, 1);
-                if (z == -1) {
-                    if (errno == EAGAIN) {
-                        break;
-                    } else {
-                        perror("read");
-                        return -1;
-                    }
-                }
+        for (;;) {
+            char e;
+            ssize_t z;
 
-                switch (e) {
-                case EVENT_WAKE:
+            z = read(event[0], &e, 1);
+            if (z == -1) {
+                if (errno == EAGAIN) {
                     break;
+                } else {
+                    perror("read");
+                    return -1;
+                }
+            }
 
-                case EVENT_QUIT:
-                    goto finish;
+            switch (e) {
+            case EVENT_WAKE:
+                break;
 
-                default:
-                    abort();
-                }
+            case EVENT_QUIT:
+                goto finish;
+
+            default:
+                abort();
             }
         }
 
         mutex_lock(&lock);
 
+        watch_handle();
+
         list_for_each_safe(track, xtrack, &tracks, rig)
             track_handle(track);
 
         list_for_each_safe(excrate, xexcrate, &excrates, rig)
             excrate_handle(excrate);
+
+        list_for_each_safe(analyse, xanalyse, &analyses, rig)
+            analyse_handle(analyse);
     }
  finish:
 
@@ -197,7 +349,7 @@ static int post_event(char e)
 }
 
 /*
- * Ask the rig to exit from another thread or signal handler
+ * Ask the rig to exit from another thread
  */
 
 int rig_quit()
@@ -205,6 +357,34 @@ int rig_quit()
     return post_event(EVENT_QUIT);
 }
 
+/*
+ * As rig_quit(), but callable from a signal handler
+ *
+ * A process-directed signal is delivered on an arbitrary thread,
+ * which may be a realtime one, so this must not take locks, call
+ * stdio or trip the check in rt_not_allowed(). A raw write() to the
+ * event pipe is async-signal-safe; if it fails there is nothing safe
+ * we can do, and if the pipe is full the rig is already awake.
+ */
+
+void rig_quit_async(void)
+{
+    char e = EVENT_QUIT;
+    ssize_t z;
+
+    z = write(event[1], &e, 1);
+    (void)z; /* see above */
+}
+
+/*
+ * Wake the rig from another thread to handle deferred work
+ */
+
+int rig_awaken()
+{
+    return post_event(EVENT_WAKE);
+}
+
 void rig_lock(void)
 {
     mutex_lock(&lock);
@@ -217,19 +397,47 @@ void rig_unlock(void)
 
 /*
  * Add a track to be handled until import has completed
+ *
+ * Takes only the posting lock, never the rig lock; posting does not
+ * wait on any I/O in flight in the service loop
  */
 
 void rig_post_track(struct track *t)
 {
     track_acquire(t);
-    list_add(&t->rig, &tracks);
+
+    mutex_lock(&post_lock);
+    list_add(&t->rig, &posted_tracks);
+    mutex_unlock(&post_lock);
+
+    rig_monitor(track_fd(t)); /* -1 for an in-process decode */
     post_event(EVENT_WAKE);
 }
 
 void rig_post_excrate(struct excrate *e)
 {
     excrate_acquire(e);
-    list_add(&e->rig, &excrates);
+
+    mutex_lock(&post_lock);
+    list_add(&e->rig, &posted_excrates);
+    mutex_unlock(&post_lock);
+
+    rig_monitor(excrate_fd(e));
+    post_event(EVENT_WAKE);
+}
+
+/*
+ * As rig_post_excrate(), for an analysis job. The job belongs to
+ * the analyse module, which frees it when handling completes.
+ */
+
+void rig_post_analyse(struct analyse *a)
+{
+    mutex_lock(&post_lock);
+    list_add(&a->rig, &posted_analyses);
+    mutex_unlock(&post_lock);
+
+    rig_monitor(analyse_fd(a));
     post_event(EVENT_WAKE);
 }
 
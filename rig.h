@@ -20,6 +20,7 @@
 #ifndef RIG_H
 #define RIG_H
 
+#include "analyse.h"
 #include "excrate.h"
 #include "track.h"
 
@@ -29,11 +30,17 @@ void rig_clear();
 int rig_main();
 
 int rig_quit();
+void rig_quit_async(void);
+int rig_awaken();
 
 void rig_lock();
 void rig_unlock();
 
+void rig_monitor(int fd);
+void rig_unmonitor(int fd);
+
 void rig_post_track(struct track *t);
 void rig_post_excrate(struct excrate *e);
+void rig_post_analyse(struct analyse *a);
 
 #endif
@@ -0,0 +1,252 @@
+/*
+ * Copyright (C) 2021 Mark Hills <mark@xwax.org>
+ *
+ * This file is part of "xwax".
+ *
+ * "xwax" is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 3 as
+ * published by the Free Software Foundation.
+ *
+ * "xwax" is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "rtlog.h"
+
+/* Size of the ring; a power of two. If the rig thread falls this far
+ * behind, further messages are counted and dropped */
+
+#define RTLOG_ENTRIES 64
+
+struct entry {
+    unsigned int seq; /* absolute position + 1, set on commit */
+    unsigned int strs; /* number of string arguments */
+    const char *fmt, *str[2];
+    double num[2];
+};
+
+static struct entry ring[RTLOG_ENTRIES];
+static unsigned int head, tail; /* reserve and read positions */
+static unsigned int drops;
+
+static int wake[2] = { -1, -1 }; /* pipe to the rig thread */
+
+/*
+ * Post: rtlog is initialised
+ */
+
+int rtlog_init(void)
+{
+    if (pipe(wake) == -1) {
+        perror("pipe");
+        return -1;
+    }
+
+    /* Both ends are non-blocking: the writer is realtime, and the
+     * reader drains speculatively */
+
+    if (fcntl(wake[0], F_SETFL, O_NONBLOCK) == -1 ||
+        fcntl(wake[1], F_SETFL, O_NONBLOCK) == -1)
+    {
+        perror("fcntl");
+        if (close(wake[1]) == -1)
+            abort();
+        if (close(wake[0]) == -1)
+            abort();
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Pre: rtlog is initialised
+ */
+
+void rtlog_clear(void)
+{
+    rtlog_handle(); /* flush anything outstanding */
+
+    if (close(wake[1]) == -1)
+        abort();
+    if (close(wake[0]) == -1)
+        abort();
+}
+
+/*
+ * Reserve a slot in the ring
+ *
+ * Safe against concurrent realtime writers; no locks are taken and
+ * no I/O is performed other than a non-blocking wake.
+ *
+ * Return: slot, or NULL if the ring is full
+ */
+
+static struct entry* reserve(unsigned int *pos)
+{
+    unsigned int h;
+
+    for (;;) {
+        h = __atomic_load_n(&head, __ATOMIC_RELAXED);
+
+        if (h - __atomic_load_n(&tail, __ATOMIC_ACQUIRE) >= RTLOG_ENTRIES) {
+            __atomic_add_fetch(&drops, 1, __ATOMIC_RELAXED);
+            return NULL;
+        }
+
+        if (__atomic_compare_exchange_n(&head, &h, h + 1, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            break;
+    }
+
+    *pos = h;
+    return &ring[h & (RTLOG_ENTRIES - 1)];
+}
+
+/*
+ * Commit a reserved slot and wake the rig thread
+ */
+
+static void commit(struct entry *e, unsigned int pos)
+{
+    char c = 0;
+
+    __atomic_store_n(&e->seq, pos + 1, __ATOMIC_RELEASE);
+
+    if (write(wake[1], &c, 1) == -1) {
+        /* EAGAIN means a wake is already pending */
+    }
+}
+
+void rtlog(const char *fmt, double a, double b)
+{
+    unsigned int pos;
+    struct entry *e;
+
+    e = reserve(&pos);
+    if (e == NULL)
+        return;
+
+    e->strs = 0;
+    e->fmt = fmt;
+    e->num[0] = a;
+    e->num[1] = b;
+
+    commit(e, pos);
+}
+
+void rtlog_s(const char *fmt, const char *s, double a)
+{
+    unsigned int pos;
+    struct entry *e;
+
+    e = reserve(&pos);
+    if (e == NULL)
+        return;
+
+    e->strs = 1;
+    e->fmt = fmt;
+    e->str[0] = s;
+    e->num[0] = a;
+    e->num[1] = 0.0;
+
+    commit(e, pos);
+}
+
+void rtlog_ss(const char *fmt, const char *s, const char *t)
+{
+    unsigned int pos;
+    struct entry *e;
+
+    e = reserve(&pos);
+    if (e == NULL)
+        return;
+
+    e->strs = 2;
+    e->fmt = fmt;
+    e->str[0] = s;
+    e->str[1] = t;
+    e->num[0] = 0.0;
+    e->num[1] = 0.0;
+
+    commit(e, pos);
+}
+
+/*
+ * Get entry for use by poll()
+ *
+ * Post: *pe contains poll entry
+ */
+
+void rtlog_pollfd(struct pollfd *pe)
+{
+    pe->fd = wake[0];
+    pe->events = POLLIN;
+}
+
+/*
+ * Format and write out any outstanding records
+ *
+ * Passing surplus arguments to fprintf() is harmless; each format
+ * string consumes only its own.
+ *
+ * Pre: current thread is not realtime
+ */
+
+void rtlog_handle(void)
+{
+    for (;;) {
+        char c;
+
+        if (read(wake[0], &c, 1) == -1) {
+            if (errno == EAGAIN)
+                break;
+            perror("read");
+            abort();
+        }
+    }
+
+    for (;;) {
+        struct entry *e;
+        unsigned int d;
+
+        e = &ring[tail & (RTLOG_ENTRIES - 1)];
+
+        if (__atomic_load_n(&e->seq, __ATOMIC_ACQUIRE) != tail + 1)
+            break;
+
+        switch (e->strs) {
+        case 0:
+            fprintf(stderr, e->fmt, e->num[0], e->num[1]);
+            break;
+        case 1:
+            fprintf(stderr, e->fmt, e->str[0], e->num[0], e->num[1]);
+            break;
+        case 2:
+            fprintf(stderr, e->fmt, e->str[0], e->str[1]);
+            break;
+        default:
+            abort();
+        }
+
+        __atomic_store_n(&tail, tail + 1, __ATOMIC_RELEASE);
+
+        d = __atomic_exchange_n(&drops, 0, __ATOMIC_RELAXED);
+        if (d != 0)
+            fprintf(stderr, "rtlog: dropped %u messages\n", d);
+    }
+}
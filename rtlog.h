@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2021 Mark Hills <mark@xwax.org>
+ *
+ * This file is part of "xwax".
+ *
+ * "xwax" is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 3 as
+ * published by the Free Software Foundation.
+ *
+ * "xwax" is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Asynchronous logging for realtime code
+ *
+ * The realtime thread may not block on stderr. Instead it posts
+ * fixed-size records into a lock-free ring, which the rig thread
+ * formats and writes out.
+ */
+
+#ifndef RTLOG_H
+#define RTLOG_H
+
+#include <poll.h>
+
+int rtlog_init(void);
+void rtlog_clear(void);
+
+/* Post a message from realtime code. The format string and any
+ * string arguments must be static; formatting is deferred */
+
+void rtlog(const char *fmt, double a, double b);
+void rtlog_s(const char *fmt, const char *s, double a);
+void rtlog_ss(const char *fmt, const char *s, const char *t);
+
+/* Functions used by the rig thread */
+
+void rtlog_pollfd(struct pollfd *pe);
+void rtlog_handle(void);
+
+#endif
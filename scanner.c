@@ -0,0 +1,623 @@
+/*
+ * Copyright (C) 2021 Mark Hills <mark@xwax.org>
+ *
+ * This file is part of "xwax".
+ *
+ * "xwax" is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 3 as
+ * published by the Free Software Foundation.
+ *
+ * "xwax" is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Native library scanner; a compiled replacement for the 'scan'
+ * shell script
+ *
+ * Takes a pathname as an argument and outputs a playlist on
+ * standard output, in the same format the script produces:
+ *
+ *   <pathname>\t<artist>\t<title>[\t<bpm>]\n
+ *
+ * The script walks one directory at a time and pushes every
+ * pathname through several sed passes; on a large archive, and
+ * particularly on cold NFS metadata, that dominates the cost of a
+ * scan. Here a small pool of threads walks directories from a
+ * shared queue, and the artist and title are picked out of each
+ * pathname directly.
+ */
+
+#define _GNU_SOURCE /* memrchr() */
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h> /* strcasecmp() */
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define WORKERS 4 /* threads walking directories */
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof(*x))
+
+/* Filename extensions to regard as audio, as the script */
+
+static const char *extension[] = {
+    "ogg", "oga", "aac", "cdaudio", "mp3", "flac",
+    "wav", "aif", "aiff", "m4a", "wma"
+};
+
+/* Queue of directories awaiting a walk */
+
+struct task {
+    struct task *next;
+    char path[];
+};
+
+static struct task *backlog = NULL;
+static unsigned int walking = 0; /* directories being walked now */
+static pthread_mutex_t mx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+
+/* Identities of directories already queued; symlinks (which we
+ * follow, as 'find -L') could otherwise walk a loop forever */
+
+static struct {
+    uint64_t *slot;
+    size_t size, fill;
+} seen = { NULL, 0, 0 };
+
+/*
+ * Record a directory identity. The identity hashes the device and
+ * inode; a collision only costs a skipped directory, where a loop
+ * would cost us never finishing.
+ *
+ * Pre: the queue lock is held
+ * Return: true if this directory has not been seen before
+ */
+
+static bool first_visit(dev_t dev, ino_t ino)
+{
+    uint64_t key;
+    size_t n;
+
+    key = ((uint64_t)dev << 32) ^ (uint64_t)ino;
+    if (key == 0)
+        key = 1; /* zero marks an empty slot */
+
+    if (seen.fill * 3 >= seen.size * 2) { /* limit occupancy to 2/3 */
+        uint64_t *bigger;
+        size_t size, i;
+
+        size = seen.size ? seen.size * 2 : 1024;
+
+        bigger = calloc(size, sizeof(uint64_t));
+        if (bigger == NULL) {
+            perror("calloc");
+            exit(EXIT_FAILURE);
+        }
+
+        for (i = 0; i < seen.size; i++) {
+            if (seen.slot[i] != 0) {
+                size_t j = (seen.slot[i] * 2654435761u) & (size - 1);
+
+                while (bigger[j] != 0)
+                    j = (j + 1) & (size - 1);
+                bigger[j] = seen.slot[i];
+            }
+        }
+
+        free(seen.slot);
+        seen.slot = bigger;
+        seen.size = size;
+    }
+
+    n = (key * 2654435761u) & (seen.size - 1);
+
+    for (;;) {
+        if (seen.slot[n] == 0)
+            break;
+        if (seen.slot[n] == key)
+            return false;
+        n = (n + 1) & (seen.size - 1); /* linear probe */
+    }
+
+    seen.slot[n] = key;
+    seen.fill++;
+
+    return true;
+}
+
+/*
+ * Queue a directory to be walked
+ *
+ * Pre: the queue lock is held
+ */
+
+static void enqueue(const char *path)
+{
+    struct task *t;
+    size_t len;
+
+    len = strlen(path) + 1;
+
+    t = malloc(sizeof *t + len);
+    if (t == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    memcpy(t->path, path, len);
+    t->next = backlog;
+    backlog = t;
+
+    pthread_cond_signal(&cond);
+}
+
+/*
+ * Skip over a leading track number, eg. "B2. " or "12 ", as the
+ * script's '[A-H]?[A0-9]?[0-9].? +' pattern
+ *
+ * Return: position after the track number, or s if there is none
+ */
+
+static const char* skip_track_number(const char *s)
+{
+    int letter, mid;
+
+    for (letter = 1; letter >= 0; letter--) {
+        for (mid = 1; mid >= 0; mid--) {
+            const char *p = s;
+
+            if (letter) {
+                int c = toupper((unsigned char)*p);
+
+                if (c < 'A' || c > 'H')
+                    continue;
+                p++;
+            }
+
+            if (mid) {
+                int c = toupper((unsigned char)*p);
+
+                if (c != 'A' && !isdigit((unsigned char)*p))
+                    continue;
+                p++;
+            }
+
+            if (!isdigit((unsigned char)*p))
+                continue;
+            p++;
+
+            /* one optional character, eg. '.', then spaces */
+
+            if (*p != ' ') {
+                if (*p == '\0' || p[1] != ' ')
+                    continue;
+                p++;
+            }
+
+            while (*p == ' ')
+                p++;
+
+            return p;
+        }
+    }
+
+    return s;
+}
+
+/*
+ * Find the last " - " separator (any runs of spaces) in the
+ * bounded string
+ *
+ * The script's patterns are greedy, hence the last separator.
+ *
+ * Return: true if found
+ * Post: on success, *end is the end of the left-hand side and
+ * *right the start of the right-hand side
+ */
+
+static bool split_separator(const char *s, const char *bound,
+                            const char **end, const char **right)
+{
+    const char *p;
+    bool found = false;
+
+    for (p = s; p < bound; p++) {
+        const char *q;
+
+        if (*p != ' ')
+            continue;
+
+        q = p;
+        while (q < bound && *q == ' ')
+            q++;
+        if (q == bound || *q != '-')
+            continue;
+        q++;
+        if (q == bound || *q != ' ')
+            continue;
+        while (q < bound && *q == ' ')
+            q++;
+
+        *end = p;
+        *right = q;
+        found = true;
+    }
+
+    return found;
+}
+
+/*
+ * Does this directory name a disc of a larger release, eg.
+ * "Disc 2" or "Side A"
+ */
+
+static bool is_disc(const char *name, size_t len)
+{
+    if (len < 6)
+        return false;
+
+    if (strncasecmp(name, "disc ", 5) != 0 &&
+       strncasecmp(name, "side ", 5) != 0)
+    {
+        return false;
+    }
+
+    return isalnum((unsigned char)name[5]);
+}
+
+/*
+ * Check for an audio filename extension
+ *
+ * Return: position of the '.', or NULL if this is not audio
+ */
+
+static const char* audio_extension(const char *base)
+{
+    const char *dot;
+    size_t n;
+
+    dot = strrchr(base, '.');
+    if (dot == NULL)
+        return NULL;
+
+    for (n = 0; n < ARRAY_SIZE(extension); n++) {
+        if (strcasecmp(dot + 1, extension[n]) == 0)
+            return dot;
+    }
+
+    return NULL;
+}
+
+/*
+ * Pick BPM metadata out of the end of the title, eg.
+ * "Ghostbusters (115.6 BPM)"
+ *
+ * Return: length of the number, or 0 if there is none
+ * Post: on success, *bpm is the start of the number and *tlen is
+ * reduced to exclude the metadata
+ */
+
+static size_t title_bpm(const char *title, size_t *tlen, const char **bpm)
+{
+    const char *open, *p, *close, *num;
+    size_t digits;
+    bool dot;
+
+    if (*tlen < 2 || title[*tlen - 1] != ')')
+        return 0;
+
+    close = title + *tlen - 1;
+
+    open = memrchr(title, '(', *tlen);
+    if (open == NULL)
+        return 0;
+
+    num = open + 1;
+    p = num;
+    digits = 0;
+    dot = false;
+
+    while (p < close && (isdigit((unsigned char)*p) ||
+                         (*p == '.' && !dot)))
+    {
+        if (*p == '.') {
+            if (digits == 0 || !isdigit((unsigned char)p[1]))
+                return 0;
+            dot = true;
+        } else {
+            digits++;
+        }
+        p++;
+    }
+
+    if (digits < 2) /* the script's pattern implies two or more */
+        return 0;
+
+    *bpm = num;
+    digits = p - num;
+
+    while (p < close && *p == ' ')
+        p++;
+
+    if (close - p != 3 || memcmp(p, "BPM", 3) != 0)
+        return 0;
+
+    /* strip the metadata; the script's greedy pattern leaves any
+     * spaces before it in place */
+
+    *tlen = open - title;
+
+    return digits;
+}
+
+/*
+ * Pick artist and title out of the pathname and write the record
+ * to standard output
+ *
+ * The patterns mirror the scan script:
+ *
+ *   .../[<num>] <artist> - <title>.ext
+ *   .../<artist> - <album>[/<disc>]/[<num>] <title>.ext
+ *   .../[<num>] <title>.ext
+ */
+
+static void emit(const char *path, const char *base, const char *ext)
+{
+    const char *artist, *title, *end, *right, *bpm;
+    size_t alen, tlen, blen;
+
+    title = skip_track_number(base);
+    tlen = ext - title;
+
+    if (split_separator(title, ext, &end, &right)) {
+
+        /* <artist> - <title> in the filename itself */
+
+        artist = title;
+        alen = end - artist;
+        title = right;
+        tlen = ext - right;
+    } else {
+        const char *from, *to;
+
+        /* Look to the parent directory, skipping any disc */
+
+        artist = "";
+        alen = 0;
+
+        to = base - 1; /* the '/' */
+        from = memrchr(path, '/', to - path);
+
+        if (from != NULL && is_disc(from + 1, to - from - 1)) {
+            to = from;
+            from = memrchr(path, '/', to - path);
+        }
+
+        if (from != NULL &&
+           split_separator(from + 1, to, &end, &right))
+        {
+            artist = from + 1;
+            alen = end - artist;
+        }
+    }
+
+    blen = title_bpm(title, &tlen, &bpm);
+
+    /* One call per record; stdio's lock keeps lines whole */
+
+    if (blen > 0) {
+        fprintf(stdout, "%s\t%.*s\t%.*s\t%.*s\n", path,
+                (int)alen, artist, (int)tlen, title, (int)blen, bpm);
+    } else {
+        fprintf(stdout, "%s\t%.*s\t%.*s\n", path,
+                (int)alen, artist, (int)tlen, title);
+    }
+}
+
+/*
+ * Walk the entries of a single directory: emit the audio files,
+ * and queue any directories for the pool
+ */
+
+static void scan_dir(const char *path)
+{
+    DIR *dir;
+    struct dirent *de;
+    char child[4096];
+
+    dir = opendir(path);
+    if (dir == NULL) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return; /* carry on; the script would too */
+    }
+
+    while (errno = 0, (de = readdir(dir)) != NULL) {
+        struct stat st;
+        const char *base, *ext;
+
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+
+        if (snprintf(child, sizeof child, "%s/%s",
+                     path, de->d_name) >= (int)sizeof child)
+        {
+            continue; /* pathname too long */
+        }
+
+        if (stat(child, &st) == -1) /* follow symlinks, as 'find -L' */
+            continue;
+
+        if (S_ISDIR(st.st_mode)) {
+            pthread_mutex_lock(&mx);
+            if (first_visit(st.st_dev, st.st_ino))
+                enqueue(child);
+            pthread_mutex_unlock(&mx);
+            continue;
+        }
+
+        if (!S_ISREG(st.st_mode))
+            continue;
+
+        base = strrchr(child, '/') + 1;
+
+        ext = audio_extension(base);
+        if (ext != NULL)
+            emit(child, base, ext);
+    }
+
+    if (closedir(dir) == -1)
+        abort();
+}
+
+/*
+ * A worker of the pool; take directories from the shared queue
+ * until the queue is empty and no worker can add to it
+ */
+
+static void* worker(void *x)
+{
+    for (;;) {
+        struct task *t;
+
+        pthread_mutex_lock(&mx);
+
+        while (backlog == NULL && walking > 0)
+            pthread_cond_wait(&cond, &mx);
+
+        if (backlog == NULL) { /* and nobody walking: finished */
+            pthread_cond_broadcast(&cond);
+            pthread_mutex_unlock(&mx);
+            return NULL;
+        }
+
+        t = backlog;
+        backlog = t->next;
+        walking++;
+
+        pthread_mutex_unlock(&mx);
+
+        scan_dir(t->path);
+        free(t);
+
+        pthread_mutex_lock(&mx);
+        walking--;
+        if (walking == 0 && backlog == NULL)
+            pthread_cond_broadcast(&cond);
+        pthread_mutex_unlock(&mx);
+    }
+}
+
+/*
+ * A plain file as the argument is a ready-made playlist; pass it
+ * through, as the script does
+ *
+ * Return: exit status
+ */
+
+static int stream_file(const char *path)
+{
+    FILE *f;
+    char buf[4096];
+    size_t z;
+
+    f = fopen(path, "r");
+    if (f == NULL) {
+        perror(path);
+        return EXIT_FAILURE;
+    }
+
+    while ((z = fread(buf, 1, sizeof buf, f)) > 0) {
+        if (fwrite(buf, 1, z, stdout) != z) {
+            perror("fwrite");
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (ferror(f)) {
+        perror(path);
+        return EXIT_FAILURE;
+    }
+
+    if (fclose(f) == -1)
+        abort();
+
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[])
+{
+    struct stat st;
+    pthread_t thread[WORKERS];
+    const char *path;
+    size_t n;
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <path>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    path = argv[1];
+
+    if (stat(path, &st) == -1) {
+        perror(path);
+        return EXIT_FAILURE;
+    }
+
+    if (!S_ISDIR(st.st_mode)) {
+        const char *base, *ext;
+
+        /* A single music file names itself -- used for incremental
+         * scans; anything else is a ready-made playlist */
+
+        base = strrchr(path, '/');
+        base = (base != NULL) ? base + 1 : path;
+
+        ext = audio_extension(base);
+        if (ext == NULL)
+            return stream_file(path);
+
+        emit(path, base, ext);
+
+        if (fflush(stdout) != 0) {
+            perror("fflush");
+            return EXIT_FAILURE;
+        }
+
+        return EXIT_SUCCESS;
+    }
+
+    (void)first_visit(st.st_dev, st.st_ino);
+    enqueue(path);
+
+    for (n = 0; n < ARRAY_SIZE(thread); n++) {
+        if (pthread_create(&thread[n], NULL, worker, NULL) != 0)
+            abort();
+    }
+
+    for (n = 0; n < ARRAY_SIZE(thread); n++) {
+        if (pthread_join(thread[n], NULL) != 0)
+            abort();
+    }
+
+    if (fflush(stdout) != 0) {
+        perror("fflush");
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
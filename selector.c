@@ -19,6 +19,7 @@
 
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "selector.h"
 
@@ -57,35 +58,6 @@ static void retain_target(struct selector *sel)
         listbox_to(&sel->records, n);
 }
 
-/*
- * Optimised version of retain_target where our position may
- * only have moved due to insertion of a single record
- */
-
-static void hunt_target(struct selector *s)
-{
-    struct index *l;
-    size_t n;
-
-    if (s->target == NULL)
-        return;
-
-    l = s->view_index;
-    n = listbox_current(&s->records);
-
-    if (n < l->entries && l->record[n + 1] == s->target) {
-        struct listbox *x;
-
-        /* Retain selection in the same position on screen
-         * FIXME: listbox should provide this functionality */
-
-        x = &s->records;
-
-        x->selected++;
-        x->offset++;
-    }
-}
-
 /*
  * Return: the currently selected crate
  */
@@ -129,6 +101,71 @@ static void notify(struct selector *s)
     fire(&s->changed, NULL);
 }
 
+/*
+ * Forget the search history, leaving only the current view
+ *
+ * The stacked views are snapshots, and go stale whenever anything
+ * other than the search changes; backspace then falls back to
+ * re-computing the match.
+ */
+
+static void history_collapse(struct selector *sel)
+{
+    size_t n;
+    struct index top;
+
+    if (sel->depth == 0)
+        return;
+
+    /* The current view keeps its array; it moves to the bottom
+     * of the stack */
+
+    top = *sel->view_index;
+
+    for (n = 0; n < sel->depth; n++) {
+        index_clear(&sel->view[n]);
+        index_init(&sel->view[n]);
+    }
+
+    sel->view[0] = top;
+    index_init(sel->view_index); /* its array now lives at [0] */
+
+    sel->depth = 0;
+    sel->view_index = &sel->view[0];
+}
+
+/*
+ * Fill the destination with the records of the current crate which
+ * match the search criteria
+ *
+ * Where the search has a word long enough for the trigram postings,
+ * resolve a candidate set from them rather than scanning the whole
+ * crate; only short searches pay for the linear scan.
+ *
+ * Return: 0 on success, or -1 on memory allocation failure
+ */
+
+static int crate_match(struct selector *sel, struct index *dest)
+{
+    struct listing *l;
+
+    l = current_crate(sel)->listing;
+
+    if (postings_can_match(&l->postings, &sel->match)) {
+        if (postings_match(&l->postings, dest, &sel->match) == -1)
+            return -1;
+
+        /* The candidates arrive in playlist order */
+
+        if (sel->sort != SORT_PLAYLIST)
+            index_sort(dest, sel->sort);
+
+        return 0;
+    }
+
+    return index_match(initial(sel), dest, &sel->match);
+}
+
 /*
  * When the crate has changed, update the current index to reflect
  * the crate and the search criteria
@@ -136,7 +173,10 @@ static void notify(struct selector *s)
 
 static void do_content_change(struct selector *sel)
 {
-    (void)index_match(initial(sel), sel->view_index, &sel->match);
+    sel->generation++; /* expire any batches of additions in flight */
+
+    history_collapse(sel);
+    (void)crate_match(sel, sel->view_index);
     listbox_set_entries(&sel->records, sel->view_index->entries);
     retain_target(sel);
     notify(sel);
@@ -169,42 +209,130 @@ static void handle_refresh(struct observer *o, void *x)
 }
 
 /*
- * A new record has been added to the currently selected crate. Merge
- * this new addition into the current view, if applicable.
+ * New records have been added to the currently selected crate. Merge
+ * the batch into the current view, if applicable.
  */
 
-static void merge_addition(struct observer *o, void *x)
+static void merge_batch(struct selector *s, const struct index *batch)
 {
-    struct selector *s = container_of(o, struct selector, on_addition);
-    struct record *r = x;
+    struct index matched;
+    size_t n;
 
-    assert(r != NULL);
+    /* The snapshots below the current view do not gain these
+     * records, so they can no longer be popped to */
 
-    if (!record_match(r, &s->match))
-        return;
+    history_collapse(s);
 
-    /* If we're out of memory then silently drop it */
+    /* Filter the batch down to the current search. If we're out
+     * of memory then silently drop the additions */
 
-    if (index_reserve(s->view_index, 1) == -1)
-        return;
+    index_init(&matched);
 
-    if (s->sort == SORT_PLAYLIST)
-        index_add(s->view_index, r);
-    else
-        index_insert(s->view_index, r, s->sort);
+    for (n = 0; n < batch->entries; n++) {
+        struct record *r = batch->record[n];
 
-    listbox_set_entries(&s->records, s->view_index->entries);
+        if (!record_match(r, &s->match))
+            continue;
 
-    /* If this addition is what we've been looking for, send the
-     * cursor to it (not optimal, in some cases we know the position
-     * from the insert above.) Otherwise track the target one step */
+        if (index_reserve(&matched, 1) == -1)
+            goto out;
 
-    if (r == s->target)
-        retain_target(s);
-    else
-        hunt_target(s);
+        index_add(&matched, r);
+    }
 
+    if (matched.entries == 0)
+        goto out;
+
+    /* One sorted merge for the whole batch, rather than an
+     * insertion per record */
+
+    if (s->sort == SORT_PLAYLIST) {
+        if (index_reserve(s->view_index, matched.entries) == -1)
+            goto out;
+        for (n = 0; n < matched.entries; n++)
+            index_add(s->view_index, matched.record[n]);
+    } else {
+        index_sort(&matched, s->sort);
+        if (index_merge(s->view_index, &matched, s->sort) == -1)
+            goto out;
+    }
+
+    listbox_set_entries(&s->records, s->view_index->entries);
+    retain_target(s);
     notify(s);
+out:
+    index_clear(&matched);
+}
+
+/* A batch captured on the scanning thread, awaiting merge by the
+ * thread which owns the selector */
+
+struct batch {
+    struct selector *selector;
+    unsigned int generation;
+    struct index index;
+    struct record *record[];
+};
+
+static void deferred_merge(void *x)
+{
+    struct batch *b = x;
+    struct selector *s = b->selector;
+
+    /* A rebuilt view took its records from the listing, which
+     * already held this batch; merging again would duplicate */
+
+    if (b->generation == s->generation)
+        merge_batch(s, &b->index);
+
+    free(b);
+}
+
+/*
+ * Capture the batch and post it to the owning thread
+ *
+ * Return: 0 on success, -1 if it must be merged in place
+ */
+
+static int post_batch(struct selector *s, const struct index *batch)
+{
+    struct batch *b;
+
+    b = malloc(sizeof *b + batch->entries * sizeof b->record[0]);
+    if (b == NULL)
+        return -1;
+
+    b->selector = s;
+    b->generation = s->generation;
+    memcpy(b->record, batch->record,
+           batch->entries * sizeof b->record[0]);
+    b->index.record = b->record;
+    b->index.size = batch->entries;
+    b->index.entries = batch->entries;
+
+    if (eventq_post(s->events, deferred_merge, b) == -1) {
+        free(b);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void merge_addition(struct observer *o, void *x)
+{
+    struct selector *s = container_of(o, struct selector, on_addition);
+    struct index *batch = x;
+
+    assert(batch != NULL);
+
+    /* Hand the merge to the owning thread, so that a large scan is
+     * not paced by it; fall back to merging here, which is always
+     * correct as both run with the rig lock held */
+
+    if (s->events != NULL && post_batch(s, batch) == 0)
+        return;
+
+    merge_batch(s, batch);
 }
 
 /*
@@ -223,6 +351,7 @@ static void watch_crate(struct selector *s, struct crate *c)
 
 void selector_init(struct selector *sel, struct library *lib)
 {
+    size_t n;
     struct crate *c;
 
     sel->library = lib;
@@ -238,11 +367,13 @@ void selector_init(struct selector *sel, struct library *lib)
     sel->search[0] = '\0';
     sel->search_len = 0;
     sel->target = NULL;
+    sel->events = NULL;
+    sel->generation = 0;
 
-    index_init(&sel->index_a);
-    index_init(&sel->index_b);
-    sel->view_index = &sel->index_a;
-    sel->swap_index = &sel->index_b;
+    for (n = 0; n < SEARCH_MAX; n++)
+        index_init(&sel->view[n]);
+    sel->depth = 0;
+    sel->view_index = &sel->view[0];
 
     c = current_crate(sel);
     watch_crate(sel, c);
@@ -255,12 +386,27 @@ void selector_init(struct selector *sel, struct library *lib)
 
 void selector_clear(struct selector *sel)
 {
+    size_t n;
+
     event_clear(&sel->changed);
     ignore(&sel->on_activity);
     ignore(&sel->on_refresh);
     ignore(&sel->on_addition);
-    index_clear(&sel->index_a);
-    index_clear(&sel->index_b);
+
+    for (n = 0; n < SEARCH_MAX; n++)
+        index_clear(&sel->view[n]);
+}
+
+/*
+ * Merge batches of additions via the given queue, on the thread
+ * which drains it
+ *
+ * Pre: the queue is drained before selector_clear()
+ */
+
+void selector_use_eventq(struct selector *sel, struct eventq *q)
+{
+    sel->events = q;
 }
 
 /*
@@ -436,6 +582,19 @@ void selector_search_expand(struct selector *sel)
     sel->search[--sel->search_len] = '\0';
     match_compile(&sel->match, sel->search);
 
+    /* The previous view is still on the stack; pop it rather than
+     * re-computing the match */
+
+    if (sel->depth > 0) {
+        sel->depth--;
+        sel->view_index = &sel->view[sel->depth];
+
+        listbox_set_entries(&sel->records, sel->view_index->entries);
+        retain_target(sel);
+        notify(sel);
+        return;
+    }
+
     do_content_change(sel);
 }
 
@@ -446,7 +605,7 @@ void selector_search_expand(struct selector *sel)
 
 void selector_search_refine(struct selector *sel, char key)
 {
-    struct index *tmp;
+    struct index *next;
 
     if (sel->search_len >= sizeof(sel->search) - 1) /* would overflow */
         return;
@@ -455,11 +614,24 @@ void selector_search_refine(struct selector *sel, char key)
     sel->search[++sel->search_len] = '\0';
     match_compile(&sel->match, sel->search);
 
-    (void)index_match(sel->view_index, sel->swap_index, &sel->match);
+    /* The current view stays on the stack, ready for backspace;
+     * the narrowed view goes above it */
+
+    next = &sel->view[sel->depth + 1];
+
+    /* The refined matches are a subset of the current view, so the
+     * postings give the same result as narrowing the view itself */
+
+    if (postings_can_match(&current_crate(sel)->listing->postings,
+                           &sel->match))
+    {
+        (void)crate_match(sel, next);
+    } else {
+        (void)index_match(sel->view_index, next, &sel->match);
+    }
 
-    tmp = sel->view_index;
-    sel->view_index = sel->swap_index;
-    sel->swap_index = tmp;
+    sel->depth++;
+    sel->view_index = next;
 
     listbox_set_entries(&sel->records, sel->view_index->entries);
     set_target(sel);
@@ -22,16 +22,24 @@
 
 #include <stdbool.h>
 
+#include "eventq.h"
 #include "library.h"
 #include "listbox.h"
 #include "index.h"
 
+#define SEARCH_MAX 256 /* bytes, including \0 terminator */
+
 struct selector {
     struct library *library;
-    struct index
-        *view_index, /* base_index + search filter applied */
-        *swap_index, /* used to swap between a and b indexes */
-        index_a, index_b;
+
+    /* History of views as the search was refined: view[n] is the
+     * current search less its last (depth - n) characters, and
+     * backspace simply pops. The top of the stack is the current
+     * view */
+
+    struct index view[SEARCH_MAX];
+    struct index *view_index; /* &view[depth] */
+    size_t depth;
 
     struct listbox records, crates;
     bool toggled;
@@ -40,15 +48,25 @@ struct selector {
     struct observer on_activity, on_refresh, on_addition;
 
     size_t search_len;
-    char search[256];
+    char search[SEARCH_MAX];
     struct match match; /* the compiled search, kept in-sync */
 
+    /* Where set, batches of additions are posted to this queue and
+     * merged by the thread which owns the selector, rather than on
+     * the scanning thread. The generation invalidates batches in
+     * flight across a rebuild of the view */
+
+    struct eventq *events;
+    unsigned int generation;
+
     struct event changed;
 };
 
 void selector_init(struct selector *sel, struct library *lib);
 void selector_clear(struct selector *sel);
 
+void selector_use_eventq(struct selector *sel, struct eventq *q);
+
 void selector_set_lines(struct selector *sel, unsigned int lines);
 
 void selector_up(struct selector *sel);
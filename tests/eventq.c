@@ -0,0 +1,119 @@
+/*
+ * Copyright (C) 2021 Mark Hills <mark@xwax.org>
+ *
+ * This file is part of "xwax".
+ *
+ * "xwax" is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 3 as
+ * published by the Free Software Foundation.
+ *
+ * "xwax" is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "eventq.h"
+
+#define PRODUCERS 4
+#define POSTS 100000 /* per producer */
+
+static struct eventq q;
+static unsigned long run[PRODUCERS];
+static unsigned int wakes;
+
+static void wake(void)
+{
+    wakes++;
+}
+
+/*
+ * Each event carries its producer and a sequence number; events
+ * from one producer must run in the order they were posted
+ */
+
+static void event(void *data)
+{
+    unsigned long token = (unsigned long)data;
+
+    run[token % PRODUCERS]++;
+    assert(run[token % PRODUCERS] == token / PRODUCERS + 1);
+}
+
+static void* producer(void *data)
+{
+    unsigned long id = (unsigned long)data, n;
+
+    for (n = 0; n < POSTS; n++) {
+        void *token = (void*)(n * PRODUCERS + id);
+
+        while (eventq_post(&q, event, token) == -1)
+            sched_yield(); /* full; the consumer will catch up */
+    }
+
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    pthread_t thread[PRODUCERS];
+    unsigned long n, total;
+
+    /* Single-threaded: order, capacity and wrap-around */
+
+    eventq_init(&q, wake);
+
+    for (n = 0; n < EVENTQ_SIZE; n++)
+        assert(eventq_post(&q, event, (void*)(n * PRODUCERS)) == 0);
+
+    assert(eventq_post(&q, event, NULL) == -1); /* full */
+    assert(wakes == EVENTQ_SIZE);
+
+    eventq_drain(&q);
+    assert(run[0] == EVENTQ_SIZE);
+
+    eventq_clear(&q);
+
+    /* Multi-threaded: producers racing a draining consumer */
+
+    for (n = 0; n < PRODUCERS; n++)
+        run[n] = 0;
+
+    eventq_init(&q, NULL);
+
+    for (n = 0; n < PRODUCERS; n++) {
+        if (pthread_create(&thread[n], NULL, producer, (void*)n) != 0)
+            abort();
+    }
+
+    do {
+        eventq_drain(&q);
+
+        total = 0;
+        for (n = 0; n < PRODUCERS; n++)
+            total += run[n];
+    } while (total < (unsigned long)PRODUCERS * POSTS);
+
+    for (n = 0; n < PRODUCERS; n++) {
+        if (pthread_join(thread[n], NULL) != 0)
+            abort();
+
+        assert(run[n] == POSTS);
+    }
+
+    eventq_clear(&q);
+
+    fprintf(stderr, "%lu events drained in order\n", total);
+
+    return 0;
+}
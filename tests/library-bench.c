@@ -0,0 +1,322 @@
+/*
+ * Copyright (C) 2021 Mark Hills <mark@xwax.org>
+ *
+ * This file is part of "xwax".
+ *
+ * "xwax" is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 3 as
+ * published by the Free Software Foundation.
+ *
+ * "xwax" is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "library.h"
+#include "thread.h"
+
+/*
+ * Benchmark of the library side: parsing of scan output, the bulk
+ * build of the sorted indexes and search postings, per-keystroke
+ * search latency, and resident memory. Runs against a synthetic
+ * corpus (default a million records) whose artists follow a skewed
+ * distribution, so string interning and the postings see realistic
+ * repetition. Used for regression numbers when changing any of the
+ * library-side data structures.
+ */
+
+#define DEFAULT_RECORDS 1000000
+
+#define INSERTS 10000 /* incremental insertions measured */
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof(*x))
+
+static const char *first[] = {
+    "DJ", "MC", "The", "Little", "Big", "Crazy", "Golden", "Silent",
+    "Lucky", "Midnight", "Electric", "Royal", "Lost", "Vinyl",
+    "Analogue", "Deep",
+};
+
+static const char *second[] = {
+    "Smith", "Jones", "Fingers", "Shadow", "Wolf", "Hawkins",
+    "Carter", "Breaks", "Junction", "Collective", "Brothers",
+    "Sisters", "Allstars", "Orchestra", "Project", "Sound",
+};
+
+static const char *words[] = {
+    "love", "night", "fire", "dance", "rain", "summer", "heart",
+    "city", "dream", "light", "groove", "soul", "moon", "street",
+    "echo", "wire", "glass", "river", "static", "gold", "smoke",
+    "thunder", "velvet", "neon", "drift", "pulse", "haze", "stone",
+    "mirror", "wave", "dust", "iron",
+};
+
+/* Keystrokes of a typical search, plus a miss */
+
+static const char *searches[] = {
+    "f", "fi", "fir", "fire", "fire n", "fire night", "zzz",
+};
+
+/*
+ * One line of synthetic scan output; the caller's responsibility to
+ * free, which get_record() takes over
+ */
+
+static char* gen_line(unsigned long n)
+{
+    char artist[64], title[64], buf[512];
+    unsigned int a, bpm;
+    double r;
+
+    /* A skewed artist distribution: a few artists account for much
+     * of the library, with a long tail */
+
+    r = (double)rand() / RAND_MAX;
+    a = 4096 * r * r * r;
+
+    sprintf(artist, "%s %s %u",
+            first[a % ARRAY_SIZE(first)],
+            second[(a / ARRAY_SIZE(first)) % ARRAY_SIZE(second)],
+            a / 256);
+
+    sprintf(title, "%s %s",
+            words[rand() % ARRAY_SIZE(words)],
+            words[rand() % ARRAY_SIZE(words)]);
+
+    bpm = rand() % 4 ? 60 + rand() % 120 : 0; /* sometimes unknown */
+
+    if (bpm != 0) {
+        sprintf(buf, "/music/%s/%08lu %s.flac\t%s\t%s\t%u.0",
+                artist, n, title, artist, title, bpm);
+    } else {
+        sprintf(buf, "/music/%s/%08lu %s.flac\t%s\t%s",
+                artist, n, title, artist, title);
+    }
+
+    return strdup(buf);
+}
+
+static double now(void)
+{
+    struct timespec t;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &t) == -1)
+        abort();
+
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static unsigned long rss_kb(void)
+{
+    FILE *f;
+    char line[128];
+    unsigned long kb;
+
+    kb = 0;
+
+    f = fopen("/proc/self/status", "r");
+    if (f == NULL)
+        return 0;
+
+    while (fgets(line, sizeof line, f) != NULL) {
+        if (sscanf(line, "VmRSS: %lu kB", &kb) == 1)
+            break;
+    }
+
+    if (fclose(f) == EOF)
+        abort();
+
+    return kb;
+}
+
+/*
+ * One keystroke of a search: the postings path the selector takes,
+ * against the linear scan it replaces
+ */
+
+static void search(struct listing *l, const char *text)
+{
+    struct match m;
+    struct index dest;
+    double t0, post, scan;
+    size_t hits;
+
+    match_compile(&m, text);
+    index_init(&dest);
+
+    post = -1.0;
+
+    if (postings_can_match(&l->postings, &m)) {
+        t0 = now();
+        if (postings_match(&l->postings, &dest, &m) == -1)
+            abort();
+        post = now() - t0;
+    }
+
+    t0 = now();
+    if (index_match(&l->by_order, &dest, &m) == -1)
+        abort();
+    scan = now() - t0;
+
+    hits = dest.entries;
+    index_clear(&dest);
+
+    if (post >= 0.0) {
+        printf("search %-12s %8zu hits  postings %8.3f ms  "
+               "scan %8.3f ms\n",
+               text, hits, post * 1e3, scan * 1e3);
+    } else {
+        printf("search %-12s %8zu hits  postings        -  "
+               "scan %8.3f ms\n",
+               text, hits, scan * 1e3);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long count, n, baseline;
+    char **line;
+    struct record **rec;
+    struct listing l;
+    struct index batch, scratch;
+    double t0, elapsed;
+
+    count = DEFAULT_RECORDS;
+    if (argc > 1)
+        count = strtoul(argv[1], NULL, 10);
+    if (count <= INSERTS) {
+        fprintf(stderr, "Too few records to be meaningful\n");
+        return 1;
+    }
+
+    if (thread_global_init() == -1)
+        return 1;
+    if (library_global_init() == -1)
+        return 1;
+
+    baseline = rss_kb();
+
+    /*
+     * Generate the corpus up-front, outside any measurement
+     */
+
+    line = malloc(sizeof(char*) * (count + INSERTS));
+    rec = malloc(sizeof(struct record*) * (count + INSERTS));
+    if (line == NULL || rec == NULL) {
+        perror("malloc");
+        return 1;
+    }
+
+    srand(0); /* comparable runs */
+
+    for (n = 0; n < count + INSERTS; n++) {
+        line[n] = gen_line(n);
+        if (line[n] == NULL)
+            abort();
+    }
+
+    /*
+     * Parse, as reading scan output does. The last INSERTS records
+     * are held back from the bulk build, for the insertion
+     * measurement below
+     */
+
+    listing_init(&l);
+
+    t0 = now();
+
+    for (n = 0; n < count; n++) {
+        rec[n] = get_record(&l, line[n]);
+        if (rec[n] == NULL)
+            abort();
+    }
+
+    elapsed = now() - t0;
+
+    printf("parse:  %8.2f s  %6.1f krecords/s  %5.0f ns/record\n",
+           elapsed, count / elapsed / 1e3, elapsed * 1e9 / count);
+
+    /*
+     * Bulk build of the sorted indexes and postings, as one batch --
+     * the path a library scan takes
+     */
+
+    index_init(&batch);
+    if (index_reserve(&batch, count) == -1)
+        abort();
+    for (n = 0; n < count; n++)
+        index_add(&batch, rec[n]);
+
+    t0 = now();
+
+    if (listing_add_batch(&l, &batch) == -1)
+        abort();
+
+    elapsed = now() - t0;
+
+    printf("build:  %8.2f s  %6.1f krecords/s  "
+           "(all sort orders and postings)\n",
+           elapsed, count / elapsed / 1e3);
+
+    /*
+     * Per-keystroke search latency
+     */
+
+    for (n = 0; n < ARRAY_SIZE(searches); n++)
+        search(&l, searches[n]);
+
+    /*
+     * Incremental insertion into the full artist index, as a watch
+     * event adding files does. A copy is mutated, leaving the
+     * listing intact
+     */
+
+    for (n = count; n < count + INSERTS; n++) {
+        rec[n] = get_record(&l, line[n]);
+        if (rec[n] == NULL)
+            abort();
+    }
+
+    index_init(&scratch);
+    if (index_copy(&l.by_artist, &scratch) == -1)
+        abort();
+
+    t0 = now();
+
+    for (n = count; n < count + INSERTS; n++) {
+        if (index_reserve(&scratch, 1) == -1)
+            abort();
+        if (index_insert(&scratch, rec[n], SORT_ARTIST) == NULL)
+            abort();
+    }
+
+    elapsed = now() - t0;
+
+    printf("insert: %5.1f us/record into %zu entries\n",
+           elapsed * 1e6 / INSERTS, l.by_artist.entries);
+
+    index_clear(&scratch);
+    index_clear(&batch);
+
+    printf("memory: %lu MB resident (%lu MB baseline)\n",
+           (rss_kb() - baseline) >> 10, baseline >> 10);
+
+    listing_clear(&l);
+    free(rec);
+    free(line);
+    library_global_clear();
+    thread_global_clear();
+
+    return 0;
+}
@@ -22,6 +22,7 @@
 
 #include "library.h"
 #include "rig.h"
+#include "rtlog.h"
 #include "thread.h"
 
 void handle(int signum)
@@ -50,9 +51,15 @@ int main(int argc, char *argv[])
     if (thread_global_init() == -1)
         return -1;
 
+    if (library_global_init() == -1)
+        return -1;
+
     if (rig_init() == -1)
         return -1;
 
+    if (rtlog_init() == -1)
+        return -1;
+
     if (signal(SIGINT, handle) == SIG_ERR) {
         perror("signal");
         return -1;
@@ -69,6 +76,8 @@ int main(int argc, char *argv[])
     rig_main();
 
     library_clear(&lib);
+    library_global_clear();
+    rtlog_clear();
     rig_clear();
     thread_global_clear();
 
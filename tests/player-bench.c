@@ -0,0 +1,236 @@
+/*
+ * Copyright (C) 2021 Mark Hills <mark@xwax.org>
+ *
+ * This file is part of "xwax".
+ *
+ * "xwax" is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 3 as
+ * published by the Free Software Foundation.
+ *
+ * "xwax" is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "player.h"
+#include "timecoder.h"
+#include "track.h"
+
+#define RATE 44100
+#define CHUNK 256 /* frames per collect, typical of a device */
+
+#define TONE 1000.0 /* Hz, in the synthetic track */
+#define TONE_LEVEL 0.5 /* of full scale */
+
+#define WARMUP (RATE / 2) /* frames discarded before analysis */
+#define ANALYSE (RATE * 4) /* frames measured for SNR */
+#define BENCH (RATE * 16) /* frames in the timed pass */
+
+/*
+ * Throughput and quality benchmark of the player's resamplers. A
+ * synthetic track holding a known tone is pumped through
+ * player_collect() across a pitch sweep, for each interpolation
+ * mode. Reports the collect rate, and the SNR of the output against
+ * a best-fit of the expected tone -- the residual contains all
+ * distortion and aliasing introduced by the resampler. Used to
+ * compare the interpolation modes on the deployment hardware before
+ * choosing defaults.
+ */
+
+static const double pitches[] = { 0.5, 0.75, 1.0, 1.33, 2.0 };
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof(*x))
+
+/*
+ * Construct a track holding the test tone; enough audio that no
+ * case plays off the end of it
+ */
+
+static struct track* synth_track(void)
+{
+    struct track *t;
+    struct track_block *b;
+    unsigned int s;
+
+    t = calloc(1, sizeof *t);
+    if (t == NULL)
+        abort();
+
+    b = malloc(sizeof *b);
+    if (b == NULL)
+        abort();
+
+    for (s = 0; s < TRACK_BLOCK_SAMPLES; s++) {
+        signed short v;
+
+        v = sin(2 * M_PI * TONE * s / RATE) * SHRT_MAX * TONE_LEVEL;
+        b->pcm[s * TRACK_CHANNELS] = v;
+        b->pcm[s * TRACK_CHANNELS + 1] = v;
+    }
+
+    t->refcount = 1;
+    t->rate = RATE;
+    t->blocks = 1;
+    t->block[0] = b;
+    t->length = TRACK_BLOCK_SAMPLES;
+
+    return t;
+}
+
+/*
+ * Fit the expected tone to the output and return the SNR (dB) of
+ * the fit; everything which is not the tone -- distortion, aliases,
+ * interpolation noise -- counts as noise
+ */
+
+static double snr(const signed short *pcm, unsigned int frames,
+                  double freq)
+{
+    double w, si, sq, signal, noise, a, phi;
+    unsigned int n;
+
+    w = 2 * M_PI * freq / RATE;
+
+    si = 0.0;
+    sq = 0.0;
+
+    for (n = 0; n < frames; n++) {
+        double x = pcm[n * 2]; /* left channel */
+
+        si += x * sin(w * n);
+        sq += x * cos(w * n);
+    }
+
+    a = 2 * sqrt(si * si + sq * sq) / frames;
+    phi = atan2(sq, si);
+
+    signal = 0.0;
+    noise = 0.0;
+
+    for (n = 0; n < frames; n++) {
+        double x, fit;
+
+        x = pcm[n * 2];
+        fit = a * sin(w * n + phi);
+
+        signal += fit * fit;
+        noise += (x - fit) * (x - fit);
+    }
+
+    if (noise == 0.0)
+        return INFINITY;
+
+    return 10 * log10(signal / noise);
+}
+
+static double now(void)
+{
+    struct timespec t;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &t) == -1)
+        abort();
+
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/*
+ * Run one case: an un-timed pass which captures output for the
+ * quality measurement, then a timed pass for the throughput
+ */
+
+static void run(struct player *pl, const char *name,
+                enum player_interp interp, double pitch,
+                signed short *capture)
+{
+    signed short chunk[CHUNK * PLAYER_CHANNELS];
+    unsigned int s;
+    double t0, elapsed, q;
+
+    player_set_interp(pl, interp);
+
+    player_seek_to(pl, 0.0);
+    pl->pitch = pitch;
+
+    for (s = 0; s < WARMUP; s += CHUNK)
+        player_collect(pl, chunk, CHUNK);
+
+    for (s = 0; s + CHUNK <= ANALYSE; s += CHUNK)
+        player_collect(pl, capture + s * PLAYER_CHANNELS, CHUNK);
+
+    q = snr(capture, s, TONE * pitch);
+
+    player_seek_to(pl, 0.0);
+
+    t0 = now();
+
+    for (s = 0; s + CHUNK <= BENCH; s += CHUNK)
+        player_collect(pl, chunk, CHUNK);
+
+    elapsed = now() - t0;
+
+    printf("%-6s  pitch %.2f:  %6.1f Mframes/s  %5.1f ns/frame  "
+           "SNR %5.1f dB\n",
+           name, pitch,
+           s / elapsed / 1e6,
+           elapsed * 1e9 / s,
+           q);
+}
+
+int main(int argc, char *argv[])
+{
+    struct track *tr;
+    struct timecoder tc;
+    struct timecode_def *def;
+    struct player pl;
+    signed short *capture;
+    unsigned int p;
+
+    capture = malloc(sizeof(signed short) * PLAYER_CHANNELS * ANALYSE);
+    if (capture == NULL) {
+        perror("malloc");
+        return 1;
+    }
+
+    tr = synth_track();
+
+    /* The player insists on a timecoder, though internal playback
+     * (below) never consults it */
+
+    def = timecoder_find_definition("serato_2a");
+    if (def == NULL)
+        abort();
+    timecoder_init(&tc, def, 1.0, RATE, false);
+
+    player_init(&pl, RATE, tr, &tc);
+    player_set_internal_playback(&pl);
+
+    for (p = 0; p < ARRAY_SIZE(pitches); p++)
+        run(&pl, "cubic", PLAYER_CUBIC, pitches[p], capture);
+
+    for (p = 0; p < ARRAY_SIZE(pitches); p++)
+        run(&pl, "sinc", PLAYER_SINC, pitches[p], capture);
+
+    /* The track is synthetic, not from the pool, so it is not
+     * released via player_clear() */
+
+    timecoder_clear(&tc);
+    timecoder_free_lookup();
+
+    free(tr->block[0]);
+    free(tr);
+    free(capture);
+
+    return 0;
+}
@@ -0,0 +1,337 @@
+/*
+ * Copyright (C) 2021 Mark Hills <mark@xwax.org>
+ *
+ * This file is part of "xwax".
+ *
+ * "xwax" is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 3 as
+ * published by the Free Software Foundation.
+ *
+ * "xwax" is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#define _GNU_SOURCE /* sincos() */
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "timecoder.h"
+
+#define RATE 44100
+#define SECONDS 10 /* of synthesised signal per case */
+#define CHUNK 256 /* frames per submit, typical of a device */
+
+#define DECKS 4 /* decoders in the fused pass; as FUSED_DECKS */
+
+/*
+ * Throughput benchmark of the timecode decoder. For each timecode
+ * definition, synthesise signal at several pitches and noise levels
+ * (the generator follows mktimecode.c), pump it through
+ * timecoder_submit() and report the decode rate and the success rate
+ * of position decoding. Used to evaluate decoder changes and catch
+ * regressions.
+ *
+ * The fused multi-deck path is checked against sequential submits
+ * for bit-identical results, then timed; see run_multi().
+ */
+
+static const char *names[] = {
+    "serato_2a",
+    "serato_2b",
+    "serato_cd",
+    "traktor_a",
+    "traktor_b",
+    "mixvibes_v2",
+    "mixvibes_7inch",
+    "pioneer_a",
+    "pioneer_b",
+};
+
+static const double pitches[] = { 0.5, 1.0, 2.0 };
+static const int noises[] = { 0, 512, 4096 }; /* peak, in sample units */
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof(*x))
+
+/*
+ * Calculate the next bit in the LFSR sequence
+ */
+
+static inline bits_t lfsr(bits_t code, bits_t taps)
+{
+    bits_t taken;
+    int xrs;
+
+    taken = code & taps;
+    xrs = 0;
+    while (taken != 0x0) {
+        xrs += taken & 0x1;
+        taken >>= 1;
+    }
+
+    return xrs & 0x1;
+}
+
+/*
+ * LFSR in the forward direction
+ */
+
+static inline bits_t fwd(bits_t current, bits_t taps, unsigned int nbits)
+{
+    bits_t l;
+
+    /* New bits are added at the MSB; shift right by one */
+
+    l = lfsr(current, taps | 0x1);
+    return (current >> 1) | (l << (nbits - 1));
+}
+
+/*
+ * Synthesise timecode signal for the given definition; see
+ * mktimecode.c for the generator this is based on
+ */
+
+static void synthesise(const struct timecode_def *def, double pitch,
+                       int noise, signed short *pcm, unsigned int frames)
+{
+    unsigned int s;
+    int length;
+    bits_t b;
+
+    b = def->seed;
+    length = 0;
+
+    for (s = 0; s < frames; s++) {
+        double time, cycle, angle, modulate, x, y;
+
+        time = (double)s / RATE;
+        cycle = time * def->resolution * pitch;
+        angle = cycle * M_PI * 2;
+
+        sincos(angle, &x, &y);
+
+        /* Modulate the waveform according to the bitstream */
+
+        modulate = 1.0 - (-cos(angle) + 1.0) * 0.25 * ((b & 0x1) == 0);
+        x *= modulate;
+        y *= modulate;
+
+        pcm[s * 2] = -y * SHRT_MAX * 0.5;
+        pcm[s * 2 + 1] = x * SHRT_MAX * 0.5;
+
+        if (noise > 0) {
+            pcm[s * 2] += rand() % (2 * noise + 1) - noise;
+            pcm[s * 2 + 1] += rand() % (2 * noise + 1) - noise;
+        }
+
+        if ((int)cycle > length) {
+            b = fwd(b, def->taps, def->bits);
+            length = cycle;
+        }
+    }
+}
+
+static double now(void)
+{
+    struct timespec t;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &t) == -1)
+        abort();
+
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/*
+ * Run one case: an un-timed pass which samples the decode success
+ * rate, then a timed pass for the throughput
+ */
+
+static void run(struct timecode_def *def, double pitch, int noise,
+                signed short *pcm, unsigned int frames)
+{
+    struct timecoder tc;
+    unsigned int s, probes, hits;
+    double t0, elapsed;
+
+    timecoder_init(&tc, def, 1.0, RATE, false);
+
+    probes = 0;
+    hits = 0;
+
+    for (s = 0; s + CHUNK <= frames; s += CHUNK) {
+        timecoder_submit(&tc, pcm + s * 2, CHUNK);
+
+        if (s > RATE) { /* allow one second to lock on */
+            probes++;
+            if (timecoder_get_position(&tc, NULL) != -1)
+                hits++;
+        }
+    }
+
+    timecoder_clear(&tc);
+
+    timecoder_init(&tc, def, 1.0, RATE, false);
+
+    t0 = now();
+
+    for (s = 0; s + CHUNK <= frames; s += CHUNK)
+        timecoder_submit(&tc, pcm + s * 2, CHUNK);
+
+    elapsed = now() - t0;
+
+    timecoder_clear(&tc);
+
+    printf("%-14s  pitch %.1f  noise %4d:  %6.1f Mframes/s  "
+           "%5.1f ns/frame  decode %5.1f%%\n",
+           def->name, pitch, noise,
+           frames / elapsed / 1e6,
+           elapsed * 1e9 / frames,
+           probes > 0 ? (double)hits * 100 / probes : 0.0);
+}
+
+/*
+ * Run the fused multi-deck pass: a verification pass which demands
+ * results bit-identical to sequential submits after every chunk,
+ * then a timed pass for the throughput
+ */
+
+static void run_multi(struct timecode_def *def, signed short *pcm[],
+                      unsigned int frames)
+{
+    struct timecoder seq[DECKS], fus[DECKS];
+    struct timecoder *f[DECKS];
+    signed short *chunk[DECKS];
+    unsigned int d, s;
+    double t0, elapsed;
+
+    for (d = 0; d < DECKS; d++) {
+        timecoder_init(&seq[d], def, 1.0, RATE, false);
+        timecoder_init(&fus[d], def, 1.0, RATE, false);
+        f[d] = &fus[d];
+    }
+
+    for (s = 0; s + CHUNK <= frames; s += CHUNK) {
+        for (d = 0; d < DECKS; d++) {
+            chunk[d] = pcm[d] + s * 2;
+            timecoder_submit(&seq[d], chunk[d], CHUNK);
+        }
+
+        timecoder_submit_multi(f, chunk, CHUNK, DECKS);
+
+        for (d = 0; d < DECKS; d++) {
+            double a, b;
+
+            a = timecoder_get_pitch(&seq[d]);
+            b = timecoder_get_pitch(&fus[d]);
+
+            if (memcmp(&a, &b, sizeof a) != 0 ||
+                timecoder_get_position(&seq[d], NULL) !=
+                timecoder_get_position(&fus[d], NULL))
+            {
+                fprintf(stderr, "%s: fused decode diverges from "
+                        "sequential at frame %u, deck %u\n",
+                        def->name, s, d);
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+
+    for (d = 0; d < DECKS; d++) {
+        timecoder_clear(&seq[d]);
+        timecoder_clear(&fus[d]);
+
+        timecoder_init(&fus[d], def, 1.0, RATE, false);
+    }
+
+    t0 = now();
+
+    for (s = 0; s + CHUNK <= frames; s += CHUNK) {
+        for (d = 0; d < DECKS; d++)
+            chunk[d] = pcm[d] + s * 2;
+
+        timecoder_submit_multi(f, chunk, CHUNK, DECKS);
+    }
+
+    elapsed = now() - t0;
+
+    for (d = 0; d < DECKS; d++)
+        timecoder_clear(&fus[d]);
+
+    printf("%-14s  fused x%d  identical:  %6.1f Mframes/s  "
+           "%5.1f ns/frame\n",
+           def->name, DECKS,
+           (double)frames * DECKS / elapsed / 1e6,
+           elapsed * 1e9 / ((double)frames * DECKS));
+}
+
+int main(int argc, char *argv[])
+{
+    signed short *pcm, *mpcm[DECKS];
+    unsigned int n, p, z, d;
+
+    pcm = malloc(sizeof(signed short) * 2 * RATE * SECONDS);
+    if (pcm == NULL) {
+        perror("malloc");
+        return 1;
+    }
+
+    for (d = 0; d < DECKS; d++) {
+        mpcm[d] = malloc(sizeof(signed short) * 2 * RATE * SECONDS);
+        if (mpcm[d] == NULL) {
+            perror("malloc");
+            return 1;
+        }
+    }
+
+    for (n = 0; n < ARRAY_SIZE(names); n++) {
+        struct timecode_def *def;
+
+        def = timecoder_find_definition(names[n]);
+        if (def == NULL) {
+            fprintf(stderr, "%s: no such timecode\n", names[n]);
+            return 1;
+        }
+
+        /* The lookup table may still be building on a worker
+         * thread; position decode reports failure until it is done */
+
+        while (!def->lookup)
+            usleep(100000);
+
+        for (p = 0; p < ARRAY_SIZE(pitches); p++) {
+            for (z = 0; z < ARRAY_SIZE(noises); z++) {
+                srand(0); /* comparable runs */
+                synthesise(def, pitches[p], noises[z],
+                           pcm, RATE * SECONDS);
+                run(def, pitches[p], noises[z], pcm, RATE * SECONDS);
+            }
+        }
+
+        /* Decks in the fused pass carry distinct signal: the same
+         * timecode under a different noise stream each */
+
+        for (d = 0; d < DECKS; d++) {
+            srand(d + 1);
+            synthesise(def, 1.0, 512, mpcm[d], RATE * SECONDS);
+        }
+
+        run_multi(def, mpcm, RATE * SECONDS);
+    }
+
+    for (d = 0; d < DECKS; d++)
+        free(mpcm[d]);
+    free(pcm);
+    timecoder_free_lookup();
+
+    return 0;
+}
@@ -20,6 +20,7 @@
 #include <stdio.h>
 
 #include "rig.h"
+#include "rtlog.h"
 #include "thread.h"
 #include "track.h"
 
@@ -41,6 +42,9 @@ int main(int argc, char *argv[])
 
     rig_init();
 
+    if (rtlog_init() == -1)
+        return -1;
+
     track = track_acquire_by_import(argv[1], argv[2]);
     if (track == NULL)
         return -1;
@@ -48,6 +52,7 @@ int main(int argc, char *argv[])
     rig_main();
 
     track_release(track);
+    rtlog_clear();
     rig_clear();
     thread_global_clear();
 
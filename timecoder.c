@@ -31,17 +31,38 @@
  */
 
 #include <assert.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <math.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#ifdef __x86_64__ /* SSE2 is baseline on x86-64 */
+#include <emmintrin.h>
+#endif
+
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+#include "cache.h"
 #include "debug.h"
 #include "timecoder.h"
 
 #define ZERO_THRESHOLD (128 << 16)
 
+/* Frames demodulated as one block; bounded by the bits of the
+ * crossing masks */
+
+#define SUBMIT_BLOCK 32
+
+/* Decoders interleaved in one fused pass */
+
+#define FUSED_DECKS 4
+
 #define ZERO_RC 0.001 /* time constant for zero/rumble filter */
 
 #define REF_PEAKS_AVG 48 /* in wave cycles */
@@ -52,7 +73,7 @@
 
 #define VALID_BITS 24
 
-#define MONITOR_DECAY_EVERY 512 /* in samples */
+#define MONITOR_STRIDE 4 /* samples per scope point */
 
 #define SQ(x) ((x)*(x))
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof(*x))
@@ -211,10 +232,145 @@ static inline bits_t rev(bits_t current, struct timecode_def *def)
     return ((current << 1) & mask) | l;
 }
 
+/* On-disk cache of the generated lookup tables. The LFSR walk for a
+ * long timecode takes a noticeable time at startup; subsequent runs
+ * map the result from disk instead */
+
+#define CACHE_MAGIC "xwaxlut"
+#define CACHE_VERSION 2 /* v2: open-addressing table */
+
+struct cache_header {
+    char magic[8];
+    uint32_t version,
+        bits, seed, taps, length,
+        reserved;
+};
+
 /*
- * Where necessary, build the lookup table required for this timecode
+ * Path of the cache file for the given timecode, optionally creating
+ * the cache directory on the way
+ *
+ * Return: -1 if no suitable directory is configured, otherwise 0
+ */
+
+static int cache_file(const struct timecode_def *def, bool create,
+                      char *path, size_t len)
+{
+    char dir[256];
+    int r;
+
+    if (cache_dir(create, dir, sizeof dir) == -1)
+        return -1;
+
+    r = snprintf(path, len, "%s/%s.lut", dir, def->name);
+    if (r < 0 || (size_t)r >= len)
+        return -1;
+
+    return 0;
+}
+
+/*
+ * Map a previously cached lookup table, if one is valid
+ *
+ * Return: -1 if no valid cache is available, otherwise 0
+ */
+
+static int load_lookup(struct timecode_def *def)
+{
+    char path[512];
+    struct cache_header h;
+    int fd;
+
+    if (cache_file(def, false, path, sizeof path) == -1)
+        return -1;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return -1;
+
+    if (read(fd, &h, sizeof h) != sizeof h)
+        goto fail;
+
+    if (memcmp(h.magic, CACHE_MAGIC, sizeof h.magic) != 0 ||
+       h.version != CACHE_VERSION ||
+       h.bits != (uint32_t)def->bits ||
+       h.seed != def->seed ||
+       h.taps != def->taps ||
+       h.length != def->length)
+    {
+        goto fail;
+    }
+
+    if (lut_map(&def->lut, def->length, fd, sizeof h) == -1)
+        goto fail;
+
+    if (close(fd) == -1)
+        abort(); /* under our control; see close(2) */
+
+    fprintf(stderr, "Mapped cached LUT for %d bit %dHz timecode (%s)\n",
+            def->bits, def->resolution, def->desc);
+
+    return 0;
+
+fail:
+    if (close(fd) == -1)
+        abort();
+    return -1;
+}
+
+/*
+ * Cache the generated lookup table to disk, ready for the next
+ * startup
+ *
+ * Failure is not fatal; the table is simply rebuilt next time.
+ */
+
+static void save_lookup(struct timecode_def *def)
+{
+    char path[512], tmp[520];
+    struct cache_header h;
+    FILE *f;
+
+    if (cache_file(def, true, path, sizeof path) == -1)
+        return;
+
+    if (snprintf(tmp, sizeof tmp, "%s.new", path) >= (int)sizeof tmp)
+        return;
+
+    f = fopen(tmp, "w");
+    if (f == NULL)
+        return;
+
+    memset(&h, 0, sizeof h);
+    memcpy(h.magic, CACHE_MAGIC, sizeof h.magic);
+    h.version = CACHE_VERSION;
+    h.bits = def->bits;
+    h.seed = def->seed;
+    h.taps = def->taps;
+    h.length = def->length;
+
+    if (fwrite(&h, sizeof h, 1, f) != 1 ||
+       lut_store(&def->lut, def->length, f) == -1)
+    {
+        fclose(f);
+        unlink(tmp);
+        return;
+    }
+
+    if (fclose(f) == EOF) {
+        unlink(tmp);
+        return;
+    }
+
+    if (rename(tmp, path) == -1) /* atomic replace */
+        unlink(tmp);
+}
+
+/*
+ * Build the lookup table required for this timecode
  *
  * Return: -1 if not enough memory could be allocated, otherwise 0
+ * Post: if 0 is returned, def->lookup is true
  */
 
 static int build_lookup(struct timecode_def *def)
@@ -222,9 +378,6 @@ static int build_lookup(struct timecode_def *def)
     unsigned int n;
     bits_t current;
 
-    if (def->lookup)
-        return 0;
-
     fprintf(stderr, "Building LUT for %d bit %dHz timecode (%s)\n",
             def->bits, def->resolution, def->desc);
 
@@ -247,14 +400,37 @@ static int build_lookup(struct timecode_def *def)
         current = next;
     }
 
-    def->lookup = true;
+    save_lookup(def);
+
+    __atomic_store_n(&def->lookup, true, __ATOMIC_RELEASE);
 
     return 0;
 }
 
+/*
+ * Entry point of the worker thread which builds a lookup table in
+ * the background
+ */
+
+static void* build_worker(void *p)
+{
+    struct timecode_def *def = p;
+
+    if (build_lookup(def) == -1) {
+        fprintf(stderr, "Failed to build LUT for %s; "
+                "position decode is unavailable\n", def->name);
+    }
+
+    return NULL;
+}
+
 /*
  * Find a timecode definition by name
  *
+ * If no cached lookup table is available, construction is handed to
+ * a worker thread so startup is not delayed; until it completes the
+ * decoder runs pitch-only and timecoder_get_position() returns -1.
+ *
  * Return: pointer to timecode definition, or NULL if not available
  */
 
@@ -268,8 +444,25 @@ struct timecode_def* timecoder_find_definition(const char *name)
         if (strcmp(def->name, name) != 0)
             continue;
 
-        if (build_lookup(def) == -1)
-            return NULL;  /* error */
+        if (def->lookup || def->building)
+            return def;
+
+        if (load_lookup(def) == 0) {
+            __atomic_store_n(&def->lookup, true, __ATOMIC_RELEASE);
+            return def;
+        }
+
+        if (pthread_create(&def->ph, NULL, build_worker, def) != 0) {
+
+            /* Fall back to building synchronously */
+
+            if (build_lookup(def) == -1)
+                return NULL;  /* error */
+
+            return def;
+        }
+
+        def->building = true;
 
         return def;
     }
@@ -287,11 +480,151 @@ void timecoder_free_lookup(void) {
     for (n = 0; n < ARRAY_SIZE(timecodes); n++) {
         struct timecode_def *def = &timecodes[n];
 
+        if (def->building) {
+            if (pthread_join(def->ph, NULL) != 0)
+                abort(); /* under our control; see pthread_join(3) */
+            def->building = false;
+        }
+
         if (def->lookup)
             lut_clear(&def->lut);
     }
 }
 
+/* RIAA playback equalisation; time constants in seconds */
+
+#define RIAA_T1 3180e-6
+#define RIAA_T2 318e-6
+#define RIAA_T3 75e-6
+
+/*
+ * Calculate biquad coefficients for RIAA de-emphasis at the given
+ * sample rate, normalised to unity gain at 1kHz where the timecode
+ * carrier sits
+ *
+ * The analogue response (1 + sT2) / ((1 + sT1)(1 + sT3)) is mapped
+ * by the bilinear transform; the order mismatch places the extra
+ * zero at the Nyquist frequency.
+ */
+
+static void riaa_coefficients(double fs, double b[3], double a[2])
+{
+    double c, n0, n1, d10, d11, d30, d31, a0,
+        w, rn, in, rd, id, g;
+
+    c = 2 * fs;
+
+    n0 = 1 + c * RIAA_T2;
+    n1 = 1 - c * RIAA_T2;
+    d10 = 1 + c * RIAA_T1;
+    d11 = 1 - c * RIAA_T1;
+    d30 = 1 + c * RIAA_T3;
+    d31 = 1 - c * RIAA_T3;
+
+    a0 = d10 * d30;
+
+    b[0] = n0 / a0;
+    b[1] = (n0 + n1) / a0;
+    b[2] = n1 / a0;
+    a[0] = (d10 * d31 + d11 * d30) / a0;
+    a[1] = d11 * d31 / a0;
+
+    /* Evaluate the response at 1kHz and normalise it away */
+
+    w = 2 * M_PI * 1000.0 * 2 / c;
+    rn = b[0] + b[1] * cos(w) + b[2] * cos(2 * w);
+    in = b[1] * sin(w) + b[2] * sin(2 * w);
+    rd = 1.0 + a[0] * cos(w) + a[1] * cos(2 * w);
+    id = a[0] * sin(w) + a[1] * sin(2 * w);
+
+    g = sqrt((rd * rd + id * id) / (rn * rn + in * in));
+
+    b[0] *= g;
+    b[1] *= g;
+    b[2] *= g;
+}
+
+/*
+ * Apply RIAA de-emphasis to a block, in place
+ *
+ * The biquad is serial along time but the two channels are
+ * independent, so they sit side-by-side in the filter state and map
+ * directly onto two SIMD lanes.
+ */
+
+static void riaa_block(struct timecoder *tc, signed int left[],
+                       signed int right[], size_t n)
+{
+    size_t i;
+
+#ifdef __x86_64__
+    __m128d b0 = _mm_set1_pd(tc->riaa_b[0]),
+        b1 = _mm_set1_pd(tc->riaa_b[1]),
+        b2 = _mm_set1_pd(tc->riaa_b[2]),
+        a1 = _mm_set1_pd(tc->riaa_a[0]),
+        a2 = _mm_set1_pd(tc->riaa_a[1]),
+        x1 = _mm_loadu_pd(tc->riaa_x1),
+        x2 = _mm_loadu_pd(tc->riaa_x2),
+        y1 = _mm_loadu_pd(tc->riaa_y1),
+        y2 = _mm_loadu_pd(tc->riaa_y2),
+        min = _mm_set1_pd(INT_MIN),
+        max = _mm_set1_pd(INT_MAX);
+
+    for (i = 0; i < n; i++) {
+        __m128d x, y;
+
+        x = _mm_setr_pd(left[i], right[i]);
+
+        y = _mm_mul_pd(b0, x);
+        y = _mm_add_pd(y, _mm_mul_pd(b1, x1));
+        y = _mm_add_pd(y, _mm_mul_pd(b2, x2));
+        y = _mm_sub_pd(y, _mm_mul_pd(a1, y1));
+        y = _mm_sub_pd(y, _mm_mul_pd(a2, y2));
+
+        x2 = x1;
+        x1 = x;
+        y2 = y1;
+        y1 = y;
+
+        y = _mm_min_pd(_mm_max_pd(y, min), max);
+        left[i] = _mm_cvttsd_si32(y);
+        right[i] = _mm_cvttsd_si32(_mm_unpackhi_pd(y, y));
+    }
+
+    _mm_storeu_pd(tc->riaa_x1, x1);
+    _mm_storeu_pd(tc->riaa_x2, x2);
+    _mm_storeu_pd(tc->riaa_y1, y1);
+    _mm_storeu_pd(tc->riaa_y2, y2);
+#else
+    for (i = 0; i < n; i++) {
+        unsigned int c;
+
+        for (c = 0; c < 2; c++) {
+            signed int *s = c ? &right[i] : &left[i];
+            double x = *s, y;
+
+            y = tc->riaa_b[0] * x
+                + tc->riaa_b[1] * tc->riaa_x1[c]
+                + tc->riaa_b[2] * tc->riaa_x2[c]
+                - tc->riaa_a[0] * tc->riaa_y1[c]
+                - tc->riaa_a[1] * tc->riaa_y2[c];
+
+            tc->riaa_x2[c] = tc->riaa_x1[c];
+            tc->riaa_x1[c] = x;
+            tc->riaa_y2[c] = tc->riaa_y1[c];
+            tc->riaa_y1[c] = y;
+
+            if (y > INT_MAX)
+                y = INT_MAX;
+            if (y < INT_MIN)
+                y = INT_MIN;
+
+            *s = y;
+        }
+    }
+#endif
+}
+
 /*
  * Initialise filter values for one channel
  */
@@ -314,14 +647,14 @@ void timecoder_init(struct timecoder *tc, struct timecode_def *def,
     assert(def != NULL);
 
     /* A definition contains a lookup table which can be shared
-     * across multiple timecoders */
+     * across multiple timecoders, and may still be under
+     * construction on a worker thread */
 
-    assert(def->lookup);
     tc->def = def;
     tc->speed = speed;
+    tc->sample_rate = sample_rate;
+    tc->phono = phono;
 
-    tc->dt = 1.0 / sample_rate;
-    tc->zero_alpha = tc->dt / (ZERO_RC + tc->dt);
     tc->threshold = ZERO_THRESHOLD;
     if (phono)
         tc->threshold >>= 5; /* approx -36dB */
@@ -329,7 +662,7 @@ void timecoder_init(struct timecoder *tc, struct timecode_def *def,
     tc->forwards = 1;
     init_channel(&tc->primary);
     init_channel(&tc->secondary);
-    pitch_init(&tc->pitch, tc->dt);
+    timecoder_set_decimation(tc, 1); /* also sets dt and pitch filter */
 
     tc->ref_level = INT_MAX;
     tc->bitstream = 0;
@@ -340,6 +673,43 @@ void timecoder_init(struct timecoder *tc, struct timecode_def *def,
     tc->mon = NULL;
 }
 
+/*
+ * Set the decimation factor applied ahead of the demodulator
+ *
+ * At high sample rates (eg. 96kHz and 192kHz) the timecode tone is
+ * heavily oversampled and the decoder does proportionally more work
+ * for no gain in accuracy. Decimating ahead of demodulation brings
+ * the cost back down; the monitor is unaffected and always plots the
+ * incoming audio at the full sample rate.
+ *
+ * Pre: factor is 1, 2 or 4
+ * Post: the pitch filter is reset
+ */
+
+void timecoder_set_decimation(struct timecoder *tc, unsigned int factor)
+{
+    assert(factor == 1 || factor == 2 || factor == 4);
+
+    tc->decimation = factor;
+    tc->dec_fill = 0;
+    tc->dec_l = 0;
+    tc->dec_r = 0;
+
+    tc->dt = (double)factor / tc->sample_rate;
+    tc->zero_alpha = tc->dt / (ZERO_RC + tc->dt);
+    pitch_init_batch(&tc->pitch, tc->dt, SUBMIT_BLOCK);
+
+    /* The de-emphasis filter runs at the decimated rate */
+
+    if (tc->phono) {
+        riaa_coefficients(1.0 / tc->dt, tc->riaa_b, tc->riaa_a);
+        memset(tc->riaa_x1, 0, sizeof tc->riaa_x1);
+        memset(tc->riaa_x2, 0, sizeof tc->riaa_x2);
+        memset(tc->riaa_y1, 0, sizeof tc->riaa_y1);
+        memset(tc->riaa_y2, 0, sizeof tc->riaa_y2);
+    }
+}
+
 /*
  * Clear resources associated with a timecode decoder
  */
@@ -368,10 +738,65 @@ int timecoder_monitor_init(struct timecoder *tc, int size)
         return -1;
     }
     memset(tc->mon, 0, SQ(tc->mon_size));
+    tc->ring_head = 0;
+    tc->ring_tail = 0;
     tc->mon_counter = 0;
     return 0;
 }
 
+/*
+ * Transfer the queued points into the x-y raster and decay the
+ * phosphor
+ *
+ * Called by the interface thread each time the monitor is about to be
+ * drawn. ref_level is read unsynchronised, which is benign; it moves
+ * slowly and is used here only for display scaling.
+ */
+
+void timecoder_monitor_update(struct timecoder *tc)
+{
+    unsigned int head, tail;
+    int p, size, ref;
+
+    assert(tc->mon != NULL);
+
+    size = tc->mon_size;
+
+    /* Decay the pixels already in the monitor */
+
+    for (p = 0; p < SQ(size); p++) {
+        if (tc->mon[p])
+            tc->mon[p] = tc->mon[p] * 7 / 8;
+    }
+
+    ref = tc->ref_level;
+    if (ref <= 0)
+        return;
+
+    tail = tc->ring_tail;
+    head = __atomic_load_n(&tc->ring_head, __ATOMIC_ACQUIRE);
+
+    while (tail != head) {
+        signed int x, y;
+        int px, py;
+
+        x = (signed int)tc->ring[tail % MONITOR_RING].x << 16;
+        y = (signed int)tc->ring[tail % MONITOR_RING].y << 16;
+        tail++;
+
+        /* ref_level is half the precision of signal level */
+        px = size / 2 + (long long)x * size / ref / 8;
+        py = size / 2 + (long long)y * size / ref / 8;
+
+        if (px < 0 || px >= size || py < 0 || py >= size)
+            continue;
+
+        tc->mon[py * size + px] = 0xff; /* white */
+    }
+
+    __atomic_store_n(&tc->ring_tail, tail, __ATOMIC_RELEASE);
+}
+
 /*
  * Clear the monitor on the given timecoder
  */
@@ -384,64 +809,308 @@ void timecoder_monitor_clear(struct timecoder *tc)
 }
 
 /*
- * Update channel information with axis-crossings
+ * De-interleave a block of stereo samples, scaling each channel to
+ * the full range of a signed int
  */
 
-static void detect_zero_crossing(struct timecoder_channel *ch,
-                                 signed int v, double alpha,
-                                 signed int threshold)
+static void split_channels(const signed short *pcm, size_t n,
+                           signed int *left, signed int *right)
 {
-    ch->crossing_ticker++;
-
-    ch->swapped = false;
-    if (v > ch->zero + threshold && !ch->positive) {
-        ch->swapped = true;
-        ch->positive = true;
-        ch->crossing_ticker = 0;
-    } else if (v < ch->zero - threshold && ch->positive) {
-        ch->swapped = true;
-        ch->positive = false;
-        ch->crossing_ticker = 0;
+    size_t i = 0;
+
+#ifdef __x86_64__
+    while (i + 4 <= n) {
+        __m128i s;
+
+        s = _mm_loadu_si128((const __m128i*)&pcm[i * 2]);
+        _mm_storeu_si128((__m128i*)&left[i], _mm_slli_epi32(s, 16));
+        _mm_storeu_si128((__m128i*)&right[i],
+                         _mm_and_si128(s, _mm_set1_epi32((int)0xffff0000)));
+        i += 4;
+    }
+#endif
+
+#ifdef __ARM_NEON
+    while (i + 4 <= n) {
+        int16x4x2_t s;
+
+        s = vld2_s16(&pcm[i * 2]);
+        vst1q_s32(&left[i], vshll_n_s16(s.val[0], 16));
+        vst1q_s32(&right[i], vshll_n_s16(s.val[1], 16));
+        i += 4;
     }
+#endif
 
-    ch->zero += alpha * (v - ch->zero);
+    for (; i < n; i++) {
+        left[i] = pcm[i * 2] << 16;
+        right[i] = pcm[i * 2 + 1] << 16;
+    }
 }
 
 /*
- * Plot the given sample value in the x-y monitor
+ * Store the block state back to a channel
  */
 
-static void update_monitor(struct timecoder *tc, signed int x, signed int y)
+static void channel_done(struct timecoder_channel *ch, size_t n,
+                         signed int zero, uint32_t swapped,
+                         bool positive)
 {
-    int px, py, size, ref;
+    ch->zero = zero;
+    ch->positive = positive;
+    ch->swapped = (swapped >> (n - 1)) & 0x1;
+
+    if (swapped == 0x0)
+        ch->crossing_ticker += n;
+    else
+        ch->crossing_ticker = n - 1 - (31 - __builtin_clz(swapped));
+}
 
-    if (!tc->mon)
-        return;
+/*
+ * Demodulate a whole block: axis-crossings on both channels, vinyl
+ * direction and the pitch filter
+ *
+ * The zero-level EMAs and the pitch filter carry serial dependencies
+ * from one sample to the next, so the kernel is written branch-free
+ * rather than wide; the comparisons and polarity updates reduce to
+ * conditional moves and the independent chains overlap in flight.
+ * The rare events which need scalar attention -- direction changes
+ * and bitstream reads -- come back as bitmasks for the caller.
+ *
+ * Pre: n is no more than SUBMIT_BLOCK
+ * Post: zero[i] is the primary zero level after sample i; bit i of
+ *   forwards is the direction after sample i; bit i of direction and
+ *   bits marks a direction change or bitstream read at sample i
+ */
 
-    size = tc->mon_size;
-    ref = tc->ref_level;
+static void demodulate_block(struct timecoder *tc,
+                             const signed int pri[], const signed int sec[],
+                             size_t n, signed int zero[],
+                             uint32_t *forwards, uint32_t *direction,
+                             uint32_t *bits)
+{
+    double alpha = tc->zero_alpha,
+        q = 1.0 / tc->def->resolution / 4;
+    signed int threshold = tc->threshold,
+        zp = tc->primary.zero,
+        zs = tc->secondary.zero;
+    bool pp = tc->primary.positive,
+        ps = tc->secondary.positive,
+        f = tc->forwards,
+        phase = (tc->def->flags & SWITCH_PHASE) != 0,
+        read_pos = (tc->def->flags & SWITCH_POLARITY) == 0;
+    uint32_t swp = 0, sws = 0, fwd = 0, dir = 0, bit = 0;
+    double dxb = 0.0;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        bool hi, lo, p, swapped_p, swapped_s, nf;
+        double dx;
+
+        hi = pri[i] > zp + threshold;
+        lo = pri[i] < zp - threshold;
+        p = hi || (pp && !lo);
+        swapped_p = (p != pp);
+        pp = p;
+
+        zp += alpha * (pri[i] - zp);
+        zero[i] = zp;
+
+        hi = sec[i] > zs + threshold;
+        lo = sec[i] < zs - threshold;
+        p = hi || (ps && !lo);
+        swapped_s = (p != ps);
+        ps = p;
+
+        zs += alpha * (sec[i] - zs);
+
+        /* The direction of any crossing gives the direction of the
+         * vinyl */
+
+        nf = (swapped_p ? (pp != ps) : (pp == ps)) ^ phase;
+        nf = (swapped_p || swapped_s) ? nf : f;
+
+        swp |= (uint32_t)swapped_p << i;
+        sws |= (uint32_t)swapped_s << i;
+        dir |= (uint32_t)(nf != f) << i;
+        fwd |= (uint32_t)nf << i;
+        bit |= (uint32_t)(swapped_s && pp == read_pos) << i;
+        f = nf;
+
+        /* Any crossing registers movement on the pitch counters */
+
+        dx = ((swapped_p || swapped_s) * (2 * (signed int)f - 1)) * q;
+        dxb += dx;
+    }
+
+    /* The whole block folds into one filter update, rather than an
+     * update per sample */
+
+    pitch_batch_observation(&tc->pitch, dxb, n);
+
+    channel_done(&tc->primary, n, zp, swp, pp);
+    channel_done(&tc->secondary, n, zs, sws, ps);
+
+    *forwards = fwd;
+    *direction = dir;
+    *bits = bit;
+}
+
+/*
+ * Demodulate one block for several decoders in a single pass
+ *
+ * Each decoder's zero-level and pitch filters form a serial chain,
+ * but the chains of different decoders are independent of each
+ * other. Holding the state in structure-of-arrays form and
+ * interleaving the decoders in the inner loop lets those chains
+ * proceed in parallel, where a single decoder is limited by the
+ * latency of its own feedback.
+ *
+ * Pre: all decoders share the definition and zero_alpha of tc[0];
+ *   m is no more than FUSED_DECKS
+ */
+
+static inline void demodulate_lanes(struct timecoder *tc[], unsigned int m,
+                                    signed int (*pri)[SUBMIT_BLOCK],
+                                    signed int (*sec)[SUBMIT_BLOCK],
+                                    size_t n, signed int (*zero)[SUBMIT_BLOCK],
+                                    uint32_t forwards[], uint32_t direction[],
+                                    uint32_t bits[])
+{
+    double alpha = tc[0]->zero_alpha,
+        q = 1.0 / tc[0]->def->resolution / 4;
+    bool phase = (tc[0]->def->flags & SWITCH_PHASE) != 0,
+        read_pos = (tc[0]->def->flags & SWITCH_POLARITY) == 0;
+    signed int threshold[FUSED_DECKS] = {0}, zp[FUSED_DECKS] = {0},
+        zs[FUSED_DECKS] = {0};
+    bool pp[FUSED_DECKS] = {false}, ps[FUSED_DECKS] = {false},
+        f[FUSED_DECKS] = {false};
+    uint32_t swp[FUSED_DECKS] = {0}, sws[FUSED_DECKS] = {0},
+        fwd[FUSED_DECKS] = {0}, dir[FUSED_DECKS] = {0},
+        bit[FUSED_DECKS] = {0};
+    struct pitch pch[FUSED_DECKS];
+    double dxb[FUSED_DECKS] = {0.0};
+    size_t i;
+    unsigned int d;
+
+    for (d = 0; d < m; d++) {
+        threshold[d] = tc[d]->threshold;
+        zp[d] = tc[d]->primary.zero;
+        zs[d] = tc[d]->secondary.zero;
+        pp[d] = tc[d]->primary.positive;
+        ps[d] = tc[d]->secondary.positive;
+        f[d] = tc[d]->forwards;
+        pch[d] = tc[d]->pitch; /* keep the filters in registers */
+    }
 
-    /* Decay the pixels already in the montior */
+    for (i = 0; i < n; i++) {
+        for (d = 0; d < m; d++) {
+            bool hi, lo, p, swapped_p, swapped_s, nf;
+            double dx;
 
-    if (++tc->mon_counter % MONITOR_DECAY_EVERY == 0) {
-        int p;
+            hi = pri[d][i] > zp[d] + threshold[d];
+            lo = pri[d][i] < zp[d] - threshold[d];
+            p = hi || (pp[d] && !lo);
+            swapped_p = (p != pp[d]);
+            pp[d] = p;
 
-        for (p = 0; p < SQ(size); p++) {
-            if (tc->mon[p])
-                tc->mon[p] = tc->mon[p] * 7 / 8;
+            zp[d] += alpha * (pri[d][i] - zp[d]);
+            zero[d][i] = zp[d];
+
+            hi = sec[d][i] > zs[d] + threshold[d];
+            lo = sec[d][i] < zs[d] - threshold[d];
+            p = hi || (ps[d] && !lo);
+            swapped_s = (p != ps[d]);
+            ps[d] = p;
+
+            zs[d] += alpha * (sec[d][i] - zs[d]);
+
+            nf = (swapped_p ? (pp[d] != ps[d]) : (pp[d] == ps[d])) ^ phase;
+            nf = (swapped_p || swapped_s) ? nf : f[d];
+
+            swp[d] |= (uint32_t)swapped_p << i;
+            sws[d] |= (uint32_t)swapped_s << i;
+            dir[d] |= (uint32_t)(nf != f[d]) << i;
+            fwd[d] |= (uint32_t)nf << i;
+            bit[d] |= (uint32_t)(swapped_s && pp[d] == read_pos) << i;
+            f[d] = nf;
+
+            dx = ((swapped_p || swapped_s) * (2 * (signed int)f[d] - 1)) * q;
+            dxb[d] += dx;
         }
     }
 
-    assert(ref > 0);
+    for (d = 0; d < m; d++) {
+        pitch_batch_observation(&pch[d], dxb[d], n);
+        tc[d]->pitch = pch[d];
+        channel_done(&tc[d]->primary, n, zp[d], swp[d], pp[d]);
+        channel_done(&tc[d]->secondary, n, zs[d], sws[d], ps[d]);
+        forwards[d] = fwd[d];
+        direction[d] = dir[d];
+        bits[d] = bit[d];
+    }
+}
+
+/*
+ * Dispatch on the deck count so the compiler sees a constant lane
+ * count in each instance and fully unrolls the inner loop
+ */
+
+static void demodulate_multi(struct timecoder *tc[], unsigned int m,
+                             signed int (*pri)[SUBMIT_BLOCK],
+                             signed int (*sec)[SUBMIT_BLOCK],
+                             size_t n, signed int (*zero)[SUBMIT_BLOCK],
+                             uint32_t forwards[], uint32_t direction[],
+                             uint32_t bits[])
+{
+    switch (m) {
+    case 2:
+        demodulate_lanes(tc, 2, pri, sec, n, zero,
+                         forwards, direction, bits);
+        break;
+    case 3:
+        demodulate_lanes(tc, 3, pri, sec, n, zero,
+                         forwards, direction, bits);
+        break;
+    case 4:
+        demodulate_lanes(tc, 4, pri, sec, n, zero,
+                         forwards, direction, bits);
+        break;
+    default:
+        demodulate_lanes(tc, m, pri, sec, n, zero,
+                         forwards, direction, bits);
+        break;
+    }
+}
+
+/*
+ * Queue the given sample for plotting in the x-y monitor
+ *
+ * This runs on the realtime thread, so the work is kept to a
+ * minimum: one sample in every few is pushed to a small ring, and
+ * the scaling, pixel writes and phosphor decay all happen on the
+ * interface thread in timecoder_monitor_update(). If the interface
+ * falls behind, points are simply dropped.
+ */
+
+static void update_monitor(struct timecoder *tc, signed short x, signed short y)
+{
+    unsigned int head, tail;
 
-    /* ref_level is half the precision of signal level */
-    px = size / 2 + (long long)x * size / ref / 8;
-    py = size / 2 + (long long)y * size / ref / 8;
+    if (!tc->mon)
+        return;
 
-    if (px < 0 || px >= size || py < 0 || py >= size)
+    if (tc->mon_counter++ % MONITOR_STRIDE != 0)
         return;
 
-    tc->mon[py * size + px] = 0xff; /* white */
+    head = tc->ring_head;
+    tail = __atomic_load_n(&tc->ring_tail, __ATOMIC_ACQUIRE);
+
+    if (head - tail == MONITOR_RING)
+        return; /* ring is full; drop the point */
+
+    tc->ring[head % MONITOR_RING].x = x;
+    tc->ring[head % MONITOR_RING].y = y;
+    __atomic_store_n(&tc->ring_head, head + 1, __ATOMIC_RELEASE);
 }
 
 /*
@@ -497,67 +1166,46 @@ static void process_bitstream(struct timecoder *tc, signed int m)
 }
 
 /*
- * Process a single sample from the incoming audio
+ * Apply the rare per-sample events flagged by the demodulator
  *
- * The two input signals (primary and secondary) are in the full range
- * of a signed int; ie. 32-bit signed.
+ * Scalar processing is needed only at the samples where the
+ * direction changed or a bit is to be read; walk the masks rather
+ * than test every sample.
  */
 
-static void process_sample(struct timecoder *tc,
-			   signed int primary, signed int secondary)
+static void scalar_fallout(struct timecoder *tc,
+                           const signed int pri[], const signed int zero[],
+                           size_t n, uint32_t fwd, uint32_t dir,
+                           uint32_t bits)
 {
-    detect_zero_crossing(&tc->primary, primary, tc->zero_alpha, tc->threshold);
-    detect_zero_crossing(&tc->secondary, secondary, tc->zero_alpha, tc->threshold);
+    uint32_t scan;
 
-    /* If an axis has been crossed, use the direction of the crossing
-     * to work out the direction of the vinyl */
+    scan = dir | bits;
 
-    if (tc->primary.swapped || tc->secondary.swapped) {
-        bool forwards;
+    while (scan != 0x0) {
+        size_t b;
 
-        if (tc->primary.swapped) {
-            forwards = (tc->primary.positive != tc->secondary.positive);
-        } else {
-            forwards = (tc->primary.positive == tc->secondary.positive);
-        }
+        b = __builtin_ctz(scan);
+        scan &= scan - 1;
 
-        if (tc->def->flags & SWITCH_PHASE)
-	    forwards = !forwards;
-
-        if (forwards != tc->forwards) { /* direction has changed */
-            tc->forwards = forwards;
+        if ((dir >> b) & 0x1) { /* direction has changed */
+            tc->forwards = (fwd >> b) & 0x1;
             tc->valid_counter = 0;
         }
-    }
-
-    /* If any axis has been crossed, register movement using the pitch
-     * counters */
-
-    if (!tc->primary.swapped && !tc->secondary.swapped)
-	pitch_dt_observation(&tc->pitch, 0.0);
-    else {
-	double dx;
-
-	dx = 1.0 / tc->def->resolution / 4;
-	if (!tc->forwards)
-	    dx = -dx;
-	pitch_dt_observation(&tc->pitch, dx);
-    }
-
-    /* If we have crossed the primary channel in the right polarity,
-     * it's time to read off a timecode 0 or 1 value */
 
-    if (tc->secondary.swapped &&
-       tc->primary.positive == ((tc->def->flags & SWITCH_POLARITY) == 0))
-    {
-        signed int m;
+        if ((bits >> b) & 0x1) {
+            signed int m;
 
-        /* scale to avoid clipping */
-        m = abs(primary / 2 - tc->primary.zero / 2);
-	process_bitstream(tc, m);
+            /* scale to avoid clipping */
+            m = abs(pri[b] / 2 - zero[b] / 2);
+            process_bitstream(tc, m);
+        }
     }
 
-    tc->timecode_ticker++;
+    if (bits == 0x0)
+        tc->timecode_ticker += n;
+    else
+        tc->timecode_ticker = n - (31 - __builtin_clz(bits));
 }
 
 /*
@@ -568,17 +1216,24 @@ static void process_sample(struct timecoder *tc,
 
 static struct timecode_def* next_definition(struct timecode_def *def)
 {
+    struct timecode_def *next;
+    unsigned int n;
+
     assert(def != NULL);
 
-    do {
-        def++;
+    next = def;
 
-        if (def >= timecodes + ARRAY_SIZE(timecodes))
-            def = timecodes;
+    for (n = 0; n < ARRAY_SIZE(timecodes); n++) {
+        next++;
 
-    } while (!def->lookup);
+        if (next >= timecodes + ARRAY_SIZE(timecodes))
+            next = timecodes;
 
-    return def;
+        if (__atomic_load_n(&next->lookup, __ATOMIC_ACQUIRE))
+            return next;
+    }
+
+    return def; /* none ready; eg. still building */
 }
 
 /*
@@ -600,11 +1255,63 @@ void timecoder_cycle_definition(struct timecoder *tc)
 
 void timecoder_submit(struct timecoder *tc, signed short *pcm, size_t npcm)
 {
-    while (npcm--) {
-	signed int left, right, primary, secondary;
+    unsigned int dec = tc->decimation;
+
+    while (npcm > 0) {
+        signed int left[SUBMIT_BLOCK], right[SUBMIT_BLOCK],
+            zero_p[SUBMIT_BLOCK];
+        signed int *primary, *secondary;
+        uint32_t fwd, dir, bits;
+        size_t n, in, i;
+
+        if (dec == 1) {
+            n = npcm;
+            if (n > SUBMIT_BLOCK)
+                n = SUBMIT_BLOCK;
+
+            split_channels(pcm, n, left, right);
+            in = n;
+        } else {
 
-        left = pcm[0] << 16;
-        right = pcm[1] << 16;
+            /* Average each group of frames into one decimated
+             * frame; a boxcar is sufficient anti-aliasing as the
+             * timecode tone sits well below the new Nyquist rate.
+             * A partial group is carried to the next submit */
+
+            n = 0;
+            in = 0;
+
+            while (n < SUBMIT_BLOCK && in < npcm) {
+                tc->dec_l += pcm[in * 2];
+                tc->dec_r += pcm[in * 2 + 1];
+                in++;
+
+                if (++tc->dec_fill == dec) {
+                    left[n] = tc->dec_l * (signed int)(65536 / dec);
+                    right[n] = tc->dec_r * (signed int)(65536 / dec);
+                    tc->dec_l = 0;
+                    tc->dec_r = 0;
+                    tc->dec_fill = 0;
+                    n++;
+                }
+            }
+
+        }
+
+        if (tc->mon != NULL) {
+            /* The monitor always sees the full sample rate */
+            for (i = 0; i < in; i++)
+                update_monitor(tc, pcm[i * 2], pcm[i * 2 + 1]);
+        }
+
+        if (n == 0) { /* input exhausted mid-group */
+            pcm += in * TIMECODER_CHANNELS;
+            npcm -= in;
+            continue;
+        }
+
+        if (tc->phono)
+            riaa_block(tc, left, right, n);
 
         if (tc->def->flags & SWITCH_PRIMARY) {
             primary = left;
@@ -614,10 +1321,93 @@ void timecoder_submit(struct timecoder *tc, signed short *pcm, size_t npcm)
             secondary = left;
         }
 
-	process_sample(tc, primary, secondary);
-        update_monitor(tc, left, right);
+        demodulate_block(tc, primary, secondary, n, zero_p,
+                         &fwd, &dir, &bits);
+
+        scalar_fallout(tc, primary, zero_p, n, fwd, dir, bits);
+
+        pcm += in * TIMECODER_CHANNELS;
+        npcm -= in;
+    }
+}
+
+/*
+ * Submit the capture blocks of several decoders as one fused pass
+ *
+ * Produces the same decoder state as calling timecoder_submit() on
+ * each decoder in turn, but demodulates the decks interleaved; see
+ * demodulate_multi(). Intended for hardware which delivers the
+ * capture for multiple decks in the same period.
+ *
+ * Pre: all decoders share the same timecode definition, sample rate
+ *   and decimation factor; each pcm[] holds npcm stereo frames
+ */
+
+void timecoder_submit_multi(struct timecoder *tc[], signed short *pcm[],
+                            size_t npcm, unsigned int ndecks)
+{
+    signed short *p[FUSED_DECKS];
+    unsigned int d;
+
+    /* The decimation carry makes frame alignment per-deck; send
+     * decimated decoders (and excess decks) down the plain path */
+
+    if (ndecks > FUSED_DECKS || tc[0]->decimation != 1) {
+        for (d = 0; d < ndecks; d++)
+            timecoder_submit(tc[d], pcm[d], npcm);
+        return;
+    }
+
+    for (d = 0; d < ndecks; d++) {
+        assert(tc[d]->def == tc[0]->def);
+        assert(tc[d]->decimation == tc[0]->decimation);
+        p[d] = pcm[d];
+    }
+
+    while (npcm > 0) {
+        signed int left[FUSED_DECKS][SUBMIT_BLOCK],
+            right[FUSED_DECKS][SUBMIT_BLOCK],
+            zero_p[FUSED_DECKS][SUBMIT_BLOCK];
+        signed int (*primary)[SUBMIT_BLOCK], (*secondary)[SUBMIT_BLOCK];
+        uint32_t fwd[FUSED_DECKS], dir[FUSED_DECKS], bits[FUSED_DECKS];
+        size_t n, i;
+
+        n = npcm;
+        if (n > SUBMIT_BLOCK)
+            n = SUBMIT_BLOCK;
+
+        for (d = 0; d < ndecks; d++) {
+            split_channels(p[d], n, left[d], right[d]);
+
+            if (tc[d]->phono)
+                riaa_block(tc[d], left[d], right[d], n);
+        }
+
+        if (tc[0]->def->flags & SWITCH_PRIMARY) {
+            primary = left;
+            secondary = right;
+        } else {
+            primary = right;
+            secondary = left;
+        }
+
+        demodulate_multi(tc, ndecks, primary, secondary, n, zero_p,
+                         fwd, dir, bits);
+
+        for (d = 0; d < ndecks; d++)
+            scalar_fallout(tc[d], primary[d], zero_p[d], n,
+                           fwd[d], dir[d], bits[d]);
 
-        pcm += TIMECODER_CHANNELS;
+        for (d = 0; d < ndecks; d++) {
+            if (tc[d]->mon != NULL) {
+                for (i = 0; i < n; i++)
+                    update_monitor(tc[d], p[d][i * 2], p[d][i * 2 + 1]);
+            }
+
+            p[d] += n * TIMECODER_CHANNELS;
+        }
+
+        npcm -= n;
     }
 }
 
@@ -637,6 +1427,9 @@ signed int timecoder_get_position(struct timecoder *tc, double *when)
 {
     signed int r;
 
+    if (!__atomic_load_n(&tc->def->lookup, __ATOMIC_ACQUIRE))
+        return -1; /* lut is still being built; pitch-only */
+
     if (tc->valid_counter <= VALID_BITS)
         return -1;
 
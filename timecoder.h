@@ -20,6 +20,7 @@
 #ifndef TIMECODER_H
 #define TIMECODER_H
 
+#include <pthread.h>
 #include <stdbool.h>
 
 #include "lut.h"
@@ -27,6 +28,8 @@
 
 #define TIMECODER_CHANNELS 2
 
+#define MONITOR_RING 256 /* pending scope points */
+
 typedef unsigned int bits_t;
 
 struct timecode_def {
@@ -39,6 +42,13 @@ struct timecode_def {
     unsigned int length, /* in cycles */
         safe; /* last 'safe' timecode number (for auto disconnect) */
     bool lookup; /* true if lut has been generated */
+
+    /* Where the lut is generated on a worker thread, position decode
+     * is unavailable (pitch-only) until lookup flips true */
+
+    bool building;
+    pthread_t ph;
+
     struct lut lut;
 };
 
@@ -52,12 +62,26 @@ struct timecoder_channel {
 struct timecoder {
     struct timecode_def *def;
     double speed;
+    unsigned int sample_rate;
 
     /* Precomputed values */
 
     double dt, zero_alpha;
     signed int threshold;
 
+    /* Decimation ahead of the demodulator; the monitor still sees
+     * the full sample rate */
+
+    unsigned int decimation, dec_fill;
+    signed int dec_l, dec_r;
+
+    /* Software RIAA de-emphasis, active in phono mode; one biquad
+     * with both channels held in its state side-by-side */
+
+    bool phono;
+    double riaa_b[3], riaa_a[2],
+        riaa_x1[2], riaa_x2[2], riaa_y1[2], riaa_y2[2];
+
     /* Pitch information */
 
     bool forwards;
@@ -75,7 +99,15 @@ struct timecoder {
     /* Feedback */
 
     unsigned char *mon; /* x-y array */
-    int mon_size, mon_counter;
+    int mon_size;
+
+    /* Ring of pending points, filled by the realtime thread and
+     * drained into the x-y array by the interface thread */
+
+    struct {
+        signed short x, y;
+    } ring[MONITOR_RING];
+    unsigned int ring_head, ring_tail, mon_counter;
 };
 
 struct timecode_def* timecoder_find_definition(const char *name);
@@ -85,11 +117,16 @@ void timecoder_init(struct timecoder *tc, struct timecode_def *def,
                     double speed, unsigned int sample_rate, bool phono);
 void timecoder_clear(struct timecoder *tc);
 
+void timecoder_set_decimation(struct timecoder *tc, unsigned int factor);
+
 int timecoder_monitor_init(struct timecoder *tc, int size);
+void timecoder_monitor_update(struct timecoder *tc);
 void timecoder_monitor_clear(struct timecoder *tc);
 
 void timecoder_cycle_definition(struct timecoder *tc);
 void timecoder_submit(struct timecoder *tc, signed short *pcm, size_t npcm);
+void timecoder_submit_multi(struct timecoder *tc[], signed short *pcm[],
+                            size_t npcm, unsigned int ndecks);
 signed int timecoder_get_position(struct timecoder *tc, double *when);
 
 /*
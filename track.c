@@ -19,15 +19,35 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h> /* readv() */
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <sys/mman.h> /* mlock() */
 
+#ifdef __x86_64__ /* SSE2 is baseline on x86-64 */
+#include <emmintrin.h>
+#endif
+
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+#include "cache.h"
 #include "debug.h"
+#include "decoder.h"
 #include "external.h"
 #include "list.h"
+#include "memory.h"
+#include "mutex.h"
 #include "realtime.h"
 #include "rig.h"
 #include "status.h"
@@ -38,11 +58,25 @@
 #define SAMPLE (sizeof(signed short) * TRACK_CHANNELS) /* bytes per sample */
 #define TRACK_BLOCK_PCM_BYTES (TRACK_BLOCK_SAMPLES * SAMPLE)
 
+#define PIPE_BUFFER (1 << 20) /* from the importer, in bytes */
+
+#define METER_CHUNK 256 /* frames rectified per pass */
+
 #define _STR(tok) #tok
 #define STR(tok) _STR(tok)
 
 static struct list tracks = LIST_INIT(tracks);
-static bool use_mlock = false;
+static bool use_mlock = false,
+    use_compact = false;
+
+signed short track_mulaw[256];
+
+/* Recently-released tracks, most recent first, and the memory
+ * budget they are allowed to occupy */
+
+static struct list retained = LIST_INIT(retained);
+static size_t retain_limit = TRACK_RETAIN_DEFAULT,
+    retain_used = 0;
 
 /*
  * An empty track is used rarely, and is easier than
@@ -57,17 +91,667 @@ static struct track empty = {
     .length = 0,
     .blocks = 0,
 
-    .pid = 0
-};
+    .pid = 0
+};
+
+/*
+ * Request that memory for tracks is locked into RAM as it is
+ * allocated
+ */
+
+void track_use_mlock(void)
+{
+    use_mlock = true;
+}
+
+/*
+ * Compress one 16-bit sample to its 8-bit mu-law code
+ */
+
+#define MULAW_BIAS 0x84
+#define MULAW_CLIP 32635
+
+static unsigned char mulaw(int s)
+{
+    int sign, exponent, mantissa;
+
+    sign = 0;
+    if (s < 0) {
+        s = -s;
+        sign = 0x80;
+    }
+    if (s > MULAW_CLIP)
+        s = MULAW_CLIP;
+
+    s += MULAW_BIAS;
+    exponent = 24 - __builtin_clz(s); /* position of the MSB, 0-7 */
+    mantissa = (s >> (exponent + 3)) & 0x0f;
+
+    return ~(sign | (exponent << 4) | mantissa);
+}
+
+/*
+ * Store all tracks as 8-bit mu-law codes, halving the memory they
+ * occupy, for deployments where memory is short; the codes are
+ * expanded on the fly as the audio is fetched
+ */
+
+void track_use_compact(void)
+{
+    int i;
+
+    use_compact = true;
+
+    for (i = 0; i < 256; i++) {
+        int u, t;
+
+        u = ~i & 0xff;
+        t = ((((u & 0x0f) << 3) + MULAW_BIAS) << ((u & 0x70) >> 4))
+            - MULAW_BIAS;
+
+        track_mulaw[i] = (u & 0x80) ? -t : t;
+    }
+}
+
+/*
+ * Set the memory budget for retaining recently-released tracks
+ *
+ * Zero disables retention; a track is then freed the moment the
+ * last reference to it is released.
+ */
+
+void track_set_retain(size_t bytes)
+{
+    retain_limit = bytes;
+}
+
+/* Pool of track blocks, preallocated as one mapping and recycled
+ * across track loads without returning to the allocator. Individual
+ * mallocs fragment, and the first touch of a fresh block faults
+ * 4KB at a time, felt as jitter when scratching a newly loaded
+ * region; hugepages, where available, cut those faults by 512x */
+
+#define HUGEPAGE (2UL << 20) /* for rounding only; kernel advises */
+
+static struct track_block *pool_free = NULL; /* chained via block memory */
+static void *pool_base = NULL;
+static size_t pool_size = 0;
+
+/*
+ * Allocated size of one block; compact blocks are truncated
+ */
+
+static size_t block_bytes(void)
+{
+    return use_compact ? TRACK_BLOCK_COMPACT_BYTES
+        : sizeof(struct track_block);
+}
+
+/* The rig thread and decode threads allocate concurrently */
+
+static mutex pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Preallocate the block pool, sized to the retain budget
+ *
+ * Called once at startup, after the options are set. Failure is not
+ * fatal; blocks are then allocated as before.
+ */
+
+void track_pool_init(void)
+{
+    size_t n, blocks;
+    void *base;
+
+    blocks = retain_limit / block_bytes();
+    if (blocks == 0)
+        return;
+
+    pool_size = (blocks * block_bytes() + HUGEPAGE - 1)
+        & ~(HUGEPAGE - 1);
+
+    base = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+    base = mmap(NULL, pool_size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+
+    if (base == MAP_FAILED) { /* eg. no hugepages reserved */
+        base = mmap(NULL, pool_size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED) {
+            perror("mmap");
+            pool_size = 0;
+            return;
+        }
+
+#ifdef MADV_HUGEPAGE
+        if (madvise(base, pool_size, MADV_HUGEPAGE) == -1)
+            debug("madvise: %s", strerror(errno));
+#endif
+    }
+
+    if (use_mlock && mlock(base, pool_size) == -1) {
+        perror("mlock");
+        if (munmap(base, pool_size) == -1)
+            abort();
+        pool_size = 0;
+        return;
+    }
+
+    pool_base = base;
+    memory_add(MEMORY_TRACK, pool_size);
+
+    for (n = 0; n < blocks; n++) {
+        struct track_block *b = (void*)((char*)base + n * block_bytes());
+
+        *(struct track_block**)b = pool_free;
+        pool_free = b;
+    }
+
+    debug("preallocated pool of %zu track blocks", blocks);
+}
+
+/*
+ * Take a block from the pool
+ *
+ * Return: block, or NULL if the pool is empty or not in use
+ */
+
+static struct track_block* pool_get(void)
+{
+    struct track_block *b;
+
+    mutex_lock(&pool_lock);
+
+    b = pool_free;
+    if (b != NULL)
+        pool_free = *(struct track_block**)b;
+
+    mutex_unlock(&pool_lock);
+
+    return b;
+}
+
+/*
+ * Return a block to the pool, or the allocator it came from
+ */
+
+static void pool_put(struct track_block *b)
+{
+    if ((void*)b >= pool_base &&
+       (void*)b < (void*)((char*)pool_base + pool_size))
+    {
+        mutex_lock(&pool_lock);
+        *(struct track_block**)b = pool_free;
+        pool_free = b;
+        mutex_unlock(&pool_lock);
+    } else {
+        memory_sub(MEMORY_TRACK, block_bytes());
+        free(b);
+    }
+}
+
+/* A long-lived importer daemon, or pid 0 if none is running. One
+ * importer process is started at boot and each load is streamed
+ * from it over a socket, amortising the fork, exec and decoder
+ * startup which otherwise precede the first byte of PCM */
+
+static pid_t daemon_pid = 0;
+static const char *daemon_importer = NULL;
+static char daemon_socket[108]; /* fits struct sockaddr_un */
+
+/*
+ * Start the given importer as a daemon
+ *
+ * The importer is run once, as "import --daemon <socket> <rate>",
+ * and is expected to listen on the socket. Each connection carries
+ * one newline-terminated pathname, answered with the raw PCM and
+ * end-of-stream on completion.
+ *
+ * Return: -1 on error, otherwise 0
+ */
+
+int track_daemon(const char *importer)
+{
+    const char *dir;
+    pid_t pid;
+    int r;
+
+    assert(daemon_pid == 0);
+
+    dir = getenv("XDG_RUNTIME_DIR");
+    if (dir == NULL)
+        dir = "/tmp";
+
+    r = snprintf(daemon_socket, sizeof daemon_socket,
+                 "%s/xwax-import-%d", dir, getpid());
+    if (r < 0 || (size_t)r >= sizeof daemon_socket) {
+        fprintf(stderr, "Runtime directory name is too long.\n");
+        return -1;
+    }
+
+    pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        return -1;
+    }
+
+    if (pid == 0) { /* child */
+        if (execl(importer, "import", "--daemon",
+                  daemon_socket, STR(RATE), NULL) == -1)
+        {
+            perror(importer);
+        }
+        _exit(EXIT_FAILURE);
+    }
+
+    daemon_pid = pid;
+    daemon_importer = importer;
+
+    return 0;
+}
+
+/*
+ * Stop the importer daemon, if one is running
+ */
+
+void track_daemon_stop(void)
+{
+    if (daemon_pid == 0)
+        return;
+
+    if (kill(daemon_pid, SIGTERM) == -1)
+        abort();
+    if (waitpid(daemon_pid, NULL, 0) == -1)
+        abort();
+
+    unlink(daemon_socket); /* daemon may have removed it already */
+
+    daemon_pid = 0;
+}
+
+/*
+ * Connect to the importer daemon and request the given path
+ *
+ * Return: file descriptor to stream the PCM from, or -1 on error,
+ * eg. the daemon is still starting up
+ */
+
+static int daemon_connect(const char *path)
+{
+    struct sockaddr_un addr;
+    size_t len;
+    int fd;
+
+    len = strlen(path);
+    if (len + 1 > sizeof addr.sun_path) /* re-used as a size limit */
+        return -1;
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        perror("socket");
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, daemon_socket);
+
+    if (connect(fd, (struct sockaddr*)&addr, sizeof addr) == -1)
+        goto fail;
+
+    if (write(fd, path, len) != (ssize_t)len ||
+       write(fd, "\n", 1) != 1)
+    {
+        goto fail;
+    }
+
+    if (fcntl(fd, F_SETFL, O_NONBLOCK) == -1)
+        goto fail;
+
+    return fd;
+
+fail:
+    if (close(fd) == -1)
+        abort();
+    return -1;
+}
+
+/*
+ * Propagate a newly stored meter byte up its peak pyramid
+ *
+ * The meters arrive in order, so an entry is re-written as its
+ * right-hand children appear; entries wholly beyond the committed
+ * audio are never read.
+ */
+
+static void pyramid_update(const unsigned char *base, unsigned char *pyr,
+                           unsigned int entries, unsigned int levels,
+                           unsigned int g)
+{
+    const unsigned char *child = base;
+    unsigned int k, off = 0;
+
+    for (k = 1; k <= levels; k++) {
+        unsigned int i = g >> k;
+        unsigned char v;
+
+        v = child[i * 2];
+        if (i * 2 + 1 <= (g >> (k - 1)) && child[i * 2 + 1] > v)
+            v = child[i * 2 + 1];
+
+        pyr[off + i] = v;
+
+        child = pyr + off;
+        off += entries >> k;
+    }
+}
+
+/*
+ * Zero the pyramid entries beyond the ones in use, so that heap
+ * contents do not reach the on-disk cache
+ */
+
+static void pyramid_zero_tail(unsigned char *pyr, unsigned int entries,
+                              unsigned int levels, unsigned int used)
+{
+    unsigned int k, off = 0;
+
+    for (k = 1; k <= levels; k++) {
+        unsigned int len = entries >> k,
+            m = ((used - 1) >> k) + 1;
+
+        memset(pyr + off + m, 0, len - m);
+        off += len;
+    }
+}
+
+/* On-disk cache of the decoded PCM and meters, keyed on the source
+ * path, its mtime and the sample rate. Without it every load runs
+ * the importer and decodes the whole file; with it a repeat load
+ * maps the previous result and the kernel pages audio in on demand */
+
+#define CACHE_MAGIC "xwaxpcm"
+#define CACHE_VERSION 3 /* v3: meters moved ahead of the audio */
+#define CACHE_DATA 4096 /* file offset of the first block */
+
+struct cache_header {
+    char magic[8];
+    uint32_t version, rate;
+    uint64_t mtime;
+    uint32_t length, /* in samples */
+        path_len; /* of the source path, including terminator */
+};
+
+/*
+ * Hash of the source path, used only to name the cache file; the
+ * path stored in the header is authoritative. On the rare collision
+ * the last import wins and the other track simply re-imports.
+ */
+
+static uint32_t hash_path(const char *path)
+{
+    uint32_t h = 2166136261u; /* FNV-1a */
+
+    while (*path != '\0') {
+        h ^= (unsigned char)*path++;
+        h *= 16777619u;
+    }
+
+    return h;
+}
+
+/*
+ * Path of the cache file for the given track, optionally creating
+ * the cache directory on the way
+ *
+ * Return: -1 if no suitable directory is configured, otherwise 0
+ */
+
+static int cache_file(const char *path, bool create, char *buf, size_t len)
+{
+    char dir[256];
+    int r;
+
+    if (cache_dir(create, dir, sizeof dir) == -1)
+        return -1;
+
+    r = snprintf(buf, len, "%s/%08x.pcm", dir, hash_path(path));
+    if (r < 0 || (size_t)r >= len)
+        return -1;
+
+    return 0;
+}
+
+/*
+ * Map a previously cached track, if one is valid for the file
+ * currently at the given path
+ *
+ * The blocks are pointed directly into the read-only mapping, so
+ * the layout on disk is the in-memory struct track_block.
+ *
+ * Return: -1 if no valid cache is available, otherwise 0
+ * Post: if 0 is returned, the audio and meters of tr are populated
+ */
+
+static int cache_load(struct track *tr, const char *path)
+{
+    char file[512], stored[CACHE_DATA];
+    struct cache_header h;
+    struct stat st, fs;
+    size_t blocks, bytes;
+    unsigned int n;
+    void *map;
+    int fd;
+
+    if (stat(path, &st) == -1)
+        return -1;
+
+    if (cache_file(path, false, file, sizeof file) == -1)
+        return -1;
+
+    fd = open(file, O_RDONLY);
+    if (fd == -1)
+        return -1;
+
+    if (read(fd, &h, sizeof h) != sizeof h)
+        goto fail;
+
+    if (memcmp(h.magic, CACHE_MAGIC, sizeof h.magic) != 0 ||
+       h.version != CACHE_VERSION ||
+       h.rate != RATE ||
+       h.mtime != (uint64_t)st.st_mtime ||
+       h.path_len == 0 ||
+       h.path_len > sizeof stored)
+    {
+        goto fail;
+    }
+
+    if (read(fd, stored, h.path_len) != (ssize_t)h.path_len)
+        goto fail;
+
+    if (stored[h.path_len - 1] != '\0' || strcmp(stored, path) != 0)
+        goto fail;
+
+    blocks = (h.length + TRACK_BLOCK_SAMPLES - 1) / TRACK_BLOCK_SAMPLES;
+    if (blocks == 0 || blocks > TRACK_MAX_BLOCKS)
+        goto fail;
+
+    bytes = CACHE_DATA + blocks * sizeof(struct track_block);
+
+    if (fstat(fd, &fs) == -1 ||
+       (size_t)fs.st_size != bytes) /* eg. truncated write */
+    {
+        goto fail;
+    }
+
+    map = mmap(NULL, bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+        goto fail;
+
+    if (use_mlock && mlock(map, bytes) == -1) {
+        perror("mlock");
+        if (munmap(map, bytes) == -1)
+            abort();
+        goto fail;
+    }
+
+    if (close(fd) == -1)
+        abort(); /* under our control; see close(2) */
+
+    for (n = 0; n < blocks; n++)
+        tr->block[n] = (struct track_block*)((char*)map + CACHE_DATA) + n;
+
+    tr->blocks = blocks;
+    tr->length = h.length;
+    tr->bytes = (size_t)h.length * SAMPLE;
+    tr->rate = h.rate;
+    tr->map = map;
+    tr->maplen = bytes;
+
+    return 0;
+
+fail:
+    if (close(fd) == -1)
+        abort();
+    return -1;
+}
+
+/*
+ * Cache the decoded PCM and meters to disk, ready for an instant
+ * reload next time
+ *
+ * Failure is not fatal; the track is simply imported again.
+ */
+
+static void cache_save(struct track *tr)
+{
+    char file[512], tmp[520];
+    static const char zero[CACHE_DATA];
+    struct cache_header h;
+    struct stat st;
+    unsigned int n, fill, blocks;
+    size_t path_len, pad;
+    FILE *f;
+
+    if (tr->length == 0 || tr->map != NULL)
+        return;
+
+    /* Blocks holding audio; one further block may have been
+     * allocated ahead of the pipe, and is not written out */
+
+    blocks = (tr->length - 1) / TRACK_BLOCK_SAMPLES + 1;
+
+    path_len = strlen(tr->path) + 1;
+    if (sizeof h + path_len > CACHE_DATA)
+        return;
+
+    if (stat(tr->path, &st) == -1)
+        return;
+
+    if (cache_file(tr->path, true, file, sizeof file) == -1)
+        return;
+
+    if (snprintf(tmp, sizeof tmp, "%s.new", file) >= (int)sizeof tmp)
+        return;
+
+    /* The unused tail of the last block would otherwise write heap
+     * contents to disk; it is past the track length and never read */
+
+    fill = tr->length % TRACK_BLOCK_SAMPLES;
+    if (fill != 0) {
+        struct track_block *b = tr->block[blocks - 1];
+        unsigned int m;
+
+        if (tr->compact) {
+            memset((unsigned char*)b->pcm + fill * TRACK_CHANNELS,
+                   mulaw(0),
+                   (TRACK_BLOCK_SAMPLES - fill) * TRACK_CHANNELS);
+        } else {
+            memset(b->pcm + fill * TRACK_CHANNELS, 0,
+                   (TRACK_BLOCK_SAMPLES - fill) * SAMPLE);
+        }
+
+        m = (fill - 1) / TRACK_PPM_RES + 1;
+        memset(b->ppm + m, 0, sizeof b->ppm - m);
+        pyramid_zero_tail(b->ppm_peak, TRACK_PPM_GROUPS,
+                          TRACK_PPM_LEVELS, m);
+
+        m = (fill - 1) / TRACK_OVERVIEW_RES + 1;
+        memset(b->overview + m, 0, sizeof b->overview - m);
+        pyramid_zero_tail(b->overview_peak, TRACK_OVERVIEW_GROUPS,
+                          TRACK_OVERVIEW_LEVELS, m);
+    }
+
+    f = fopen(tmp, "w");
+    if (f == NULL)
+        return;
+
+    memset(&h, 0, sizeof h);
+    memcpy(h.magic, CACHE_MAGIC, sizeof h.magic);
+    h.version = CACHE_VERSION;
+    h.rate = tr->rate;
+    h.mtime = st.st_mtime;
+    h.length = tr->length;
+    h.path_len = path_len;
+
+    pad = CACHE_DATA - sizeof h - path_len;
+
+    if (fwrite(&h, sizeof h, 1, f) != 1 ||
+       fwrite(tr->path, path_len, 1, f) != 1 ||
+       (pad > 0 && fwrite(zero, pad, 1, f) != 1))
+    {
+        goto fail;
+    }
+
+    for (n = 0; n < blocks; n++) {
+        struct track_block *b = tr->block[n];
+
+        if (!tr->compact) {
+            if (fwrite(b, sizeof(struct track_block), 1, f) != 1)
+                goto fail;
+            continue;
+        }
+
+        /* The cache always holds 16-bit PCM; expand the mu-law
+         * codes, so the file reloads on any configuration */
+
+        if (fwrite(b, offsetof(struct track_block, pcm), 1, f) != 1)
+            goto fail;
+
+        {
+            const unsigned char *m = (const unsigned char*)b->pcm;
+            unsigned int i;
+
+            for (i = 0; i < TRACK_BLOCK_SAMPLES * TRACK_CHANNELS; ) {
+                signed short buf[4096];
+                unsigned int j;
+
+                for (j = 0; j < 4096; j++)
+                    buf[j] = track_mulaw[m[i + j]];
+                i += 4096;
+
+                if (fwrite(buf, sizeof buf, 1, f) != 1)
+                    goto fail;
+            }
+        }
+    }
+
+    if (fclose(f) == EOF) {
+        unlink(tmp);
+        return;
+    }
 
-/*
- * Request that memory for tracks is locked into RAM as it is
- * allocated
- */
+    if (rename(tmp, file) == -1) /* atomic replace */
+        unlink(tmp);
 
-void track_use_mlock(void)
-{
-    use_mlock = true;
+    return;
+
+fail:
+    fclose(f);
+    unlink(tmp);
 }
 
 /*
@@ -87,16 +771,22 @@ static int more_space(struct track *tr)
         return -1;
     }
 
-    block = malloc(sizeof(struct track_block));
-    if (block == NULL) {
-        perror("malloc");
-        return -1;
-    }
+    block = pool_get();
 
-    if (use_mlock && mlock(block, sizeof(struct track_block)) == -1) {
-        perror("mlock");
-        free(block);
-        return -1;
+    if (block == NULL) { /* pool is empty, or not in use */
+        block = malloc(block_bytes());
+        if (block == NULL) {
+            perror("malloc");
+            return -1;
+        }
+
+        if (use_mlock && mlock(block, block_bytes()) == -1) {
+            perror("mlock");
+            free(block);
+            return -1;
+        }
+
+        memory_add(MEMORY_TRACK, block_bytes());
     }
 
     /* No memory barrier is needed here, because nobody else tries to
@@ -111,13 +801,17 @@ static int more_space(struct track *tr)
 }
 
 /*
- * Get access to the PCM buffer for incoming audio
+ * Get access to the PCM buffers for incoming audio
  *
- * Return: pointer to buffer
- * Post: len contains the length of the buffer, in bytes
+ * When close to a block boundary, the next block is opened up too,
+ * so that a full pipe buffer is not cut short at the edge and
+ * drained with a second syscall on the next wakeup.
+ *
+ * Return: number of entries placed in iov, or 0 if memory could
+ * not be allocated
  */
 
-static void* access_pcm(struct track *tr, size_t *len)
+static int access_pcm(struct track *tr, struct iovec iov[2])
 {
     unsigned int block;
     size_t fill;
@@ -125,13 +819,54 @@ static void* access_pcm(struct track *tr, size_t *len)
     block = tr->bytes / TRACK_BLOCK_PCM_BYTES;
     if (block == tr->blocks) {
         if (more_space(tr) == -1)
-            return NULL;
+            return 0;
+    }
+
+    /* A compact track receives 16-bit PCM into a staging buffer,
+     * and commit() encodes it into the block */
+
+    if (tr->compact) {
+        size_t space;
+
+        if (tr->stage == NULL) {
+            tr->stage = malloc(PIPE_BUFFER);
+            if (tr->stage == NULL) {
+                perror("malloc");
+                return 0;
+            }
+        }
+
+        fill = tr->bytes - (size_t)tr->length * SAMPLE; /* residual */
+        space = (size_t)(block + 1) * TRACK_BLOCK_PCM_BYTES - tr->bytes;
+
+        if (space < PIPE_BUFFER - fill &&
+           (block + 1 < tr->blocks || more_space(tr) != -1))
+        {
+            space += TRACK_BLOCK_PCM_BYTES;
+        }
+
+        iov[0].iov_base = (char*)tr->stage + fill;
+        iov[0].iov_len = PIPE_BUFFER - fill;
+        if (iov[0].iov_len > space)
+            iov[0].iov_len = space;
+
+        return 1;
     }
 
     fill = tr->bytes % TRACK_BLOCK_PCM_BYTES;
-    *len = TRACK_BLOCK_PCM_BYTES - fill;
+    iov[0].iov_base = (void*)tr->block[block]->pcm + fill;
+    iov[0].iov_len = TRACK_BLOCK_PCM_BYTES - fill;
+
+    if (iov[0].iov_len >= PIPE_BUFFER)
+        return 1;
+
+    if (block + 1 == tr->blocks && more_space(tr) == -1)
+        return 1; /* use what we have */
+
+    iov[1].iov_base = (void*)tr->block[block + 1]->pcm;
+    iov[1].iov_len = TRACK_BLOCK_PCM_BYTES;
 
-    return (void*)tr->block[block]->pcm + fill;
+    return 2;
 }
 
 /*
@@ -141,49 +876,131 @@ static void* access_pcm(struct track *tr, size_t *len)
  * placed in the buffer.
  */
 
-static void commit_pcm_samples(struct track *tr, unsigned int samples)
+/*
+ * Rectify a run of stereo frames to v = |left| + |right|
+ *
+ * The sum is used modulo 2^16, as the scalar code has always
+ * truncated it to an unsigned short.
+ */
+
+static void rectify(const signed short *pcm, uint32_t *v, unsigned int n)
+{
+    unsigned int i = 0;
+
+#ifdef __x86_64__
+    for (; i + 4 <= n; i += 4) {
+        __m128i s, a;
+
+        s = _mm_loadu_si128((const __m128i*)(pcm + i * TRACK_CHANNELS));
+        a = _mm_max_epi16(s, _mm_sub_epi16(_mm_setzero_si128(), s));
+        _mm_storeu_si128((__m128i*)(v + i),
+                         _mm_madd_epi16(a, _mm_set1_epi16(1)));
+    }
+#endif
+
+#ifdef __ARM_NEON
+    for (; i + 4 <= n; i += 4) {
+        int16x8_t s;
+
+        s = vld1q_s16(pcm + i * TRACK_CHANNELS);
+        vst1q_u32(v + i, vpaddlq_u16(vreinterpretq_u16_s16(vabsq_s16(s))));
+    }
+#endif
+
+    for (; i < n; i++) {
+        v[i] = abs(pcm[i * TRACK_CHANNELS])
+            + abs(pcm[i * TRACK_CHANNELS + 1]);
+    }
+}
+
+static void commit_pcm_samples(struct track *tr, const signed short *src,
+                               unsigned int samples)
 {
-    unsigned int fill, n;
-    signed short *pcm;
+    unsigned int fill, end, done;
+    const signed short *pcm;
     struct track_block *block;
 
     block = tr->block[tr->length / TRACK_BLOCK_SAMPLES];
     fill = tr->length % TRACK_BLOCK_SAMPLES;
-    pcm = block->pcm + TRACK_CHANNELS * fill;
+
+    /* Audio arrives in place in the block, unless staged for
+     * encoding (compact mode), when the caller passes it in */
+
+    pcm = src != NULL ? src : block->pcm + TRACK_CHANNELS * fill;
 
     assert(samples <= TRACK_BLOCK_SAMPLES - fill);
 
-    /* Meter the new audio */
+    end = fill + samples;
+
+    if (tr->compact) {
+        unsigned char *out = (unsigned char*)block->pcm
+            + (size_t)fill * TRACK_CHANNELS;
+        unsigned int i;
+
+        for (i = 0; i < samples * TRACK_CHANNELS; i++)
+            out[i] = mulaw(pcm[i]);
+    }
+
+    /* Meter the new audio. The rectification runs a SIMD pass
+     * ahead of the filters, which are serial by nature, and the
+     * meters are stored once per group rather than every sample */
+
+    for (done = 0; done < samples; ) {
+        uint32_t v[METER_CHUNK];
+        unsigned int m, i;
+
+        m = samples - done;
+        if (m > METER_CHUNK)
+            m = METER_CHUNK;
+
+        rectify(pcm + done * TRACK_CHANNELS, v, m);
 
-    for (n = samples; n > 0; n--) {
-        unsigned short v;
-        unsigned int w;
+        for (i = 0; i < m; i++) {
+            unsigned short x = v[i];
+            unsigned int w;
 
-        v = abs(pcm[0]) + abs(pcm[1]);
+            /* PPM-style fast meter approximation */
 
-        /* PPM-style fast meter approximation */
+            if (x > tr->ppm)
+                tr->ppm += (x - tr->ppm) >> 3;
+            else
+                tr->ppm -= (tr->ppm - x) >> 9;
 
-        if (v > tr->ppm)
-            tr->ppm += (v - tr->ppm) >> 3;
-        else
-            tr->ppm -= (tr->ppm - v) >> 9;
+            /* Update the slow-metering overview. Fixed point
+             * arithmetic going on here */
 
-        block->ppm[fill / TRACK_PPM_RES] = tr->ppm >> 8;
+            w = (unsigned int)x << 16;
 
-        /* Update the slow-metering overview. Fixed point arithmetic
-         * going on here */
+            if (w > tr->overview)
+                tr->overview += (w - tr->overview) >> 8;
+            else
+                tr->overview -= (tr->overview - w) >> 17;
 
-        w = v << 16;
+            fill++;
 
-        if (w > tr->overview)
-            tr->overview += (w - tr->overview) >> 8;
-        else
-            tr->overview -= (tr->overview - w) >> 17;
+            /* Group boundary, or the partial group at the end of
+             * the batch; the audio is not yet readable, so nobody
+             * sees the intermediate values we no longer store */
 
-        block->overview[fill / TRACK_OVERVIEW_RES] = tr->overview >> 24;
+            if (fill % TRACK_PPM_RES == 0 || fill == end) {
+                unsigned int g = (fill - 1) / TRACK_PPM_RES;
 
-        fill++;
-        pcm += TRACK_CHANNELS;
+                block->ppm[g] = tr->ppm >> 8;
+                pyramid_update(block->ppm, block->ppm_peak,
+                               TRACK_PPM_GROUPS, TRACK_PPM_LEVELS, g);
+            }
+
+            if (fill % TRACK_OVERVIEW_RES == 0 || fill == end) {
+                unsigned int g = (fill - 1) / TRACK_OVERVIEW_RES;
+
+                block->overview[g] = tr->overview >> 24;
+                pyramid_update(block->overview, block->overview_peak,
+                               TRACK_OVERVIEW_GROUPS,
+                               TRACK_OVERVIEW_LEVELS, g);
+            }
+        }
+
+        done += m;
     }
 
     /* Increment the track length. A memory barrier ensures the
@@ -196,13 +1013,82 @@ static void commit_pcm_samples(struct track *tr, unsigned int samples)
  * Notify that data has been placed in the buffer
  *
  * This function passes any whole samples to commit_pcm_samples()
- * and leaves the residual in the buffer ready for next time.
+ * and leaves the residual in the buffer ready for next time. A
+ * read-ahead into the next block can span a block boundary, so the
+ * samples are committed one block at a time.
  */
 
 static void commit(struct track *tr, size_t len)
 {
+    const signed short *src = tr->stage;
+
     tr->bytes += len;
-    commit_pcm_samples(tr, tr->bytes / SAMPLE - tr->length);
+
+    while (tr->bytes / SAMPLE > tr->length) {
+        unsigned int samples, space;
+
+        samples = tr->bytes / SAMPLE - tr->length;
+        space = TRACK_BLOCK_SAMPLES - tr->length % TRACK_BLOCK_SAMPLES;
+        if (samples > space)
+            samples = space;
+
+        commit_pcm_samples(tr, tr->compact ? src : NULL, samples);
+
+        if (tr->compact)
+            src += samples * TRACK_CHANNELS;
+    }
+
+    /* Keep any partial sample at the head of the staging buffer,
+     * ready to be completed by the next read */
+
+    if (tr->compact) {
+        size_t residual = tr->bytes - (size_t)tr->length * SAMPLE;
+
+        memmove(tr->stage, src, residual);
+    }
+}
+
+/*
+ * Decode a track in-process, directly into the track's own buffers
+ *
+ * One thread per track being loaded; no process spawn, and no copy
+ * of the decoded audio through a pipe. The rig is woken to complete
+ * the track when decoding finishes.
+ */
+
+static void* decode_thread(void *arg)
+{
+    struct track *t = arg;
+    const struct decoder *d = decoder_get();
+
+    for (;;) {
+        struct iovec iov[2];
+        ssize_t z;
+
+        if (__atomic_load_n(&t->terminated, __ATOMIC_RELAXED))
+            break;
+
+        if (access_pcm(t, iov) == 0)
+            break;
+
+        z = d->read(t->decoder, iov[0].iov_base, iov[0].iov_len / SAMPLE);
+        if (z <= 0) {
+            if (z < 0) {
+                fprintf(stderr, "Error decoding %s\n", t->path);
+                t->terminated = true; /* incomplete; do not cache */
+            }
+            break;
+        }
+
+        commit(t, z * SAMPLE);
+    }
+
+    d->close(t->decoder);
+
+    __atomic_store_n(&t->done, true, __ATOMIC_RELEASE);
+    rig_awaken();
+
+    return NULL;
 }
 
 /*
@@ -217,28 +1103,101 @@ static int track_init(struct track *t, const char *importer, const char *path)
 {
     pid_t pid;
 
+    t->refcount = 0;
+    t->throttle = false;
+    t->terminated = false;
+    t->ppm = 0;
+    t->overview = 0;
+    t->importer = importer;
+    t->path = path;
+    t->map = NULL;
+    t->maplen = 0;
+    t->decoder = NULL;
+    t->done = false;
+    t->stream = false;
+    t->demand = 0;
+    t->compact = false; /* a mapped cache is always 16-bit */
+    t->stage = NULL;
+
+    /* A valid cache means no import at all; the audio is mapped
+     * and ready before this function returns */
+
+    if (cache_load(t, path) == 0) {
+        fprintf(stderr, "Mapped cached PCM for '%s'\n", path);
+        t->pid = 0;
+        list_add(&t->tracks, &tracks);
+        return 0;
+    }
+
+    t->compact = use_compact;
+
+    /* An in-process decoder, where one is loaded and accepts the
+     * file, avoids the importer altogether */
+
+    if (decoder_get() != NULL)
+        t->decoder = decoder_get()->open(path, RATE);
+
+    if (t->decoder != NULL) {
+        fprintf(stderr, "Decoding '%s'...\n", path);
+
+        t->pid = 0;
+        t->blocks = 0;
+        t->rate = RATE;
+        t->bytes = 0;
+        t->length = 0;
+
+        list_add(&t->tracks, &tracks);
+        rig_post_track(t);
+
+        if (pthread_create(&t->thread, NULL, decode_thread, t) != 0)
+            abort(); /* under our control; see pthread_create(3) */
+
+        return 0;
+    }
+
     fprintf(stderr, "Importing '%s'...\n", path);
 
+    /* Stream from the importer daemon, where one is running for
+     * this importer; fall back to fork and exec, eg. while the
+     * daemon is still starting up */
+
+    if (daemon_pid != 0 && importer == daemon_importer) {
+        t->fd = daemon_connect(path);
+        if (t->fd != -1) {
+            t->pid = 0;
+            t->stream = true;
+
+            t->blocks = 0;
+            t->rate = RATE;
+            t->bytes = 0;
+            t->length = 0;
+
+            list_add(&t->tracks, &tracks);
+            rig_post_track(t);
+
+            return 0;
+        }
+    }
+
     pid = fork_pipe_nb(&t->fd, importer, "import", path, STR(RATE), NULL);
     if (pid == -1)
         return -1;
 
     t->pid = pid;
-    t->pe = NULL;
-    t->terminated = false;
 
-    t->refcount = 0;
+#ifdef F_SETPIPE_SZ
+    /* A larger pipe carries more audio per rig wakeup; the kernel
+     * may refuse, and the default size still works */
+
+    if (fcntl(t->fd, F_SETPIPE_SZ, PIPE_BUFFER) == -1)
+        debug("F_SETPIPE_SZ: %s", strerror(errno));
+#endif
 
     t->blocks = 0;
     t->rate = RATE;
 
     t->bytes = 0;
     t->length = 0;
-    t->ppm = 0;
-    t->overview = 0;
-
-    t->importer = importer;
-    t->path = path;
 
     list_add(&t->tracks, &tracks);
     rig_post_track(t);
@@ -262,12 +1221,101 @@ static void track_clear(struct track *tr)
 
     assert(tr->pid == 0);
 
-    for (n = 0; n < tr->blocks; n++)
-        free(tr->block[n]);
+    if (tr->map != NULL) {
+        if (munmap(tr->map, tr->maplen) == -1)
+            abort(); /* under our control; see munmap(2) */
+    } else {
+        for (n = 0; n < tr->blocks; n++)
+            pool_put(tr->block[n]);
+    }
+
+    free(tr->stage);
 
     list_del(&tr->tracks);
 }
 
+/*
+ * Memory occupied by a track, used to account the retain budget
+ */
+
+static size_t track_size(const struct track *tr)
+{
+    if (tr->map != NULL)
+        return tr->maplen;
+
+    return sizeof *tr + (size_t)tr->blocks
+        * (tr->compact ? TRACK_BLOCK_COMPACT_BYTES
+           : sizeof(struct track_block));
+}
+
+/*
+ * Free retained tracks, least recently used first, while the global
+ * memory budget is short; see memory_short()
+ *
+ * The retained tracks are the only memory which can be given up
+ * without losing anything -- each is only a re-import away.
+ *
+ * Pre: called from the same side of the rig lock as retire()
+ */
+
+static void reclaim(void)
+{
+    while (memory_short() && !list_empty(&retained)) {
+        struct track *old;
+
+        old = list_entry(retained.prev, struct track, retained);
+
+        list_del(&old->retained);
+        retain_used -= track_size(old);
+
+        track_clear(old);
+        free(old);
+    }
+}
+
+/*
+ * Keep hold of a track which is no longer in use
+ *
+ * Reloading the track which just left the deck is common during a
+ * set; retaining it makes that free rather than a re-import. The
+ * least recently used tracks are freed to keep within the memory
+ * budget.
+ */
+
+static void retire(struct track *tr)
+{
+    size_t size;
+
+    size = track_size(tr);
+
+    if (tr->terminated || size > retain_limit) {
+        track_clear(tr);
+        free(tr);
+        return;
+    }
+
+    list_add(&tr->retained, &retained);
+    retain_used += size;
+
+    debug("retained track '%s' (%zu of %zu bytes in use)",
+          tr->path, retain_used, retain_limit);
+
+    while (retain_used > retain_limit) {
+        struct track *old;
+
+        old = list_entry(retained.prev, struct track, retained);
+        assert(old != tr); /* size <= retain_limit, checked above */
+
+        list_del(&old->retained);
+        retain_used -= track_size(old);
+
+        track_clear(old);
+        free(old);
+    }
+
+    reclaim();
+}
+
 /*
  * Get a pointer to a track object already in memory
  *
@@ -280,6 +1328,14 @@ static struct track* track_get_again(const char *importer, const char *path)
 
     list_for_each(t, &tracks, tracks) {
         if (t->importer == importer && t->path == path) {
+
+            /* A retained track comes back into use */
+
+            if (t->refcount == 0) {
+                list_del(&t->retained);
+                retain_used -= track_size(t);
+            }
+
             track_acquire(t);
             return t;
         }
@@ -302,6 +1358,10 @@ struct track* track_acquire_by_import(const char *importer, const char *path)
     if (t != NULL)
         return t;
 
+    /* Make room for the incoming audio ahead of its import */
+
+    reclaim();
+
     t = malloc(sizeof *t);
     if (t == NULL) {
         perror("malloc");
@@ -336,17 +1396,24 @@ void track_acquire(struct track *t)
 }
 
 /*
- * Request premature termination of an import operation
+ * Request premature termination of an import or decode operation
  */
 
 static void terminate(struct track *t)
 {
-    assert(t->pid != 0);
+    assert(track_is_importing(t));
 
-    if (kill(t->pid, SIGTERM) == -1)
+    if (t->pid != 0 && kill(t->pid, SIGTERM) == -1)
         abort();
 
-    t->terminated = true;
+    /* End of stream tells the daemon to stop decoding */
+
+    if (t->stream && shutdown(t->fd, SHUT_RDWR) == -1)
+        abort();
+
+    /* The decode thread checks this flag between blocks */
+
+    __atomic_store_n(&t->terminated, true, __ATOMIC_RELAXED);
 }
 
 /*
@@ -360,33 +1427,137 @@ void track_release(struct track *t)
     /* When importing, a reference is held. If it's the
      * only one remaining terminate it to save resources */
 
-    if (t->refcount == 1 && t->pid != 0) {
+    if (t->refcount == 1 && track_is_importing(t)) {
         terminate(t);
         return;
     }
 
     if (t->refcount == 0) {
         assert(t != &empty);
-        track_clear(t);
-        free(t);
+        retire(t);
+    }
+}
+
+/*
+ * Clamp a sample range to the audio currently loaded
+ *
+ * Return: number of samples in the range, possibly zero
+ */
+
+static unsigned int clamp_range(struct track *tr, unsigned int start,
+                                unsigned int samples)
+{
+    unsigned int length;
+
+    length = __atomic_load_n(&tr->length, __ATOMIC_ACQUIRE);
+
+    if (start >= length)
+        return 0;
+    if (samples > length - start)
+        samples = length - start;
+
+    return samples;
+}
+
+/*
+ * Pin the PCM for a range of samples into RAM
+ *
+ * Used to back cue points, so that jumping to one does not fault
+ * pages in on the audio path. Pins are not reference counted; the
+ * pages stay resident until the track itself is freed.
+ */
+
+void track_pin(struct track *tr, unsigned int start, unsigned int samples)
+{
+    long page;
+
+    page = sysconf(_SC_PAGESIZE);
+
+    samples = clamp_range(tr, start, samples);
+
+    while (samples > 0) {
+        unsigned int block, offset, n;
+        uintptr_t a, b;
+
+        block = start / TRACK_BLOCK_SAMPLES;
+        offset = start % TRACK_BLOCK_SAMPLES;
+
+        n = TRACK_BLOCK_SAMPLES - offset;
+        if (n > samples)
+            n = samples;
+
+        /* A compact track stores one byte per channel sample */
+
+        if (tr->compact) {
+            a = (uintptr_t)tr->block[block]->pcm
+                + (size_t)offset * TRACK_CHANNELS;
+            b = a + (size_t)n * TRACK_CHANNELS;
+        } else {
+            a = (uintptr_t)&tr->block[block]->pcm[offset * TRACK_CHANNELS];
+            b = a + n * SAMPLE;
+        }
+
+        a -= a % page;
+
+        if (mlock((void*)a, b - a) == -1)
+            debug("mlock: %s", strerror(errno));
+
+        start += n;
+        samples -= n;
     }
 }
 
 /*
- * Get entry for use by poll()
+ * Warm the cache with the PCM for a range of samples
+ */
+
+void track_warm(struct track *tr, unsigned int start, unsigned int samples)
+{
+    unsigned int s;
+    volatile signed short acc = 0;
+
+    samples = clamp_range(tr, start, samples);
+
+    /* One touch per cache line is enough */
+
+    for (s = 0; s < samples; s += 64 / SAMPLE)
+        acc += *track_get_sample(tr, start + s);
+
+    (void)acc;
+}
+
+/*
+ * The descriptor which feeds this import, registered with the rig
+ *
+ * Return: file descriptor, or -1 for an in-process decode which
+ * has none
+ */
+
+int track_fd(const struct track *t)
+{
+    if (t->pid == 0 && !t->stream)
+        return -1;
+
+    return t->fd;
+}
+
+/*
+ * Set whether this track's pipe is left unread, giving the ingest
+ * bandwidth to a track which playback is about to overrun
  *
  * Pre: track is importing
- * Post: *pe contains poll entry
+ * Return: true if the state changed, otherwise false
  */
 
-void track_pollfd(struct track *t, struct pollfd *pe)
+bool track_throttle(struct track *t, bool throttle)
 {
-    assert(t->pid != 0);
+    assert(track_is_importing(t));
 
-    pe->fd = t->fd;
-    pe->events = POLLIN;
+    if (t->throttle == throttle)
+        return false;
 
-    t->pe = pe;
+    t->throttle = throttle;
+    return true;
 }
 
 /*
@@ -399,15 +1570,15 @@ void track_pollfd(struct track *t, struct pollfd *pe)
 static int read_from_pipe(struct track *tr)
 {
     for (;;) {
-        void *pcm;
-        size_t len;
+        struct iovec iov[2];
+        int count;
         ssize_t z;
 
-        pcm = access_pcm(tr, &len);
-        if (pcm == NULL)
+        count = access_pcm(tr, iov);
+        if (count == 0)
             return -1;
 
-        z = read(tr->fd, pcm, len);
+        z = readv(tr->fd, iov, count);
         if (z == -1) {
             if (errno == EAGAIN) {
                 return 0;
@@ -437,6 +1608,27 @@ static void stop_import(struct track *t)
 {
     int status;
 
+    free(t->stage);
+    t->stage = NULL;
+
+    /* Withdraw before close(); the registration would outlive a
+     * close() if any duplicate of the descriptor remains */
+
+    rig_unmonitor(t->fd);
+
+    if (t->stream) { /* daemon; no child of our own to reap */
+        if (close(t->fd) == -1)
+            abort();
+
+        t->stream = false;
+
+        fprintf(stderr, "Track import completed\n");
+        if (!t->terminated)
+            cache_save(t);
+
+        return;
+    }
+
     assert(t->pid != 0);
 
     if (close(t->fd) == -1)
@@ -447,6 +1639,8 @@ static void stop_import(struct track *t)
 
     if (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS) {
         fprintf(stderr, "Track import completed\n");
+        if (!t->terminated)
+            cache_save(t);
     } else {
         fprintf(stderr, "Track import completed with status %d\n", status);
         if (!t->terminated)
@@ -464,15 +1658,32 @@ static void stop_import(struct track *t)
 
 void track_handle(struct track *tr)
 {
-    assert(tr->pid != 0);
+    /* Completion of an in-process decode */
+
+    if (tr->decoder != NULL) {
+        if (!__atomic_load_n(&tr->done, __ATOMIC_ACQUIRE))
+            return;
+
+        if (pthread_join(tr->thread, NULL) != 0)
+            abort();
 
-    /* A track may be added while poll() was waiting,
-     * in which case it has no return data from poll */
+        tr->decoder = NULL;
 
-    if (tr->pe == NULL)
+        free(tr->stage);
+        tr->stage = NULL;
+
+        fprintf(stderr, "Track decode completed\n");
+        if (!tr->terminated)
+            cache_save(tr);
+
+        list_del(&tr->rig);
+        track_release(tr); /* may delete the track */
         return;
+    }
+
+    assert(tr->pid != 0 || tr->stream);
 
-    if (tr->pe->revents == 0)
+    if (tr->throttle)
         return;
 
     if (read_from_pipe(tr) != -1)
@@ -20,8 +20,9 @@
 #ifndef TRACK_H
 #define TRACK_H
 
-#include <poll.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <sys/types.h>
 
 #include "list.h"
@@ -29,18 +30,63 @@
 #define TRACK_CHANNELS 2
 
 #define TRACK_MAX_BLOCKS 64
+#define TRACK_RETAIN_DEFAULT (256UL << 20) /* bytes */
 #define TRACK_BLOCK_SAMPLES (2048 * 1024)
 #define TRACK_PPM_RES 64
 #define TRACK_OVERVIEW_RES 2048
 
+#define TRACK_PPM_GROUPS (TRACK_BLOCK_SAMPLES / TRACK_PPM_RES)
+#define TRACK_OVERVIEW_GROUPS (TRACK_BLOCK_SAMPLES / TRACK_OVERVIEW_RES)
+
+/* Levels in the peak pyramids; the top level covers a whole block */
+
+#define TRACK_PPM_LEVELS 15
+#define TRACK_OVERVIEW_LEVELS 10
+
+/* Playback closer than this (in seconds) to the import frontier
+ * makes the import urgent */
+
+#define TRACK_MARGIN 10
+
+/* The meters come first, so that a compact block (below) is simply
+ * a truncation of this struct with the same offsets */
+
 struct track_block {
+    unsigned char ppm[TRACK_PPM_GROUPS],
+        overview[TRACK_OVERVIEW_GROUPS];
+
+    /* Pyramid of maxima over the meters above: level 1 (pairs of
+     * groups) first, then level 2, up to a single entry for the
+     * block. Maintained as the meters are committed */
+
+    unsigned char ppm_peak[TRACK_PPM_GROUPS - 1],
+        overview_peak[TRACK_OVERVIEW_GROUPS - 1];
+
     signed short pcm[TRACK_BLOCK_SAMPLES * TRACK_CHANNELS];
-    unsigned char ppm[TRACK_BLOCK_SAMPLES / TRACK_PPM_RES],
-        overview[TRACK_BLOCK_SAMPLES / TRACK_OVERVIEW_RES];
 };
 
+/* In compact mode the same block holds 8-bit mu-law codes in the
+ * pcm area, halving its size; see track_use_compact() */
+
+#define TRACK_BLOCK_COMPACT_BYTES \
+    (offsetof(struct track_block, pcm) \
+     + TRACK_BLOCK_SAMPLES * TRACK_CHANNELS)
+
+/* Code to 16-bit expansion, built when compact mode is enabled */
+
+extern signed short track_mulaw[256];
+
+/* Offset of the given pyramid level, numbered from 1 */
+
+static inline unsigned int track_peak_offset(unsigned int entries,
+                                             unsigned int level)
+{
+    return entries - (entries >> (level - 1));
+}
+
 struct track {
-    struct list tracks;
+    struct list tracks,
+        retained; /* recently-released tracks kept in memory */
     unsigned int refcount;
     int rate;
 
@@ -53,13 +99,37 @@ struct track {
         blocks; /* number of blocks allocated */
     struct track_block *block[TRACK_MAX_BLOCKS];
 
+    /* Memory-mapped PCM cache, or NULL if the blocks above are
+     * allocated on the heap */
+
+    void *map;
+    size_t maplen;
+
+    /* Compact (mu-law) audio, and the staging buffer which holds
+     * incoming 16-bit PCM ahead of encoding */
+
+    bool compact;
+    signed short *stage;
+
     /* State of audio import */
 
     struct list rig;
     pid_t pid;
     int fd;
-    struct pollfd *pe;
-    bool terminated;
+    bool throttle; /* leave the pipe unread; see track_throttle() */
+    bool terminated,
+        stream; /* fd is a daemon stream, not a child's pipe */
+
+    /* In-process decode, as an alternative to the importer */
+
+    pthread_t thread;
+    void *decoder; /* context, or NULL */
+    bool done;
+
+    /* Playback frontier (in samples); a hint written by the audio
+     * threads and read by the rig, without a lock */
+
+    unsigned int demand;
 
     /* Current value of audio meters when loading */
     
@@ -68,6 +138,11 @@ struct track {
 };
 
 void track_use_mlock(void);
+void track_use_compact(void);
+void track_set_retain(size_t bytes);
+void track_pool_init(void);
+int track_daemon(const char *importer);
+void track_daemon_stop(void);
 
 /* Tracks are dynamically allocated and reference counted */
 
@@ -78,14 +153,30 @@ void track_release(struct track *t);
 
 /* Functions used by the rig and main thread */
 
-void track_pollfd(struct track *tr, struct pollfd *pe);
+int track_fd(const struct track *tr);
+bool track_throttle(struct track *tr, bool throttle);
 void track_handle(struct track *tr);
 
-/* Return true if the track importer is running, otherwise false */
+/* Pin a region of PCM into RAM, and warm the cache with it */
+
+void track_pin(struct track *tr, unsigned int start, unsigned int samples);
+void track_warm(struct track *tr, unsigned int start, unsigned int samples);
+
+/* Return true if the track importer or decoder is running,
+ * otherwise false */
 
 static inline bool track_is_importing(struct track *tr)
 {
-    return tr->pid != 0;
+    return tr->pid != 0 || tr->stream || tr->decoder != NULL;
+}
+
+/* Return true if playback is close behind the import frontier, and
+ * so this import should be serviced ahead of any other */
+
+static inline bool track_is_starved(struct track *tr)
+{
+    return track_is_importing(tr)
+        && tr->demand + tr->rate * TRACK_MARGIN > tr->length;
 }
 
 /* Return the pseudo-PPM meter value for the given sample */
@@ -106,13 +197,67 @@ static inline unsigned char track_get_overview(struct track *tr, int s)
     return b->overview[(s % TRACK_BLOCK_SAMPLES) / TRACK_OVERVIEW_RES];
 }
 
-/* Return a pointer to (not value of) the sample data for each channel */
+/* Return the peak PPM meter value over the 2^level meter groups
+ * around the given sample, in constant time */
+
+static inline unsigned char track_get_ppm_peak(struct track *tr, int s,
+                                               unsigned int level)
+{
+    struct track_block *b;
+    unsigned int g;
+
+    if (level == 0)
+        return track_get_ppm(tr, s);
+
+    b = tr->block[s / TRACK_BLOCK_SAMPLES];
+    g = (s % TRACK_BLOCK_SAMPLES) / TRACK_PPM_RES;
+
+    return b->ppm_peak[track_peak_offset(TRACK_PPM_GROUPS, level)
+                       + (g >> level)];
+}
+
+/* Return the peak overview meter value over the 2^level meter
+ * groups around the given sample, in constant time */
+
+static inline unsigned char track_get_overview_peak(struct track *tr, int s,
+                                                    unsigned int level)
+{
+    struct track_block *b;
+    unsigned int g;
+
+    if (level == 0)
+        return track_get_overview(tr, s);
+
+    b = tr->block[s / TRACK_BLOCK_SAMPLES];
+    g = (s % TRACK_BLOCK_SAMPLES) / TRACK_OVERVIEW_RES;
+
+    return b->overview_peak[track_peak_offset(TRACK_OVERVIEW_GROUPS, level)
+                            + (g >> level)];
+}
+
+/* Return a pointer to (not value of) the sample data for each channel.
+ * A compact track expands into a per-thread sample; the pointer is
+ * valid until the caller's next fetch */
 
 static inline signed short* track_get_sample(struct track *tr, int s)
 {
     struct track_block *b;
+    unsigned int i;
+
     b = tr->block[s / TRACK_BLOCK_SAMPLES];
-    return &b->pcm[(s % TRACK_BLOCK_SAMPLES) * TRACK_CHANNELS];
+    i = (s % TRACK_BLOCK_SAMPLES) * TRACK_CHANNELS;
+
+    if (tr->compact) {
+        static __thread signed short f[TRACK_CHANNELS];
+        const unsigned char *m = (const unsigned char*)b->pcm + i;
+
+        f[0] = track_mulaw[m[0]];
+        f[1] = track_mulaw[m[1]];
+
+        return f;
+    }
+
+    return &b->pcm[i];
 }
 
 #endif
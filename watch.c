@@ -0,0 +1,636 @@
+/*
+ * Copyright (C) 2021 Mark Hills <mark@xwax.org>
+ *
+ * This file is part of "xwax".
+ *
+ * "xwax" is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 3 as
+ * published by the Free Software Foundation.
+ *
+ * "xwax" is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Watches on the library directories
+ *
+ * A full rescan re-reads the whole library even when a single file
+ * changed. Instead, inotify reports the change itself, and only the
+ * affected directory is re-scanned (with the crate's own scan
+ * script) and merged into the existing listings; a deleted file is
+ * simply dropped from them. The cost is proportional to the change,
+ * not the library.
+ *
+ * The scan script decides which names are music, so a changed
+ * directory is handed back to it rather than second-guessed here.
+ * Directories are watched as the scan (or the cache) reports records
+ * in them; a directory which has never held music is not noticed
+ * until a manual rescan does.
+ *
+ * All operations happen on the rig thread, or before it starts.
+ */
+
+#define _GNU_SOURCE /* alloca() */
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "excrate.h"
+#include "list.h"
+#include "rig.h"
+#include "watch.h"
+
+#define EVENT_BUF 4096 /* bytes, a batch of inotify events */
+
+#define WATCH_MASK (IN_ONLYDIR | IN_CLOSE_WRITE | IN_CREATE | \
+                    IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)
+
+/* A single watched directory */
+
+struct wdir {
+    struct list dirs;
+    int wd;
+    char path[];
+};
+
+/* A directory awaiting an incremental scan */
+
+struct dirty {
+    struct list dirty;
+    char path[];
+};
+
+static int ifd = -1; /* inotify, shared by all watches */
+static struct list watches = LIST_INIT(watches),
+    dirs = LIST_INIT(dirs);
+
+/*
+ * Watches are optional; without them the library still works, only
+ * a manual rescan notices changes
+ *
+ * Return: 0 on success, -1 on error
+ */
+
+int watch_global_init(void)
+{
+    assert(ifd == -1);
+
+    ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (ifd == -1)
+        fprintf(stderr, "Not watching the library for changes; no inotify on this system\n");
+
+    return 0;
+}
+
+void watch_global_clear(void)
+{
+    assert(list_empty(&watches));
+    assert(list_empty(&dirs));
+
+    if (ifd != -1) {
+        if (close(ifd) == -1)
+            abort();
+        ifd = -1;
+    }
+}
+
+/*
+ * Return: true if path is the given root, or lies below it
+ */
+
+static bool below(const char *root, const char *path)
+{
+    size_t len;
+
+    len = strlen(root);
+
+    return strncmp(path, root, len) == 0 &&
+        (path[len] == '\0' || path[len] == '/');
+}
+
+/*
+ * Return: the watched directory with the given descriptor, or NULL
+ */
+
+static struct wdir* watched(int wd)
+{
+    struct wdir *d;
+
+    list_for_each(d, &dirs, dirs) {
+        if (d->wd == wd)
+            return d;
+    }
+
+    return NULL;
+}
+
+/*
+ * Begin watching the given directory
+ *
+ * The same directory under two crates shares one watch; events are
+ * dispatched to every crate whose root covers it.
+ *
+ * Return: 0 on success, -1 on error
+ */
+
+static int add_dir(const char *path)
+{
+    int wd;
+    struct wdir *d;
+    static bool warned = false;
+
+    wd = inotify_add_watch(ifd, path, WATCH_MASK);
+    if (wd == -1) {
+        if (errno == ENOSPC && !warned) {
+            fprintf(stderr, "Too many directories to watch; some changes will not be noticed\n");
+            warned = true;
+        }
+        return -1;
+    }
+
+    if (watched(wd) != NULL) /* already known */
+        return 0;
+
+    d = malloc(sizeof *d + strlen(path) + 1);
+    if (d == NULL) {
+        perror("malloc");
+        return -1;
+    }
+
+    d->wd = wd;
+    strcpy(d->path, path);
+    list_add(&d->dirs, &dirs);
+
+    return 0;
+}
+
+/*
+ * Watch a new directory and everything below it
+ *
+ * Used when a directory appears under an existing watch; it is
+ * typically small (eg. an album being copied in). Symlinks are not
+ * followed -- a symlinked directory risks a loop, and the scan
+ * itself still visits it.
+ */
+
+static void add_tree(const char *path)
+{
+    DIR *dir;
+    struct dirent *de;
+
+    if (add_dir(path) == -1)
+        return;
+
+    dir = opendir(path);
+    if (dir == NULL)
+        return;
+
+    while ((de = readdir(dir)) != NULL) {
+        char *child;
+        struct stat st;
+
+        if (de->d_name[0] == '.')
+            continue;
+
+        child = alloca(strlen(path) + strlen(de->d_name) + 2);
+        sprintf(child, "%s/%s", path, de->d_name);
+
+        if (lstat(child, &st) == -1)
+            continue;
+
+        if (S_ISDIR(st.st_mode))
+            add_tree(child);
+    }
+
+    if (closedir(dir) == -1)
+        abort();
+}
+
+/*
+ * Stop watching the given directory and everything below it
+ */
+
+static void unwatch_tree(const char *path)
+{
+    struct wdir *d, *x;
+
+    list_for_each_safe(d, x, &dirs, dirs) {
+        if (!below(path, d->path))
+            continue;
+
+        (void)inotify_rm_watch(ifd, d->wd); /* may already be gone */
+        list_del(&d->dirs);
+        free(d);
+    }
+}
+
+/*
+ * Mark a path for an incremental scan -- the changed file itself,
+ * or a directory which just appeared
+ *
+ * A path already queued is not queued again; repeated writes to one
+ * file coalesce to a single scan.
+ */
+
+static void dirty(struct watch *w, const char *path)
+{
+    struct dirty *d;
+
+    list_for_each(d, &w->dirty, dirty) {
+        if (strcmp(d->path, path) == 0)
+            return;
+    }
+
+    d = malloc(sizeof *d + strlen(path) + 1);
+    if (d == NULL) {
+        perror("malloc");
+        return; /* a manual rescan will pick it up */
+    }
+
+    strcpy(d->path, path);
+    list_add_tail(&d->dirty, &w->dirty);
+}
+
+/*
+ * Mark the path dirty for every crate it falls under
+ */
+
+static void mark_dirty(const char *path)
+{
+    struct watch *w;
+
+    list_for_each(w, &watches, watches) {
+        if (below(w->crate->path, path))
+            dirty(w, path);
+    }
+}
+
+/*
+ * Drop the records at the given path from every crate it falls
+ * under, and from the global storage
+ */
+
+static void removed(const char *path)
+{
+    struct watch *w;
+    struct listing *storage = NULL;
+
+    list_for_each(w, &watches, watches) {
+        struct index gone;
+
+        if (!below(w->crate->path, path))
+            continue;
+
+        index_init(&gone);
+
+        if (listing_find_below(w->crate->listing, path, &gone) == 0)
+            (void)listing_remove_batch(w->crate->listing, &gone);
+
+        index_clear(&gone);
+        storage = w->storage;
+    }
+
+    if (storage != NULL) {
+        struct index gone;
+
+        index_init(&gone);
+
+        if (listing_find_below(storage, path, &gone) == 0)
+            (void)listing_remove_batch(storage, &gone);
+
+        index_clear(&gone);
+    }
+}
+
+/*
+ * The completion of an incremental scan
+ *
+ * The records are already in the global storage; merge what the
+ * scan delivered into the crate, in one batch.
+ *
+ * This event fires with the excrate mid-operation, so its release
+ * (and the next launch) is deferred to kick(); see watch_handle().
+ */
+
+static void scan_done(struct observer *o, void *x)
+{
+    struct watch *w = container_of(o, struct watch, on_scan);
+    struct index batch;
+
+    index_init(&batch);
+
+    if (index_copy(&w->rescan->fresh.by_order, &batch) == 0)
+        (void)listing_add_batch(w->crate->listing, &batch);
+
+    index_clear(&batch);
+
+    w->done = true;
+    rig_awaken();
+}
+
+/*
+ * Scan one dirty directory at a time; see scan_done()
+ */
+
+static void kick(struct watch *w)
+{
+    for (;;) {
+        struct dirty *d;
+        struct excrate *e;
+
+        if (w->rescan != NULL) {
+            if (!w->done)
+                return;
+
+            ignore(&w->on_scan);
+            excrate_release(w->rescan);
+            w->rescan = NULL;
+            free(w->scanning);
+            w->scanning = NULL;
+            w->done = false;
+        }
+
+        if (list_empty(&w->dirty))
+            return;
+
+        d = list_entry(w->dirty.next, struct dirty, dirty);
+        list_del(&d->dirty);
+
+        e = excrate_acquire_by_refresh(w->crate->scan, d->path, w->storage);
+        if (e == NULL) {
+            free(d);
+            continue;
+        }
+
+        w->scanning = d; /* the excrate refers to its path */
+        w->rescan = e;
+        watch(&w->on_scan, &e->completion, scan_done);
+
+        /* The launch may already have failed, before we could
+         * observe its completion */
+
+        if (e->pid == 0 && !e->pending)
+            w->done = true;
+    }
+}
+
+/*
+ * Begin watching the directory of the given records, including any
+ * intermediate directories up from the crate root
+ */
+
+static void cover(struct watch *w, const struct index *news)
+{
+    size_t n;
+    const char *last = NULL;
+
+    for (n = 0; n < news->entries; n++) {
+        char *buf, *s;
+        const char *dir = news->record[n]->dir;
+        size_t root;
+
+        if (dir == last) /* interned; records arrive grouped */
+            continue;
+        last = dir;
+
+        root = strlen(w->crate->path);
+
+        if (strncmp(dir, w->crate->path, root) != 0)
+            continue;
+
+        buf = strdupa(dir);
+
+        for (s = buf + root; *s != '\0'; s++) {
+            if (*s != '/')
+                continue;
+
+            *s = '\0';
+            (void)add_dir(buf);
+            *s = '/';
+        }
+    }
+}
+
+static void handle_addition(struct observer *o, void *x)
+{
+    struct watch *w = container_of(o, struct watch, on_addition);
+
+    cover(w, x);
+}
+
+/*
+ * Handle a single inotify event
+ */
+
+static void handle_event(const struct inotify_event *ev)
+{
+    char *path;
+    struct wdir *d;
+
+    if (ev->mask & IN_Q_OVERFLOW) {
+        struct watch *w;
+
+        /* Events were lost; re-scan whole crates. Deletions are
+         * missed until a manual rescan */
+
+        list_for_each(w, &watches, watches)
+            dirty(w, w->crate->path);
+
+        return;
+    }
+
+    d = watched(ev->wd);
+    if (d == NULL)
+        return; /* stale; no longer watched */
+
+    if (ev->mask & IN_IGNORED) {
+        list_del(&d->dirs);
+        free(d);
+        return;
+    }
+
+    if (ev->len == 0)
+        return;
+
+    path = alloca(strlen(d->path) + strlen(ev->name) + 2);
+    sprintf(path, "%s/%s", d->path, ev->name);
+
+    if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+        if (ev->mask & IN_ISDIR) {
+            add_tree(path);
+            mark_dirty(path);
+        } else if (ev->mask & IN_MOVED_TO) {
+            removed(path); /* replaces any record at this path */
+            mark_dirty(path);
+        }
+
+        /* A plain create of a file: wait for the close */
+
+        return;
+    }
+
+    if (ev->mask & IN_CLOSE_WRITE) {
+        removed(path); /* a re-tagged file replaces its record */
+        mark_dirty(path);
+        return;
+    }
+
+    if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+        removed(path);
+        if (ev->mask & IN_ISDIR)
+            unwatch_tree(path);
+    }
+}
+
+/*
+ * Keep the given crate up-to-date with changes on disk
+ *
+ * Return: the watch, or NULL if watches are not available
+ */
+
+struct watch* watch_add(struct crate *crate, struct listing *storage)
+{
+    struct watch *w;
+
+    if (ifd == -1)
+        return NULL;
+
+    w = malloc(sizeof *w);
+    if (w == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+
+    w->crate = crate;
+    w->storage = storage;
+    list_init(&w->dirty);
+    w->rescan = NULL;
+    w->scanning = NULL;
+    w->done = false;
+
+    watch(&w->on_addition, &crate->addition, handle_addition);
+    list_add(&w->watches, &watches);
+
+    (void)add_dir(crate->path);
+
+    /* Directories already known, typically from the cache; later
+     * ones arrive as additions */
+
+    cover(w, &crate->listing->by_order);
+
+    return w;
+}
+
+void watch_remove(struct watch *w)
+{
+    struct wdir *d, *x;
+
+    ignore(&w->on_addition);
+
+    if (w->rescan != NULL) {
+        ignore(&w->on_scan);
+        excrate_release(w->rescan);
+        free(w->scanning);
+    }
+
+    while (!list_empty(&w->dirty)) {
+        struct dirty *t;
+
+        t = list_entry(w->dirty.next, struct dirty, dirty);
+        list_del(&t->dirty);
+        free(t);
+    }
+
+    list_del(&w->watches);
+
+    /* Unwatch directories no other crate covers */
+
+    list_for_each_safe(d, x, &dirs, dirs) {
+        struct watch *v;
+        bool used = false;
+
+        if (!below(w->crate->path, d->path))
+            continue;
+
+        list_for_each(v, &watches, watches) {
+            if (below(v->crate->path, d->path))
+                used = true;
+        }
+
+        if (used)
+            continue;
+
+        (void)inotify_rm_watch(ifd, d->wd);
+        list_del(&d->dirs);
+        free(d);
+    }
+
+    free(w);
+}
+
+/*
+ * Get entry for use by poll()
+ *
+ * Post: *pe contains poll entry
+ */
+
+void watch_pollfd(struct pollfd *p)
+{
+    p->fd = ifd; /* -1 if not available */
+    p->events = POLLIN;
+}
+
+/*
+ * Handle events from the watches, and advance the incremental scans
+ *
+ * Pre: rig lock is held
+ */
+
+void watch_handle(void)
+{
+    struct watch *w;
+
+    if (ifd == -1)
+        return;
+
+    for (;;) {
+        char buf[EVENT_BUF]
+            __attribute__ ((aligned(__alignof__(struct inotify_event))));
+        ssize_t z;
+        const char *s;
+
+        z = read(ifd, buf, sizeof buf);
+        if (z == -1) {
+            if (errno == EAGAIN)
+                break;
+            perror("read");
+            return;
+        }
+
+        if (z == 0)
+            break;
+
+        for (s = buf; s < buf + z; ) {
+            const struct inotify_event *ev;
+
+            ev = (const struct inotify_event*)s;
+            handle_event(ev);
+            s += sizeof *ev + ev->len;
+        }
+    }
+
+    list_for_each(w, &watches, watches)
+        kick(w);
+}
@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2021 Mark Hills <mark@xwax.org>
+ *
+ * This file is part of "xwax".
+ *
+ * "xwax" is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 3 as
+ * published by the Free Software Foundation.
+ *
+ * "xwax" is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef WATCH_H
+#define WATCH_H
+
+#include <poll.h>
+#include <stdbool.h>
+
+#include "library.h"
+#include "list.h"
+#include "observer.h"
+
+/* A crate kept up-to-date with changes on disk */
+
+struct watch {
+    struct list watches;
+    struct crate *crate;
+    struct listing *storage;
+
+    /* Directories awaiting an incremental scan */
+
+    struct list dirty;
+
+    /* The incremental scan in flight, if any */
+
+    struct excrate *rescan;
+    struct dirty *scanning;
+    bool done;
+
+    struct observer on_addition, on_scan;
+};
+
+int watch_global_init(void);
+void watch_global_clear(void);
+
+struct watch* watch_add(struct crate *crate, struct listing *storage);
+void watch_remove(struct watch *w);
+
+/* Used by the rig */
+
+void watch_pollfd(struct pollfd *pe);
+void watch_handle(void);
+
+#endif
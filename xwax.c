@@ -19,6 +19,8 @@
 
 #include <assert.h>
 #include <locale.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -28,19 +30,26 @@
 #include <SDL.h> /* may override main() */
 
 #include "alsa.h"
+#include "analyse.h"
 #include "controller.h"
+#include "decoder.h"
 #include "device.h"
 #include "dicer.h"
 #include "dummy.h"
+#include "export.h"
 #include "interface.h"
 #include "jack.h"
 #include "library.h"
+#include "memory.h"
 #include "oss.h"
 #include "realtime.h"
+#include "recorder.h"
+#include "rtlog.h"
 #include "thread.h"
 #include "rig.h"
 #include "timecoder.h"
 #include "track.h"
+#include "watch.h"
 #include "xwax.h"
 
 #define DEFAULT_OSS_BUFFERS 8
@@ -52,6 +61,7 @@
 
 #define DEFAULT_IMPORTER EXECDIR "/xwax-import"
 #define DEFAULT_SCANNER EXECDIR "/xwax-scan"
+#define DEFAULT_ANALYSER EXECDIR "/xwax-analyse"
 #define DEFAULT_TIMECODE "serato_2a"
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof(*x))
@@ -60,7 +70,7 @@ char *banner = "xwax " VERSION \
     " (C) Copyright 2021 Mark Hills <mark@xwax.org>";
 
 size_t ndeck;
-struct deck deck[3];
+struct deck deck[MAX_DECKS];
 
 static size_t nctl;
 static struct controller ctl[2];
@@ -79,15 +89,24 @@ static void usage(FILE *fd)
     fprintf(fd, "Program-wide options:\n"
       "  -k             Lock real-time memory into RAM\n"
       "  -q <n>         Real-time priority (0 for no priority, default %d)\n"
+      "  --cpu <n>      Pin real-time threads to CPUs, starting at CPU n\n"
+      "  --retain <n>   Megabytes of memory for keeping recently used\n"
+      "                 tracks loaded (default %lu)\n"
+      "  --budget <n>   Overall memory budget in megabytes (default none)\n"
+      "  --compact      Store tracks as 8-bit mu-law, halving their memory\n"
+      "  --profile      Measure where audio thread time goes (SIGUSR1 dumps)\n"
       "  -g <s>         Set display geometry (see man page)\n"
       "  --no-decor     Request a window with no decorations\n"
+      "  --headless     Run without a display or user interface\n"
       "  -h             Display this message to stdout and exit\n\n",
-      DEFAULT_PRIORITY);
+      DEFAULT_PRIORITY, (unsigned long)(TRACK_RETAIN_DEFAULT >> 20));
 
     fprintf(fd, "Music library options:\n"
       "  -l <path>      Location to scan for audio tracks\n"
-      "  -s <program>   Library scanner (default '%s')\n\n",
-      DEFAULT_SCANNER);
+      "  -s <program>   Library scanner (default '%s')\n"
+      "  --analyse      Compute BPM and key of records which lack them\n"
+      "                 in the background (using '%s')\n\n",
+      DEFAULT_SCANNER, DEFAULT_ANALYSER);
 
     fprintf(fd, "Deck options:\n"
       "  -t <name>      Timecode name\n"
@@ -98,6 +117,9 @@ static void usage(FILE *fd)
       "  --line         Line level signal (default)\n"
       "  --phono        Tolerate cartridge level signal ('software pre-amp')\n"
       "  -i <program>   Importer (default '%s')\n"
+      "  --decoder <lib> In-process decoder plugin, with importer as fallback\n"
+      "  --import-daemon Start the importer once and stream each load from it\n"
+      "  --record <dir> Record the output of every deck to WAV files\n"
       "  --dummy        Build a dummy deck with no audio device\n\n",
       DEFAULT_IMPORTER);
 
@@ -114,7 +136,8 @@ static void usage(FILE *fd)
     fprintf(fd, "ALSA device options:\n"
       "  -a <device>    Build a deck connected to ALSA audio device\n"
       "  --rate <hz>    Sample rate (default is automatic)\n"
-      "  --buffer <n>   Buffer size (default %d samples)\n\n",
+      "  --buffer <n>   Buffer size (default %d samples)\n"
+      "  --probe        Probe for the smallest stable buffer before starting\n\n",
       DEFAULT_ALSA_BUFFER);
 #endif
 
@@ -140,6 +163,54 @@ static void usage(FILE *fd)
       "See the xwax(1) man page for full information and examples.\n");
 }
 
+/*
+ * Shut down the rig on a terminating signal
+ *
+ * With an interface, exit is via the window or EVENT_QUIT; when
+ * running headless this is the only clean exit path. The signal may
+ * be delivered on any thread, including a realtime one, so only the
+ * async-signal-safe entry point may be used here.
+ */
+
+static void handle_signal(int sig)
+{
+    rig_quit_async();
+}
+
+/*
+ * Dump the performance counters of every deck, on request
+ *
+ * Diagnostic use only: stdio from a signal handler is not strictly
+ * safe, but the dump only happens when asked for by hand
+ */
+
+static void handle_dump_signal(int sig)
+{
+    size_t n;
+
+    for (n = 0; n < ndeck; n++)
+        device_stats_dump(&deck[n].device, stderr);
+}
+
+#ifdef WITH_ALSA
+/*
+ * Entry point of a thread which probes one audio device
+ *
+ * Each card takes its trials in real time, so the probes overlap
+ * almost perfectly when run concurrently
+ */
+
+static void* probe_worker(void *p)
+{
+    struct device *dv = p;
+
+    if (alsa_probe(dv) == -1)
+        return (void*)-1;
+
+    return NULL;
+}
+#endif
+
 static struct device* start_deck(const char *desc)
 {
     fprintf(stderr, "Initialising deck %zd (%s)...\n", ndeck, desc);
@@ -184,10 +255,11 @@ static int commit_deck(void)
 
 int main(int argc, char *argv[])
 {
-    int rc = -1, n, priority;
-    const char *scanner, *geo;
+    int rc = -1, n, priority, rt_cpu;
+    long retain, budget;
+    const char *scanner, *analyser, *geo, *record_dir;
     char *endptr;
-    bool use_mlock, decor;
+    bool use_mlock, decor, import_daemon, headless;
 
     struct library library;
 
@@ -201,6 +273,9 @@ int main(int argc, char *argv[])
 
 #ifdef WITH_ALSA
     unsigned int alsa_buffer;
+    bool alsa_probe_buffer;
+    struct device *probe[ARRAY_SIZE(deck)];
+    size_t nprobe;
 #endif
 
     fprintf(stderr, "%s\n\n" NOTICE "\n\n", banner);
@@ -225,6 +300,10 @@ int main(int argc, char *argv[])
 
     if (rig_init() == -1)
         return -1;
+    if (rtlog_init() == -1)
+        return -1;
+    if (watch_global_init() == -1)
+        return -1;
     rt_init(&rt);
     library_init(&library);
 
@@ -233,13 +312,18 @@ int main(int argc, char *argv[])
     decor = true;
     nctl = 0;
     priority = DEFAULT_PRIORITY;
+    rt_cpu = -1; /* no affinity */
     importer = DEFAULT_IMPORTER;
     scanner = DEFAULT_SCANNER;
+    analyser = NULL;
     timecode = NULL;
     speed = 1.0;
     protect = false;
     phono = false;
     use_mlock = false;
+    import_daemon = false;
+    headless = false;
+    record_dir = NULL;
 
 #if defined WITH_OSS || WITH_ALSA
     rate = 0; /* automatic */
@@ -247,6 +331,8 @@ int main(int argc, char *argv[])
 
 #ifdef WITH_ALSA
     alsa_buffer = DEFAULT_ALSA_BUFFER;
+    alsa_probe_buffer = false;
+    nprobe = 0;
 #endif
 
 #ifdef WITH_OSS
@@ -362,6 +448,15 @@ int main(int argc, char *argv[])
 
             argv += 2;
             argc -= 2;
+
+        } else if (!strcmp(argv[0], "--probe")) {
+
+            /* Probe subsequent ALSA devices for their buffer size */
+
+            alsa_probe_buffer = true;
+
+            argv++;
+            argc--;
 #endif
 
         } else if (!strcmp(argv[0], "-d") || !strcmp(argv[0], "-a") ||
@@ -396,6 +491,8 @@ int main(int argc, char *argv[])
 #ifdef WITH_ALSA
             case 'a':
                 r = alsa_init(device, argv[1], rate, alsa_buffer);
+                if (r == 0 && alsa_probe_buffer)
+                    probe[nprobe++] = device;
                 break;
 #endif
 #ifdef WITH_JACK
@@ -521,6 +618,124 @@ int main(int argc, char *argv[])
             argv += 2;
             argc -= 2;
 
+        } else if (!strcmp(argv[0], "--cpu")) {
+
+            if (argc < 2) {
+                fprintf(stderr, "--cpu requires an integer argument.\n");
+                return -1;
+            }
+
+            rt_cpu = strtol(argv[1], &endptr, 10);
+            if (*endptr != '\0') {
+                fprintf(stderr, "--cpu requires an integer argument.\n");
+                return -1;
+            }
+
+            if (rt_cpu < 0) {
+                fprintf(stderr, "CPU (%d) must be zero or positive.\n",
+                        rt_cpu);
+                return -1;
+            }
+
+            argv += 2;
+            argc -= 2;
+
+        } else if (!strcmp(argv[0], "--retain")) {
+
+            if (argc < 2) {
+                fprintf(stderr, "--retain requires an integer argument.\n");
+                return -1;
+            }
+
+            retain = strtol(argv[1], &endptr, 10);
+            if (*endptr != '\0') {
+                fprintf(stderr, "--retain requires an integer argument.\n");
+                return -1;
+            }
+
+            if (retain < 0) {
+                fprintf(stderr, "Memory budget (%ld) must be zero "
+                        "or positive.\n", retain);
+                return -1;
+            }
+
+            track_set_retain((size_t)retain << 20);
+
+            argv += 2;
+            argc -= 2;
+
+        } else if (!strcmp(argv[0], "--budget")) {
+
+            if (argc < 2) {
+                fprintf(stderr, "--budget requires an integer argument.\n");
+                return -1;
+            }
+
+            budget = strtol(argv[1], &endptr, 10);
+            if (*endptr != '\0') {
+                fprintf(stderr, "--budget requires an integer argument.\n");
+                return -1;
+            }
+
+            if (budget < 0) {
+                fprintf(stderr, "Memory budget (%ld) must be zero "
+                        "or positive.\n", budget);
+                return -1;
+            }
+
+            memory_set_budget((size_t)budget << 20);
+
+            argv += 2;
+            argc -= 2;
+
+        } else if (!strcmp(argv[0], "--compact")) {
+
+            track_use_compact();
+
+            argv++;
+            argc--;
+
+        } else if (!strcmp(argv[0], "--profile")) {
+
+            device_set_profile(true);
+
+            argv++;
+            argc--;
+
+        } else if (!strcmp(argv[0], "--import-daemon")) {
+
+            import_daemon = true;
+
+            argv++;
+            argc--;
+
+        } else if (!strcmp(argv[0], "--decoder")) {
+
+            if (argc < 2) {
+                fprintf(stderr, "--decoder requires a library path "
+                        "as an argument.\n");
+                return -1;
+            }
+
+            if (decoder_load(argv[1]) == -1)
+                return -1;
+
+            argv += 2;
+            argc -= 2;
+
+        } else if (!strcmp(argv[0], "--record")) {
+
+            if (argc < 2) {
+                fprintf(stderr, "--record requires a directory "
+                        "as an argument.\n");
+                return -1;
+            }
+
+            record_dir = argv[1];
+
+            argv += 2;
+            argc -= 2;
+
         } else if (!strcmp(argv[0], "-g")) {
 
             if (argc < 2) {
@@ -540,6 +755,16 @@ int main(int argc, char *argv[])
             argv++;
             argc--;
 
+        } else if (!strcmp(argv[0], "--headless")) {
+
+            /* Timecode-driven or controller-driven players with no
+             * display attached; don't touch SDL, fonts or X */
+
+            headless = true;
+
+            argv++;
+            argc--;
+
         } else if (!strcmp(argv[0], "-i")) {
 
             /* Importer script for subsequent decks */
@@ -570,6 +795,13 @@ int main(int argc, char *argv[])
             argv += 2;
             argc -= 2;
 
+        } else if (!strcmp(argv[0], "--analyse")) {
+
+            analyser = DEFAULT_ANALYSER;
+
+            argv++;
+            argc--;
+
         } else if (!strcmp(argv[0], "-l")) {
 
             /* Load in a music library */
@@ -617,8 +849,46 @@ int main(int argc, char *argv[])
         }
     }
 
+    /* Fonts are slow to find and load; begin in the background so
+     * the work overlaps the device probes below. The LUT build and
+     * library scans already run off the main thread */
+
+    if (!headless)
+        interface_load_fonts();
+
 #ifdef WITH_ALSA
-    alsa_clear_config_cache();
+    /* Probes exercise the decks' timecoders and players, so they
+     * must wait until all decks are committed. Run before realtime
+     * scheduling and locked memory are acquired, one thread per
+     * card; the global ALSA config is shared, but was already
+     * loaded serially by alsa_init() */
+
+    if (nprobe > 0) {
+        pthread_t th[ARRAY_SIZE(deck)];
+        bool failed = false;
+
+        for (n = 0; n < nprobe; n++) {
+            if (pthread_create(&th[n], NULL, probe_worker, probe[n]) != 0) {
+                perror("pthread_create");
+                return -1;
+            }
+        }
+
+        for (n = 0; n < nprobe; n++) {
+            void *status;
+
+            if (pthread_join(th[n], &status) != 0)
+                abort();
+
+            if (status != NULL)
+                failed = true;
+        }
+
+        if (failed)
+            return -1;
+
+        alsa_clear_config_cache();
+    }
 #endif
 
     if (ndeck == 0) {
@@ -629,10 +899,42 @@ int main(int argc, char *argv[])
 
     rc = EXIT_FAILURE; /* until clean exit */
 
+    track_pool_init();
+
+    if (import_daemon && track_daemon(importer) == -1)
+        return -1;
+
+    /* Deck state export for external visualisers. Losing it is not
+     * worth refusing to start over */
+
+    if (export_init(ndeck) == 0) {
+        for (n = 0; n < ndeck; n++)
+            deck[n].player.export = export_slot(n);
+    }
+
+    /* Recording to disk; one file per deck, and a writer thread
+     * shared by all of them */
+
+    if (record_dir != NULL) {
+        if (recorder_global_init() == -1)
+            return -1;
+
+        for (n = 0; n < ndeck; n++) {
+            if (deck_record_start(&deck[n], record_dir, n) == -1)
+                return -1;
+        }
+    }
+
+    /* Background analysis fills in BPM and key as the scans deliver
+     * records without them */
+
+    if (analyser != NULL && analyse_init(analyser, &library) == -1)
+        return -1;
+
     /* Order is important: launch realtime thread first, then mlock.
      * Don't mlock the interface, use sparingly for audio threads */
 
-    if (rt_start(&rt, priority) == -1)
+    if (rt_start(&rt, priority, rt_cpu) == -1)
         return -1;
 
     if (use_mlock && mlockall(MCL_CURRENT) == -1) {
@@ -640,8 +942,36 @@ int main(int argc, char *argv[])
         goto out_rt;
     }
 
-    if (interface_start(&library, geo, decor) == -1)
-        goto out_rt;
+    {
+        struct sigaction sa;
+
+        sa.sa_handler = handle_dump_signal;
+        sigemptyset(&sa.sa_mask);
+        sa.sa_flags = 0;
+
+        if (sigaction(SIGUSR1, &sa, NULL) == -1) {
+            perror("sigaction");
+            goto out_rt;
+        }
+    }
+
+    if (headless) {
+        struct sigaction sa;
+
+        sa.sa_handler = handle_signal;
+        sigemptyset(&sa.sa_mask);
+        sa.sa_flags = 0;
+
+        if (sigaction(SIGINT, &sa, NULL) == -1
+            || sigaction(SIGTERM, &sa, NULL) == -1)
+        {
+            perror("sigaction");
+            goto out_rt;
+        }
+    } else {
+        if (interface_start(&library, geo, decor) == -1)
+            goto out_rt;
+    }
 
     if (rig_main() == -1)
         goto out_interface;
@@ -650,19 +980,29 @@ int main(int argc, char *argv[])
     fprintf(stderr, "Exiting cleanly...\n");
 
 out_interface:
-    interface_stop();
+    if (!headless)
+        interface_stop();
 out_rt:
     rt_stop(&rt);
 
     for (n = 0; n < ndeck; n++)
         deck_clear(&deck[n]);
 
+    if (record_dir != NULL)
+        recorder_global_clear();
+
+    export_clear();
+
     for (n = 0; n < nctl; n++)
         controller_clear(&ctl[n]);
 
+    track_daemon_stop();
     timecoder_free_lookup();
+    analyse_clear();
     library_clear(&library);
+    watch_global_clear();
     rt_clear(&rt);
+    rtlog_clear();
     rig_clear();
     library_global_clear();
     thread_global_clear();